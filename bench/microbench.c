@@ -0,0 +1,343 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file A microbenchmark harness for the server's hot functions.
+ * The harness is linked against the server's own objects, and times each function
+ * in isolation, so that regressions are not hidden by the noise of end-to-end runs.
+ * Every benchmark runs for long enough to be stable, and is reported as a JSON line
+ * with its cost in nanoseconds and heap allocations per operation.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "http.h"
+#include "arena.h"
+#include "logger.h"
+#include "missing.h"
+#include "response.h"
+
+/*
+ * Forward declaration of the server's internal functions being benchmarked.
+ * These functions are not exported by headers, as they are private to the server.
+ */
+extern const void *response_moved_current(const void *, uint64_t, bool);
+extern bool response_check_moved_object(const void *, char *, const char *);
+extern const char *response_get_mime(const char *);
+extern struct http_response_t response_make_basic(enum http_code_t);
+extern void response_add_common_headers(struct http_response_t *);
+extern void logger_write_entry_to_sink(logger_sink_t *, const logger_entry_t *);
+
+/*
+ * The glibc's own allocator functions. The harness replaces the allocator entry
+ * points, so that every allocation is counted, even those made by the C library.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+/*!
+ * \var g_microbench_allocs
+ * \brief The number of heap allocations made since the harness has started.
+ * \since 3.0
+ */
+static uint64_t g_microbench_allocs = 0;
+
+void *malloc(size_t size)
+{
+    ++g_microbench_allocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    ++g_microbench_allocs;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    ++g_microbench_allocs;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+/*!
+ * \typedef microbench_func
+ * \brief The type of a function to be benchmarked.
+ * \since 3.0
+ */
+typedef void (*microbench_func)(const void *);
+
+/*!
+ * \struct microbench_case_t
+ * \brief A benchmark case: a function and the input it is run with.
+ * \since 3.0
+ */
+typedef struct microbench_case_t {
+    const char *name;
+    microbench_func func;
+    const void *input;
+} microbench_case_t;
+
+/*!
+ * \var g_microbench_sink
+ * \brief Keeps results alive, so that the compiler cannot elide benchmarked calls.
+ * \since 3.0
+ */
+static volatile uintptr_t g_microbench_sink;
+
+/*!
+ * \var g_microbench_devnull
+ * \brief The logger sink to which log entries are written while benchmarking.
+ * \since 3.0
+ */
+static logger_sink_t g_microbench_devnull;
+
+/*!
+ * \fn uint64_t microbench_now()
+ * \brief Reads the monotonic clock in nanoseconds.
+ * \return The current monotonic time.
+ */
+uint64_t microbench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/*!
+ * \fn void microbench_http_request_parse(const void*)
+ * \brief Parses a raw request out of a scratch copy, as the parser works in place.
+ * \param input The raw request to be parsed.
+ */
+void microbench_http_request_parse(const void *input)
+{
+    static char scratch[8192];
+    enum http_error_t error = HTTP_ERROR_OK;
+
+    size_t length = strlen((const char*) input);
+    memcpy(scratch, input, length + 1);
+
+    struct http_request_t request = http_request_parse(&error, scratch, length);
+    g_microbench_sink = (uintptr_t) request.uri.path + error;
+
+    http_request_free(&request);
+}
+
+/*!
+ * \fn void microbench_response_get_mime(const void*)
+ * \brief Looks up the MIME type of a file extension.
+ * \param input The extension to be looked up.
+ */
+void microbench_response_get_mime(const void *input)
+{
+    g_microbench_sink = (uintptr_t) response_get_mime((const char*) input);
+}
+
+/*!
+ * \fn void microbench_response_check_moved_object(const void*)
+ * \brief Checks whether a path has been permanently moved, with the redirections in effect.
+ * \param input The path to be checked.
+ */
+void microbench_response_check_moved_object(const void *input)
+{
+    char target[2048];
+    const void *moved = response_moved_current(NULL, missing_generation(), true);
+    g_microbench_sink = response_check_moved_object(moved, target, (const char*) input);
+}
+
+/*!
+ * \fn void microbench_response_add_common_headers(const void*)
+ * \brief Adds the common headers to a response, then discards them for reuse.
+ * \param input (ignored)
+ */
+void microbench_response_add_common_headers(const void *input)
+{
+    static struct http_response_t response;
+
+    if (response.header == NULL)
+        response = response_make_basic(HTTP_RESPONSE_OK);
+
+    response_add_common_headers(&response);
+    g_microbench_sink = response.count_headers;
+
+    for (size_t i = 0; i < response.count_headers; ++i) {
+        arena_free(response.header[i].key);
+        arena_free(response.header[i].value);
+    }
+
+    response.count_headers = 0;
+}
+
+/*!
+ * \fn void microbench_logger_write_entry_to_sink(const void*)
+ * \brief Writes a log entry to a sink backed by /dev/null.
+ * \param input The URI path to be logged.
+ */
+void microbench_logger_write_entry_to_sink(const void *input)
+{
+    time_t t = 1700000000;
+
+    logger_entry_t entry = {
+        .level = LOGGER_LEVEL_INFO
+      , .datetime = *gmtime(&t)
+      , .http_method = HTTP_GET
+      , .http_code = HTTP_RESPONSE_OK
+      , .http_uri = { .path = (char*) input, .query = "" }
+    };
+
+    logger_write_entry_to_sink(&g_microbench_devnull, &entry);
+}
+
+/*!
+ * \fn void microbench_run(const microbench_case_t*, double)
+ * \brief Runs a benchmark case and reports its per operation costs.
+ * The number of iterations is doubled until the case runs for the minimum time.
+ * \param bench The benchmark case to be run.
+ * \param min_time The minimum time the case must run for, in seconds.
+ */
+void microbench_run(const microbench_case_t *bench, double min_time)
+{
+    uint64_t elapsed = 0, allocs = 0, iterations = 1;
+    uint64_t target = (uint64_t) (min_time * 1e9);
+
+    for (int i = 0; i < 1000; ++i)
+        bench->func(bench->input);
+
+    while (true) {
+        uint64_t alloc_start = g_microbench_allocs;
+        uint64_t start = microbench_now();
+
+        for (uint64_t i = 0; i < iterations; ++i)
+            bench->func(bench->input);
+
+        elapsed = microbench_now() - start;
+        allocs = g_microbench_allocs - alloc_start;
+
+        if (elapsed >= target || iterations >= (1ull << 40))
+            break;
+
+        iterations *= 2;
+    }
+
+    printf(
+        "{\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.2f}\n"
+      , bench->name, (unsigned long long) iterations
+      , (double) elapsed / iterations, (double) allocs / iterations
+    );
+}
+
+/*
+ * The corpus of realistic requests given to the parser. The requests are modeled
+ * after what command line clients and modern browsers send to a static server.
+ */
+static const char g_corpus_curl[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char g_corpus_browser[] =
+    "GET /img/grassball.jpg HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,pt-BR;q=0.8,pt;q=0.7\r\n"
+    "If-None-Match: \"3ca-65f1b2c4\"\r\n"
+    "If-Modified-Since: Wed, 13 Mar 2024 14:32:04 GMT\r\n"
+    "\r\n";
+
+static const char g_corpus_query[] =
+    "GET /search/some%20folder/file%2Bname.html?q=mu%20httpd&page=2&sort=desc HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Wget/1.21.4\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: identity\r\n"
+    "\r\n";
+
+static const char g_corpus_post[] =
+    "POST /form.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 47\r\n"
+    "Origin: http://localhost:8080\r\n"
+    "\r\n"
+    "name=mu-httpd&email=someone%40example.com&ok=1";
+
+static const char g_corpus_bad_protocol[] =
+    "GET / HTTP/1.0\r\n"
+    "Host: localhost:8080\r\n"
+    "\r\n";
+
+/*!
+ * \fn int main(int, char **)
+ * \brief The microbenchmark harness entry point.
+ * \param argc The number of command line arguments.
+ * \param argv The list of command line arguments.
+ */
+int main(int argc, char **argv)
+{
+    int option;
+    double min_time = 0.25;
+    const char *filter = NULL;
+
+    while ((option = getopt(argc, argv, "t:f:h")) != -1) {
+        switch (option) {
+            case 't': min_time = atof(optarg); break;
+            case 'f': filter = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] [-f name-filter]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    g_microbench_devnull = fopen("/dev/null", "w");
+
+    const microbench_case_t cases[] = {
+        { "http_request_parse/curl",            &microbench_http_request_parse,          g_corpus_curl }
+      , { "http_request_parse/browser",         &microbench_http_request_parse,          g_corpus_browser }
+      , { "http_request_parse/query",           &microbench_http_request_parse,          g_corpus_query }
+      , { "http_request_parse/post",            &microbench_http_request_parse,          g_corpus_post }
+      , { "http_request_parse/bad-protocol",    &microbench_http_request_parse,          g_corpus_bad_protocol }
+      , { "response_get_mime/html",             &microbench_response_get_mime,           ".html" }
+      , { "response_get_mime/pdf",              &microbench_response_get_mime,           ".pdf" }
+      , { "response_get_mime/unknown",          &microbench_response_get_mime,           ".tar" }
+      , { "response_check_moved_object/hit",    &microbench_response_check_moved_object, "/old-index.html" }
+      , { "response_check_moved_object/miss",   &microbench_response_check_moved_object, "/wp-login.php" }
+      , { "response_add_common_headers",        &microbench_response_add_common_headers, NULL }
+      , { "logger_write_entry_to_sink/devnull", &microbench_logger_write_entry_to_sink,  "/index.html" }
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+        if (filter == NULL || strstr(cases[i].name, filter) != NULL)
+            microbench_run(&cases[i], min_time);
+
+    fclose(g_microbench_devnull);
+
+    return EXIT_SUCCESS;
+}
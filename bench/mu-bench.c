@@ -0,0 +1,594 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file A small epoll-based HTTP load generator for benchmarking the server.
+ * The generator keeps a fixed number of connections busy with a single request
+ * path, until a fixed number of responses is received. Every response latency is
+ * recorded, so that exact percentiles can be reported as a JSON object.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+#define BENCH_HEADER_SIZE   8192
+#define BENCH_READ_SIZE     65536
+#define BENCH_MAX_EVENTS    256
+
+/*!
+ * \struct bench_config_t
+ * \brief The parameters of a single benchmark scenario.
+ * \since 3.0
+ */
+typedef struct bench_config_t {
+    const char *name;
+    const char *address;
+    uint16_t port;
+    const char *path;
+    int connections;
+    uint64_t requests;
+    uint64_t warmup;
+    int expected_status;
+    bool keepalive;
+    int timeout;
+} bench_config_t;
+
+/*!
+ * \enum bench_conn_state_t
+ * \brief The states a benchmark connection can be in.
+ * \since 3.0
+ */
+typedef enum bench_conn_state_t {
+    BENCH_CONN_IDLE = 0
+  , BENCH_CONN_CONNECTING
+  , BENCH_CONN_WRITING
+  , BENCH_CONN_READING
+} bench_conn_state_t;
+
+/*!
+ * \struct bench_conn_t
+ * \brief A client connection kept busy by the load generator.
+ * \since 3.0
+ */
+typedef struct bench_conn_t {
+    int fd;
+    bench_conn_state_t state;
+    size_t sent;
+    char header[BENCH_HEADER_SIZE];
+    size_t header_length;
+    bool header_done;
+    int status;
+    long content_length;
+    size_t body_read;
+    bool server_close;
+    bool reused;
+    uint64_t started;
+} bench_conn_t;
+
+/*!
+ * \struct bench_stats_t
+ * \brief The measurements collected while running a scenario.
+ * \since 3.0
+ */
+typedef struct bench_stats_t {
+    uint64_t *latency;
+    uint64_t issued;
+    uint64_t completed;
+    uint64_t measured;
+    uint64_t errors;
+    uint64_t unexpected;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t began;
+    uint64_t finished;
+} bench_stats_t;
+
+static char g_bench_request[1024];
+static size_t g_bench_request_length;
+
+/*!
+ * \fn uint64_t bench_now()
+ * \brief Reads the monotonic clock in nanoseconds.
+ * \return The current monotonic time.
+ */
+uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/*!
+ * \fn void bench_conn_reset(bench_conn_t*)
+ * \brief Resets a connection's response parsing state for a new request.
+ * \param conn The connection to be reset.
+ */
+void bench_conn_reset(bench_conn_t *conn)
+{
+    conn->sent = 0;
+    conn->header_length = 0;
+    conn->header_done = false;
+    conn->status = 0;
+    conn->content_length = -1;
+    conn->body_read = 0;
+    conn->server_close = false;
+}
+
+/*!
+ * \fn void bench_conn_close(int, bench_conn_t*)
+ * \brief Closes a connection, so that a new one is opened for the next request.
+ * \param epoll The epoll instance watching the connection.
+ * \param conn The connection to be closed.
+ */
+void bench_conn_close(int epoll, bench_conn_t *conn)
+{
+    if (conn->fd >= 0) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+
+    conn->fd = -1;
+    conn->reused = false;
+    conn->state = BENCH_CONN_IDLE;
+}
+
+/*!
+ * \fn bool bench_conn_open(int, const bench_config_t*, bench_conn_t*, bench_stats_t*)
+ * \brief Starts a non-blocking connection to the server.
+ * \param epoll The epoll instance to watch the connection.
+ * \param config The scenario configuration.
+ * \param conn The connection to be opened.
+ * \param stats The scenario measurements.
+ * \return Could the connection be started?
+ */
+bool bench_conn_open(int epoll, const bench_config_t *config, bench_conn_t *conn, bench_stats_t *stats)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET
+      , .sin_port = htons(config->port)
+    };
+
+    inet_pton(AF_INET, config->address, &addr.sin_addr);
+
+    int one = 1;
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(conn->fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        return false;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT | EPOLLIN, .data.ptr = conn };
+    epoll_ctl(epoll, EPOLL_CTL_ADD, conn->fd, &event);
+
+    conn->state = BENCH_CONN_CONNECTING;
+    ++stats->connects;
+
+    return true;
+}
+
+/*!
+ * \fn void bench_conn_watch(int, bench_conn_t*, uint32_t)
+ * \brief Changes the events a connection is waiting for.
+ * \param epoll The epoll instance watching the connection.
+ * \param conn The connection being watched.
+ * \param events The new set of events to wait for.
+ */
+void bench_conn_watch(int epoll, bench_conn_t *conn, uint32_t events)
+{
+    struct epoll_event event = { .events = events, .data.ptr = conn };
+    epoll_ctl(epoll, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/*!
+ * \fn bool bench_conn_write(int, bench_conn_t*)
+ * \brief Writes as much of the request as possible to the connection.
+ * \param epoll The epoll instance watching the connection.
+ * \param conn The connection to write the request to.
+ * \return Has the connection failed?
+ */
+bool bench_conn_write(int epoll, bench_conn_t *conn)
+{
+    while (conn->sent < g_bench_request_length) {
+        ssize_t n = send(
+            conn->fd
+          , g_bench_request + conn->sent
+          , g_bench_request_length - conn->sent
+          , MSG_NOSIGNAL
+        );
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            bench_conn_watch(epoll, conn, EPOLLOUT | EPOLLIN);
+            return false;
+        }
+
+        if (n <= 0)
+            return true;
+
+        conn->sent += n;
+    }
+
+    conn->state = BENCH_CONN_READING;
+    bench_conn_watch(epoll, conn, EPOLLIN);
+
+    return false;
+}
+
+/*!
+ * \fn bool bench_conn_start(int, const bench_config_t*, bench_conn_t*, bench_stats_t*)
+ * \brief Issues a new request on a connection, opening it if needed.
+ * \param epoll The epoll instance to watch the connection.
+ * \param config The scenario configuration.
+ * \param conn The connection to issue the request on.
+ * \param stats The scenario measurements.
+ * \return Has a request been issued?
+ */
+bool bench_conn_start(int epoll, const bench_config_t *config, bench_conn_t *conn, bench_stats_t *stats)
+{
+    if (stats->issued >= config->requests + config->warmup)
+        return false;
+
+    ++stats->issued;
+    bench_conn_reset(conn);
+    conn->started = bench_now();
+
+    if (conn->fd >= 0) {
+        conn->state = BENCH_CONN_WRITING;
+        conn->reused = true;
+
+        if (bench_conn_write(epoll, conn))
+            bench_conn_close(epoll, conn);
+        else
+            return true;
+    }
+
+    if (!bench_conn_open(epoll, config, conn, stats)) {
+        ++stats->errors;
+        ++stats->completed;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \fn void bench_conn_parse_header(bench_conn_t*)
+ * \brief Parses the response status line and relevant headers.
+ * \param conn The connection which has received a full response header.
+ */
+void bench_conn_parse_header(bench_conn_t *conn)
+{
+    char *line = strstr(conn->header, "\r\n");
+    sscanf(conn->header, "HTTP/%*s %d", &conn->status);
+
+    while (line != NULL && line[2] != '\r') {
+        line += 2;
+
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            conn->content_length = strtol(line + 15, NULL, 10);
+
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11;
+            while (*value == ' ') ++value;
+            conn->server_close = strncasecmp(value, "close", 5) == 0;
+        }
+
+        line = strstr(line, "\r\n");
+    }
+}
+
+/*!
+ * \fn void bench_conn_complete(int, const bench_config_t*, bench_conn_t*, bench_stats_t*, bool)
+ * \brief Records a finished request and issues the next one on the connection.
+ * \param epoll The epoll instance watching the connection.
+ * \param config The scenario configuration.
+ * \param conn The connection which has finished a request.
+ * \param stats The scenario measurements.
+ * \param failed Has the request failed?
+ */
+void bench_conn_complete(
+    int epoll
+  , const bench_config_t *config
+  , bench_conn_t *conn
+  , bench_stats_t *stats
+  , bool failed
+) {
+    uint64_t now = bench_now();
+
+    if (stats->completed++ < config->warmup) {
+        if (stats->completed == config->warmup)
+            stats->began = now;
+    } else if (failed) {
+        ++stats->errors;
+    } else {
+        stats->latency[stats->measured++] = now - conn->started;
+        stats->unexpected += config->expected_status && conn->status != config->expected_status;
+    }
+
+    stats->finished = now;
+
+    if (failed || !config->keepalive || conn->server_close)
+        bench_conn_close(epoll, conn);
+
+    if (!bench_conn_start(epoll, config, conn, stats))
+        bench_conn_close(epoll, conn);
+}
+
+/*!
+ * \fn void bench_conn_read(int, const bench_config_t*, bench_conn_t*, bench_stats_t*)
+ * \brief Reads the response from a connection, draining its body.
+ * \param epoll The epoll instance watching the connection.
+ * \param config The scenario configuration.
+ * \param conn The connection to read from.
+ * \param stats The scenario measurements.
+ */
+void bench_conn_read(int epoll, const bench_config_t *config, bench_conn_t *conn, bench_stats_t *stats)
+{
+    static char sink[BENCH_READ_SIZE];
+
+    while (true) {
+        char *target = conn->header_done ? sink : conn->header + conn->header_length;
+        size_t space = conn->header_done ? sizeof(sink) : BENCH_HEADER_SIZE - conn->header_length - 1;
+        ssize_t n = recv(conn->fd, target, space, 0);
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (n == 0 && conn->header_done && conn->content_length < 0)
+            return bench_conn_complete(epoll, config, conn, stats, false);
+
+        if (n == 0 && conn->reused && conn->header_length == 0) {
+            // The server has closed an idle kept-alive connection. The request is
+            // then transparently retried on a brand new connection.
+            --stats->issued;
+            bench_conn_close(epoll, conn);
+            bench_conn_start(epoll, config, conn, stats);
+            return;
+        }
+
+        if (n <= 0)
+            return bench_conn_complete(epoll, config, conn, stats, true);
+
+        stats->bytes += n;
+
+        if (!conn->header_done) {
+            conn->header_length += n;
+            conn->header[conn->header_length] = '\0';
+
+            char *end = strstr(conn->header, "\r\n\r\n");
+
+            if (end == NULL && conn->header_length >= BENCH_HEADER_SIZE - 1)
+                return bench_conn_complete(epoll, config, conn, stats, true);
+
+            if (end == NULL)
+                continue;
+
+            conn->header_done = true;
+            conn->body_read = conn->header_length - (end + 4 - conn->header);
+            bench_conn_parse_header(conn);
+        } else {
+            conn->body_read += n;
+        }
+
+        if (conn->content_length >= 0 && conn->body_read >= (size_t) conn->content_length)
+            return bench_conn_complete(epoll, config, conn, stats, false);
+    }
+}
+
+/*!
+ * \fn int bench_compare(const void*, const void*)
+ * \brief Compares two latency measurements for sorting.
+ * \param a The first latency to compare.
+ * \param b The second latency to compare.
+ * \return The comparison result.
+ */
+int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/*!
+ * \fn double bench_percentile(const bench_stats_t*, double)
+ * \brief Picks a percentile out of the sorted latency measurements.
+ * \param stats The scenario measurements.
+ * \param q The percentile to pick, between 0 and 1.
+ * \return The latency at the requested percentile, in microseconds.
+ */
+double bench_percentile(const bench_stats_t *stats, double q)
+{
+    if (stats->measured == 0)
+        return 0.0;
+
+    uint64_t rank = (uint64_t) (q * stats->measured + 0.999999);
+    rank = rank == 0 ? 1 : (rank > stats->measured ? stats->measured : rank);
+
+    return stats->latency[rank - 1] / 1000.0;
+}
+
+/*!
+ * \fn void bench_report(const bench_config_t*, bench_stats_t*)
+ * \brief Prints the scenario results as a JSON object.
+ * \param config The scenario configuration.
+ * \param stats The scenario measurements.
+ */
+void bench_report(const bench_config_t *config, bench_stats_t *stats)
+{
+    qsort(stats->latency, stats->measured, sizeof(uint64_t), &bench_compare);
+
+    double duration = (stats->finished - stats->began) / 1e9;
+    double rps = duration > 0 ? stats->measured / duration : 0.0;
+
+    printf(
+        "{\"name\": \"%s\", \"path\": \"%s\", \"keepalive\": %s, \"connections\": %d"
+        ", \"requests\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"unexpected\": %" PRIu64
+        ", \"connects\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"duration_s\": %.6f"
+        ", \"rps\": %.1f, \"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p99\": %.1f"
+        ", \"p999\": %.1f, \"max\": %.1f}}\n"
+      , config->name, config->path, config->keepalive ? "true" : "false", config->connections
+      , stats->measured, stats->errors, stats->unexpected
+      , stats->connects, stats->bytes, duration
+      , rps, bench_percentile(stats, 0.0), bench_percentile(stats, 0.50), bench_percentile(stats, 0.99)
+      , bench_percentile(stats, 0.999), bench_percentile(stats, 1.0)
+    );
+}
+
+/*!
+ * \fn int bench_run(const bench_config_t*)
+ * \brief Runs a benchmark scenario and reports its results.
+ * \param config The scenario configuration.
+ * \return The process exit status.
+ */
+int bench_run(const bench_config_t *config)
+{
+    struct epoll_event events[BENCH_MAX_EVENTS];
+
+    bench_stats_t stats = { .latency = calloc(config->requests + 1, sizeof(uint64_t)) };
+    bench_conn_t *conns = calloc(config->connections, sizeof(bench_conn_t));
+
+    int epoll = epoll_create1(0);
+    uint64_t deadline = bench_now() + (uint64_t) config->timeout * 1000000000ull;
+
+    g_bench_request_length = snprintf(
+        g_bench_request, sizeof(g_bench_request)
+      , "GET %s HTTP/1.1\r\nHost: %s:%hu\r\nUser-Agent: mu-bench\r\nConnection: %s\r\n\r\n"
+      , config->path, config->address, config->port
+      , config->keepalive ? "keep-alive" : "close"
+    );
+
+    stats.began = bench_now();
+
+    for (int i = 0; i < config->connections; ++i) {
+        conns[i].fd = -1;
+        bench_conn_start(epoll, config, &conns[i], &stats);
+    }
+
+    while (stats.completed < stats.issued && bench_now() < deadline) {
+        int count = epoll_wait(epoll, events, BENCH_MAX_EVENTS, 100);
+
+        for (int i = 0; i < count; ++i) {
+            bench_conn_t *conn = (bench_conn_t*) events[i].data.ptr;
+
+            if (conn->fd < 0)
+                continue;
+
+            if (conn->state == BENCH_CONN_CONNECTING) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+                if (error != 0 || (events[i].events & EPOLLERR)) {
+                    bench_conn_complete(epoll, config, conn, &stats, true);
+                    continue;
+                }
+
+                conn->state = BENCH_CONN_WRITING;
+            }
+
+            if (conn->state == BENCH_CONN_WRITING && bench_conn_write(epoll, conn))
+                bench_conn_complete(epoll, config, conn, &stats, true);
+            else if (conn->state == BENCH_CONN_READING)
+                bench_conn_read(epoll, config, conn, &stats);
+        }
+    }
+
+    bool timed_out = stats.completed < stats.issued;
+    stats.errors += stats.issued - stats.completed;
+
+    for (int i = 0; i < config->connections; ++i)
+        bench_conn_close(epoll, &conns[i]);
+
+    bench_report(config, &stats);
+
+    close(epoll);
+    free(stats.latency);
+    free(conns);
+
+    return (timed_out || stats.measured == 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*!
+ * \fn void bench_usage(const char*)
+ * \brief Prints the load generator's usage message.
+ * \param program The program's name.
+ */
+void bench_usage(const char *program)
+{
+    fprintf(stderr,
+        "usage: %s [options] path\n"
+        "  -a address   server address (default 127.0.0.1)\n"
+        "  -p port      server port (default 8080)\n"
+        "  -c conns     concurrent connections (default 16)\n"
+        "  -n requests  measured requests (default 10000)\n"
+        "  -w requests  warm-up requests, not measured (default 100)\n"
+        "  -e status    expected response status, counted otherwise\n"
+        "  -k           keeps connections alive between requests\n"
+        "  -N name      scenario name to report (default the path)\n"
+        "  -t seconds   gives up after the given time (default 60)\n"
+      , program
+    );
+}
+
+/*!
+ * \fn int main(int, char **)
+ * \brief The load generator's entry point.
+ * \param argc The number of command line arguments.
+ * \param argv The list of command line arguments.
+ */
+int main(int argc, char **argv)
+{
+    int option;
+
+    bench_config_t config = {
+        .address = "127.0.0.1"
+      , .port = 8080
+      , .connections = 16
+      , .requests = 10000
+      , .warmup = 100
+      , .timeout = 60
+    };
+
+    while ((option = getopt(argc, argv, "a:p:c:n:w:e:kN:t:h")) != -1) {
+        switch (option) {
+            case 'a': config.address = optarg; break;
+            case 'p': config.port = (uint16_t) atoi(optarg); break;
+            case 'c': config.connections = atoi(optarg); break;
+            case 'n': config.requests = strtoull(optarg, NULL, 10); break;
+            case 'w': config.warmup = strtoull(optarg, NULL, 10); break;
+            case 'e': config.expected_status = atoi(optarg); break;
+            case 'k': config.keepalive = true; break;
+            case 'N': config.name = optarg; break;
+            case 't': config.timeout = atoi(optarg); break;
+            default:  bench_usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc || config.connections <= 0 || config.requests == 0) {
+        bench_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    config.path = argv[optind];
+    config.name = config.name ? config.name : config.path;
+
+    return bench_run(&config);
+}
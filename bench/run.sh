@@ -0,0 +1,90 @@
+#!/bin/sh
+# mu-HTTPd: A very very simple HTTP server.
+# @file Runs the benchmark scenarios against a freshly started server over loopback.
+# The server is run from a scratch copy of the document root, so that fixtures and
+# access logs created by the benchmark never touch the repository. Results are
+# printed as a single JSON document, which can be stored and compared among commits.
+# @author Rodrigo Siqueira <rodriados@gmail.com>
+# @copyright 2014-present Rodrigo Siqueira
+set -e
+
+SERVER=$(realpath "$1")
+BENCH=$(realpath "$2")
+ROOT=$(pwd)
+
+PORT=${BENCH_PORT:-18080}
+CONNECTIONS=${BENCH_CONNECTIONS:-16}
+REQUESTS=${BENCH_REQUESTS:-10000}
+LARGE_SIZE=${BENCH_LARGE_SIZE:-8388608}
+LISTING_SIZE=${BENCH_LISTING_SIZE:-200}
+TIMEOUT=${BENCH_TIMEOUT:-30}
+SERVER_ARGS=${BENCH_SERVER_ARGS:-}
+
+WORKDIR=$(mktemp -d)
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill -INT "$SERVER_PID" 2>/dev/null || true
+        sleep 1
+        kill -KILL "$SERVER_PID" 2>/dev/null || true
+    fi
+
+    rm -rf "$WORKDIR"
+}
+
+trap cleanup EXIT INT TERM
+
+# Preparing the fixtures. The files are deterministic, so that results are only
+# affected by changes to the server and not by the benchmark's own inputs.
+cp -R "$ROOT/default" "$ROOT/www" "$WORKDIR"
+mkdir -p "$WORKDIR/log" "$WORKDIR/www/bench/listing"
+head -c "$LARGE_SIZE" /dev/zero > "$WORKDIR/www/bench/large.bin"
+
+for i in $(seq 1 "$LISTING_SIZE"); do
+    echo "$i" > "$WORKDIR/www/bench/listing/file-$i.txt"
+done
+
+cd "$WORKDIR"
+"$SERVER" $SERVER_ARGS "$PORT" > /dev/null 2>&1 &
+SERVER_PID=$!
+
+for i in $(seq 1 50); do
+    "$BENCH" -p "$PORT" -c 1 -n 1 -w 0 -t 1 / > /dev/null 2>&1 && break
+    sleep 0.1
+done
+
+if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    echo "error: server could not be started on port $PORT" >&2
+    SERVER_PID=
+    exit 1
+fi
+
+# Runs a single scenario and prints its JSON result. A failing scenario still has
+# its partial results reported, with the failures counted as errors.
+# @param $1 The scenario name.
+# @param $2 The number of requests to be measured.
+# @param $3 The response status expected from the server.
+# @param $4 The request path.
+# @param $5 Extra arguments for the load generator.
+scenario() {
+    "$BENCH" -p "$PORT" -c "$CONNECTIONS" -t "$TIMEOUT" -N "$1" -n "$2" -e "$3" $5 "$4" || true
+}
+
+printf '{"commit": "%s", "date": "%s", "server_args": "%s", "connections": %s, "scenarios": [\n' \
+    "$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)" \
+    "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$SERVER_ARGS" "$CONNECTIONS"
+
+scenario small-file         "$REQUESTS"               200 /index.html
+printf ', '
+scenario small-file-keepalive "$REQUESTS"             200 /index.html -k
+printf ', '
+scenario not-found          "$REQUESTS"               404 /bench/missing.html
+printf ', '
+scenario redirect           "$REQUESTS"               301 /old-index.html
+printf ', '
+scenario directory-listing  "$((REQUESTS / 10))"      200 /bench/listing/ "-w 10"
+printf ', '
+scenario large-file         "$((REQUESTS / 100 + 1))" 200 /bench/large.bin "-w 10"
+
+printf ']}\n'
@@ -0,0 +1,180 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of request-scoped memory arenas.
+ * An arena is bound to a thread, and serves all short-lived allocations made while
+ * the thread processes a request. Once the request is done, the whole arena is reset
+ * at once, so that processing a request does not need to touch the heap at all.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+/*!
+ * \struct arena_block_t
+ * \brief The header stored right before every arena allocation.
+ * \since 3.0
+ */
+typedef struct arena_block_t {
+    size_t size;
+    size_t _padding;
+} arena_block_t;
+
+/*!
+ * \var g_arena_bound
+ * \brief The arena bound to the current thread, if any.
+ * \since 3.0
+ */
+static _Thread_local arena_t *g_arena_bound = NULL;
+
+/*!
+ * \fn arena_t *arena_create(size_t)
+ * \brief Creates a new arena with the given capacity.
+ * \param capacity The total number of bytes the arena can serve.
+ * \return The new arena instance.
+ */
+extern arena_t *arena_create(size_t capacity)
+{
+    arena_t *arena = malloc(sizeof(arena_t));
+
+    arena->buffer = malloc(capacity);
+    arena->capacity = capacity;
+    arena->used = 0;
+    arena->last = 0;
+
+    return arena;
+}
+
+/*!
+ * \fn void arena_bind(arena_t*)
+ * \brief Binds an arena to the current thread, so that it serves its allocations.
+ * \param arena The arena to be bound, or NULL to unbind the current one.
+ */
+extern void arena_bind(arena_t *arena)
+{
+    g_arena_bound = arena;
+}
+
+/*!
+ * \fn void arena_reset(arena_t*)
+ * \brief Releases all allocations made from an arena at once.
+ * \param arena The arena to be reset.
+ */
+extern void arena_reset(arena_t *arena)
+{
+    arena->used = 0;
+    arena->last = 0;
+}
+
+/*!
+ * \fn void arena_destroy(arena_t*)
+ * \brief Destroys an arena and frees its memory.
+ * \param arena The arena to be destroyed.
+ */
+extern void arena_destroy(arena_t *arena)
+{
+    if (g_arena_bound == arena)
+        g_arena_bound = NULL;
+
+    free(arena->buffer);
+    free(arena);
+}
+
+/*!
+ * \fn bool arena_owns(const arena_t*, const void*)
+ * \brief Checks whether a pointer has been allocated from the given arena.
+ * \param arena The arena to be checked.
+ * \param ptr The pointer to be checked.
+ * \return Has the pointer been allocated from the arena?
+ */
+bool arena_owns(const arena_t *arena, const void *ptr)
+{
+    return arena != NULL
+        && (const unsigned char*) ptr >= arena->buffer
+        && (const unsigned char*) ptr < arena->buffer + arena->capacity;
+}
+
+/*!
+ * \fn void *arena_malloc(size_t)
+ * \brief Allocates memory from the arena bound to the current thread.
+ * \param size The number of bytes to allocate.
+ * \return The allocated memory.
+ */
+extern void *arena_malloc(size_t size)
+{
+    arena_t *arena = g_arena_bound;
+    size_t total = sizeof(arena_block_t) + ((size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1));
+
+    if (arena == NULL || arena->used + total > arena->capacity)
+        return malloc(size);
+
+    arena_block_t *block = (arena_block_t*) (arena->buffer + arena->used);
+    block->size = size;
+
+    arena->last = arena->used;
+    arena->used += total;
+
+    return block + 1;
+}
+
+/*!
+ * \fn void *arena_realloc(void*, size_t)
+ * \brief Resizes memory previously allocated from the arena or from the heap.
+ * The last allocation made from the arena is resized in place whenever possible.
+ * \param ptr The memory to be resized.
+ * \param size The new number of bytes required.
+ * \return The resized memory.
+ */
+extern void *arena_realloc(void *ptr, size_t size)
+{
+    arena_t *arena = g_arena_bound;
+
+    if (ptr == NULL)
+        return arena_malloc(size);
+
+    if (!arena_owns(arena, ptr))
+        return realloc(ptr, size);
+
+    arena_block_t *block = (arena_block_t*) ptr - 1;
+    size_t offset = (unsigned char*) block - arena->buffer;
+    size_t total = sizeof(arena_block_t) + ((size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1));
+
+    if (offset == arena->last && offset + total <= arena->capacity) {
+        block->size = size;
+        arena->used = offset + total;
+        return ptr;
+    }
+
+    void *resized = arena_malloc(size);
+    memcpy(resized, ptr, block->size < size ? block->size : size);
+
+    return resized;
+}
+
+/*!
+ * \fn void arena_free(void*)
+ * \brief Frees memory previously allocated from the arena or from the heap.
+ * Arena memory is only really released when the arena is reset, unless it is the
+ * arena's last allocation, which can be immediately reused.
+ * \param ptr The memory to be freed.
+ */
+extern void arena_free(void *ptr)
+{
+    arena_t *arena = g_arena_bound;
+
+    if (!arena_owns(arena, ptr)) {
+        free(ptr);
+        return;
+    }
+
+    size_t offset = (unsigned char*) ((arena_block_t*) ptr - 1) - arena->buffer;
+
+    if (offset == arena->last)
+        arena->used = arena->last;
+}
@@ -0,0 +1,42 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for request-scoped memory arenas.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_ARENA_H
+#define MU_HTTPD_ARENA_H
+
+#include <stddef.h>
+
+/*!
+ * \struct arena_t
+ * \brief A bump allocator whose allocations are all released at once.
+ * \since 3.0
+ */
+typedef struct arena_t {
+    unsigned char *buffer;
+    size_t capacity;
+    size_t used;
+    size_t last;
+} arena_t;
+
+/*
+ * Forward declaration of arena instance functions.
+ * These functions are needed for creating arenas and binding them to threads.
+ */
+extern arena_t *arena_create(size_t);
+extern void arena_bind(arena_t*);
+extern void arena_reset(arena_t*);
+extern void arena_destroy(arena_t*);
+
+/*
+ * Forward declaration of arena allocation functions.
+ * These functions allocate from the arena bound to the calling thread, and fall back
+ * to the heap when the thread has no arena or when the arena is exhausted.
+ */
+extern void *arena_malloc(size_t);
+extern void *arena_realloc(void*, size_t);
+extern void arena_free(void*);
+
+#endif
@@ -0,0 +1,85 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The assets embedded into the server.
+ * The server's default pages are included into the binary when it is built, so that they
+ * are served from memory, and never depend on the working directory nor touch the disk.
+ * The assets are included by the assembler, relative to where the server is built from.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "asset.h"
+
+/*
+ * Embeds a file into the binary's read-only data, between two symbols marking where it
+ * starts and ends. The file is followed by a terminating null byte, which is not a part
+ * of the asset, so that text assets can be used as strings.
+ */
+#define ASSET_EMBED(symbol, path)                                   \
+    __asm__(                                                        \
+        ".section .rodata\n"                                        \
+        ".balign 16\n"                                              \
+        ".global " #symbol "_start\n"                               \
+        ".global " #symbol "_end\n"                                 \
+        #symbol "_start:\n"                                         \
+        ".incbin \"" path "\"\n"                                    \
+        #symbol "_end:\n"                                           \
+        ".byte 0\n"                                                 \
+        ".previous\n"                                               \
+    );                                                              \
+    extern const unsigned char symbol##_start[];                    \
+    extern const unsigned char symbol##_end[];
+
+ASSET_EMBED(asset_404, "default/404.html")
+ASSET_EMBED(asset_413, "default/413.html")
+ASSET_EMBED(asset_500, "default/500.html")
+ASSET_EMBED(asset_501, "default/501.html")
+ASSET_EMBED(asset_505, "default/505.html")
+ASSET_EMBED(asset_directory, "default/directory.html")
+
+/*!
+ * \struct asset_t
+ * \brief An embedded asset, and the name it is found by.
+ * \since 3.0
+ */
+typedef struct asset_t {
+    const char *name;
+    const unsigned char *start;
+    const unsigned char *end;
+} asset_t;
+
+/*!
+ * \var g_assets
+ * \brief The assets embedded into the server.
+ * \since 3.0
+ */
+static const asset_t g_assets[] = {
+    { "404.html",       asset_404_start,       asset_404_end }
+  , { "413.html",       asset_413_start,       asset_413_end }
+  , { "500.html",       asset_500_start,       asset_500_end }
+  , { "501.html",       asset_501_start,       asset_501_end }
+  , { "505.html",       asset_505_start,       asset_505_end }
+  , { "directory.html", asset_directory_start, asset_directory_end }
+};
+
+/*!
+ * \fn const unsigned char *asset_find(const char*, size_t*)
+ * \brief Finds an embedded asset by its name.
+ * \param name The asset's name, as in the default folder.
+ * \param length The asset's length.
+ * \return The asset's contents, or NULL if there is no such asset.
+ */
+extern const unsigned char *asset_find(const char *name, size_t *length)
+{
+    for (size_t i = 0; i < sizeof(g_assets) / sizeof(g_assets[0]); ++i) {
+        if (strcmp(g_assets[i].name, name) == 0) {
+            *length = (size_t) (g_assets[i].end - g_assets[i].start);
+            return g_assets[i].start;
+        }
+    }
+
+    *length = 0;
+    return NULL;
+}
@@ -0,0 +1,18 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The functions declarations for the assets embedded into the server.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_ASSET_H
+#define MU_HTTPD_ASSET_H
+
+#include <stddef.h>
+
+/*
+ * Forward declaration of asset functions.
+ * These functions are needed for serving the server's default pages from memory.
+ */
+extern const unsigned char *asset_find(const char*, size_t*);
+
+#endif
@@ -0,0 +1,377 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the request body decoder.
+ * Bodies are either delimited by a `Content-Length` header, or sent with the chunked
+ * transfer-encoding, in which case they are decoded as they arrive. Either way, bodies
+ * are handed to their consumer in pieces no larger than what has been received.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "body.h"
+
+/*!
+ * \enum body_state_t
+ * \brief The states of a chunked body's decoder.
+ * \since 3.0
+ */
+typedef enum body_state_t {
+    BODY_STATE_SIZE = 0
+  , BODY_STATE_EXTENSION
+  , BODY_STATE_DATA
+  , BODY_STATE_DATA_END
+  , BODY_STATE_TRAILER
+} body_state_t;
+
+/*!
+ * \fn bool body_header_match(const char*, size_t, const char*, const char**, size_t*)
+ * \brief Checks whether a header line holds the given header, and finds its value.
+ * \param line The header line to be checked.
+ * \param length The header line's length.
+ * \param name The name of the header being looked for.
+ * \param value The header's value, without surrounding whitespace.
+ * \param value_length The header's value length.
+ * \return Does the line hold the given header?
+ */
+bool body_header_match(const char *line, size_t length, const char *name, const char **value, size_t *value_length)
+{
+    size_t name_length = strlen(name);
+
+    if (length <= name_length || line[name_length] != ':' || strncasecmp(line, name, name_length) != 0)
+        return false;
+
+    const char *start = line + name_length + 1;
+    const char *end = line + length;
+
+    while (start < end && isspace((unsigned char) *start))
+        ++start;
+
+    while (end > start && isspace((unsigned char) end[-1]))
+        --end;
+
+    *value = start;
+    *value_length = (size_t) (end - start);
+    return true;
+}
+
+/*!
+ * \fn bool body_length_parse(const char*, size_t, uint64_t*)
+ * \brief Parses the length announced by a `Content-Length` header.
+ * \param value The header's value.
+ * \param length The header's value length.
+ * \param content_length The parsed length.
+ * \return Is the announced length valid?
+ */
+bool body_length_parse(const char *value, size_t length, uint64_t *content_length)
+{
+    *content_length = 0;
+
+    if (length == 0 || length > 19)
+        return false;
+
+    for (size_t i = 0; i < length; ++i) {
+        if (!isdigit((unsigned char) value[i]))
+            return false;
+
+        *content_length = *content_length * 10 + (uint64_t) (value[i] - '0');
+    }
+
+    return true;
+}
+
+/*!
+ * \fn body_status_t body_delimit(body_t*, const char*, size_t)
+ * \brief Finds out from a request's header section how its body is delimited.
+ * A request must not announce both a length and the chunked transfer-encoding, as it
+ * would be ambiguous where its body ends. Bodies announced to be larger than the limit
+ * are refused before any of them is received.
+ * \param body The body being initialized.
+ * \param header The request's raw header section.
+ * \param size The header section's size.
+ * \return The body's decoding state.
+ */
+body_status_t body_delimit(body_t *body, const char *header, size_t size)
+{
+    size_t value_length;
+    const char *value;
+    const char *end = header + size;
+    const char *line = memchr(header, '\n', size);
+
+    bool announced = false;
+    bool chunked = false;
+
+    // The request line is skipped, and every header line is checked for the headers
+    // which tell how the body is delimited and whether the client awaits to send it.
+    while (line != NULL && ++line < end) {
+        const char *next = memchr(line, '\n', end - line);
+        size_t length = (size_t) ((next != NULL ? next : end) - line);
+        uint64_t content_length;
+
+        if (body_header_match(line, length, "Content-Length", &value, &value_length)) {
+            if (!body_length_parse(value, value_length, &content_length))
+                return BODY_INVALID;
+
+            if (announced && content_length != body->remaining)
+                return BODY_INVALID;
+
+            body->remaining = content_length;
+            announced = true;
+        } else if (body_header_match(line, length, "Transfer-Encoding", &value, &value_length)) {
+            if (value_length != 7 || strncasecmp(value, "chunked", 7) != 0 || chunked)
+                return BODY_INVALID;
+
+            chunked = true;
+        } else if (body_header_match(line, length, "Expect", &value, &value_length)) {
+            body->expects_continue = value_length == 12 && strncasecmp(value, "100-continue", 12) == 0;
+        }
+
+        line = next;
+    }
+
+    if (chunked && announced)
+        return BODY_INVALID;
+
+    if (chunked) {
+        body->encoding = BODY_ENCODING_CHUNKED;
+        body->state = BODY_STATE_SIZE;
+        return BODY_INCOMPLETE;
+    }
+
+    if (body->remaining > body->limit)
+        return BODY_TOO_LONG;
+
+    if (body->remaining > 0) {
+        body->encoding = BODY_ENCODING_LENGTH;
+        return BODY_INCOMPLETE;
+    }
+
+    body->expects_continue = false;
+    return BODY_COMPLETE;
+}
+
+/*!
+ * \fn body_status_t body_initialize(body_t*, const char*, size_t, uint64_t, body_consumer_t, void*)
+ * \brief Prepares for decoding a request's body, once its header section is received.
+ * \param body The body to be initialized.
+ * \param header The request's raw header section.
+ * \param size The header section's size.
+ * \param limit The maximum number of bytes the decoded body may have.
+ * \param consumer The function to hand the decoded body to.
+ * \param context The context to call the consumer with.
+ * \return The body's decoding state.
+ */
+extern body_status_t body_initialize(
+    body_t *body
+  , const char *header
+  , size_t size
+  , uint64_t limit
+  , body_consumer_t consumer
+  , void *context
+) {
+    memset(body, 0, sizeof(body_t));
+    body->limit = limit;
+    body->consumer = consumer;
+    body->context = context;
+    body->status = body_delimit(body, header, size);
+
+    return body->status;
+}
+
+/*!
+ * \fn body_status_t body_deliver(body_t*, const char*, size_t)
+ * \brief Hands a piece of decoded body to its consumer.
+ * \param body The body being decoded.
+ * \param data The decoded piece of body.
+ * \param size The piece's size.
+ * \return The body's decoding state.
+ */
+body_status_t body_deliver(body_t *body, const char *data, size_t size)
+{
+    body->received += size;
+
+    if (body->received > body->limit)
+        return BODY_TOO_LONG;
+
+    if (!body->consumer(body->context, data, size))
+        return BODY_INVALID;
+
+    return BODY_INCOMPLETE;
+}
+
+/*!
+ * \fn body_status_t body_chunk_started(body_t*)
+ * \brief Starts receiving a chunk, once its size line has been received.
+ * A chunk of size zero ends the body, and is only followed by optional trailers.
+ * \param body The body being decoded.
+ * \return The body's decoding state.
+ */
+body_status_t body_chunk_started(body_t *body)
+{
+    body->line = 0;
+
+    if (body->remaining == 0)
+        body->state = BODY_STATE_TRAILER;
+    else if (body->remaining > body->limit - body->received)
+        return BODY_TOO_LONG;
+    else
+        body->state = BODY_STATE_DATA;
+
+    return BODY_INCOMPLETE;
+}
+
+/*!
+ * \fn body_status_t body_chunked_feed(body_t*, const char*, size_t, size_t*)
+ * \brief Decodes received bytes of a body sent with the chunked transfer-encoding.
+ * Chunk extensions and trailers are not used by the server, and are skipped.
+ * \param body The body being decoded.
+ * \param data The received bytes.
+ * \param size The number of received bytes.
+ * \param consumed The number of bytes which belonged to the body.
+ * \return The body's decoding state.
+ */
+body_status_t body_chunked_feed(body_t *body, const char *data, size_t size, size_t *consumed)
+{
+    size_t offset = 0;
+    body_status_t status = BODY_INCOMPLETE;
+
+    while (status == BODY_INCOMPLETE && offset < size) {
+        char c = data[offset];
+
+        if (body->state == BODY_STATE_DATA) {
+            size_t piece = body->remaining < size - offset ? (size_t) body->remaining : size - offset;
+            status = body_deliver(body, data + offset, piece);
+            body->remaining -= piece;
+            offset += piece;
+
+            if (body->remaining == 0)
+                body->state = BODY_STATE_DATA_END;
+
+            continue;
+        }
+
+        ++offset;
+
+        switch (body->state) {
+            case BODY_STATE_SIZE:
+                if (isxdigit((unsigned char) c) && body->line < 15) {
+                    body->remaining = body->remaining * 16 + (uint64_t) (isdigit((unsigned char) c) ? c - '0' : tolower(c) - 'a' + 10);
+                    ++body->line;
+                } else if (isxdigit((unsigned char) c) || body->line == 0) {
+                    status = BODY_INVALID;
+                } else if (c == '\n') {
+                    status = body_chunk_started(body);
+                } else {
+                    body->state = BODY_STATE_EXTENSION;
+                }
+                break;
+
+            case BODY_STATE_EXTENSION:
+                if (c == '\n')
+                    status = body_chunk_started(body);
+                break;
+
+            case BODY_STATE_DATA_END:
+                if (c == '\r' && body->line == 0) {
+                    body->line = 1;
+                } else if (c == '\n') {
+                    body->state = BODY_STATE_SIZE;
+                    body->line = 0;
+                } else {
+                    status = BODY_INVALID;
+                }
+                break;
+
+            case BODY_STATE_TRAILER:
+                if (c == '\n' && body->line == 0)
+                    status = BODY_COMPLETE;
+                else if (c == '\n')
+                    body->line = 0;
+                else if (c != '\r' && ++body->line > BODY_CHUNK_SIZE)
+                    status = BODY_INVALID;
+                break;
+        }
+    }
+
+    *consumed = offset;
+    return status;
+}
+
+/*!
+ * \fn body_status_t body_feed(body_t*, const char*, size_t, size_t*)
+ * \brief Decodes bytes received for a body, and hands them to its consumer.
+ * The received bytes may go past the body's end, in which case they belong to the
+ * client's next request, and are left unconsumed. Nothing is consumed by a body which
+ * has already ended.
+ * \param body The body being decoded.
+ * \param data The received bytes.
+ * \param size The number of received bytes.
+ * \param consumed The number of bytes which belonged to the body.
+ * \return The body's decoding state.
+ */
+extern body_status_t body_feed(body_t *body, const char *data, size_t size, size_t *consumed)
+{
+    *consumed = 0;
+
+    if (body->status != BODY_INCOMPLETE)
+        return body->status;
+
+    if (body->encoding == BODY_ENCODING_CHUNKED)
+        return body->status = body_chunked_feed(body, data, size, consumed);
+
+    size_t piece = body->remaining < size ? (size_t) body->remaining : size;
+    body_status_t status = piece > 0 ? body_deliver(body, data, piece) : BODY_INCOMPLETE;
+
+    body->remaining -= piece;
+    *consumed = piece;
+
+    body->status = status == BODY_INCOMPLETE && body->remaining == 0
+        ? BODY_COMPLETE
+        : status;
+
+    return body->status;
+}
+
+/*!
+ * \fn body_status_t body_bypass(body_t*, size_t)
+ * \brief Accounts for bytes of a body which have been moved without being decoded.
+ * Only a body delimited by its length can be moved as it is, straight to where its
+ * consumer would have put it, as its bytes need no decoding.
+ * \param body The body being moved.
+ * \param size The number of bytes moved, which must not go past the body's end.
+ * \return The body's decoding state.
+ */
+extern body_status_t body_bypass(body_t *body, size_t size)
+{
+    body->received += size;
+    body->remaining -= size;
+
+    if (body->remaining == 0)
+        body->status = BODY_COMPLETE;
+
+    return body->status;
+}
+
+/*!
+ * \fn bool body_discard(void*, const char*, size_t)
+ * \brief Consumes a body by throwing it away.
+ * The server only serves static files, so the bodies it receives are of no use, but
+ * must nonetheless be received so that the connection can be kept alive.
+ * \param context Unused.
+ * \param data Unused.
+ * \param size Unused.
+ * \return Always accepts the body's contents.
+ */
+extern bool body_discard(void *context, const char *data, size_t size)
+{
+    (void) context;
+    (void) data;
+    (void) size;
+
+    return true;
+}
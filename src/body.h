@@ -0,0 +1,77 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for decoding request bodies.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_BODY_H
+#define MU_HTTPD_BODY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define BODY_CHUNK_SIZE 16384
+
+/*!
+ * \enum body_status_t
+ * \brief The states of a request body being decoded.
+ * \since 3.0
+ */
+typedef enum body_status_t {
+    BODY_INCOMPLETE = 0
+  , BODY_COMPLETE
+  , BODY_INVALID
+  , BODY_TOO_LONG
+} body_status_t;
+
+/*!
+ * \enum body_encoding_t
+ * \brief The ways in which a request may delimit its body.
+ * \since 3.0
+ */
+typedef enum body_encoding_t {
+    BODY_ENCODING_NONE = 0
+  , BODY_ENCODING_LENGTH
+  , BODY_ENCODING_CHUNKED
+} body_encoding_t;
+
+/*!
+ * \typedef body_consumer_t
+ * \brief The function to which a body's decoded contents are handed, in pieces.
+ * A consumer may refuse the contents, in which case the body cannot be decoded.
+ * \since 3.0
+ */
+typedef bool (*body_consumer_t)(void*, const char*, size_t);
+
+/*!
+ * \struct body_t
+ * \brief A request body, decoded as it is received.
+ * Bodies are never held in memory as a whole, but handed to their consumer as soon as
+ * they are decoded, so that the memory needed by a request does not grow with its body.
+ * A body's status is kept once it has ended, so that it can be checked by its consumer.
+ * \since 3.0
+ */
+typedef struct body_t {
+    body_status_t status;
+    body_encoding_t encoding;
+    int state;
+    uint64_t remaining;
+    uint64_t received;
+    uint64_t limit;
+    size_t line;
+    bool expects_continue;
+    body_consumer_t consumer;
+    void *context;
+} body_t;
+
+/*
+ * Forward declaration of body functions.
+ * These functions are needed for decoding request bodies as they are received.
+ */
+extern body_status_t body_initialize(body_t*, const char*, size_t, uint64_t, body_consumer_t, void*);
+extern body_status_t body_feed(body_t*, const char*, size_t, size_t*);
+extern body_status_t body_bypass(body_t*, size_t);
+extern bool body_discard(void*, const char*, size_t);
+
+#endif
@@ -1,6 +1,7 @@
 /*!
  * \brief The server's configuration and limit values.
- * Here you can see your personal preferences and configurations.
+ * These are the defaults for the settings that can be changed at runtime through the
+ * configuration file or the command line.
  * \author Rodrigo Siqueira <rodriados@gmail.com>
  */
 #ifndef MU_HTTPD_CONFIG_H
@@ -8,16 +9,71 @@
 
 #define MAX_THREADS         5
 #define MAX_CONNECTIONS     50
+#define MAX_QUEUED_REQUESTS 128
+#define MAX_INFLIGHT        10000
+#define MEMORY_BUDGET       268435456
+#define RETRY_AFTER         "1"
+
+#define RATE_LIMIT          0
+#define RATE_LIMIT_BURST    20
+#define LIMITER_SIZE        65536
 
 #define DEFAULT_ADDR        "127.0.0.1"
 #define DEFAULT_PORT        8080
+#define DEFAULT_MODE        "shared"
+#define DEFAULT_ENGINE      "epoll"
+#define DEFAULT_CONFIG      "mu-httpd.conf"
+#define MAX_ENDPOINTS       16
+
+#define REUSEADDR           1
+#define DEFER_ACCEPT        0
+#define FASTOPEN_QUEUE      0
+#define NODELAY             1
+#define CORK                0
+#define SEND_BUFFER         0
+#define RECEIVE_BUFFER      0
 
 #define PAGE_SIZE           4096
 #define BUFFER_SIZE         2048
 #define MAX_REQUEST_SIZE    52428800
+#define MAX_HEADER_SIZE     16384
 #define MAX_URL_SIZE        2048
 
 #define PUBLIC_FOLDER       "www"
+#define BUNDLE_FILE         ""
+#define ROUTES_FILE         ""
+#define VHOSTS_FILE         ""
+#define MAX_VIRTUAL_HOSTS   256
+#define PROXY_BALANCE       "round-robin"
+#define PROXY_POOL          8
+#define PROXY_TIMEOUT       10000
+#define PROXY_HEALTH        5000
+#define LISTING_CACHE_SIZE  64
+#define LISTING_TTL         10000
+#define LISTING_PAGE_SIZE   0
+#define FILE_CACHE_SIZE     256
+#define FILE_TTL            2000
+#define FILE_INLINE_SIZE    16384
+#define MISSING_CACHE_SIZE  1024
+#define MISSING_TTL         30000
+#define WARMUP_THREADS      0
+#define WARMUP_MANIFEST     ""
 #define LOG_FILE            "log/requests.txt"
+#define LOG_RING_SIZE       65536
+#define LOG_FLUSH_INTERVAL  50
+
+#define ARENA_SIZE          65536
+#define LOOP_MAX_EVENTS     256
+#define LOOP_URING_ENTRIES  256
+#define LOOP_URING_BUFFERS  256
+#define OFFLOAD_THREADS     4
+
+#define TIMER_TICK          100
+#define TIMEOUT_HEADER      10000
+#define TIMEOUT_BODY        30000
+#define TIMEOUT_KEEPALIVE   5000
+#define TIMEOUT_WRITE       30000
+#define DRAIN_TIMEOUT       10000
+#define HANDOFF_TIMEOUT     10000
 
 #endif
@@ -0,0 +1,307 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the server's listening endpoints.
+ * Endpoints are given as a comma-separated list, in which each endpoint is either an
+ * IPv4 address, an IPv6 address within brackets, or a Unix domain socket path prefixed
+ * by `unix:`. Paths starting with `@` are bound on the abstract namespace. Addresses
+ * may be followed by a port, and otherwise listen on the server's port.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+
+#include "endpoint.h"
+
+#define ENDPOINT_UNIX_PREFIX "unix:"
+
+/*!
+ * \fn bool endpoint_port_parse(const char*, uint16_t*)
+ * \brief Parses the port an endpoint listens on.
+ * \param text The port to be parsed.
+ * \param port The parsed port.
+ * \return Is the port valid?
+ */
+bool endpoint_port_parse(const char *text, uint16_t *port)
+{
+    char *end;
+    unsigned long value = strtoul(text, &end, 10);
+
+    if (!isdigit((unsigned char) *text) || *end != '\0' || value > UINT16_MAX)
+        return false;
+
+    *port = (uint16_t) value;
+    return true;
+}
+
+/*!
+ * \fn bool endpoint_unix_parse(const char*, endpoint_t*)
+ * \brief Parses a Unix domain socket endpoint.
+ * \param path The socket's path, or its name on the abstract namespace.
+ * \param endpoint The parsed endpoint.
+ * \return Is the path valid?
+ */
+bool endpoint_unix_parse(const char *path, endpoint_t *endpoint)
+{
+    struct sockaddr_un *address = (struct sockaddr_un*) &endpoint->address;
+    size_t length = strlen(path);
+
+    if (length == 0 || (path[0] == '@' && length == 1) || length >= sizeof(address->sun_path))
+        return false;
+
+    address->sun_family = AF_UNIX;
+
+    // Abstract sockets are named by a leading null byte instead of the `@`, and their
+    // names are not null-terminated, so the address length must not count one.
+    if (path[0] == '@') {
+        address->sun_path[0] = '\0';
+        memcpy(address->sun_path + 1, path + 1, length - 1);
+        endpoint->length = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length);
+    } else {
+        memcpy(address->sun_path, path, length + 1);
+        endpoint->length = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length + 1);
+    }
+
+    return true;
+}
+
+/*!
+ * \fn bool endpoint_inet_parse(char*, uint16_t, endpoint_t*)
+ * \brief Parses an IPv4 or IPv6 endpoint, with an optional port.
+ * \param text The endpoint's address and port. The text is changed while parsed.
+ * \param port The port to listen on if none is given.
+ * \param endpoint The parsed endpoint.
+ * \return Is the endpoint valid?
+ */
+bool endpoint_inet_parse(char *text, uint16_t port, endpoint_t *endpoint)
+{
+    char *host = text;
+    char *separator = NULL;
+    bool ipv6 = false;
+
+    if (text[0] == '[') {
+        char *close = strchr(text, ']');
+
+        if (close == NULL || (close[1] != '\0' && close[1] != ':'))
+            return false;
+
+        host = text + 1;
+        separator = close[1] == ':' ? close + 1 : NULL;
+        *close = '\0';
+        ipv6 = true;
+    } else if ((separator = strchr(text, ':')) != NULL && strchr(separator + 1, ':') != NULL) {
+        separator = NULL;
+        ipv6 = true;
+    }
+
+    if (separator != NULL) {
+        *separator = '\0';
+
+        if (!endpoint_port_parse(separator + 1, &port))
+            return false;
+    }
+
+    if (ipv6) {
+        struct sockaddr_in6 *address = (struct sockaddr_in6*) &endpoint->address;
+        address->sin6_family = AF_INET6;
+        address->sin6_port = htons(port);
+        endpoint->length = sizeof(struct sockaddr_in6);
+        return inet_pton(AF_INET6, host, &address->sin6_addr) == 1;
+    } else {
+        struct sockaddr_in *address = (struct sockaddr_in*) &endpoint->address;
+        address->sin_family = AF_INET;
+        address->sin_port = htons(port);
+        endpoint->length = sizeof(struct sockaddr_in);
+        return inet_pton(AF_INET, host, &address->sin_addr) == 1;
+    }
+}
+
+/*!
+ * \fn int endpoint_parse(const char*, uint16_t, endpoint_t*, int)
+ * \brief Parses a comma-separated list of endpoints.
+ * \param list The list of endpoints to be parsed.
+ * \param port The port to listen on for addresses given without one.
+ * \param endpoint The parsed endpoints.
+ * \param capacity The maximum number of endpoints to be parsed.
+ * \return The number of endpoints parsed, or -1 if the list is invalid.
+ */
+extern int endpoint_parse(const char *list, uint16_t port, endpoint_t *endpoint, int capacity)
+{
+    int count = 0;
+    char text[ENDPOINT_NAME_SIZE];
+
+    for (const char *cursor = list; ; ++cursor) {
+        const char *end = strchrnul(cursor, ',');
+
+        while (cursor < end && isspace((unsigned char) *cursor))
+            ++cursor;
+
+        size_t length = (size_t) (end - cursor);
+
+        while (length > 0 && isspace((unsigned char) cursor[length - 1]))
+            --length;
+
+        if (length == 0 || length >= sizeof(text) || count >= capacity)
+            return -1;
+
+        memcpy(text, cursor, length);
+        text[length] = '\0';
+
+        memset(&endpoint[count], 0, sizeof(endpoint_t));
+
+        bool valid = strncmp(text, ENDPOINT_UNIX_PREFIX, sizeof(ENDPOINT_UNIX_PREFIX) - 1) == 0
+            ? endpoint_unix_parse(text + sizeof(ENDPOINT_UNIX_PREFIX) - 1, &endpoint[count])
+            : endpoint_inet_parse(text, port, &endpoint[count]);
+
+        if (!valid)
+            return -1;
+
+        ++count;
+
+        if (*(cursor = end) == '\0')
+            return count;
+    }
+}
+
+/*!
+ * \fn bool endpoint_match(const endpoint_t*, socket_id_t)
+ * \brief Checks whether a socket is bound to an endpoint.
+ * \param endpoint The endpoint to be checked.
+ * \param socket_id The socket to be checked.
+ * \return Is the socket bound to the endpoint?
+ */
+extern bool endpoint_match(const endpoint_t *endpoint, socket_id_t socket_id)
+{
+    struct sockaddr_storage bound;
+    socklen_t l = sizeof(struct sockaddr_storage);
+
+    if (getsockname(socket_id, (struct sockaddr*) &bound, &l) == -1)
+        return false;
+
+    if (bound.ss_family != endpoint->address.ss_family)
+        return false;
+
+    if (bound.ss_family == AF_INET) {
+        const struct sockaddr_in *a = (const struct sockaddr_in*) &bound;
+        const struct sockaddr_in *b = (const struct sockaddr_in*) &endpoint->address;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+
+    if (bound.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a = (const struct sockaddr_in6*) &bound;
+        const struct sockaddr_in6 *b = (const struct sockaddr_in6*) &endpoint->address;
+        return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(struct in6_addr)) == 0;
+    }
+
+    return l == endpoint->length && memcmp(&bound, &endpoint->address, l) == 0;
+}
+
+/*!
+ * \fn void endpoint_update(endpoint_t*, socket_id_t)
+ * \brief Updates an endpoint with the address a socket has actually been bound to.
+ * An endpoint given without a port is bound to any free port, so that the sockets
+ * later bound to it must use the port which has been picked for the first one.
+ * \param endpoint The endpoint to be updated.
+ * \param socket_id The socket bound to the endpoint.
+ */
+extern void endpoint_update(endpoint_t *endpoint, socket_id_t socket_id)
+{
+    struct sockaddr_storage bound;
+    socklen_t l = sizeof(struct sockaddr_storage);
+
+    if (endpoint->address.ss_family != AF_UNIX && getsockname(socket_id, (struct sockaddr*) &bound, &l) == 0)
+        memcpy(&endpoint->address, &bound, endpoint->length);
+}
+
+/*!
+ * \fn void endpoint_describe(const endpoint_t*, char*, size_t)
+ * \brief Describes an endpoint, in the same format it is parsed from.
+ * \param endpoint The endpoint to be described.
+ * \param buffer The buffer to write the description to.
+ * \param size The buffer's size.
+ */
+extern void endpoint_describe(const endpoint_t *endpoint, char *buffer, size_t size)
+{
+    char host[INET6_ADDRSTRLEN];
+
+    if (endpoint->address.ss_family == AF_INET) {
+        const struct sockaddr_in *address = (const struct sockaddr_in*) &endpoint->address;
+        inet_ntop(AF_INET, &address->sin_addr, host, sizeof(host));
+        snprintf(buffer, size, "%s:%hu", host, ntohs(address->sin_port));
+    } else if (endpoint->address.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *address = (const struct sockaddr_in6*) &endpoint->address;
+        inet_ntop(AF_INET6, &address->sin6_addr, host, sizeof(host));
+        snprintf(buffer, size, "[%s]:%hu", host, ntohs(address->sin6_port));
+    } else {
+        const struct sockaddr_un *address = (const struct sockaddr_un*) &endpoint->address;
+        int length = (int) (endpoint->length - offsetof(struct sockaddr_un, sun_path));
+
+        if (address->sun_path[0] == '\0')
+            snprintf(buffer, size, ENDPOINT_UNIX_PREFIX "@%.*s", length - 1, address->sun_path + 1);
+        else
+            snprintf(buffer, size, ENDPOINT_UNIX_PREFIX "%s", address->sun_path);
+    }
+}
+
+/*!
+ * \fn bool endpoint_on_filesystem(const endpoint_t*)
+ * \brief Checks whether an endpoint is a Unix domain socket bound on the filesystem.
+ * \param endpoint The endpoint to be checked.
+ * \return Is the endpoint bound on the filesystem?
+ */
+bool endpoint_on_filesystem(const endpoint_t *endpoint)
+{
+    const struct sockaddr_un *address = (const struct sockaddr_un*) &endpoint->address;
+    return address->sun_family == AF_UNIX && address->sun_path[0] != '\0';
+}
+
+/*!
+ * \fn void endpoint_unlink_stale(const endpoint_t*)
+ * \brief Removes a Unix domain socket left behind on the filesystem by a dead server.
+ * Sockets on the filesystem outlive the processes bound to them, and must be removed
+ * before they can be bound to again. A socket is only removed when nobody is listening
+ * on it anymore, so that a server already running is never taken over.
+ * \param endpoint The endpoint whose socket must be removed.
+ */
+extern void endpoint_unlink_stale(const endpoint_t *endpoint)
+{
+    struct stat status;
+    const char *path = ((const struct sockaddr_un*) &endpoint->address)->sun_path;
+
+    if (!endpoint_on_filesystem(endpoint) || lstat(path, &status) == -1 || !S_ISSOCK(status.st_mode))
+        return;
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (probe == -1)
+        return;
+
+    if (connect(probe, (const struct sockaddr*) &endpoint->address, endpoint->length) == -1 && errno == ECONNREFUSED)
+        unlink(path);
+
+    close(probe);
+}
+
+/*!
+ * \fn void endpoint_unlink(const endpoint_t*)
+ * \brief Removes an endpoint's Unix domain socket from the filesystem.
+ * \param endpoint The endpoint whose socket must be removed.
+ */
+extern void endpoint_unlink(const endpoint_t *endpoint)
+{
+    if (endpoint_on_filesystem(endpoint))
+        unlink(((const struct sockaddr_un*) &endpoint->address)->sun_path);
+}
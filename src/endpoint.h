@@ -0,0 +1,42 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the server's listening endpoints.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_ENDPOINT_H
+#define MU_HTTPD_ENDPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+#define ENDPOINT_NAME_SIZE 128
+
+/*!
+ * \struct endpoint_t
+ * \brief An address on which the server listens for clients.
+ * Endpoints may be IPv4 or IPv6 addresses, the latter also accepting IPv4 clients, or
+ * Unix domain socket paths, either on the filesystem or on the abstract namespace.
+ * \since 3.0
+ */
+typedef struct endpoint_t {
+    struct sockaddr_storage address;
+    socklen_t length;
+} endpoint_t;
+
+/*
+ * Forward declaration of endpoint functions.
+ * These functions are needed for parsing, describing and binding to endpoints.
+ */
+extern int endpoint_parse(const char*, uint16_t, endpoint_t*, int);
+extern bool endpoint_match(const endpoint_t*, socket_id_t);
+extern void endpoint_update(endpoint_t*, socket_id_t);
+extern void endpoint_describe(const endpoint_t*, char*, size_t);
+extern void endpoint_unlink_stale(const endpoint_t*);
+extern void endpoint_unlink(const endpoint_t*);
+
+#endif
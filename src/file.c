@@ -0,0 +1,585 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the open file cache.
+ * Files are kept open along with their metadata, so that a request for a cached file
+ * resolves no path at all. Cached files are revalidated against their paths once they
+ * have been cached for longer than the configured time, and are replaced whenever they
+ * are found to have changed. The oldest files not used since they were last considered
+ * for eviction are evicted when full. The cache may be split into partitions, such as
+ * one for each virtual host, which evict their files independently, so that a busy
+ * partition cannot evict another's files. Each event loop and worker keeps a shard of
+ * the files it has recently used, in which its hits are found without any locking, so
+ * that the cache's lock is only taken to insert and evict files, or when a thread
+ * first uses a file.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "http.h"
+#include "settings.h"
+#include "timer.h"
+
+#include "file.h"
+
+/*
+ * The number of files a thread's shard may remember, each in the slot given by its
+ * path's hash.
+ */
+#define FILE_SHARD_SIZE 256
+
+/*!
+ * \struct file_cache_t
+ * \brief The files recently opened, looked up by path.
+ * Cached files are kept in a list from the most to the least recently cached.
+ * \since 3.0
+ */
+typedef struct file_cache_t {
+    pthread_mutex_t lock;
+    file_t **bucket;
+    size_t buckets;
+    size_t capacity;
+    size_t count;
+    file_t *newest;
+    file_t *oldest;
+} file_cache_t;
+
+/*!
+ * \var g_file_cache_default
+ * \brief The cache shared by all threads serving files, when it is not partitioned.
+ * \since 3.0
+ */
+static file_cache_t g_file_cache_default = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*!
+ * \var g_file_cache
+ * \brief The cache's partitions, shared by all threads serving files.
+ * \since 3.0
+ */
+static file_cache_t *g_file_cache = &g_file_cache_default;
+
+/*!
+ * \var g_file_partitions
+ * \brief The number of partitions the cache is split into.
+ * \since 3.0
+ */
+static size_t g_file_partitions = 1;
+
+/*!
+ * \struct file_shard_t
+ * \brief The files recently used by a single thread, found by their paths' hashes.
+ * A shard holds a reference to each of its files, which it drops as soon as it finds
+ * that the file is no longer cached, or when another file takes its slot.
+ * \since 3.0
+ */
+struct file_shard_t {
+    file_t *file[FILE_SHARD_SIZE];
+    size_t partition[FILE_SHARD_SIZE];
+};
+
+/*!
+ * \var g_file_shard
+ * \brief The shard bound to the current thread, if any.
+ * \since 3.0
+ */
+static _Thread_local file_shard_t *g_file_shard = NULL;
+
+/*!
+ * \fn uint64_t file_hash(const char*)
+ * \brief Hashes a path, with the FNV-1a function.
+ * \param path The path to be hashed.
+ * \return The path's hash.
+ */
+uint64_t file_hash(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *c = (const unsigned char*) path; *c != '\0'; ++c)
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+/*!
+ * \fn bool file_unchanged(const struct stat*, const struct stat*)
+ * \brief Checks whether a path still refers to the same, unchanged, file.
+ * \param cached The file's status when it has been cached.
+ * \param current The path's current status.
+ * \return Is the file unchanged?
+ */
+bool file_unchanged(const struct stat *cached, const struct stat *current)
+{
+    return cached->st_dev == current->st_dev
+        && cached->st_ino == current->st_ino
+        && cached->st_size == current->st_size
+        && cached->st_mtim.tv_sec == current->st_mtim.tv_sec
+        && cached->st_mtim.tv_nsec == current->st_mtim.tv_nsec
+        && cached->st_ctim.tv_sec == current->st_ctim.tv_sec
+        && cached->st_ctim.tv_nsec == current->st_ctim.tv_nsec;
+}
+
+/*!
+ * \fn void file_cache_prepare(file_cache_t*)
+ * \brief Allocates the cache when it is first used, with its share of the configured capacity.
+ * \param cache The cache to be prepared.
+ */
+void file_cache_prepare(file_cache_t *cache)
+{
+    if (cache->bucket != NULL || (cache->capacity = settings_current()->file_cache) == 0)
+        return;
+
+    cache->capacity = (cache->capacity + g_file_partitions - 1) / g_file_partitions;
+
+    for (cache->buckets = 16; cache->buckets < cache->capacity * 2; cache->buckets *= 2)
+        ;
+
+    cache->bucket = calloc(cache->buckets, sizeof(file_t*));
+}
+
+/*!
+ * \fn file_t *file_cache_find(const file_cache_t*, const char*, uint64_t)
+ * \brief Finds a path's file in the cache.
+ * \param cache The cache to look the file up in.
+ * \param path The file's path.
+ * \param hash The path's hash.
+ * \return The cached file, or NULL if the path is not cached.
+ */
+file_t *file_cache_find(const file_cache_t *cache, const char *path, uint64_t hash)
+{
+    if (cache->bucket == NULL)
+        return NULL;
+
+    for (file_t *file = cache->bucket[hash & (cache->buckets - 1)]; file != NULL; file = file->next)
+        if (file->hash == hash && strcmp(file->path, path) == 0)
+            return file;
+
+    return NULL;
+}
+
+/*!
+ * \fn void file_cache_detach(file_cache_t*, file_t*)
+ * \brief Removes a file from the list of recently used files.
+ * \param cache The cache the file belongs to.
+ * \param file The file to be removed from the list.
+ */
+void file_cache_detach(file_cache_t *cache, file_t *file)
+{
+    *(file->newer != NULL ? &file->newer->older : &cache->newest) = file->older;
+    *(file->older != NULL ? &file->older->newer : &cache->oldest) = file->newer;
+}
+
+/*!
+ * \fn void file_cache_touch(file_cache_t*, file_t*)
+ * \brief Moves a file on to the newest end of the list, as if it had just been cached.
+ * \param cache The cache the file belongs to.
+ * \param file The file to be moved.
+ */
+void file_cache_touch(file_cache_t *cache, file_t *file)
+{
+    if (cache->newest == file)
+        return;
+
+    file_cache_detach(cache, file);
+
+    file->newer = NULL;
+    file->older = cache->newest;
+    cache->newest->newer = file;
+    cache->newest = file;
+}
+
+/*!
+ * \fn void file_cache_insert(file_cache_t*, file_t*)
+ * \brief Stores a file into the cache, as its most recently used one.
+ * \param cache The cache to store the file into.
+ * \param file The file to be stored.
+ */
+void file_cache_insert(file_cache_t *cache, file_t *file)
+{
+    file_t **bucket = &cache->bucket[file->hash & (cache->buckets - 1)];
+
+    file->next = *bucket;
+    file->newer = NULL;
+    file->older = cache->newest;
+    *bucket = file;
+
+    *(cache->newest != NULL ? &cache->newest->newer : &cache->oldest) = file;
+    cache->newest = file;
+
+    atomic_fetch_add(&file->references, 1);
+    atomic_store_explicit(&file->cached, true, memory_order_release);
+    ++cache->count;
+}
+
+/*!
+ * \fn void file_cache_remove(file_cache_t*, file_t*)
+ * \brief Removes a file from the cache, and releases the cache's reference to it.
+ * \param cache The cache to remove the file from.
+ * \param file The file to be removed.
+ */
+void file_cache_remove(file_cache_t *cache, file_t *file)
+{
+    file_t **link = &cache->bucket[file->hash & (cache->buckets - 1)];
+
+    while (*link != file)
+        link = &(*link)->next;
+
+    *link = file->next;
+    file_cache_detach(cache, file);
+    atomic_store_explicit(&file->cached, false, memory_order_release);
+    --cache->count;
+
+    file_release(file);
+}
+
+/*!
+ * \fn void file_cache_evict(file_cache_t*)
+ * \brief Evicts the oldest file which has not been used since it was last considered.
+ * Files which have been used are given a second chance, and moved on as if they had just
+ * been cached, so that a hit never needs the cache's lock to reorder its files.
+ * \param cache The cache to evict a file from.
+ */
+void file_cache_evict(file_cache_t *cache)
+{
+    for (size_t i = 0; i < cache->count && atomic_exchange_explicit(&cache->oldest->used, false, memory_order_relaxed); ++i)
+        file_cache_touch(cache, cache->oldest);
+
+    file_cache_remove(cache, cache->oldest);
+}
+
+/*!
+ * \fn file_t *file_cache_take(file_cache_t*, const char*, uint64_t)
+ * \brief Takes a reference to a path's cached file, marking it as used.
+ * \param cache The cache to look the file up in.
+ * \param path The file's path.
+ * \param hash The path's hash.
+ * \return The cached file, which must be released, or NULL if the path is not cached.
+ */
+file_t *file_cache_take(file_cache_t *cache, const char *path, uint64_t hash)
+{
+    pthread_mutex_lock(&cache->lock);
+    file_cache_prepare(cache);
+    file_t *file = file_cache_find(cache, path, hash);
+
+    if (file != NULL) {
+        atomic_fetch_add(&file->references, 1);
+        atomic_store_explicit(&file->used, true, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return file;
+}
+
+/*!
+ * \fn file_cache_t *file_cache_select(size_t)
+ * \brief Selects one of the cache's partitions.
+ * \param partition The partition to be selected.
+ * \return The selected partition, or the first one if there is no such partition.
+ */
+file_cache_t *file_cache_select(size_t partition)
+{
+    return &g_file_cache[partition < g_file_partitions ? partition : 0];
+}
+
+/*!
+ * \fn size_t file_shard_index(uint64_t, size_t)
+ * \brief Finds the slot a file is remembered in by a shard.
+ * \param hash The file's path's hash.
+ * \param partition The partition the file is cached in.
+ * \return The file's slot in any shard.
+ */
+size_t file_shard_index(uint64_t hash, size_t partition)
+{
+    return (size_t) (hash + partition) & (FILE_SHARD_SIZE - 1);
+}
+
+/*!
+ * \fn file_t *file_shard_find(file_shard_t*, const char*, uint64_t, size_t)
+ * \brief Takes a reference to a path's file, if a shard remembers it as still being cached.
+ * Only the shard's own thread ever looks into it, so that no lock is needed.
+ * \param shard The shard to look the file up in.
+ * \param path The file's path.
+ * \param hash The path's hash.
+ * \param partition The partition the file is cached in.
+ * \return The cached file, which must be released, or NULL if the shard does not have it.
+ */
+file_t *file_shard_find(file_shard_t *shard, const char *path, uint64_t hash, size_t partition)
+{
+    size_t index = file_shard_index(hash, partition);
+    file_t *file = shard->file[index];
+
+    if (file == NULL || shard->partition[index] != partition || file->hash != hash || strcmp(file->path, path) != 0)
+        return NULL;
+
+    if (!atomic_load_explicit(&file->cached, memory_order_acquire)) {
+        shard->file[index] = NULL;
+        file_release(file);
+        return NULL;
+    }
+
+    if (!atomic_load_explicit(&file->used, memory_order_relaxed))
+        atomic_store_explicit(&file->used, true, memory_order_relaxed);
+
+    atomic_fetch_add(&file->references, 1);
+    return file;
+}
+
+/*!
+ * \fn void file_shard_keep(file_t*, size_t)
+ * \brief Remembers a cached file in the current thread's shard, if it has one.
+ * \param file The file to be remembered.
+ * \param partition The partition the file is cached in.
+ */
+void file_shard_keep(file_t *file, size_t partition)
+{
+    file_shard_t *shard = g_file_shard;
+    size_t index = file_shard_index(file->hash, partition);
+
+    if (shard == NULL || shard->file[index] == file || !atomic_load_explicit(&file->cached, memory_order_acquire))
+        return;
+
+    if (shard->file[index] != NULL)
+        file_release(shard->file[index]);
+
+    atomic_fetch_add(&file->references, 1);
+    shard->file[index] = file;
+    shard->partition[index] = partition;
+}
+
+/*!
+ * \fn file_t *file_take(size_t, const char*, uint64_t)
+ * \brief Takes a reference to a path's cached file, from the current thread's shard if possible.
+ * \param partition The partition the file is cached in.
+ * \param path The file's path.
+ * \param hash The path's hash.
+ * \return The cached file, which must be released, or NULL if the path is not cached.
+ */
+file_t *file_take(size_t partition, const char *path, uint64_t hash)
+{
+    file_t *file = g_file_shard != NULL ? file_shard_find(g_file_shard, path, hash, partition) : NULL;
+
+    if (file == NULL && (file = file_cache_take(file_cache_select(partition), path, hash)) != NULL)
+        file_shard_keep(file, partition);
+
+    return file;
+}
+
+/*!
+ * \fn file_t *file_open(const char*, uint64_t, uint64_t)
+ * \brief Opens a file and reads its metadata.
+ * Files are opened without blocking, so that a pipe in the public folder cannot hold
+ * a thread back until someone writes to it.
+ * \param path The path of the file to be opened.
+ * \param hash The path's hash.
+ * \param now The current time, in timer ticks.
+ * \return The open file, or NULL if it cannot be opened.
+ */
+file_t *file_open(const char *path, uint64_t hash, uint64_t now)
+{
+    struct stat status;
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &status) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    file_t *file = calloc(1, sizeof(file_t));
+
+    file->path = strdup(path);
+    file->hash = hash;
+    file->fd = fd;
+    file->status = status;
+    atomic_init(&file->references, 1);
+    atomic_init(&file->validated, now);
+    atomic_init(&file->prepared, NULL);
+    atomic_init(&file->cached, false);
+    atomic_init(&file->used, false);
+
+    return file;
+}
+
+/*!
+ * \fn void file_partition(size_t)
+ * \brief Splits the cache into partitions, sharing its capacity evenly.
+ * The cache must be partitioned before it is first used.
+ * \param count The number of partitions.
+ */
+extern void file_partition(size_t count)
+{
+    if (count <= 1 || g_file_partitions > 1)
+        return;
+
+    g_file_cache = calloc(count, sizeof(file_cache_t));
+    g_file_partitions = count;
+
+    for (size_t i = 0; i < count; ++i)
+        pthread_mutex_init(&g_file_cache[i].lock, NULL);
+}
+
+/*!
+ * \fn file_t *file_acquire(const char*, size_t)
+ * \brief Opens a file through one of the cache's partitions.
+ * A cached file past its revalidation time is checked against its path with a single
+ * `stat`, without holding the cache's lock, and is only reopened if it has changed.
+ * \param path The path of the file to be opened.
+ * \param partition The partition to cache the file into.
+ * \return The open file, which must be released, or NULL if it cannot be opened.
+ */
+extern file_t *file_acquire(const char *path, size_t partition)
+{
+    struct stat status;
+    file_cache_t *cache = file_cache_select(partition);
+    uint64_t hash = file_hash(path);
+    uint64_t now = timer_clock();
+    file_t *file = file_take(partition, path, hash);
+
+    if (file != NULL) {
+        if ((now - atomic_load(&file->validated)) * TIMER_TICK < settings_current()->file_ttl)
+            return file;
+
+        if (stat(path, &status) == 0 && file_unchanged(&file->status, &status)) {
+            atomic_store(&file->validated, now);
+            return file;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+
+        if (file_cache_find(cache, path, hash) == file)
+            file_cache_remove(cache, file);
+
+        pthread_mutex_unlock(&cache->lock);
+        file_release(file);
+    }
+
+    if ((file = file_open(path, hash, now)) == NULL || cache->capacity == 0)
+        return file;
+
+    pthread_mutex_lock(&cache->lock);
+    file_t *previous = file_cache_find(cache, path, hash);
+
+    if (previous != NULL)
+        file_cache_remove(cache, previous);
+
+    file_cache_insert(cache, file);
+
+    while (cache->count > cache->capacity)
+        file_cache_evict(cache);
+
+    pthread_mutex_unlock(&cache->lock);
+    file_shard_keep(file, partition);
+
+    return file;
+}
+
+/*!
+ * \fn file_t *file_lookup(const char*, size_t)
+ * \brief Finds a file in one of the cache's partitions, without touching the filesystem at all.
+ * Only files which need not be revalidated yet are found, so that a file found can be
+ * trusted as much as if it had been opened through the cache.
+ * \param path The path of the file to be found.
+ * \param partition The partition to look the file up in.
+ * \return The cached file, which must be released, or NULL if it is not cached.
+ */
+extern file_t *file_lookup(const char *path, size_t partition)
+{
+    file_t *file = file_take(partition, path, file_hash(path));
+
+    if (file != NULL && (timer_clock() - atomic_load(&file->validated)) * TIMER_TICK >= settings_current()->file_ttl) {
+        file_release(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/*!
+ * \fn void file_release(file_t*)
+ * \brief Releases a file, closing it if it is not used by anyone anymore.
+ * \param file The file to be released.
+ */
+extern void file_release(file_t *file)
+{
+    if (atomic_fetch_sub(&file->references, 1) == 1) {
+        if (file->prepared != NULL)
+            http_prepared_release(file->prepared);
+
+        close(file->fd);
+        free(file->path);
+        free(file);
+    }
+}
+
+/*!
+ * \fn void file_finalize()
+ * \brief Releases every cached file, in every partition.
+ */
+extern void file_finalize()
+{
+    for (size_t i = 0; i < g_file_partitions; ++i) {
+        file_cache_t *cache = &g_file_cache[i];
+
+        while (cache->oldest != NULL)
+            file_cache_remove(cache, cache->oldest);
+
+        free(cache->bucket);
+        cache->bucket = NULL;
+        cache->capacity = 0;
+    }
+
+    if (g_file_cache != &g_file_cache_default) {
+        for (size_t i = 0; i < g_file_partitions; ++i)
+            pthread_mutex_destroy(&g_file_cache[i].lock);
+
+        free(g_file_cache);
+        g_file_cache = &g_file_cache_default;
+        g_file_partitions = 1;
+    }
+}
+
+/*!
+ * \fn file_shard_t *file_shard_create()
+ * \brief Creates a new shard, which does not remember any file yet.
+ * \return The new shard instance.
+ */
+extern file_shard_t *file_shard_create()
+{
+    return calloc(1, sizeof(file_shard_t));
+}
+
+/*!
+ * \fn void file_shard_bind(file_shard_t*)
+ * \brief Binds a shard to the current thread, so that its hits are found in the shard.
+ * \param shard The shard to be bound, or NULL to unbind the current one.
+ */
+extern void file_shard_bind(file_shard_t *shard)
+{
+    g_file_shard = shard;
+}
+
+/*!
+ * \fn void file_shard_destroy(file_shard_t*)
+ * \brief Releases every file a shard remembers, and frees the shard.
+ * \param shard The shard to be destroyed.
+ */
+extern void file_shard_destroy(file_shard_t *shard)
+{
+    for (size_t i = 0; i < FILE_SHARD_SIZE; ++i)
+        if (shard->file[i] != NULL)
+            file_release(shard->file[i]);
+
+    free(shard);
+}
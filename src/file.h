@@ -0,0 +1,66 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the open file cache.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_FILE_H
+#define MU_HTTPD_FILE_H
+
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*!
+ * \struct file_t
+ * \brief An open file and its metadata, shared by all requests for its path.
+ * Files are reference counted, so that a file being sent remains open even after it
+ * has been evicted from the cache or replaced by a newer version. A file never changes
+ * once opened, so its response, once prepared, is kept along with it. Whether a file
+ * is still cached, and whether it has been used since the cache last looked for a file
+ * to evict, are flags which are set without the cache's lock.
+ * \since 3.0
+ */
+typedef struct file_t {
+    atomic_size_t references;
+    char *path;
+    uint64_t hash;
+    int fd;
+    struct stat status;
+    _Atomic uint64_t validated;
+    _Atomic(struct http_prepared_t *) prepared;
+    atomic_bool cached;
+    atomic_bool used;
+    struct file_t *next;
+    struct file_t *newer;
+    struct file_t *older;
+} file_t;
+
+/*!
+ * \typedef file_shard_t
+ * \brief The files recently used by a single thread, found without the cache's lock.
+ * \since 3.0
+ */
+typedef struct file_shard_t file_shard_t;
+
+/*
+ * Forward declaration of file functions.
+ * These functions are needed for opening files through the cache.
+ */
+extern void file_partition(size_t);
+extern file_t *file_acquire(const char*, size_t);
+extern file_t *file_lookup(const char*, size_t);
+extern void file_release(file_t*);
+extern void file_finalize();
+
+/*
+ * Forward declaration of file shard functions.
+ * These functions are needed for finding hot files without any cross-thread locking.
+ */
+extern file_shard_t *file_shard_create();
+extern void file_shard_bind(file_shard_t*);
+extern void file_shard_destroy(file_shard_t*);
+
+#endif
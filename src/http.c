@@ -10,6 +10,7 @@
 #include <stdio.h>
 
 #include "config.h"
+#include "arena.h"
 #include "http.h"
 
 size_t http_request_parse_method(enum http_error_t *, struct http_request_t *, char *);
@@ -66,7 +67,7 @@ size_t http_request_parse_method(enum http_error_t *error, struct http_request_t
         return 0;
 
     size_t total_size;
-    sscanf(raw, "%16s%zn ", buffer, &total_size);
+    sscanf(raw, "%15s%zn ", buffer, &total_size);
 
     request->method = http_request_parse_map_method(buffer);
 
@@ -120,12 +121,20 @@ size_t http_request_parse_uri(enum http_error_t *error, struct http_request_t *r
     else if (total_size > MAX_URL_SIZE)
         *error = HTTP_ERROR_URI_TOO_LONG;
 
+    // The path and query are decoded in place, so the target is copied out beforehand.
+    if (*error == HTTP_ERROR_OK) {
+        request->target = arena_malloc(sizeof(char) * (total_size + 1));
+        memcpy(request->target, raw, total_size);
+        request->target[total_size] = (char) 0;
+    }
+
     consumed += http_request_parse_uri_path(error, &uri->path, raw);
 
+    // A request without a query is given an empty one, right where its decoded path ends.
     if (consumed < total_size)
         http_request_parse_uri_query(error, &uri->query, raw + consumed);
     else
-        uri->query = raw + consumed - 1;
+        uri->query = uri->path + strlen(uri->path);
 
     return total_size + 1;
 }
@@ -213,7 +222,7 @@ size_t http_request_parse_protocol(enum http_error_t *error, struct http_request
         return 0;
 
     size_t total_size;
-    sscanf(raw, "%16s\r\n%zn", request->protocol, &total_size);
+    sscanf(raw, "%15s\r\n%zn", request->protocol, &total_size);
 
     if (strcmp(request->protocol, "HTTP/1.1") != 0)
         *error = HTTP_ERROR_PROTOCOL_INVALID;
@@ -243,7 +252,7 @@ size_t http_request_parse_headers(enum http_error_t *error, struct http_request_
     request->count_headers = count;
 
     if (count > 0)
-        request->header = malloc(sizeof(struct http_header_t) * count);
+        request->header = arena_malloc(sizeof(struct http_header_t) * count);
 
     for (size_t i = 0; i < count; ++i)
         consumed += http_request_parse_headers_one(&request->header[i], raw + consumed);
@@ -294,15 +303,82 @@ size_t http_request_parse_headers_one(struct http_header_t *header, char *raw)
     return total_size;
 }
 
+/*!
+ * \fn char *http_request_detach_pointer(const struct http_request_t *, char *, char *)
+ * \brief Finds where a pointer into a request's raw contents points to in their copy.
+ * \param request The request whose raw contents have been copied.
+ * \param raw The copy of the request's raw contents.
+ * \param pointer The pointer into the request's raw contents.
+ * \return The pointer into the copy, or NULL if the pointer is NULL.
+ */
+char *http_request_detach_pointer(const struct http_request_t *request, char *raw, char *pointer)
+{
+    return pointer != NULL ? raw + (pointer - request->raw) : NULL;
+}
+
+/*!
+ * \fn struct http_request_t http_request_detach(const struct http_request_t *, size_t)
+ * \brief Copies a parsed request out of the memory it has been parsed into.
+ * The copy owns its raw contents, which must be freed after the copy has been freed,
+ * and nothing of it is allocated from the current thread's arena, so that it can be
+ * handed over to another thread without being parsed again.
+ * \param request The parsed request to be copied.
+ * \param size The request's raw contents size, not counting their terminator.
+ * \return The request's copy.
+ */
+struct http_request_t http_request_detach(const struct http_request_t *request, size_t size)
+{
+    struct http_request_t detached = *request;
+
+    detached.raw = malloc(sizeof(char) * (size + 1));
+    memcpy(detached.raw, request->raw, size + 1);
+
+    detached.uri.path = http_request_detach_pointer(request, detached.raw, request->uri.path);
+    detached.uri.query = http_request_detach_pointer(request, detached.raw, request->uri.query);
+    detached.contents = http_request_detach_pointer(request, detached.raw, request->contents);
+    detached.header = NULL;
+
+    if (request->target != NULL) {
+        size_t length = strlen(request->target) + 1;
+        detached.target = malloc(sizeof(char) * length);
+        memcpy(detached.target, request->target, length);
+    }
+
+    if (request->count_headers > 0) {
+        detached.header = malloc(sizeof(struct http_header_t) * request->count_headers);
+
+        for (size_t i = 0; i < request->count_headers; ++i) {
+            detached.header[i].key = http_request_detach_pointer(request, detached.raw, request->header[i].key);
+            detached.header[i].value = http_request_detach_pointer(request, detached.raw, request->header[i].value);
+        }
+    }
+
+    return detached;
+}
+
 /*!
  * \fn void http_request_free(struct http_request_t *)
  * \brief Frees up all resources consumed by the current request.
+ * The request's raw contents are owned by whoever has read them, and are kept.
  * \param request The request to have its resources freed up.
  */
 void http_request_free(struct http_request_t *request)
 {
     if (request) {
-        free(request->header);
-        free(request->raw);
+        arena_free(request->header);
+        arena_free(request->target);
+    }
+}
+
+/*!
+ * \fn void http_prepared_release(struct http_prepared_t *)
+ * \brief Releases a prepared response, freeing it if it is not used by anyone anymore.
+ * \param prepared The prepared response to be released.
+ */
+void http_prepared_release(struct http_prepared_t *prepared)
+{
+    if (atomic_fetch_sub(&prepared->references, 1) == 1) {
+        free(prepared->data);
+        free(prepared);
     }
 }
@@ -6,6 +6,11 @@
 #ifndef MU_HTTPD_HTTP_H
 #define MU_HTTPD_HTTP_H
 
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 /*!
  * \enum http_method_t
  * \brief Enumerates all HTTP methods so they can be easily referenced in code.
@@ -34,6 +39,8 @@ enum http_error_t {
   , HTTP_ERROR_REQUEST_TOO_LONG
   , HTTP_ERROR_PROTOCOL_INVALID
   , HTTP_ERROR_HEADERS_EMPTY
+  , HTTP_ERROR_BODY_INVALID
+  , HTTP_ERROR_BODY_TOO_LONG
 };
 
 /*!
@@ -54,12 +61,20 @@ struct http_uri_t {
     char *query;
 };
 
+struct body_t;
+struct http_response_t;
+
 /*!
  * \struct http_request_t
  * \brief Groups up relevant info about a HTTP request.
+ * The request's target is kept exactly as it has been received, before its path and
+ * query have been decoded, so that it can be forwarded elsewhere without any change. A
+ * request whose body is still to be received has its body's decoder, which is only
+ * taken over by routes which stream the body elsewhere as it arrives.
  */
 struct http_request_t {
     struct http_uri_t uri;
+    char *target;
     enum http_method_t method;
     char protocol[16];
     struct http_header_t *header;
@@ -67,6 +82,7 @@ struct http_request_t {
     char *contents;
     size_t length;
     char *raw;
+    struct body_t *body;
 };
 
 /*!
@@ -75,17 +91,90 @@ struct http_request_t {
  */
 enum http_code_t {
     HTTP_RESPONSE_OK                    = 200
+  , HTTP_RESPONSE_CREATED               = 201
+  , HTTP_RESPONSE_ACCEPTED              = 202
+  , HTTP_RESPONSE_NO_CONTENT            = 204
+  , HTTP_RESPONSE_PARTIAL_CONTENT       = 206
   , HTTP_RESPONSE_MOVED_PERMANENTLY     = 301
+  , HTTP_RESPONSE_FOUND                 = 302
+  , HTTP_RESPONSE_SEE_OTHER             = 303
+  , HTTP_RESPONSE_NOT_MODIFIED          = 304
+  , HTTP_RESPONSE_TEMPORARY_REDIRECT    = 307
+  , HTTP_RESPONSE_PERMANENT_REDIRECT    = 308
   , HTTP_RESPONSE_BAD_REQUEST           = 400
+  , HTTP_RESPONSE_UNAUTHORIZED          = 401
+  , HTTP_RESPONSE_FORBIDDEN             = 403
   , HTTP_RESPONSE_NOT_FOUND             = 404
+  , HTTP_RESPONSE_METHOD_NOT_ALLOWED    = 405
+  , HTTP_RESPONSE_CONFLICT              = 409
+  , HTTP_RESPONSE_GONE                  = 410
+  , HTTP_RESPONSE_PAYLOAD_TOO_LARGE     = 413
+  , HTTP_RESPONSE_UNSUPPORTED_MEDIA     = 415
+  , HTTP_RESPONSE_UNPROCESSABLE_CONTENT = 422
+  , HTTP_RESPONSE_TOO_MANY_REQUESTS     = 429
   , HTTP_RESPONSE_INTERNAL_SERVER_ERROR = 500
   , HTTP_RESPONSE_NOT_IMPLEMENTED       = 501
+  , HTTP_RESPONSE_BAD_GATEWAY           = 502
+  , HTTP_RESPONSE_SERVICE_UNAVAILABLE   = 503
+  , HTTP_RESPONSE_GATEWAY_TIMEOUT       = 504
   , HTTP_RESPONSE_VERSION_NOT_SUPPORTED = 505
 };
 
+/*!
+ * \struct http_stream_t
+ * \brief Produces a response's content piece by piece, while the response is sent.
+ * Producers are only asked for more content once what they have produced so far has
+ * been sent, so that a slow client holds back the producer instead of piling up memory.
+ * Producing nothing ends the content. Producers extend this structure with their state.
+ */
+struct http_stream_t {
+    size_t (*produce)(struct http_stream_t *, unsigned char *, size_t);
+    void (*release)(struct http_stream_t *);
+};
+
+/*!
+ * \struct http_relay_t
+ * \brief Relays a response from elsewhere, straight into the client's socket.
+ * Forwarding moves the relay along as far as it can go without blocking, and fails
+ * with EAGAIN when the relay must wait for its descriptor, which may be the client's own
+ * socket, to be ready for its events. Forwarding first succeeds once the response's head
+ * has been received, which is then taken from the relay to be sent along with the content
+ * received with it, and succeeds again once the rest of the content has been relayed.
+ * Content which is not delimited only ends when its source closes, and so does the
+ * connection it is relayed through. Relays extend this structure with their state.
+ */
+struct http_relay_t {
+    int (*forward)(struct http_relay_t *, int);
+    bool (*respond)(struct http_relay_t *, struct http_response_t *);
+    void (*release)(struct http_relay_t *);
+    bool delimited;
+    int fd;
+    short events;
+};
+
+/*!
+ * \struct http_prepared_t
+ * \brief A response serialized beforehand, and shared by all requests it answers.
+ * Only the `Date` and `Connection` headers change from one request to the next, so a
+ * prepared response holds its status line and its other headers, followed by its content.
+ */
+struct http_prepared_t {
+    atomic_size_t references;
+    enum http_code_t status_code;
+    char *data;
+    size_t header_length;
+    size_t length;
+};
+
 /*!
  * \struct http_response_t
  * \brief Describes a HTTP response for an incoming request.
+ * A response's content is either completely known beforehand, streamed, in which case
+ * it is sent with the chunked transfer-encoding, or a large file sent straight from its
+ * open descriptor, in which case the response's length is taken from the file, starting
+ * at the response's offset within it. A response may also have been prepared beforehand,
+ * in which case it has nothing else but its status code. A relayed response only has its
+ * relay until the relay has received its head, and is framed by its relayed headers.
  */
 struct http_response_t {
     char protocol[16];
@@ -94,9 +183,17 @@ struct http_response_t {
     size_t count_headers;
     unsigned char *content;
     size_t length;
+    struct http_stream_t *stream;
+    struct file_t *file;
+    size_t offset;
+    struct http_prepared_t *prepared;
+    struct http_relay_t *relay;
 };
 
 extern struct http_request_t http_request_parse(enum http_error_t *, char *, size_t);
+extern enum http_method_t http_request_parse_map_method(const char *);
+extern struct http_request_t http_request_detach(const struct http_request_t *, size_t);
 extern void http_request_free(struct http_request_t *);
+extern void http_prepared_release(struct http_prepared_t *);
 
 #endif
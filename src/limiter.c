@@ -0,0 +1,200 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the per-client rate limiter.
+ * Each client address has a token bucket, which is refilled at a constant rate up to
+ * its burst size, and from which a token is taken for every request. Buckets live in
+ * an open-addressed table, whose slots are claimed and updated with atomic operations
+ * only, so that checking a client never blocks any thread.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "limiter.h"
+
+#define LIMITER_TOKEN_BITS  24
+#define LIMITER_TOKEN_MASK  ((1ull << LIMITER_TOKEN_BITS) - 1)
+#define LIMITER_MAX_BURST   (LIMITER_TOKEN_MASK / LIMITER_MILLI)
+#define LIMITER_MILLI       1000
+#define LIMITER_PROBE       8
+
+/*!
+ * \fn uint64_t limiter_clock()
+ * \brief Reads the monotonic clock in milliseconds.
+ * \return The current monotonic time.
+ */
+uint64_t limiter_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/*!
+ * \fn limiter_t *limiter_create(size_t, uint32_t, uint32_t)
+ * \brief Creates a new rate limiter.
+ * \param size The number of buckets in the limiter's table, rounded up to a power of two.
+ * \param rate The number of requests per second each client is allowed to make.
+ * \param burst The number of requests a client is allowed to make at once.
+ * \return The new rate limiter instance.
+ */
+extern limiter_t *limiter_create(size_t size, uint32_t rate, uint32_t burst)
+{
+    size_t capacity = LIMITER_PROBE;
+    limiter_t *limiter = malloc(sizeof(limiter_t));
+
+    while (capacity < size)
+        capacity <<= 1;
+
+    limiter->rate = rate;
+    limiter->burst = burst < 1 ? 1 : burst > LIMITER_MAX_BURST ? LIMITER_MAX_BURST : burst;
+    limiter->epoch = limiter_clock();
+    limiter->mask = capacity - 1;
+    limiter->slot = calloc(capacity, sizeof(limiter_slot_t));
+
+    return limiter;
+}
+
+/*!
+ * \fn uint64_t limiter_key(const struct sockaddr*)
+ * \brief Derives the key identifying a client address in the limiter's table.
+ * IPv4 addresses are used as they are, while IPv6 addresses are hashed into a key.
+ * Clients connected through Unix domain sockets are never limited.
+ * \param address The client's address.
+ * \return The client's key, or zero if the address cannot be limited.
+ */
+uint64_t limiter_key(const struct sockaddr *address)
+{
+    if (address->sa_family == AF_INET)
+        return (1ull << 32) | ((const struct sockaddr_in*) address)->sin_addr.s_addr;
+
+    if (address->sa_family == AF_INET6) {
+        uint64_t half[2];
+        const struct in6_addr *ipv6 = &((const struct sockaddr_in6*) address)->sin6_addr;
+
+        // IPv4 clients of a dual-stack socket are seen with mapped IPv6 addresses, and
+        // must share their buckets with the same clients seen through IPv4 sockets.
+        if (IN6_IS_ADDR_V4MAPPED(ipv6)) {
+            uint32_t ipv4;
+            memcpy(&ipv4, &ipv6->s6_addr[12], sizeof(uint32_t));
+            return (1ull << 32) | ipv4;
+        }
+
+        memcpy(half, ipv6, sizeof(half));
+        return ((half[0] * 0x9e3779b97f4a7c15ull) ^ half[1]) | (1ull << 63);
+    }
+
+    return 0;
+}
+
+/*!
+ * \fn limiter_slot_t *limiter_find(limiter_t*, uint64_t, uint64_t)
+ * \brief Finds the bucket of a client, or claims one for it.
+ * Only a few slots around the client's position are probed. If none of them is the
+ * client's or free, the least recently refilled one is taken over.
+ * \param limiter The rate limiter to find the bucket in.
+ * \param key The client's key.
+ * \param now The current time, in milliseconds since the limiter's creation.
+ * \return The client's bucket.
+ */
+limiter_slot_t *limiter_find(limiter_t *limiter, uint64_t key, uint64_t now)
+{
+    uint64_t oldest_key = 0;
+    uint64_t oldest_time = UINT64_MAX;
+    limiter_slot_t *oldest = NULL;
+
+    size_t position = (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 17);
+    uint64_t full = (now << LIMITER_TOKEN_BITS) | ((uint64_t) limiter->burst * LIMITER_MILLI);
+
+    for (size_t i = 0; i < LIMITER_PROBE; ++i) {
+        limiter_slot_t *slot = &limiter->slot[(position + i) & limiter->mask];
+        uint64_t current = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+        if (current == 0 && atomic_compare_exchange_strong(&slot->key, &current, key)) {
+            atomic_store_explicit(&slot->state, full, memory_order_release);
+            return slot;
+        }
+
+        if (current == key)
+            return slot;
+
+        uint64_t last = atomic_load_explicit(&slot->state, memory_order_relaxed) >> LIMITER_TOKEN_BITS;
+
+        if (last < oldest_time) {
+            oldest = slot;
+            oldest_key = current;
+            oldest_time = last;
+        }
+    }
+
+    // The bucket is taken over even if another thread has just done the same, as the
+    // buckets only need to be approximately right for the limiter to do its job.
+    if (atomic_compare_exchange_strong(&oldest->key, &oldest_key, key))
+        atomic_store_explicit(&oldest->state, full, memory_order_release);
+
+    return oldest;
+}
+
+/*!
+ * \fn bool limiter_allow(limiter_t*, const struct sockaddr*)
+ * \brief Takes a token from a client's bucket, if there are any left.
+ * \param limiter The rate limiter to check the client against.
+ * \param address The client's address.
+ * \return Is the client allowed to make a new request?
+ */
+extern bool limiter_allow(limiter_t *limiter, const struct sockaddr *address)
+{
+    bool allowed;
+    uint64_t updated;
+    uint64_t key = limiter_key(address);
+
+    if (key == 0)
+        return true;
+
+    uint64_t now = limiter_clock() - limiter->epoch;
+    uint64_t capacity = (uint64_t) limiter->burst * LIMITER_MILLI;
+
+    limiter_slot_t *slot = limiter_find(limiter, key, now);
+    uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+
+    // A bucket is refilled with as many milli-tokens per millisecond as the number
+    // of tokens it is refilled with per second.
+    do {
+        uint64_t last = state >> LIMITER_TOKEN_BITS;
+        uint64_t tokens = state & LIMITER_TOKEN_MASK;
+        uint64_t elapsed = now > last ? now - last : 0;
+
+        if (elapsed > capacity)
+            elapsed = capacity;
+
+        tokens += elapsed * limiter->rate;
+        tokens = tokens > capacity ? capacity : tokens;
+
+        if ((allowed = tokens >= LIMITER_MILLI))
+            tokens -= LIMITER_MILLI;
+
+        updated = ((now > last ? now : last) << LIMITER_TOKEN_BITS) | tokens;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &slot->state, &state, updated, memory_order_relaxed, memory_order_relaxed
+    ));
+
+    return allowed;
+}
+
+/*!
+ * \fn void limiter_destroy(limiter_t*)
+ * \brief Destroys a rate limiter and frees its table.
+ * \param limiter The rate limiter to be destroyed.
+ */
+extern void limiter_destroy(limiter_t *limiter)
+{
+    free(limiter->slot);
+    free(limiter);
+}
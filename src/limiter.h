@@ -0,0 +1,51 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the per-client rate limiter.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_LIMITER_H
+#define MU_HTTPD_LIMITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+/*!
+ * \struct limiter_slot_t
+ * \brief A client's token bucket, stored in the limiter's table.
+ * The bucket's state packs the time it has last been refilled at, in milliseconds,
+ * on its upper bits, and its number of milli-tokens on its lower bits.
+ * \since 3.0
+ */
+typedef struct limiter_slot_t {
+    _Atomic uint64_t key;
+    _Atomic uint64_t state;
+} limiter_slot_t;
+
+/*!
+ * \struct limiter_t
+ * \brief A rate limiter, which keeps a token bucket for each client address.
+ * The buckets are kept in a fixed-size open-addressed table, which is shared by all
+ * threads and never locked. When the table is full, the least recently used bucket
+ * around a client's position is taken over by the client.
+ * \since 3.0
+ */
+typedef struct limiter_t {
+    uint32_t rate;
+    uint32_t burst;
+    uint64_t epoch;
+    size_t mask;
+    limiter_slot_t *slot;
+} limiter_t;
+
+/*
+ * Forward declaration of rate limiter functions.
+ * These functions are needed for creating a limiter and checking clients against it.
+ */
+extern limiter_t *limiter_create(size_t, uint32_t, uint32_t);
+extern bool limiter_allow(limiter_t*, const struct sockaddr*);
+extern void limiter_destroy(limiter_t*);
+
+#endif
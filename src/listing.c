@@ -0,0 +1,565 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the directory listing cache.
+ * Directories are read with `getdents64` and their entries inspected with `fstatat`
+ * relative to the directory, so that no path is resolved more than once. Listings
+ * are cached per directory, and rebuilt when their directory has changed or when they
+ * have been cached for longer than the configured time, as changing a file does not
+ * change the directory it lives in.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "settings.h"
+#include "timer.h"
+
+#include "listing.h"
+
+#define LISTING_DENTS_SIZE 32768
+
+/*
+ * The number of listings a thread's shard may remember, each in the slot given by its
+ * path's hash.
+ */
+#define LISTING_SHARD_SIZE 16
+
+/*!
+ * \struct listing_dirent_t
+ * \brief A directory entry, as returned by the `getdents64` system call.
+ * \since 3.0
+ */
+typedef struct listing_dirent_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} listing_dirent_t;
+
+/*!
+ * \struct listing_cache_t
+ * \brief The listings recently built, replaced by least recent use when full.
+ * The cache's lock is only taken when a thread's shard does not have a listing.
+ * \since 3.0
+ */
+typedef struct listing_cache_t {
+    pthread_mutex_t lock;
+    listing_t **slot;
+    size_t capacity;
+} listing_cache_t;
+
+/*!
+ * \var g_listing_cache
+ * \brief The cache shared by all threads listing directories.
+ * \since 3.0
+ */
+static listing_cache_t g_listing_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*!
+ * \struct listing_shard_t
+ * \brief The listings recently used by a single thread, found by their paths' hashes.
+ * A shard holds a reference to each of its listings, which it drops as soon as it finds
+ * that the listing is no longer cached, or when another listing takes its slot.
+ * \since 3.0
+ */
+struct listing_shard_t {
+    listing_t *listing[LISTING_SHARD_SIZE];
+};
+
+/*!
+ * \var g_listing_shard
+ * \brief The shard bound to the current thread, if any.
+ * \since 3.0
+ */
+static _Thread_local listing_shard_t *g_listing_shard = NULL;
+
+/*!
+ * \var g_listing_sorted
+ * \brief The listing being sorted by the calling thread.
+ * The standard sorting function gives no context to its comparison function.
+ * \since 3.0
+ */
+static _Thread_local const listing_t *g_listing_sorted;
+
+/*!
+ * \fn uint64_t listing_hash(const char*)
+ * \brief Hashes a directory's path, with the FNV-1a function.
+ * \param path The path to be hashed.
+ * \return The path's hash.
+ */
+uint64_t listing_hash(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *c = (const unsigned char*) path; *c != '\0'; ++c)
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+/*!
+ * \fn int listing_compare(const listing_entry_t*, const listing_entry_t*, listing_sort_t)
+ * \brief Compares two directory entries, in the order of the given key.
+ * The parent directory always comes first, followed by directories, then files. Ties
+ * are broken by the entries' names.
+ * \param a The first entry to be compared.
+ * \param b The second entry to be compared.
+ * \param sort The key to compare the entries by.
+ * \return The comparison's result.
+ */
+int listing_compare(const listing_entry_t *a, const listing_entry_t *b, listing_sort_t sort)
+{
+    bool a_parent = strcmp(a->name, "..") == 0;
+    bool b_parent = strcmp(b->name, "..") == 0;
+
+    if (a_parent != b_parent)
+        return a_parent ? -1 : 1;
+
+    if (a->directory != b->directory)
+        return a->directory ? -1 : 1;
+
+    if (sort == LISTING_SORT_MODIFIED && a->modified != b->modified)
+        return a->modified < b->modified ? -1 : 1;
+
+    if (sort == LISTING_SORT_SIZE && a->size != b->size)
+        return a->size < b->size ? -1 : 1;
+
+    return strcmp(a->name, b->name);
+}
+
+/*!
+ * \fn int listing_compare_name(const void*, const void*)
+ * \brief Compares two directory entries by name, for sorting a listing's entries.
+ * \param a The first entry to be compared.
+ * \param b The second entry to be compared.
+ * \return The comparison's result.
+ */
+int listing_compare_name(const void *a, const void *b)
+{
+    return listing_compare(a, b, LISTING_SORT_NAME);
+}
+
+/*!
+ * \fn int listing_compare_modified(const void*, const void*)
+ * \brief Compares two entries of the listing being sorted by modification time.
+ * \param a The index of the first entry to be compared.
+ * \param b The index of the second entry to be compared.
+ * \return The comparison's result.
+ */
+int listing_compare_modified(const void *a, const void *b)
+{
+    const listing_entry_t *entry = g_listing_sorted->entry;
+    return listing_compare(&entry[*(const uint32_t*) a], &entry[*(const uint32_t*) b], LISTING_SORT_MODIFIED);
+}
+
+/*!
+ * \fn int listing_compare_size(const void*, const void*)
+ * \brief Compares two entries of the listing being sorted by size.
+ * \param a The index of the first entry to be compared.
+ * \param b The index of the second entry to be compared.
+ * \return The comparison's result.
+ */
+int listing_compare_size(const void *a, const void *b)
+{
+    const listing_entry_t *entry = g_listing_sorted->entry;
+    return listing_compare(&entry[*(const uint32_t*) a], &entry[*(const uint32_t*) b], LISTING_SORT_SIZE);
+}
+
+/*!
+ * \fn void listing_sort(listing_t*)
+ * \brief Sorts a listing's entries by name, and finds their order by every other key.
+ * \param listing The listing to be sorted.
+ */
+void listing_sort(listing_t *listing)
+{
+    static int (*const compare[LISTING_SORT_COUNT])(const void*, const void*) = {
+        [LISTING_SORT_MODIFIED] = listing_compare_modified
+      , [LISTING_SORT_SIZE]     = listing_compare_size
+    };
+
+    qsort(listing->entry, listing->count, sizeof(listing_entry_t), listing_compare_name);
+    g_listing_sorted = listing;
+
+    for (size_t i = 0; i < listing->count && listing->entry[i].directory; ++i) {
+        listing->parents += strcmp(listing->entry[i].name, "..") == 0;
+        ++listing->directories;
+    }
+
+    for (int sort = 0; sort < LISTING_SORT_COUNT; ++sort) {
+        listing->order[sort] = malloc(sizeof(uint32_t) * (listing->count + 1));
+
+        for (size_t i = 0; i < listing->count; ++i)
+            listing->order[sort][i] = (uint32_t) i;
+
+        if (compare[sort] != NULL)
+            qsort(listing->order[sort], listing->count, sizeof(uint32_t), compare[sort]);
+    }
+}
+
+/*!
+ * \fn size_t listing_position(const listing_t*, size_t, bool)
+ * \brief Finds where an entry is listed, in ascending or descending order.
+ * A descending order is reversed within each group of entries only, so that the
+ * parent directory and directories still come before files.
+ * \param listing The listing being listed.
+ * \param position The entry's position in ascending order.
+ * \param descending Is the listing in descending order?
+ * \return The position at which the entry is listed.
+ */
+extern size_t listing_position(const listing_t *listing, size_t position, bool descending)
+{
+    if (!descending || position < listing->parents)
+        return position;
+
+    if (position < listing->directories)
+        return listing->parents + listing->directories - 1 - position;
+
+    return listing->directories + listing->count - 1 - position;
+}
+
+/*!
+ * \fn void listing_destroy(listing_t*)
+ * \brief Destroys a listing, once it is not used by anyone anymore.
+ * \param listing The listing to be destroyed.
+ */
+void listing_destroy(listing_t *listing)
+{
+    for (int sort = 0; sort < LISTING_SORT_COUNT; ++sort)
+        free(listing->order[sort]);
+
+    free(listing->entry);
+    free(listing->names);
+    free(listing->path);
+    free(listing);
+}
+
+/*!
+ * \fn listing_t *listing_build(int, const char*, const struct stat*)
+ * \brief Reads a directory's entries and builds its listing.
+ * Entry names are kept as offsets while the directory is read, as the buffer holding
+ * them might move while it grows.
+ * \param fd The directory to be read.
+ * \param path The directory's path.
+ * \param status The directory's status, from before it is read.
+ * \return The directory's listing.
+ */
+listing_t *listing_build(int fd, const char *path, const struct stat *status)
+{
+    struct stat st;
+    _Alignas(8) char dents[LISTING_DENTS_SIZE];
+    size_t capacity = 64, names_length = 0, names_capacity = 1024;
+
+    listing_t *listing = calloc(1, sizeof(listing_t));
+    listing->entry = malloc(sizeof(listing_entry_t) * capacity);
+    listing->names = malloc(sizeof(char) * names_capacity);
+    listing->path = strdup(path);
+    listing->hash = listing_hash(path);
+    listing->device = status->st_dev;
+    listing->inode = status->st_ino;
+    listing->changed = status->st_mtim;
+    listing->built = timer_clock();
+    atomic_init(&listing->references, 1);
+    atomic_init(&listing->used, listing->built);
+    atomic_init(&listing->cached, false);
+
+    for (;;) {
+        long size = syscall(SYS_getdents64, fd, dents, sizeof(dents));
+
+        if (size <= 0)
+            break;
+
+        for (long offset = 0; offset < size; ) {
+            listing_dirent_t *dirent = (listing_dirent_t*) (dents + offset);
+            size_t length = strlen(dirent->d_name);
+            offset += dirent->d_reclen;
+
+            if (strcmp(dirent->d_name, ".") == 0 || fstatat(fd, dirent->d_name, &st, 0) == -1)
+                continue;
+
+            if (listing->count == capacity)
+                listing->entry = realloc(listing->entry, sizeof(listing_entry_t) * (capacity *= 2));
+
+            while (names_length + length + 1 > names_capacity)
+                listing->names = realloc(listing->names, sizeof(char) * (names_capacity *= 2));
+
+            listing->entry[listing->count++] = (listing_entry_t) {
+                .name = (const char*) (uintptr_t) names_length
+              , .directory = S_ISDIR(st.st_mode)
+              , .modified = st.st_mtime
+              , .size = st.st_size
+            };
+
+            memcpy(listing->names + names_length, dirent->d_name, length + 1);
+            names_length += length + 1;
+        }
+    }
+
+    for (size_t i = 0; i < listing->count; ++i)
+        listing->entry[i].name = listing->names + (uintptr_t) listing->entry[i].name;
+
+    close(fd);
+    listing_sort(listing);
+
+    return listing;
+}
+
+/*!
+ * \fn bool listing_fresh(const listing_t*, const struct stat*, uint64_t)
+ * \brief Checks whether a cached listing still reflects its directory.
+ * \param listing The cached listing.
+ * \param status The directory's current status.
+ * \param now The current time, in timer ticks.
+ * \return May the listing still be used?
+ */
+bool listing_fresh(const listing_t *listing, const struct stat *status, uint64_t now)
+{
+    return listing->device == status->st_dev
+        && listing->inode == status->st_ino
+        && listing->changed.tv_sec == status->st_mtim.tv_sec
+        && listing->changed.tv_nsec == status->st_mtim.tv_nsec
+        && (now - listing->built) * TIMER_TICK < settings_current()->listing_ttl;
+}
+
+/*!
+ * \fn void listing_use(listing_t*, uint64_t)
+ * \brief Takes a reference to a listing, and records when it has last been used.
+ * The time is only written when it has changed, so that threads listing the same hot
+ * directory do not keep writing to the same listing.
+ * \param listing The listing being used.
+ * \param now The current time, in timer ticks.
+ */
+void listing_use(listing_t *listing, uint64_t now)
+{
+    if (atomic_load_explicit(&listing->used, memory_order_relaxed) != now)
+        atomic_store_explicit(&listing->used, now, memory_order_relaxed);
+
+    atomic_fetch_add(&listing->references, 1);
+}
+
+/*!
+ * \fn listing_t *listing_shard_find(listing_shard_t*, const char*, uint64_t, const struct stat*, uint64_t)
+ * \brief Takes a reference to a directory's listing, if a shard remembers it as still
+ * being cached and it still reflects its directory.
+ * Only the shard's own thread ever looks into it, so that no lock is needed.
+ * \param shard The shard to look the listing up in.
+ * \param path The directory's path.
+ * \param hash The path's hash.
+ * \param status The directory's current status.
+ * \param now The current time, in timer ticks.
+ * \return The listing, which must be released, or NULL if the shard does not have it.
+ */
+listing_t *listing_shard_find(listing_shard_t *shard, const char *path, uint64_t hash, const struct stat *status, uint64_t now)
+{
+    size_t index = (size_t) hash & (LISTING_SHARD_SIZE - 1);
+    listing_t *listing = shard->listing[index];
+
+    if (listing == NULL || listing->hash != hash || strcmp(listing->path, path) != 0)
+        return NULL;
+
+    if (!atomic_load_explicit(&listing->cached, memory_order_acquire)) {
+        shard->listing[index] = NULL;
+        listing_release(listing);
+        return NULL;
+    }
+
+    if (!listing_fresh(listing, status, now))
+        return NULL;
+
+    listing_use(listing, now);
+    return listing;
+}
+
+/*!
+ * \fn void listing_shard_keep(listing_t*)
+ * \brief Remembers a cached listing in the current thread's shard, if it has one.
+ * \param listing The listing to be remembered.
+ */
+void listing_shard_keep(listing_t *listing)
+{
+    listing_shard_t *shard = g_listing_shard;
+    size_t index = (size_t) listing->hash & (LISTING_SHARD_SIZE - 1);
+
+    if (shard == NULL || shard->listing[index] == listing || !atomic_load_explicit(&listing->cached, memory_order_acquire))
+        return;
+
+    if (shard->listing[index] != NULL)
+        listing_release(shard->listing[index]);
+
+    atomic_fetch_add(&listing->references, 1);
+    shard->listing[index] = listing;
+}
+
+/*!
+ * \fn void listing_cache_store(listing_cache_t*, listing_t*)
+ * \brief Stores a listing into the cache, replacing the directory's previous listing or
+ * the cache's least recently used one.
+ * \param cache The cache to store the listing into.
+ * \param listing The listing to be stored.
+ */
+void listing_cache_store(listing_cache_t *cache, listing_t *listing)
+{
+    size_t target = 0;
+    uint64_t oldest = UINT64_MAX;
+
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        if (cache->slot[i] != NULL && strcmp(cache->slot[i]->path, listing->path) == 0) {
+            target = i;
+            break;
+        }
+
+        uint64_t used = cache->slot[i] != NULL ? atomic_load_explicit(&cache->slot[i]->used, memory_order_relaxed) : 0;
+
+        if (oldest > 0 && used < oldest) {
+            oldest = used;
+            target = i;
+        }
+    }
+
+    if (cache->slot[target] != NULL) {
+        atomic_store_explicit(&cache->slot[target]->cached, false, memory_order_release);
+        listing_release(cache->slot[target]);
+    }
+
+    atomic_fetch_add(&listing->references, 1);
+    atomic_store_explicit(&listing->cached, true, memory_order_release);
+    cache->slot[target] = listing;
+}
+
+/*!
+ * \fn listing_t *listing_acquire(const char*)
+ * \brief Finds a directory's listing, building it if it has not been cached yet.
+ * A listing is first looked up in the current thread's shard, without any lock, and the
+ * cache's lock is only taken when the shard does not have it. A directory is read
+ * without holding the cache's lock, so that listing a large directory does not hold
+ * back requests for any other directory.
+ * \param path The directory to be listed.
+ * \return The directory's listing, which must be released, or NULL on failure.
+ */
+extern listing_t *listing_acquire(const char *path)
+{
+    struct stat status;
+    listing_cache_t *cache = &g_listing_cache;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &status) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    uint64_t now = timer_clock();
+    uint64_t hash = listing_hash(path);
+    listing_t *found = g_listing_shard != NULL ? listing_shard_find(g_listing_shard, path, hash, &status, now) : NULL;
+
+    if (found != NULL) {
+        close(fd);
+        return found;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->slot == NULL && (cache->capacity = settings_current()->listing_cache) > 0)
+        cache->slot = calloc(cache->capacity, sizeof(listing_t*));
+
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        listing_t *listing = cache->slot[i];
+
+        if (listing != NULL && listing->hash == hash && strcmp(listing->path, path) == 0 && listing_fresh(listing, &status, now)) {
+            listing_use(listing, now);
+            pthread_mutex_unlock(&cache->lock);
+            listing_shard_keep(listing);
+            close(fd);
+            return listing;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    listing_t *listing = listing_build(fd, path, &status);
+
+    if (cache->capacity > 0) {
+        pthread_mutex_lock(&cache->lock);
+        listing_cache_store(cache, listing);
+        pthread_mutex_unlock(&cache->lock);
+        listing_shard_keep(listing);
+    }
+
+    return listing;
+}
+
+/*!
+ * \fn void listing_release(listing_t*)
+ * \brief Releases a listing, destroying it if it is not used by anyone anymore.
+ * \param listing The listing to be released.
+ */
+extern void listing_release(listing_t *listing)
+{
+    if (atomic_fetch_sub(&listing->references, 1) == 1)
+        listing_destroy(listing);
+}
+
+/*!
+ * \fn void listing_finalize()
+ * \brief Releases every cached listing.
+ */
+extern void listing_finalize()
+{
+    listing_cache_t *cache = &g_listing_cache;
+
+    for (size_t i = 0; i < cache->capacity; ++i)
+        if (cache->slot[i] != NULL)
+            listing_release(cache->slot[i]);
+
+    free(cache->slot);
+    cache->slot = NULL;
+    cache->capacity = 0;
+}
+
+/*!
+ * \fn listing_shard_t *listing_shard_create()
+ * \brief Creates a new shard, which does not remember any listing yet.
+ * \return The new shard instance.
+ */
+extern listing_shard_t *listing_shard_create()
+{
+    return calloc(1, sizeof(listing_shard_t));
+}
+
+/*!
+ * \fn void listing_shard_bind(listing_shard_t*)
+ * \brief Binds a shard to the current thread, so that its hits are found in the shard.
+ * \param shard The shard to be bound, or NULL to unbind the current one.
+ */
+extern void listing_shard_bind(listing_shard_t *shard)
+{
+    g_listing_shard = shard;
+}
+
+/*!
+ * \fn void listing_shard_destroy(listing_shard_t*)
+ * \brief Releases every listing a shard remembers, and frees the shard.
+ * \param shard The shard to be destroyed.
+ */
+extern void listing_shard_destroy(listing_shard_t *shard)
+{
+    for (size_t i = 0; i < LISTING_SHARD_SIZE; ++i)
+        if (shard->listing[i] != NULL)
+            listing_release(shard->listing[i]);
+
+    free(shard);
+}
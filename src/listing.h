@@ -0,0 +1,92 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the directory listing cache.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_LISTING_H
+#define MU_HTTPD_LISTING_H
+
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*!
+ * \enum listing_sort_t
+ * \brief The orders in which a directory's entries can be listed.
+ * \since 3.0
+ */
+typedef enum listing_sort_t {
+    LISTING_SORT_NAME = 0
+  , LISTING_SORT_MODIFIED
+  , LISTING_SORT_SIZE
+  , LISTING_SORT_COUNT
+} listing_sort_t;
+
+/*!
+ * \struct listing_entry_t
+ * \brief A directory entry, as shown in the directory's listing.
+ * \since 3.0
+ */
+typedef struct listing_entry_t {
+    const char *name;
+    bool directory;
+    time_t modified;
+    off_t size;
+} listing_entry_t;
+
+/*!
+ * \struct listing_t
+ * \brief A directory's entries, read once and shared by all requests listing it.
+ * Listings are never changed once built. A listing is replaced as soon as its directory
+ * is found to have changed, and only released once no request is using it anymore. In
+ * every order, the parent directory comes first, followed by directories, then files.
+ * A listing's use is recorded without any lock, as it is found by the threads' shards.
+ * \since 3.0
+ */
+typedef struct listing_t {
+    atomic_size_t references;
+    char *path;
+    uint64_t hash;
+    dev_t device;
+    ino_t inode;
+    struct timespec changed;
+    uint64_t built;
+    _Atomic uint64_t used;
+    atomic_bool cached;
+    listing_entry_t *entry;
+    uint32_t *order[LISTING_SORT_COUNT];
+    size_t parents;
+    size_t directories;
+    size_t count;
+    char *names;
+} listing_t;
+
+/*!
+ * \typedef listing_shard_t
+ * \brief The listings recently used by a single thread, found without the cache's lock.
+ * \since 3.0
+ */
+typedef struct listing_shard_t listing_shard_t;
+
+/*
+ * Forward declaration of listing functions.
+ * These functions are needed for reading directory listings through their cache.
+ */
+extern listing_t *listing_acquire(const char*);
+extern size_t listing_position(const listing_t*, size_t, bool);
+extern void listing_release(listing_t*);
+extern void listing_finalize();
+
+/*
+ * Forward declaration of listing shard functions.
+ * These functions are needed for finding hot listings without any cross-thread locking.
+ */
+extern listing_shard_t *listing_shard_create();
+extern void listing_shard_bind(listing_shard_t*);
+extern void listing_shard_destroy(listing_shard_t*);
+
+#endif
@@ -4,16 +4,40 @@
  * \author Rodrigo Siqueira <rodriados@gmail.com>
  * \copyright 2014-present Rodrigo Siqueira
  */
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include "config.h"
 #include "http.h"
 #include "logger.h"
 
 #define SINK_INCREMENT 5
+#define RING_INCREMENT 8
+#define LOGGER_LINE_SIZE (MAX_URL_SIZE + 256)
+#define LOGGER_ENTRY_FORMAT "%s [%s] %d %s %s\n"
+
+/*!
+ * \struct logger_ring_t
+ * \brief A lock-free ring of formatted log lines, filled by a single writer.
+ * The ring is drained by the logger's flusher thread, so that its writer never has
+ * to contend with other writers for the sinks while processing requests.
+ * \since 3.0
+ */
+typedef struct logger_ring_t {
+    char *buffer;
+    size_t capacity;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic uint32_t lines;
+    uint32_t flushed_lines;
+} logger_ring_t;
 
 /*!
  * \struct logger_sink_group_t
@@ -23,6 +47,11 @@
 typedef struct logger_sink_group_t {
     uint32_t capacity;
     logger_sink_t *sink_list;
+    uint32_t ring_count;
+    uint32_t ring_capacity;
+    logger_ring_t **ring_list;
+    pthread_t flusher;
+    volatile bool flusher_running;
 } logger_sink_group_t;
 
 /*!
@@ -81,11 +110,52 @@ extern logger_writer_t *logger_writer_initialize(logger_t *logger)
 
     writer->logger = logger;
     writer->_internal = logger->_internal;
+    writer->_ring = NULL;
+
+    return writer;
+}
+
+void *logger_flusher_run(void*);
+
+/*!
+ * \fn logger_writer_t *logger_ring_writer_initialize(logger_t*, size_t)
+ * \brief Creates a new log-writer which buffers its entries in a private ring.
+ * Entries written to a ring writer are formatted into the ring without any locks,
+ * and are later written to the sinks by the logger's flusher thread. A ring writer
+ * must only ever be used by a single thread.
+ * \param logger The logger instance to create writer from.
+ * \param capacity The ring's capacity in bytes.
+ * \return The new logger writer instance.
+ */
+extern logger_writer_t *logger_ring_writer_initialize(logger_t *logger, size_t capacity)
+{
+    logger_writer_t *writer = logger_writer_initialize(logger);
+    logger_sink_group_t *group = (logger_sink_group_t*) logger->_internal;
+    logger_ring_t *ring = calloc(1, sizeof(logger_ring_t));
+
+    ring->buffer = malloc(sizeof(char) * capacity);
+    ring->capacity = capacity;
+    writer->_ring = ring;
+
+    pthread_mutex_lock(&g_logger_mutex);
+
+    if (group->ring_count + 1 > group->ring_capacity) {
+        group->ring_capacity += RING_INCREMENT;
+        group->ring_list = realloc(group->ring_list, group->ring_capacity * sizeof(logger_ring_t*));
+    }
+
+    group->ring_list[group->ring_count++] = ring;
+
+    if (!group->flusher_running) {
+        group->flusher_running = true;
+        pthread_create(&group->flusher, NULL, &logger_flusher_run, (void*) logger);
+    }
+
+    pthread_mutex_unlock(&g_logger_mutex);
 
     return writer;
 }
 
-const char *logger_describe_http_method(enum http_method_t);
 const char *logger_describe_level(logger_level_t);
 
 /*!
@@ -101,7 +171,7 @@ void logger_write_entry_to_sink(logger_sink_t *sink, const logger_entry_t *entry
 
     fprintf(
         (FILE*) *sink
-      , "%s [%s] %d %s %s\n"
+      , LOGGER_ENTRY_FORMAT
       , datetime_buffer
       , logger_describe_level(entry->level)
       , entry->http_code
@@ -110,6 +180,119 @@ void logger_write_entry_to_sink(logger_sink_t *sink, const logger_entry_t *entry
     );
 }
 
+/*!
+ * \fn void logger_ring_drain(logger_t*, logger_ring_t*)
+ * \brief Writes all lines buffered in a ring to every sink linked to the logger.
+ * This function must only be called while holding the logger lock.
+ * \param logger The logger instance the ring belongs to.
+ * \param ring The ring to be drained.
+ */
+void logger_ring_drain(logger_t *logger, logger_ring_t *ring)
+{
+    logger_sink_group_t *group = (logger_sink_group_t*) logger->_internal;
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t lines = atomic_load_explicit(&ring->lines, memory_order_relaxed);
+
+    if (head == tail)
+        return;
+
+    size_t start = tail % ring->capacity;
+    size_t length = head - tail;
+    size_t first = length < ring->capacity - start ? length : ring->capacity - start;
+
+    for (uint32_t i = 0; i < logger->sink_count; ++i) {
+        fwrite(ring->buffer + start, sizeof(char), first, group->sink_list[i]);
+        fwrite(ring->buffer, sizeof(char), length - first, group->sink_list[i]);
+        fflush(group->sink_list[i]);
+    }
+
+    logger->logged_lines += lines - ring->flushed_lines;
+    ring->flushed_lines = lines;
+
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+}
+
+/*!
+ * \fn void logger_ring_write(const logger_writer_t*, const logger_entry_t*)
+ * \brief Formats an entry into the writer's ring, to be written by the flusher.
+ * If the ring is full, it is drained right away by the writer itself.
+ * \param writer The ring logger writer instance to write a new entry to.
+ * \param entry The entry to be logged.
+ */
+void logger_ring_write(const logger_writer_t *writer, const logger_entry_t *entry)
+{
+    char line[LOGGER_LINE_SIZE];
+    char datetime_buffer[128];
+    logger_ring_t *ring = (logger_ring_t*) writer->_ring;
+
+    strftime(datetime_buffer, 128, "%c", &entry->datetime);
+
+    int length = snprintf(
+        line, LOGGER_LINE_SIZE
+      , LOGGER_ENTRY_FORMAT
+      , datetime_buffer
+      , logger_describe_level(entry->level)
+      , entry->http_code
+      , logger_describe_http_method(entry->http_method)
+      , entry->http_uri.path
+    );
+
+    size_t size = length < LOGGER_LINE_SIZE ? (size_t) length : LOGGER_LINE_SIZE - 1;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head + size - atomic_load_explicit(&ring->tail, memory_order_acquire) > ring->capacity) {
+        pthread_mutex_lock(&g_logger_mutex);
+        logger_ring_drain(writer->logger, ring);
+        pthread_mutex_unlock(&g_logger_mutex);
+    }
+
+    size_t start = head % ring->capacity;
+    size_t first = size < ring->capacity - start ? size : ring->capacity - start;
+
+    memcpy(ring->buffer + start, line, first);
+    memcpy(ring->buffer, line + first, size - first);
+
+    atomic_fetch_add_explicit(&ring->lines, 1, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+}
+
+/*!
+ * \fn void logger_flush(logger_t*)
+ * \brief Drains the rings of every ring writer created from a logger.
+ * \param logger The logger instance to be flushed.
+ */
+void logger_flush(logger_t *logger)
+{
+    logger_sink_group_t *group = (logger_sink_group_t*) logger->_internal;
+
+    pthread_mutex_lock(&g_logger_mutex);
+
+    for (uint32_t i = 0; i < group->ring_count; ++i)
+        logger_ring_drain(logger, group->ring_list[i]);
+
+    pthread_mutex_unlock(&g_logger_mutex);
+}
+
+/*!
+ * \fn void *logger_flusher_run(void*)
+ * \brief The logger's flusher routine, which periodically drains all rings.
+ * \param logger The logger instance to be flushed.
+ */
+void *logger_flusher_run(void *logger)
+{
+    logger_sink_group_t *group = (logger_sink_group_t*) ((logger_t*) logger)->_internal;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL * 1000000L };
+
+    while (group->flusher_running) {
+        nanosleep(&interval, NULL);
+        logger_flush((logger_t*) logger);
+    }
+
+    return NULL;
+}
+
 /*!
  * \fn void logger_write(const logger_writer_t*, const logger_entry_t*)
  * \brief Writes a new entry to every sink linked to the logger writer.
@@ -120,6 +303,9 @@ extern void logger_write(const logger_writer_t *writer, const logger_entry_t *en
 {
     logger_sink_group_t *group = (logger_sink_group_t*) writer->_internal;
 
+    if (writer->_ring != NULL)
+        return logger_ring_write(writer, entry);
+
     pthread_mutex_lock(&g_logger_mutex);
 
     for (int i = 0; i < writer->logger->sink_count; ++i) {
@@ -138,6 +324,26 @@ extern void logger_write(const logger_writer_t *writer, const logger_entry_t *en
  */
 extern void logger_writer_finalize(logger_writer_t *writer)
 {
+    logger_ring_t *ring = (logger_ring_t*) writer->_ring;
+
+    // A ring is only detached from the logger once all of its buffered lines have been
+    // written, so that no entries are lost when a writer is finalized.
+    if (ring != NULL) {
+        logger_sink_group_t *group = (logger_sink_group_t*) writer->_internal;
+
+        pthread_mutex_lock(&g_logger_mutex);
+        logger_ring_drain(writer->logger, ring);
+
+        for (uint32_t i = 0; i < group->ring_count; ++i)
+            if (group->ring_list[i] == ring)
+                group->ring_list[i] = group->ring_list[--group->ring_count];
+
+        pthread_mutex_unlock(&g_logger_mutex);
+
+        free(ring->buffer);
+        free(ring);
+    }
+
     free(writer);
 }
 
@@ -150,8 +356,15 @@ extern void logger_finalize(logger_t *logger)
 {
     logger_sink_group_t *group = (logger_sink_group_t*) logger->_internal;
 
+    if (group->flusher_running) {
+        group->flusher_running = false;
+        pthread_join(group->flusher, NULL);
+        logger_flush(logger);
+    }
+
     pthread_mutex_destroy(&g_logger_mutex);
 
+    free(group->ring_list);
     free(group->sink_list);
     free(group);
 }
@@ -162,7 +375,7 @@ extern void logger_finalize(logger_t *logger)
  * \param method The method to get the verb of.
  * \return The requested method's verb string.
  */
-const char *logger_describe_http_method(enum http_method_t method)
+extern const char *logger_describe_http_method(enum http_method_t method)
 {
     switch (method) {
         case HTTP_GET:      return "GET";
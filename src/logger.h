@@ -52,6 +52,7 @@ typedef struct logger_t {
 typedef struct logger_writer_t {
     logger_t *logger;
     void *_internal;
+    void *_ring;
 } logger_writer_t;
 
 /*!
@@ -80,7 +81,14 @@ extern void logger_finalize(logger_t*);
  * These functions are needed to create and use logger writers.
  */
 extern logger_writer_t *logger_writer_initialize(logger_t*);
+extern logger_writer_t *logger_ring_writer_initialize(logger_t*, size_t);
 extern void logger_write(const logger_writer_t*, const logger_entry_t*);
 extern void logger_writer_finalize(logger_writer_t*);
 
+/*
+ * Forward declaration of logger description functions.
+ * These functions are needed to describe what is being logged.
+ */
+extern const char *logger_describe_http_method(enum http_method_t);
+
 #endif
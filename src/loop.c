@@ -0,0 +1,1821 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the server's event loops.
+ * Each event loop runs on its own thread, possibly pinned to a processor, and owns
+ * everything it needs to serve requests: a listening socket, a pool of connections,
+ * a memory arena and a log ring. Therefore, no locks are ever taken between threads
+ * while requests are being served. Connections may be kept alive and serve many requests.
+ * Loops are driven either by an epoll reactor on non-blocking sockets, or by io_uring,
+ * on which operations are submitted and completed in batches, with a single system
+ * call per loop iteration. Requests which cannot be answered from memory are handed
+ * over to the offload pool, and their connections wait until their replies are posted
+ * back, so that a loop never blocks on the disk. Neither does it block on the upstream
+ * servers of proxied requests, whose replies are relayed by the loop as their upstream
+ * connections become ready, through the loop's own pool of upstream connections.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "arena.h"
+#include "file.h"
+#include "listing.h"
+#include "logger.h"
+#include "offload.h"
+#include "proxy.h"
+#include "request.h"
+#include "uring.h"
+#include "timer.h"
+#include "settings.h"
+
+#include "loop.h"
+
+#define LOOP_POOL_CHUNK    64
+#define LOOP_ACCEPT_BATCH  64
+
+/*
+ * The tag marking epoll events on the upstream connection a relayed reply waits for,
+ * rather than on the client's own connection.
+ */
+#define LOOP_EPOLL_UPSTREAM 1
+
+/*
+ * The tags identifying the operation an io_uring completion refers to. Tags are
+ * stored in the lowest bits of the completion's user data, alongside the pointer to
+ * the connection or loop the operation has been submitted for.
+ */
+#define LOOP_URING_RECV     0
+#define LOOP_URING_SEND     1
+#define LOOP_URING_ACCEPT   2
+#define LOOP_URING_WAKEUP   3
+#define LOOP_URING_TIMER    4
+#define LOOP_URING_CANCEL   5
+#define LOOP_URING_PAUSE    6
+#define LOOP_URING_POLL     7
+#define LOOP_URING_TAG_MASK 7
+
+#define LOOP_URING_BUFFER_GROUP 0
+
+/*!
+ * \enum loop_connection_state_t
+ * \brief The states a connection owned by an event loop can be in.
+ * \since 3.0
+ */
+typedef enum loop_connection_state_t {
+    LOOP_CONNECTION_FREE = 0
+  , LOOP_CONNECTION_READING
+  , LOOP_CONNECTION_WRITING
+  , LOOP_CONNECTION_WAITING
+  , LOOP_CONNECTION_CLOSING
+} loop_connection_state_t;
+
+/*!
+ * \enum loop_timeout_t
+ * \brief The deadlines a connection can be waiting on.
+ * \since 3.0
+ */
+typedef enum loop_timeout_t {
+    LOOP_TIMEOUT_NONE = 0
+  , LOOP_TIMEOUT_HEADER
+  , LOOP_TIMEOUT_BODY
+  , LOOP_TIMEOUT_KEEPALIVE
+  , LOOP_TIMEOUT_WRITE
+  , LOOP_TIMEOUT_UPSTREAM
+} loop_timeout_t;
+
+/*!
+ * \struct loop_connection_t
+ * \brief A client connection served by an event loop.
+ * A connection whose reply is relayed may wait for its relay's upstream connection,
+ * which is then watched on its behalf, until it is ready or its deadline has expired.
+ * \since 3.0
+ */
+typedef struct loop_connection_t {
+    request_t request;
+    loop_connection_state_t state;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    size_t header_size;
+    enum http_error_t error;
+    bool body_pending;
+    body_t body;
+    bool eof;
+    request_reply_t reply;
+    size_t sent;
+    uint32_t watching;
+    int awaiting;
+    bool expired;
+    bool receiving;
+    bool pausing;
+    bool sending;
+    bool polling;
+    bool offloaded;
+    struct http_request_t offload_request;
+    size_t offload_size;
+    offload_job_t job;
+    loop_t *loop;
+    struct iovec iov[REQUEST_REPLY_PARTS];
+    struct msghdr message;
+    timer_entry_t timer;
+    loop_timeout_t timeout;
+    struct loop_connection_t *next;
+    struct loop_connection_t *next_completed;
+} loop_connection_t;
+
+/*!
+ * \struct loop_pool_t
+ * \brief A pool of connections, allocated in chunks and recycled when closed.
+ * \since 3.0
+ */
+typedef struct loop_pool_t {
+    loop_connection_t *free_list;
+    loop_connection_t **chunk_list;
+    size_t chunk_count;
+    size_t active;
+    size_t memory;
+} loop_pool_t;
+
+/*!
+ * \struct loop_listener_t
+ * \brief A listening socket from which an event loop accepts new clients.
+ * Listeners are aligned, so that their addresses can tag io_uring operations.
+ * \since 3.0
+ */
+typedef struct loop_listener_t {
+    _Alignas(8) socket_id_t socket;
+    bool accepting;
+} loop_listener_t;
+
+/*!
+ * \struct loop_internal_t
+ * \brief The internal event loop struct for private loop functions.
+ * \since 3.0
+ */
+typedef struct loop_internal_t {
+    int epoll;
+    int wakeup;
+    uint64_t wakeup_value;
+    server_engine_t engine;
+    uring_t uring;
+    timer_wheel_t timers;
+    struct __kernel_timespec tick;
+    bool ticking;
+    pthread_t thread;
+    bool joined;
+    atomic_bool stopping;
+    atomic_bool draining;
+    bool drained;
+    logger_writer_t *logger;
+    arena_t *arena;
+    file_shard_t *files;
+    listing_shard_t *listings;
+    proxy_pool_t *proxy;
+    loop_pool_t pool;
+    _Atomic(loop_connection_t *) completed;
+    loop_limits_t limits;
+    loop_listener_t *listener;
+    int listener_count;
+    bool paused;
+} loop_internal_t;
+
+void loop_uring_arm(loop_t*, int, void*, int);
+void loop_uring_unpoll(loop_t*, loop_connection_t*);
+void loop_connection_unwait(loop_t*, loop_connection_t*);
+bool loop_connection_write(loop_t*, loop_connection_t*);
+void loop_connection_advance(loop_t*, loop_connection_t*);
+
+/*!
+ * \fn loop_t *loop_create(uint32_t, const socket_id_t*, int, logger_t*, server_engine_t, loop_limits_t)
+ * \brief Creates a new event loop serving connections from listening sockets.
+ * The listening sockets must be non-blocking, and are not owned by the loop. Sockets
+ * which could not be opened, and thus are -1, are ignored.
+ * \param id The new event loop's id.
+ * \param listener The sockets to accept new connections from.
+ * \param count The number of listening sockets.
+ * \param logger The logger instance to which the loop must log to.
+ * \param engine The I/O engine the loop must be driven by.
+ * \param limits The limits the loop must keep to.
+ * \return The new event loop instance.
+ */
+extern loop_t *loop_create(
+    uint32_t id
+  , const socket_id_t *listener
+  , int count
+  , logger_t *logger
+  , server_engine_t engine
+  , loop_limits_t limits
+) {
+    loop_t *loop = malloc(sizeof(loop_t));
+    loop_internal_t *internal = calloc(1, sizeof(loop_internal_t));
+
+    loop->id = id;
+    loop->cpu = -1;
+    loop->_internal = internal;
+
+    internal->listener = calloc(count, sizeof(loop_listener_t));
+
+    for (int i = 0; i < count; ++i)
+        if (listener[i] != -1)
+            internal->listener[internal->listener_count++].socket = listener[i];
+
+    internal->epoll = -1;
+    internal->engine = engine;
+    internal->limits = limits;
+    internal->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    internal->logger = logger_ring_writer_initialize(logger, settings_current()->log_ring_size);
+    internal->arena = arena_create(settings_current()->arena_size);
+    internal->files = file_shard_create();
+    internal->listings = listing_shard_create();
+    internal->proxy = proxy_pool_create();
+    internal->tick = (struct __kernel_timespec) {
+        .tv_sec = TIMER_TICK / 1000
+      , .tv_nsec = (TIMER_TICK % 1000) * 1000000ll
+    };
+    atomic_init(&internal->stopping, false);
+    atomic_init(&internal->draining, false);
+    atomic_init(&internal->completed, NULL);
+
+    timer_wheel_initialize(&internal->timers, timer_clock());
+
+    return loop;
+}
+
+/*!
+ * \fn loop_connection_t *loop_pool_acquire(loop_pool_t*)
+ * \brief Takes a free connection from the pool, growing the pool if needed.
+ * \param pool The pool to take a connection from.
+ * \return The connection taken from the pool.
+ */
+loop_connection_t *loop_pool_acquire(loop_pool_t *pool)
+{
+    if (pool->free_list == NULL) {
+        loop_connection_t *chunk = calloc(LOOP_POOL_CHUNK, sizeof(loop_connection_t));
+
+        pool->chunk_list = realloc(pool->chunk_list, (pool->chunk_count + 1) * sizeof(loop_connection_t*));
+        pool->chunk_list[pool->chunk_count++] = chunk;
+
+        for (size_t i = 0; i < LOOP_POOL_CHUNK; ++i) {
+            chunk[i].next = pool->free_list;
+            pool->free_list = &chunk[i];
+        }
+    }
+
+    loop_connection_t *connection = pool->free_list;
+    pool->free_list = connection->next;
+    ++pool->active;
+
+    return connection;
+}
+
+/*!
+ * \fn void loop_pool_release(loop_pool_t*, loop_connection_t*)
+ * \brief Returns a connection to the pool, so that it can be recycled.
+ * A connection's buffers are kept for its next use, unless they have grown large.
+ * \param pool The pool to return the connection to.
+ * \param connection The connection to be returned.
+ */
+void loop_pool_release(loop_pool_t *pool, loop_connection_t *connection)
+{
+    if (connection->capacity > PAGE_SIZE) {
+        pool->memory -= connection->capacity;
+        free(connection->buffer);
+        connection->buffer = NULL;
+        connection->capacity = 0;
+    }
+
+    connection->state = LOOP_CONNECTION_FREE;
+    connection->next = pool->free_list;
+    pool->free_list = connection;
+    --pool->active;
+}
+
+/*!
+ * \fn void loop_pool_reserve(loop_pool_t*, loop_connection_t*, size_t)
+ * \brief Grows a connection's buffer, so that it can hold at least the given size.
+ * All memory held by connections is accounted for by their pool.
+ * \param pool The pool the connection belongs to.
+ * \param connection The connection whose buffer must be grown.
+ * \param size The number of bytes the buffer must be able to hold.
+ */
+void loop_pool_reserve(loop_pool_t *pool, loop_connection_t *connection, size_t size)
+{
+    size_t capacity = connection->capacity;
+
+    if (size <= capacity)
+        return;
+
+    while (size > connection->capacity)
+        connection->capacity = connection->capacity ? connection->capacity * 2 : PAGE_SIZE;
+
+    connection->buffer = realloc(connection->buffer, sizeof(char) * connection->capacity);
+    pool->memory += connection->capacity - capacity;
+}
+
+/*!
+ * \fn void loop_pool_release_reply(loop_pool_t*, loop_connection_t*)
+ * \brief Releases a connection's reply, and stops accounting for its memory.
+ * \param pool The pool the connection belongs to.
+ * \param connection The connection whose reply must be released.
+ */
+void loop_pool_release_reply(loop_pool_t *pool, loop_connection_t *connection)
+{
+    pool->memory -= connection->reply.footprint;
+    request_reply_release(&connection->reply);
+}
+
+/*!
+ * \fn void loop_connection_close(loop_t*, loop_connection_t*)
+ * \brief Closes a connection and returns it to the loop's pool.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to be closed.
+ */
+void loop_connection_close(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    timer_cancel(&internal->timers, &connection->timer);
+    connection->timeout = LOOP_TIMEOUT_NONE;
+    loop_connection_unwait(loop, connection);
+
+    // A connection cannot be released while the kernel still has operations in flight
+    // for it, or while its request is still being processed by the offload pool. Shutting
+    // the socket down forces these operations to complete, and the connection is released
+    // only once their completions have been received. A poll on an upstream connection is
+    // not completed by the client's shutdown, and so it is removed.
+    if (connection->receiving || connection->sending || connection->offloaded || connection->polling) {
+        if (connection->state != LOOP_CONNECTION_CLOSING)
+            shutdown(connection->request.client, SHUT_RDWR);
+
+        if (connection->state != LOOP_CONNECTION_CLOSING && connection->polling)
+            loop_uring_unpoll(loop, connection);
+
+        connection->state = LOOP_CONNECTION_CLOSING;
+        return;
+    }
+
+    close(connection->request.client);
+    loop_pool_release_reply(&internal->pool, connection);
+    loop_pool_release(&internal->pool, connection);
+}
+
+/*!
+ * \fn void loop_connection_deadline(loop_t*, loop_connection_t*, loop_timeout_t)
+ * \brief Sets the deadline a connection must meet, or else be closed.
+ * A deadline is only restarted when it changes, so that a client cannot hold on to a
+ * connection by trickling its request in. A write or upstream deadline is always
+ * restarted, as it is only set when a reply is making progress.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to set the deadline for.
+ * \param timeout The deadline the connection must meet.
+ */
+void loop_connection_deadline(loop_t *loop, loop_connection_t *connection, loop_timeout_t timeout)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (connection->timeout != timeout || timeout == LOOP_TIMEOUT_WRITE || timeout == LOOP_TIMEOUT_UPSTREAM) {
+        const settings_t *settings = settings_current();
+        const uint32_t duration[] = {
+            [LOOP_TIMEOUT_HEADER]    = settings->timeout_header
+          , [LOOP_TIMEOUT_BODY]      = settings->timeout_body
+          , [LOOP_TIMEOUT_KEEPALIVE] = settings->timeout_keepalive
+          , [LOOP_TIMEOUT_WRITE]     = settings->timeout_write
+          , [LOOP_TIMEOUT_UPSTREAM]  = settings->proxy_timeout
+        };
+
+        timer_arm(&internal->timers, &connection->timer, duration[timeout]);
+        connection->timeout = timeout;
+    }
+}
+
+/*!
+ * \fn void loop_connection_expire(loop_t*, loop_connection_t*)
+ * \brief Gives up waiting for a relayed reply's upstream server.
+ * The reply is then moved along as expired, so that the client is still answered,
+ * unless the relay's poll must be removed first, whose completion moves the reply along.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose upstream deadline has expired.
+ */
+void loop_connection_expire(loop_t *loop, loop_connection_t *connection)
+{
+    connection->expired = true;
+
+    if (connection->polling)
+        return loop_uring_unpoll(loop, connection);
+
+    if (loop_connection_write(loop, connection))
+        loop_connection_advance(loop, connection);
+}
+
+/*!
+ * \fn void loop_timers_expire(loop_t*)
+ * \brief Closes every connection which has missed its deadline.
+ * Connections which have been waiting for an upstream server are answered instead.
+ * \param loop The event loop owning the connections.
+ */
+void loop_timers_expire(loop_t *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    timer_entry_t *entry = timer_advance(&internal->timers, timer_clock());
+
+    while (entry != NULL) {
+        timer_entry_t *next = entry->next;
+        loop_connection_t *connection = (loop_connection_t*) ((char*) entry - offsetof(loop_connection_t, timer));
+        loop_timeout_t timeout = connection->timeout;
+
+        connection->timeout = LOOP_TIMEOUT_NONE;
+
+        if (timeout == LOOP_TIMEOUT_UPSTREAM)
+            loop_connection_expire(loop, connection);
+        else
+            loop_connection_close(loop, connection);
+
+        entry = next;
+    }
+}
+
+/*!
+ * \fn void loop_connection_watch(loop_t*, loop_connection_t*, uint32_t)
+ * \brief Changes what a connection is waiting for, either to send or to receive data.
+ * A connection waiting for nothing is only woken up if its client hangs up.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to be watched.
+ * \param events The events the connection must wait for.
+ */
+void loop_connection_watch(loop_t *loop, loop_connection_t *connection, uint32_t events)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (connection->watching != events) {
+        struct epoll_event event = { .events = events, .data.ptr = connection };
+        epoll_ctl(internal->epoll, EPOLL_CTL_MOD, connection->request.client, &event);
+        connection->watching = events;
+    }
+}
+
+/*!
+ * \fn void loop_connection_await(loop_t*, loop_connection_t*)
+ * \brief Waits for what a connection's relay must wait for, before it can move along.
+ * The client itself is not watched while its relay waits for its upstream connection, so
+ * that a client with more to send does not wake the loop up in vain.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose relay must wait.
+ */
+void loop_connection_await(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    const struct http_relay_t *relay = connection->reply.relay;
+    uint32_t events = relay->events == POLLIN ? EPOLLIN : EPOLLOUT;
+    bool upstream = relay->fd != connection->request.client;
+
+    loop_connection_deadline(loop, connection, upstream ? LOOP_TIMEOUT_UPSTREAM
+        : events == EPOLLIN ? LOOP_TIMEOUT_BODY : LOOP_TIMEOUT_WRITE);
+
+    if (internal->engine == SERVER_ENGINE_URING) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&internal->uring);
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = relay->fd;
+        sqe->poll32_events = (uint32_t) relay->events;
+        sqe->user_data = (uint64_t) (uintptr_t) connection | LOOP_URING_POLL;
+
+        connection->polling = true;
+        return;
+    }
+
+    if (!upstream)
+        return loop_connection_watch(loop, connection, events);
+
+    struct epoll_event event = { .events = events, .data.u64 = (uint64_t) (uintptr_t) connection | LOOP_EPOLL_UPSTREAM };
+    epoll_ctl(internal->epoll, EPOLL_CTL_ADD, relay->fd, &event);
+
+    connection->awaiting = relay->fd;
+    loop_connection_watch(loop, connection, 0);
+}
+
+/*!
+ * \fn void loop_connection_unwait(loop_t*, loop_connection_t*)
+ * \brief Stops watching the upstream connection a connection's relay has waited for.
+ * The upstream connection is no longer watched before its relay moves along, as the
+ * relay may then give it back to the pool, or close it.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose relay has waited.
+ */
+void loop_connection_unwait(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (connection->awaiting != -1) {
+        epoll_ctl(internal->epoll, EPOLL_CTL_DEL, connection->awaiting, NULL);
+        connection->awaiting = -1;
+    }
+}
+
+/*!
+ * \fn void loop_connection_prepare_message(loop_connection_t*)
+ * \brief Points the connection's message to the part of its reply not yet sent.
+ * \param connection The connection whose reply is being sent.
+ */
+void loop_connection_prepare_message(loop_connection_t *connection)
+{
+    size_t count = request_reply_gather(&connection->reply, connection->sent, connection->iov);
+    connection->message = (struct msghdr) { .msg_iov = connection->iov, .msg_iovlen = count };
+}
+
+/*!
+ * \fn bool loop_connection_pending(const loop_connection_t*)
+ * \brief Checks whether any of what is already in a connection's reply is left to be sent.
+ * \param connection The connection whose reply is being sent.
+ * \return Is there anything left to be sent before the reply's next chunk?
+ */
+bool loop_connection_pending(const loop_connection_t *connection)
+{
+    const request_reply_t *reply = &connection->reply;
+
+    return connection->sent < request_reply_size(reply)
+        || (reply->file != NULL && reply->file_offset < reply->file_length);
+}
+
+/*!
+ * \fn ssize_t loop_connection_send(loop_connection_t*)
+ * \brief Sends what is left of a connection's reply, without blocking.
+ * A file reply's file is sent straight from its descriptor once its header has been sent,
+ * and the header is sent with MSG_MORE, so that it leaves with the start of the file.
+ * \param connection The connection to send the reply through.
+ * \return The number of bytes sent, or -1 on error.
+ */
+ssize_t loop_connection_send(loop_connection_t *connection)
+{
+    request_reply_t *reply = &connection->reply;
+
+    if (connection->sent >= request_reply_size(reply))
+        return request_reply_sendfile(reply, connection->request.client);
+
+    loop_connection_prepare_message(connection);
+    ssize_t written = sendmsg(connection->request.client, &connection->message, MSG_NOSIGNAL | (reply->file != NULL ? MSG_MORE : 0));
+
+    connection->sent += written > 0 ? written : 0;
+    return written;
+}
+
+/*!
+ * \fn bool loop_connection_next_chunk(loop_connection_t*)
+ * \brief Moves a streamed reply on to its next chunk, once its current one has been sent.
+ * Chunks are only produced as fast as the client takes them, so that a streamed reply
+ * never holds more than a single chunk in memory.
+ * \param connection The connection whose reply is being sent.
+ * \return Is there a chunk left to be sent?
+ */
+bool loop_connection_next_chunk(loop_connection_t *connection)
+{
+    if (!request_reply_next(&connection->reply))
+        return false;
+
+    connection->sent = connection->reply.header_length;
+    return true;
+}
+
+/*!
+ * \fn bool loop_connection_finish_reply(loop_t*, loop_connection_t*)
+ * \brief Releases a connection's reply once it has been completely sent.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose reply has been sent.
+ * \return Is the connection ready for a new request?
+ */
+bool loop_connection_finish_reply(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    request_reply_t *reply = &connection->reply;
+
+    loop_pool_release_reply(&internal->pool, connection);
+
+    if (!reply->keepalive) {
+        loop_connection_close(loop, connection);
+        return false;
+    }
+
+    connection->state = LOOP_CONNECTION_READING;
+    loop_connection_deadline(loop, connection, LOOP_TIMEOUT_KEEPALIVE);
+
+    return true;
+}
+
+/*!
+ * \fn void loop_uring_send(loop_t*, loop_connection_t*)
+ * \brief Submits the sending of what is left of a connection's reply.
+ * The reply's header and body are sent together, with a single operation.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to send the reply through.
+ */
+void loop_uring_send(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    struct io_uring_sqe *sqe = uring_get_sqe(&internal->uring);
+
+    loop_connection_prepare_message(connection);
+    loop_connection_deadline(loop, connection, LOOP_TIMEOUT_WRITE);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = connection->request.client;
+    sqe->addr = (uint64_t) (uintptr_t) &connection->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) (uintptr_t) connection | LOOP_URING_SEND;
+
+    connection->sending = true;
+}
+
+/*!
+ * \fn bool loop_connection_relay(loop_t*, loop_connection_t*)
+ * \brief Moves a connection's relayed reply along, as far as it can go without blocking.
+ * The relay is only moved along once what it has produced so far has been sent. As it
+ * receives the rest of the request's body straight from the client, it first waits for
+ * the connection to stop receiving, and is handed the body bytes already received.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose reply is relayed.
+ * \return Has the relay something to be sent, or has it been completely relayed?
+ */
+bool loop_connection_relay(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (loop_connection_pending(connection))
+        return true;
+
+    if (connection->polling)
+        return false;
+
+    if (connection->receiving) {
+        if (!connection->pausing)
+            loop_uring_arm(loop, LOOP_URING_PAUSE, connection, -1);
+        return false;
+    }
+
+    loop_connection_unwait(loop, connection);
+
+    if (connection->body_pending) {
+        size_t consumed;
+        body_feed(&connection->body, connection->buffer, connection->length, &consumed);
+
+        connection->length -= consumed;
+        connection->body_pending = false;
+        memmove(connection->buffer, connection->buffer + consumed, connection->length);
+    }
+
+    int result = request_reply_relay(&connection->reply, connection->request.client, connection->expired, internal->logger);
+    connection->expired = false;
+    arena_reset(internal->arena);
+
+    if (result == 0)
+        return true;
+
+    if (errno == EAGAIN)
+        loop_connection_await(loop, connection);
+    else
+        loop_connection_close(loop, connection);
+
+    return false;
+}
+
+/*!
+ * \fn bool loop_connection_write(loop_t*, loop_connection_t*)
+ * \brief Sends as much of a connection's reply as possible without blocking.
+ * When driven by io_uring, the reply is only submitted to be sent, and the connection
+ * is advanced once the sending completes. A relayed reply is sent piece by piece, as
+ * its relay produces it.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to send the reply through.
+ * \return Has the reply been sent and the connection is ready for a new request?
+ */
+bool loop_connection_write(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    request_reply_t *reply = &connection->reply;
+
+    do {
+        if (reply->relay != NULL && !loop_connection_relay(loop, connection))
+            return false;
+
+        if (internal->engine == SERVER_ENGINE_URING) {
+            if (connection->sent < request_reply_size(reply) || loop_connection_next_chunk(connection)) {
+                loop_uring_send(loop, connection);
+                return false;
+            }
+
+            continue;
+        }
+
+        while (loop_connection_pending(connection) || loop_connection_next_chunk(connection)) {
+            ssize_t written = loop_connection_send(connection);
+
+            if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                loop_connection_deadline(loop, connection, LOOP_TIMEOUT_WRITE);
+                loop_connection_watch(loop, connection, EPOLLOUT);
+                return false;
+            }
+
+            if (written == -1 && errno != EINTR) {
+                loop_connection_close(loop, connection);
+                return false;
+            }
+        }
+    } while (reply->relay != NULL);
+
+    if (!loop_connection_finish_reply(loop, connection))
+        return false;
+
+    if (internal->engine == SERVER_ENGINE_EPOLL)
+        loop_connection_watch(loop, connection, EPOLLIN);
+
+    return true;
+}
+
+/*!
+ * \fn bool loop_connection_frame(loop_t*, loop_connection_t*)
+ * \brief Waits for a request's header section to be received, and prepares for its body.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to receive the header section from.
+ * \return Has the header section been received, and may the request be processed?
+ */
+bool loop_connection_frame(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    request_frame_t frame = request_frame(connection->buffer, connection->length, &connection->header_size);
+
+    if (frame == REQUEST_FRAME_INCOMPLETE) {
+        if (connection->eof)
+            loop_connection_close(loop, connection);
+        else if (connection->length > 0)
+            loop_connection_deadline(loop, connection, LOOP_TIMEOUT_HEADER);
+        return false;
+    }
+
+    // Clients over their rate limit are turned away before their requests are even
+    // parsed, so that they cost the server as little as possible.
+    if (internal->limits.limiter != NULL && !limiter_allow(internal->limits.limiter, (struct sockaddr*) &connection->request.origin)) {
+        request_reject(&connection->request, HTTP_RESPONSE_TOO_MANY_REQUESTS);
+        loop_connection_close(loop, connection);
+        return false;
+    }
+
+    if (frame == REQUEST_FRAME_TOO_LONG) {
+        connection->header_size = connection->length;
+        connection->error = HTTP_ERROR_REQUEST_TOO_LONG;
+        return true;
+    }
+
+    body_status_t status = request_body_start(&connection->request, &connection->body, connection->buffer, connection->header_size);
+    connection->body_pending = status == BODY_INCOMPLETE;
+    connection->error = request_body_error(status);
+
+    return true;
+}
+
+/*!
+ * \fn bool loop_connection_receive_body(loop_t*, loop_connection_t*)
+ * \brief Decodes the body bytes a connection has received so far.
+ * Decoded bytes are removed from the connection's buffer, so that the buffer only ever
+ * holds the request's header section and whatever has been received since last time.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to decode the body from.
+ * \return Has the body been completely received?
+ */
+bool loop_connection_receive_body(loop_t *loop, loop_connection_t *connection)
+{
+    size_t consumed;
+    char *body = connection->buffer + connection->header_size;
+    body_status_t status = body_feed(&connection->body, body, connection->length - connection->header_size, &consumed);
+
+    connection->length -= consumed;
+    memmove(body, body + consumed, connection->length - connection->header_size);
+
+    if (status == BODY_INCOMPLETE) {
+        if (connection->eof)
+            loop_connection_close(loop, connection);
+        else
+            loop_connection_deadline(loop, connection, LOOP_TIMEOUT_BODY);
+        return false;
+    }
+
+    connection->body_pending = false;
+    connection->error = request_body_error(status);
+    return true;
+}
+
+/*!
+ * \fn void loop_connection_consume(loop_connection_t*)
+ * \brief Removes the request just processed from a connection's buffer.
+ * \param connection The connection whose request has been processed.
+ */
+void loop_connection_consume(loop_connection_t *connection)
+{
+    size_t size = connection->header_size;
+
+    connection->length -= size;
+    connection->header_size = 0;
+    memmove(connection->buffer, connection->buffer + size, connection->length);
+}
+
+/*!
+ * \fn void loop_connection_offload_run(offload_job_t*, logger_writer_t*)
+ * \brief Processes a connection's request on the offload pool, and posts its reply back.
+ * The connection is pushed onto its loop's list of completed connections, and the loop
+ * is woken up to resume it.
+ * \param job The job embedded into the connection.
+ * \param logger_writer The logger writer instance of the pool's thread.
+ */
+void loop_connection_offload_run(offload_job_t *job, logger_writer_t *logger_writer)
+{
+    uint64_t value = 1;
+    loop_connection_t *connection = (loop_connection_t*) ((char*) job - offsetof(loop_connection_t, job));
+    loop_internal_t *internal = (loop_internal_t*) connection->loop->_internal;
+
+    request_respond_parsed(&connection->request, &connection->offload_request, logger_writer, &connection->reply);
+    connection->next_completed = atomic_load(&internal->completed);
+
+    while (!atomic_compare_exchange_weak(&internal->completed, &connection->next_completed, connection));
+
+    ssize_t ignored = write(internal->wakeup, &value, sizeof(uint64_t));
+    (void) ignored;
+}
+
+/*!
+ * \fn void loop_connection_offload(loop_t*, loop_connection_t*)
+ * \brief Hands a connection's request over to the offload pool.
+ * The request has already been parsed and detached from the connection's buffer, which
+ * the loop keeps on filling meanwhile, and the connection is neither watched nor timed
+ * out until it is resumed.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose request must be processed.
+ */
+void loop_connection_offload(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    size_t size = connection->header_size;
+
+    connection->offload_size = size;
+    internal->pool.memory += size + 1;
+
+    loop_connection_consume(connection);
+    timer_cancel(&internal->timers, &connection->timer);
+    connection->timeout = LOOP_TIMEOUT_NONE;
+
+    if (internal->engine == SERVER_ENGINE_EPOLL)
+        epoll_ctl(internal->epoll, EPOLL_CTL_DEL, connection->request.client, NULL);
+
+    connection->state = LOOP_CONNECTION_WAITING;
+    connection->offloaded = true;
+    connection->job.run = loop_connection_offload_run;
+
+    offload_submit(&connection->job);
+}
+
+/*!
+ * \fn void loop_connection_advance(loop_t*, loop_connection_t*)
+ * \brief Processes every complete request a connection has received.
+ * Requests are answered in order, and a new request is only processed once the
+ * previous reply has been completely sent. When there is an offload pool, requests
+ * which cannot be answered from memory are handed over to it. Otherwise, the loop
+ * processes them itself, and blocks on whatever they need from the disk.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to process requests from.
+ */
+void loop_connection_advance(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    while (connection->state == LOOP_CONNECTION_READING) {
+        bool framed = connection->header_size == 0;
+
+        if (framed && !loop_connection_frame(loop, connection))
+            return;
+
+        size_t size = connection->header_size;
+        connection->reply.keepalive = !connection->eof && !internal->drained;
+
+        // A request whose body is taken over by its reply is answered before its body has
+        // been received, as its reply receives the body by itself.
+        bool relayed = framed && connection->body_pending
+            && request_respond_cached(&connection->request, connection->error, connection->buffer, size, &connection->body, internal->logger, &connection->reply, NULL);
+
+        if (!relayed && connection->body_pending && !loop_connection_receive_body(loop, connection))
+            return;
+
+        // A reply which has not taken the body over, as the request is invalid, leaves the
+        // body unread, and so its connection cannot be kept alive.
+        if (relayed) {
+            connection->reply.keepalive = connection->reply.keepalive && connection->reply.relay != NULL;
+            arena_reset(internal->arena);
+        } else if (offload_available()) {
+            // A request which cannot be answered from memory is detached as it has been
+            // parsed, so that the offload pool does not parse it again.
+            bool answered = request_respond_cached(&connection->request, connection->error, connection->buffer, size, NULL, internal->logger, &connection->reply, &connection->offload_request);
+            arena_reset(internal->arena);
+
+            if (!answered)
+                return loop_connection_offload(loop, connection);
+        } else {
+            // The request is temporarily terminated, as the parser expects a string. The
+            // byte being overwritten might be the beginning of a pipelined request.
+            char next = connection->buffer[size];
+            connection->buffer[size] = (char) 0;
+
+            request_respond(&connection->request, connection->error, connection->buffer, size, internal->logger, &connection->reply);
+            arena_reset(internal->arena);
+
+            connection->buffer[size] = next;
+        }
+
+        internal->pool.memory += connection->reply.footprint;
+        loop_connection_consume(connection);
+
+        connection->state = LOOP_CONNECTION_WRITING;
+        connection->sent = 0;
+
+        if (!loop_connection_write(loop, connection))
+            return;
+    }
+}
+
+/*!
+ * \fn void loop_connection_read(loop_t*, loop_connection_t*)
+ * \brief Receives all data available on a connection, and processes it.
+ * The connection's buffer only grows as long as a header section may need it. Whenever
+ * the buffer is filled up, what it holds is processed before receiving more, so that a
+ * body is decoded as it arrives instead of being held in memory.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to receive data from.
+ */
+void loop_connection_read(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    size_t max_header_size = settings_current()->max_header_size;
+
+    while (!connection->eof) {
+        if (connection->length + 1 >= connection->capacity) {
+            if (connection->capacity > max_header_size)
+                break;
+
+            loop_pool_reserve(&internal->pool, connection, connection->capacity + 1);
+        }
+
+        size_t space = connection->capacity - connection->length - 1;
+        ssize_t received = recv(connection->request.client, connection->buffer + connection->length, space, 0);
+
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (received == -1 && errno == EINTR)
+            continue;
+
+        if (received == -1) {
+            loop_connection_close(loop, connection);
+            return;
+        }
+
+        connection->eof = received == 0;
+        connection->length += received;
+
+        if ((size_t) received < space)
+            break;
+
+        loop_connection_advance(loop, connection);
+
+        if (connection->state != LOOP_CONNECTION_READING)
+            return;
+    }
+
+    loop_connection_advance(loop, connection);
+}
+
+/*!
+ * \fn void loop_connection_append(loop_t*, loop_connection_t*, const unsigned char*, size_t)
+ * \brief Appends data received by the kernel on a connection to its buffer.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection which has received the data.
+ * \param data The data received.
+ * \param size The number of bytes received.
+ */
+void loop_connection_append(loop_t *loop, loop_connection_t *connection, const unsigned char *data, size_t size)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    loop_pool_reserve(&internal->pool, connection, connection->length + size + 1);
+
+    memcpy(connection->buffer + connection->length, data, size);
+    connection->length += size;
+}
+
+/*!
+ * \fn loop_connection_t *loop_connection_open(loop_t*, socket_id_t)
+ * \brief Takes a connection from the pool for a newly accepted client.
+ * \param loop The event loop which has accepted the client.
+ * \param client_socket The accepted client's socket.
+ * \return The client's connection.
+ */
+loop_connection_t *loop_connection_open(loop_t *loop, socket_id_t client_socket)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    loop_connection_t *connection = loop_pool_acquire(&internal->pool);
+
+    connection->request.client = client_socket;
+    connection->state = LOOP_CONNECTION_READING;
+    connection->length = 0;
+    connection->header_size = 0;
+    connection->body_pending = false;
+    connection->eof = false;
+    connection->sent = 0;
+    connection->watching = EPOLLIN;
+    connection->awaiting = -1;
+    connection->expired = false;
+    connection->receiving = false;
+    connection->pausing = false;
+    connection->sending = false;
+    connection->polling = false;
+    connection->offloaded = false;
+    connection->loop = loop;
+    connection->reply.keepalive = false;
+    connection->timeout = LOOP_TIMEOUT_NONE;
+
+    loop_connection_deadline(loop, connection, LOOP_TIMEOUT_HEADER);
+
+    return connection;
+}
+
+/*!
+ * \fn void loop_connection_resume(loop_t*, loop_connection_t*)
+ * \brief Resumes a connection whose reply has been posted back by the offload pool.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to be resumed.
+ */
+void loop_connection_resume(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    internal->pool.memory += connection->reply.footprint;
+    internal->pool.memory -= connection->offload_size + 1;
+    connection->offloaded = false;
+
+    if (connection->state == LOOP_CONNECTION_CLOSING) {
+        loop_connection_close(loop, connection);
+        return;
+    }
+
+    if (internal->engine == SERVER_ENGINE_EPOLL) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+        epoll_ctl(internal->epoll, EPOLL_CTL_ADD, connection->request.client, &event);
+        connection->watching = EPOLLIN;
+    }
+
+    connection->state = LOOP_CONNECTION_WRITING;
+    connection->sent = 0;
+
+    if (loop_connection_write(loop, connection))
+        loop_connection_advance(loop, connection);
+}
+
+/*!
+ * \fn void loop_offload_complete(loop_t*)
+ * \brief Resumes every connection whose reply has been posted back since last time.
+ * \param loop The event loop owning the connections.
+ */
+void loop_offload_complete(loop_t *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    loop_connection_t *connection = atomic_exchange(&internal->completed, NULL);
+
+    while (connection != NULL) {
+        loop_connection_t *next = connection->next_completed;
+        loop_connection_resume(loop, connection);
+        connection = next;
+    }
+}
+
+/*!
+ * \fn bool loop_admit(loop_t*, socket_id_t)
+ * \brief Checks whether a newly accepted client can be served, or rejects it otherwise.
+ * \param loop The event loop which has accepted the client.
+ * \param client_socket The accepted client's socket.
+ * \return Has the client been admitted?
+ */
+bool loop_admit(loop_t *loop, socket_id_t client_socket)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (internal->pool.active < internal->limits.connections)
+        return true;
+
+    request_t request = { .client = client_socket };
+
+    request_reject(&request, HTTP_RESPONSE_SERVICE_UNAVAILABLE);
+    close(client_socket);
+
+    return false;
+}
+
+/*!
+ * \fn void loop_admission_update(loop_t*)
+ * \brief Pauses accepting new clients while the loop is over its memory budget.
+ * Clients not yet accepted are left on the kernel's queue until the loop has freed
+ * enough memory, and only then accepting is resumed.
+ * \param loop The event loop to update.
+ */
+void loop_admission_update(loop_t *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    bool pause = internal->drained || internal->pool.memory > internal->limits.memory;
+
+    if (pause == internal->paused)
+        return;
+
+    internal->paused = pause;
+
+    for (int i = 0; i < internal->listener_count; ++i) {
+        loop_listener_t *listener = &internal->listener[i];
+
+        if (internal->engine == SERVER_ENGINE_EPOLL) {
+            struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = listener };
+            epoll_ctl(internal->epoll, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, listener->socket, &event);
+        } else if (pause && listener->accepting) {
+            loop_uring_arm(loop, LOOP_URING_CANCEL, listener, -1);
+        } else if (!pause && !listener->accepting) {
+            loop_uring_arm(loop, LOOP_URING_ACCEPT, listener, listener->socket);
+        }
+    }
+}
+
+/*!
+ * \fn void loop_drain_update(loop_t*)
+ * \brief Starts draining the loop, once it has been requested to.
+ * A draining loop stops accepting new clients, closes its idle connections, and no
+ * longer keeps connections alive once their current requests have been answered.
+ * \param loop The event loop to update.
+ */
+void loop_drain_update(loop_t *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (internal->drained || !atomic_load_explicit(&internal->draining, memory_order_relaxed))
+        return;
+
+    internal->drained = true;
+
+    for (size_t i = 0; i < internal->pool.chunk_count; ++i) {
+        for (size_t j = 0; j < LOOP_POOL_CHUNK; ++j) {
+            loop_connection_t *connection = &internal->pool.chunk_list[i][j];
+
+            if (connection->state == LOOP_CONNECTION_READING && connection->timeout == LOOP_TIMEOUT_KEEPALIVE)
+                loop_connection_close(loop, connection);
+        }
+    }
+}
+
+/*!
+ * \fn bool loop_running(const loop_t*)
+ * \brief Checks whether the loop must keep on running.
+ * A draining loop stops by itself once all of its connections have been closed.
+ * \param loop The event loop to check.
+ * \return Must the loop keep on running?
+ */
+bool loop_running(const loop_t *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    return !atomic_load_explicit(&internal->stopping, memory_order_relaxed)
+        && !(internal->drained && internal->pool.active == 0);
+}
+
+/*!
+ * \fn void loop_accept(loop_t*, const loop_listener_t*)
+ * \brief Accepts new connections from one of the loop's listening sockets.
+ * \param loop The event loop to accept connections on.
+ * \param listener The listening socket to accept connections from.
+ */
+void loop_accept(loop_t *loop, const loop_listener_t *listener)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    for (int i = 0; i < LOOP_ACCEPT_BATCH; ++i) {
+        struct sockaddr_storage client_address;
+        socklen_t l = sizeof(struct sockaddr_storage);
+
+        socket_id_t client_socket = accept4(
+            listener->socket, (struct sockaddr*) &client_address, &l
+          , SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+
+        if (client_socket == -1)
+            return;
+
+        if (!loop_admit(loop, client_socket))
+            continue;
+
+        loop_connection_t *connection = loop_connection_open(loop, client_socket);
+        connection->request.origin = client_address;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+        epoll_ctl(internal->epoll, EPOLL_CTL_ADD, client_socket, &event);
+    }
+}
+
+/*!
+ * \fn void loop_epoll_dispatch(loop_t*, struct epoll_event*)
+ * \brief Dispatches an event to the listening socket or connection it belongs to.
+ * \param loop The event loop which has received the event.
+ * \param event The event to be dispatched.
+ */
+void loop_epoll_dispatch(loop_t *loop, struct epoll_event *event)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    loop_listener_t *listener = (loop_listener_t*) event->data.ptr;
+
+    if (listener >= internal->listener && listener < internal->listener + internal->listener_count)
+        return loop_accept(loop, listener);
+
+    if (event->data.ptr == internal) {
+        ssize_t ignored = read(internal->wakeup, &internal->wakeup_value, sizeof(uint64_t));
+        (void) ignored;
+        return loop_offload_complete(loop);
+    }
+
+    // Events on an upstream connection are only of use while its relay still waits for it.
+    uint64_t upstream = event->data.u64 & LOOP_EPOLL_UPSTREAM;
+    loop_connection_t *connection = (loop_connection_t*) (uintptr_t) (event->data.u64 & ~upstream);
+
+    if (upstream && connection->awaiting == -1)
+        return;
+
+    if (!upstream && connection->state == LOOP_CONNECTION_WRITING && (event->events & (EPOLLERR | EPOLLHUP)))
+        return loop_connection_close(loop, connection);
+
+    if (connection->state == LOOP_CONNECTION_READING)
+        loop_connection_read(loop, connection);
+
+    else if (connection->state == LOOP_CONNECTION_WRITING && loop_connection_write(loop, connection))
+        loop_connection_advance(loop, connection);
+}
+
+/*!
+ * \fn void loop_epoll_run(loop_t*)
+ * \brief Runs the event loop with an epoll reactor, until the loop is stopped.
+ * \param loop The event loop to be run.
+ */
+void loop_epoll_run(loop_t *loop)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    internal->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    // The listeners and the loop's internal struct are used as markers for events on the
+    // listening sockets and on the wake-up descriptor, as neither is a connection. Sockets
+    // shared by all loops only wake one of them up for each new client.
+    struct epoll_event wakeup_event = { .events = EPOLLIN, .data.ptr = internal };
+
+    for (int i = 0; i < internal->listener_count; ++i) {
+        struct epoll_event listener_event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &internal->listener[i] };
+        epoll_ctl(internal->epoll, EPOLL_CTL_ADD, internal->listener[i].socket, &listener_event);
+    }
+
+    epoll_ctl(internal->epoll, EPOLL_CTL_ADD, internal->wakeup, &wakeup_event);
+
+    while (loop_running(loop)) {
+        int timeout = internal->timers.count > 0 ? TIMER_TICK : -1;
+        int count = epoll_wait(internal->epoll, events, LOOP_MAX_EVENTS, timeout);
+
+        loop_timers_expire(loop);
+
+        for (int i = 0; i < count; ++i)
+            loop_epoll_dispatch(loop, &events[i]);
+
+        loop_drain_update(loop);
+        loop_admission_update(loop);
+    }
+}
+
+/*!
+ * \fn void loop_uring_arm(loop_t*, int, void*, int)
+ * \brief Submits one of the loop's long-lived operations.
+ * Clients are accepted and received from by multishot operations, which keep on
+ * producing completions until they are terminated, and must then be submitted again.
+ * \param loop The event loop submitting the operation.
+ * \param tag The operation to be submitted.
+ * \param target The connection, listener or loop the operation is submitted for.
+ * \param fd The file descriptor to operate on, if any.
+ */
+void loop_uring_arm(loop_t *loop, int tag, void *target, int fd)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    struct io_uring_sqe *sqe = uring_get_sqe(&internal->uring);
+
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t) (uintptr_t) target | tag;
+
+    switch (tag) {
+        case LOOP_URING_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            ((loop_listener_t*) target)->accepting = true;
+            break;
+
+        case LOOP_URING_CANCEL:
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t) (uintptr_t) target | LOOP_URING_ACCEPT;
+            break;
+
+        case LOOP_URING_PAUSE:
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t) (uintptr_t) target | LOOP_URING_RECV;
+            ((loop_connection_t*) target)->pausing = true;
+            break;
+
+        case LOOP_URING_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = LOOP_URING_BUFFER_GROUP;
+            ((loop_connection_t*) target)->receiving = true;
+            break;
+
+        case LOOP_URING_WAKEUP:
+            sqe->opcode = IORING_OP_READ;
+            sqe->addr = (uint64_t) (uintptr_t) &internal->wakeup_value;
+            sqe->len = sizeof(uint64_t);
+            break;
+
+        case LOOP_URING_TIMER:
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t) (uintptr_t) &internal->tick;
+            sqe->len = 1;
+            internal->ticking = true;
+            break;
+    }
+}
+
+/*!
+ * \fn void loop_uring_unpoll(loop_t*, loop_connection_t*)
+ * \brief Submits the removal of the poll a connection's relay is waiting on.
+ * The poll then completes, as cancelled, and the connection is moved along from there.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose poll must be removed.
+ */
+void loop_uring_unpoll(loop_t *loop, loop_connection_t *connection)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    struct io_uring_sqe *sqe = uring_get_sqe(&internal->uring);
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) connection | LOOP_URING_POLL;
+    sqe->user_data = (uint64_t) (uintptr_t) connection | LOOP_URING_CANCEL;
+}
+
+/*!
+ * \fn void loop_uring_accepted(loop_t*, loop_listener_t*, const struct io_uring_cqe*)
+ * \brief Handles the completion of an accepted client.
+ * \param loop The event loop which has accepted the client.
+ * \param listener The listening socket the client has been accepted from.
+ * \param cqe The accept operation's completion.
+ */
+void loop_uring_accepted(loop_t *loop, loop_listener_t *listener, const struct io_uring_cqe *cqe)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (cqe->res >= 0 && loop_admit(loop, cqe->res)) {
+        socklen_t l = sizeof(struct sockaddr_storage);
+        loop_connection_t *connection = loop_connection_open(loop, cqe->res);
+
+        // Multishot accepts cannot hand out each client's address, as all completions
+        // would share the same storage. Thus the address is queried for each client.
+        getpeername(cqe->res, (struct sockaddr*) &connection->request.origin, &l);
+        loop_uring_arm(loop, LOOP_URING_RECV, connection, connection->request.client);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        listener->accepting = false;
+
+        if (!internal->paused)
+            loop_uring_arm(loop, LOOP_URING_ACCEPT, listener, listener->socket);
+    }
+}
+
+/*!
+ * \fn void loop_uring_receive_update(loop_t*, loop_connection_t*)
+ * \brief Keeps a connection receiving only while what it receives can be processed.
+ * Unlike a reactor, which simply stops reading, a multishot receive goes on filling the
+ * connection's buffer until it is cancelled. Thus, it is cancelled while a reply is
+ * outstanding or the buffer is full, so that a client cannot pile its pipelined requests
+ * up in memory, and is submitted again once the connection is ready for more data.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection to update.
+ */
+void loop_uring_receive_update(loop_t *loop, loop_connection_t *connection)
+{
+    size_t max_header_size = settings_current()->max_header_size;
+
+    if (connection->state == LOOP_CONNECTION_FREE || connection->state == LOOP_CONNECTION_CLOSING)
+        return;
+
+    bool receive = connection->state == LOOP_CONNECTION_READING
+        && connection->length - connection->header_size <= max_header_size
+        && !connection->eof;
+
+    if (receive && !connection->receiving)
+        loop_uring_arm(loop, LOOP_URING_RECV, connection, connection->request.client);
+    else if (!receive && connection->receiving && !connection->pausing)
+        loop_uring_arm(loop, LOOP_URING_PAUSE, connection, -1);
+}
+
+/*!
+ * \fn void loop_uring_received(loop_t*, loop_connection_t*, const struct io_uring_cqe*)
+ * \brief Handles the completion of data received on a connection.
+ * Data already received when the receive is cancelled is kept, as it cannot be put back.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection which has received data.
+ * \param cqe The receive operation's completion.
+ */
+void loop_uring_received(loop_t *loop, loop_connection_t *connection, const struct io_uring_cqe *cqe)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        if (cqe->res > 0 && connection->state != LOOP_CONNECTION_CLOSING)
+            loop_connection_append(loop, connection, uring_buffer_get(&internal->uring, id), cqe->res);
+
+        uring_buffer_recycle(&internal->uring, id);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        connection->receiving = connection->pausing = false;
+
+    if (connection->state == LOOP_CONNECTION_CLOSING) {
+        loop_connection_close(loop, connection);
+        return;
+    }
+
+    // Receiving is only stopped by the kernel when the client has closed its side of
+    // the connection, when there have been no buffers left to receive data into, or when
+    // it has been cancelled by the loop.
+    if (cqe->res == 0) {
+        connection->eof = true;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        loop_connection_close(loop, connection);
+        return;
+    }
+
+    // A relay waiting for the connection to stop receiving is moved along once it has.
+    bool relaying = connection->state == LOOP_CONNECTION_WRITING && connection->reply.relay != NULL
+        && !connection->receiving && !connection->sending && !connection->polling;
+
+    if (connection->state == LOOP_CONNECTION_READING || (relaying && loop_connection_write(loop, connection)))
+        loop_connection_advance(loop, connection);
+
+    loop_uring_receive_update(loop, connection);
+}
+
+/*!
+ * \fn void loop_uring_polled(loop_t*, loop_connection_t*)
+ * \brief Handles the completion of a poll a connection's relay has been waiting on.
+ * A poll removed as its deadline has expired moves the relay along as expired.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection whose relay has been waiting.
+ */
+void loop_uring_polled(loop_t *loop, loop_connection_t *connection)
+{
+    connection->polling = false;
+
+    if (connection->state == LOOP_CONNECTION_CLOSING) {
+        loop_connection_close(loop, connection);
+        return;
+    }
+
+    if (loop_connection_write(loop, connection)) {
+        loop_connection_advance(loop, connection);
+        loop_uring_receive_update(loop, connection);
+    }
+}
+
+/*!
+ * \fn void loop_uring_sent(loop_t*, loop_connection_t*, const struct io_uring_cqe*)
+ * \brief Handles the completion of a reply being sent through a connection.
+ * As io_uring has no counterpart to `sendfile`, a file reply's file is read and sent one
+ * chunk at a time.
+ * \param loop The event loop owning the connection.
+ * \param connection The connection the reply has been sent through.
+ * \param cqe The send operation's completion.
+ */
+void loop_uring_sent(loop_t *loop, loop_connection_t *connection, const struct io_uring_cqe *cqe)
+{
+    request_reply_t *reply = &connection->reply;
+    connection->sending = false;
+
+    if (connection->state == LOOP_CONNECTION_CLOSING || cqe->res < 0) {
+        loop_connection_close(loop, connection);
+        return;
+    }
+
+    connection->sent += cqe->res;
+
+    if (connection->sent < request_reply_size(reply))
+        return loop_uring_send(loop, connection);
+
+    if (loop_connection_write(loop, connection)) {
+        loop_connection_advance(loop, connection);
+        loop_uring_receive_update(loop, connection);
+    }
+}
+
+/*!
+ * \fn void loop_uring_dispatch(loop_t*, const struct io_uring_cqe*)
+ * \brief Dispatches a completion to the operation it belongs to.
+ * \param loop The event loop which has received the completion.
+ * \param cqe The completion to be dispatched.
+ */
+void loop_uring_dispatch(loop_t *loop, const struct io_uring_cqe *cqe)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+    void *target = (void*) (uintptr_t) (cqe->user_data & ~(uint64_t) LOOP_URING_TAG_MASK);
+
+    switch (cqe->user_data & LOOP_URING_TAG_MASK) {
+        case LOOP_URING_ACCEPT:
+            return loop_uring_accepted(loop, (loop_listener_t*) target, cqe);
+
+        case LOOP_URING_RECV:
+            return loop_uring_received(loop, (loop_connection_t*) target, cqe);
+
+        case LOOP_URING_SEND:
+            return loop_uring_sent(loop, (loop_connection_t*) target, cqe);
+
+        case LOOP_URING_POLL:
+            return loop_uring_polled(loop, (loop_connection_t*) target);
+
+        case LOOP_URING_WAKEUP:
+            if (!atomic_load_explicit(&internal->stopping, memory_order_relaxed))
+                loop_uring_arm(loop, LOOP_URING_WAKEUP, loop, internal->wakeup);
+            return loop_offload_complete(loop);
+
+        case LOOP_URING_TIMER:
+            internal->ticking = false;
+            return;
+
+        case LOOP_URING_CANCEL:
+        case LOOP_URING_PAUSE:
+            return;
+    }
+}
+
+/*!
+ * \fn bool loop_uring_initialize(loop_t*)
+ * \brief Sets up the io_uring instance driving the loop.
+ * The ring must be set up by the loop's thread, as it is the only thread allowed to
+ * submit operations to it.
+ * \param loop The event loop to set up the ring for.
+ * \return Has the ring been successfully set up?
+ */
+bool loop_uring_initialize(loop_t *loop)
+{
+    const settings_t *settings = settings_current();
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (!uring_create(&internal->uring, settings->uring_entries))
+        return false;
+
+    // The ring of buffers must have a power of two entries, so its configured size is
+    // rounded down to the nearest power of two.
+    uint16_t buffers = 1;
+
+    while (buffers * 2u <= settings->uring_buffers)
+        buffers <<= 1;
+
+    if (!uring_buffers_register(&internal->uring, LOOP_URING_BUFFER_GROUP, buffers, PAGE_SIZE)) {
+        uring_destroy(&internal->uring);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \fn void loop_uring_run(loop_t*)
+ * \brief Runs the event loop with io_uring, until the loop is stopped.
+ * All operations queued while handling a batch of completions are submitted at once,
+ * with the same system call that waits for the next batch of completions.
+ * \param loop The event loop to be run.
+ */
+void loop_uring_run(loop_t *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    for (int i = 0; i < internal->listener_count; ++i)
+        loop_uring_arm(loop, LOOP_URING_ACCEPT, &internal->listener[i], internal->listener[i].socket);
+
+    loop_uring_arm(loop, LOOP_URING_WAKEUP, loop, internal->wakeup);
+
+    while (loop_running(loop)) {
+        struct io_uring_cqe *cqe;
+
+        // The wheel is only turned while there are deadlines to be kept, so that an idle
+        // loop is not woken up at every tick.
+        if (internal->timers.count > 0 && !internal->ticking)
+            loop_uring_arm(loop, LOOP_URING_TIMER, loop, -1);
+
+        uring_submit_and_wait(&internal->uring, 1);
+        loop_timers_expire(loop);
+
+        while ((cqe = uring_peek_cqe(&internal->uring)) != NULL) {
+            struct io_uring_cqe completion = *cqe;
+            uring_cqe_seen(&internal->uring);
+            loop_uring_dispatch(loop, &completion);
+        }
+
+        loop_drain_update(loop);
+        loop_admission_update(loop);
+    }
+
+    // Destroying the ring cancels every operation still in flight, so the connections
+    // can then be closed as if they had never been handed to the kernel.
+    uring_destroy(&internal->uring);
+
+    for (size_t i = 0; i < internal->pool.chunk_count; ++i) {
+        for (size_t j = 0; j < LOOP_POOL_CHUNK; ++j) {
+            loop_connection_t *connection = &internal->pool.chunk_list[i][j];
+            connection->receiving = connection->sending = connection->polling = false;
+        }
+    }
+}
+
+/*!
+ * \fn void *loop_thread_run(void*)
+ * \brief The event loop's routine, run until the loop is stopped.
+ * If io_uring cannot be set up on the loop's thread, the loop falls back to epoll.
+ * \param loop The event loop to be run.
+ */
+void *loop_thread_run(void *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) ((loop_t*) loop)->_internal;
+
+    arena_bind(internal->arena);
+    file_shard_bind(internal->files);
+    listing_shard_bind(internal->listings);
+    proxy_pool_bind(internal->proxy);
+
+    if (internal->engine == SERVER_ENGINE_URING && !loop_uring_initialize((loop_t*) loop))
+        internal->engine = SERVER_ENGINE_EPOLL;
+
+    if (internal->engine == SERVER_ENGINE_URING)
+        loop_uring_run((loop_t*) loop);
+    else
+        loop_epoll_run((loop_t*) loop);
+
+    arena_bind(NULL);
+
+    for (size_t i = 0; i < internal->pool.chunk_count; ++i)
+        for (size_t j = 0; j < LOOP_POOL_CHUNK; ++j)
+            if (internal->pool.chunk_list[i][j].state != LOOP_CONNECTION_FREE)
+                loop_connection_close((loop_t*) loop, &internal->pool.chunk_list[i][j]);
+
+    file_shard_bind(NULL);
+    listing_shard_bind(NULL);
+    proxy_pool_bind(NULL);
+    return NULL;
+}
+
+/*!
+ * \fn void loop_start(loop_t*, int)
+ * \brief Starts running an event loop on a new thread.
+ * \param loop The event loop to be started.
+ * \param cpu The processor to pin the loop's thread to, or -1 for none.
+ */
+extern void loop_start(loop_t *loop, int cpu)
+{
+    pthread_attr_t attr;
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    pthread_attr_init(&attr);
+
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+    }
+
+    loop->cpu = cpu;
+    pthread_create(&internal->thread, &attr, &loop_thread_run, (void*) loop);
+    pthread_attr_destroy(&attr);
+}
+
+/*!
+ * \fn void loop_stop(loop_t*)
+ * \brief Requests an event loop to stop and wakes it up.
+ * \param loop The event loop to be stopped.
+ */
+extern void loop_stop(loop_t *loop)
+{
+    uint64_t value = 1;
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    atomic_store(&internal->stopping, true);
+
+    ssize_t ignored = write(internal->wakeup, &value, sizeof(uint64_t));
+    (void) ignored;
+}
+
+/*!
+ * \fn void loop_drain(loop_t*)
+ * \brief Requests an event loop to stop once its current requests have been answered.
+ * \param loop The event loop to be drained.
+ */
+extern void loop_drain(loop_t *loop)
+{
+    uint64_t value = 1;
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    atomic_store(&internal->draining, true);
+
+    ssize_t ignored = write(internal->wakeup, &value, sizeof(uint64_t));
+    (void) ignored;
+}
+
+/*!
+ * \fn bool loop_join(loop_t*, const struct timespec*)
+ * \brief Waits for an event loop to stop, but no later than the given deadline.
+ * \param loop The event loop to wait for.
+ * \param deadline The realtime clock's time at which to give up waiting, or NULL for none.
+ * \return Has the event loop stopped?
+ */
+extern bool loop_join(loop_t *loop, const struct timespec *deadline)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (!internal->joined && deadline == NULL)
+        internal->joined = pthread_join(internal->thread, NULL) == 0;
+
+    if (!internal->joined)
+        internal->joined = pthread_timedjoin_np(internal->thread, NULL, deadline) == 0;
+
+    return internal->joined;
+}
+
+/*!
+ * \fn void loop_destroy(loop_t*)
+ * \brief Waits for an event loop to stop and frees all of its resources.
+ * \param loop The event loop to be destroyed.
+ */
+extern void loop_destroy(loop_t *loop)
+{
+    loop_internal_t *internal = (loop_internal_t*) loop->_internal;
+
+    if (!internal->joined)
+        pthread_join(internal->thread, NULL);
+
+    // The connections still waiting on the offload pool when the loop stopped are only
+    // released now, as the pool must have been stopped beforehand.
+    loop_offload_complete(loop);
+
+    for (size_t i = 0; i < internal->pool.chunk_count; ++i) {
+        for (size_t j = 0; j < LOOP_POOL_CHUNK; ++j) {
+            free(internal->pool.chunk_list[i][j].buffer);
+            free(internal->pool.chunk_list[i][j].reply.header);
+        }
+
+        free(internal->pool.chunk_list[i]);
+    }
+
+    if (internal->epoll != -1)
+        close(internal->epoll);
+
+    close(internal->wakeup);
+
+    logger_writer_finalize(internal->logger);
+    arena_destroy(internal->arena);
+    file_shard_destroy(internal->files);
+    listing_shard_destroy(internal->listings);
+    proxy_pool_destroy(internal->proxy);
+
+    free(internal->pool.chunk_list);
+    free(internal->listener);
+    free(internal);
+    free(loop);
+}
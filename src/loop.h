@@ -0,0 +1,52 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the server's event loops.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_LOOP_H
+#define MU_HTTPD_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "server.h"
+#include "logger.h"
+#include "limiter.h"
+
+/*!
+ * \struct loop_limits_t
+ * \brief The limits an event loop must keep to, so that it is never overloaded.
+ * \since 3.0
+ */
+typedef struct loop_limits_t {
+    size_t connections;
+    size_t memory;
+    limiter_t *limiter;
+} loop_limits_t;
+
+/*!
+ * \struct loop_t
+ * \brief An event loop, which owns and serves all connections of its listening sockets.
+ * \since 3.0
+ */
+typedef struct loop_t {
+    uint32_t id;
+    int cpu;
+    void *_internal;
+} loop_t;
+
+/*
+ * Forward declaration of event loop functions.
+ * These functions are needed for creating and running event loops on their threads.
+ */
+extern loop_t *loop_create(uint32_t, const socket_id_t*, int, logger_t*, server_engine_t, loop_limits_t);
+extern void loop_start(loop_t*, int);
+extern void loop_stop(loop_t*);
+extern void loop_drain(loop_t*);
+extern bool loop_join(loop_t*, const struct timespec*);
+extern void loop_destroy(loop_t*);
+
+#endif
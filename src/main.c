@@ -12,18 +12,35 @@
  * \author Rodrigo Siqueira <rodriados@gmail.com>
  * \copyright 2014-present Rodrigo Siqueira
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 
 #include "config.h"
 #include "colors.h"
+#include "file.h"
+#include "listing.h"
 #include "logger.h"
+#include "missing.h"
+#include "pack.h"
+#include "proxy.h"
+#include "response.h"
+#include "router.h"
 #include "server.h"
+#include "settings.h"
+#include "uring.h"
+#include "vhost.h"
+#include "warmup.h"
 
-void report_success(const char *, uint16_t);
+#define HTTPD_WARNING_MSG BG_WARNING(" WARNING ") " %s\n"
+
+void report_success(const char *);
 void report_failure_and_exit(enum server_status_t);
+void report_settings_failure_and_exit(const char *);
+void report_usage_and_exit(const char *);
 
 /*!
  * \fn int main(int, char **)
@@ -33,50 +50,144 @@ void report_failure_and_exit(enum server_status_t);
  */
 int main(int argc, char **argv)
 {
+    int option;
+    char *name;
+    const char *value;
+    const char *config = NULL;
+    char error[SETTINGS_ERROR_SIZE];
+
+    // Options given on the command line override the settings on the configuration
+    // file, and keep on overriding them whenever the settings are reloaded.
+    while ((option = getopt(argc, argv, "c:o:l:m:e:w:r:h")) != -1) {
+        switch (option) {
+            case 'c': config = optarg; break;
+            case 'l': settings_override("address", optarg); break;
+            case 'm': settings_override("mode", optarg); break;
+            case 'e': settings_override("engine", optarg); break;
+            case 'w': settings_override("workers", optarg); break;
+            case 'r': settings_override("rate_limit", optarg); break;
+
+            case 'o':
+                if ((value = strchr(optarg, '=')) == NULL)
+                    report_usage_and_exit(argv[0]);
+
+                name = strndup(optarg, value - optarg);
+                settings_override(name, value + 1);
+                free(name);
+                break;
+
+            default:  report_usage_and_exit(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+        settings_override("port", argv[optind]);
+
     printf(FG_INFO("μHTTPd Hipertext Transfer Protocol Server\n"));
 
+    if (!settings_initialize(config, error, sizeof(error)))
+        report_settings_failure_and_exit(error);
+
+    const settings_t *settings = settings_current();
+    int workers = (int) settings->workers;
+
     server_t server = {
-        .address = DEFAULT_ADDR
-      , .port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT
+        .address = settings->address
+      , .port = (uint16_t) settings->port
+      , .mode = server_mode_parse(settings->mode)
+      , .engine = server_engine_parse(settings->engine)
+      , .rate_limit = settings->rate_limit
+      , .argv = argv
     };
 
+    if (server.mode == SERVER_MODE_UNKNOWN || server.engine == SERVER_ENGINE_UNKNOWN)
+        report_usage_and_exit(argv[0]);
+
+    if (server.engine == SERVER_ENGINE_URING && !uring_supported()) {
+        fprintf(stderr, HTTPD_WARNING_MSG, "io_uring is not available, falling back to epoll.");
+        server.engine = SERVER_ENGINE_EPOLL;
+    }
+
+    if (server.mode == SERVER_MODE_PERCORE && settings->offload_threads == 0)
+        fprintf(stderr, HTTPD_WARNING_MSG, "No offload threads, event loops block while reading cold files.");
+
+    if (workers == 0)
+        workers = server_mode_default_workers(server.mode);
+
+    if (!vhost_load(settings->vhosts, error, sizeof(error)))
+        report_settings_failure_and_exit(error);
+
+    // The file cache is split before the bundle is opened through it.
+    file_partition(vhost_count() + 1);
+
+    if (settings->bundle[0] != '\0' && !pack_open(settings->bundle, error, sizeof(error)))
+        report_settings_failure_and_exit(error);
+
+    router_register("health", response_handle_health);
+
+    if (!router_load(settings->routes, error, sizeof(error)))
+        report_settings_failure_and_exit(error);
+
     server_status_t server_status =
-        server_create(&server, MAX_CONNECTIONS);
+        server_create(&server, (int) settings->backlog);
 
     if (server_status != SERVER_SUCCESS)
         report_failure_and_exit(server_status);
 
-    FILE *logfile = fopen(LOG_FILE, "a");
+    FILE *logfile = fopen(settings->log_file, "a");
     logger_t logger = logger_initialize();
 
     logger_file_sink_add(&logger, logfile);
     logger_file_sink_add(&logger, stdout);
 
-    report_success(server.address, server.port);
+    char endpoint[SETTINGS_STRING_SIZE];
+
+    for (int i = 0; server_endpoint_describe(&server, i, endpoint, sizeof(endpoint)); ++i)
+        report_success(endpoint);
+
+    // The caches are warmed up in the background, as the server is already listening.
+    if (settings->warmup_threads > 0 && pack_current() == NULL) {
+        const char *manifest = settings->warmup_manifest[0] != '\0' ? settings->warmup_manifest : NULL;
+        warmup_start(settings->public_folder, manifest, settings->warmup_threads);
+    }
 
-    server_status = server_listen(&server, &logger, MAX_THREADS);
+    proxy_start(settings->proxy_health);
 
+    server_status = server_listen(&server, &logger, workers);
+
+    warmup_finalize();
+    proxy_finalize();
     server_destroy(&server);
     logger_finalize(&logger);
     fclose(logfile);
+    listing_finalize();
+    pack_close();
+    file_finalize();
+    missing_finalize();
+    response_finalize();
+    router_finalize();
+    vhost_finalize();
+    settings_finalize();
 
     printf(RESETALL);
 
+    if (server_status == SERVER_FAIL_CREATE_SOCKET)
+        report_failure_and_exit(server_status);
+
     return 0;
 }
 
-#define HTTPD_SUCCESS_MSG BG_SUCCESS(" LISTENING ") FG_INFO(" at %s:%hu\n")
+#define HTTPD_SUCCESS_MSG BG_SUCCESS(" LISTENING ") FG_INFO(" at %s\n")
 #define HTTPD_FAILURE_MSG BG_WARNING(" ERROR ") " %s\n"
 
 /*!
- * \fn void report_success(const char*, uint16_t)
+ * \fn void report_success(const char*)
  * \brief Reports a successful server connection message to the terminal.
- * \param address The address to which the server is listening to.
- * \param port The port at which the server is listening to.
+ * \param endpoint The endpoint on which the server is listening to.
  */
-void report_success(const char *address, uint16_t port)
+void report_success(const char *endpoint)
 {
-    fprintf(stderr, HTTPD_SUCCESS_MSG, address, port);
+    fprintf(stderr, HTTPD_SUCCESS_MSG, endpoint);
 }
 
 /*!
@@ -89,3 +200,38 @@ void report_failure_and_exit(server_status_t status)
     fprintf(stderr, HTTPD_FAILURE_MSG, server_status_describe(status));
     exit(EXIT_FAILURE);
 }
+
+/*!
+ * \fn void report_settings_failure_and_exit(const char*)
+ * \brief Reports the server's settings could not be loaded to the terminal.
+ * \param error The reason the settings could not be loaded.
+ */
+void report_settings_failure_and_exit(const char *error)
+{
+    fprintf(stderr, HTTPD_FAILURE_MSG, error);
+    exit(EXIT_FAILURE);
+}
+
+/*!
+ * \fn void report_usage_and_exit(const char*)
+ * \brief Reports the server's command line usage to the terminal.
+ * \param program The name the server has been invoked with.
+ */
+void report_usage_and_exit(const char *program)
+{
+    fprintf(stderr,
+        "usage: %s [-c file] [-o name=value] [-l address] [-m mode] [-e engine] [-w workers] [-r rate] [port]\n"
+        "  -c file     the configuration file to read settings from\n"
+        "  -o setting  overrides a setting from the configuration file\n"
+        "  -l address  comma-separated endpoints to listen on: 127.0.0.1, [::]:8443,\n"
+        "              unix:/path/to/socket or unix:@abstract-name\n"
+        "  -m mode     shared: a single thread accepts and hands connections to workers\n"
+        "              reuseport: each worker accepts on its own SO_REUSEPORT socket\n"
+        "              percore: each processor runs a pinned event loop, sharing nothing\n"
+        "  -e engine   epoll or uring: the I/O engine driving the per-core event loops\n"
+        "  -w workers  the number of workers or event loops to spawn\n"
+        "  -r rate     the number of requests per second allowed to each client address\n"
+      , program
+    );
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,364 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the missing paths cache.
+ * Paths recently found not to exist are remembered for a while, so that requests for
+ * them, most often from bots probing for well-known files, are answered without any
+ * filesystem access. The directories a missing path would be in are watched, and the
+ * whole cache is invalidated at once, by moving on to a new generation, as soon as any
+ * of them changes, as well as when any of the redirections files change. Paths are only
+ * remembered while the directory they would be in can be watched. Lookups never take
+ * the cache's lock: every entry is guarded by its own sequence counter, which is odd
+ * while the entry is being written, so that a lookup overlapping a write misses.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "settings.h"
+#include "timer.h"
+
+#include "missing.h"
+
+/*
+ * The number of paths which may share a set in the cache, of which the one closest to
+ * its expiration is replaced when the set is full.
+ */
+#define MISSING_WAYS 4
+
+/*
+ * The multipliers of the two hashes a path is told apart by. The first one is FNV-1a's
+ * own prime, and the second one an odd constant unrelated to it.
+ */
+#define MISSING_HASH_MULTIPLIER  0x100000001b3ULL
+#define MISSING_CHECK_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+/*
+ * The changes to a watched directory which may make a missing path exist.
+ */
+#define MISSING_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/*!
+ * \struct missing_entry_t
+ * \brief A path found not to exist, and until when it can be trusted to still be missing.
+ * Paths are told apart by two independent hashes instead of by name, so that an entry
+ * holds no memory which a lookup could find released under its feet.
+ * \since 3.0
+ */
+typedef struct missing_entry_t {
+    _Atomic uint64_t sequence;
+    _Atomic uint64_t hash;
+    _Atomic uint64_t check;
+    _Atomic uint64_t expires;
+    _Atomic uint64_t generation;
+} missing_entry_t;
+
+/*!
+ * \struct missing_cache_t
+ * \brief The paths recently found not to exist, looked up by path.
+ * The lock is only taken to prepare the cache, to remember paths and to watch directories.
+ * \since 3.0
+ */
+typedef struct missing_cache_t {
+    pthread_mutex_t lock;
+    missing_entry_t *entry;
+    size_t sets;
+    _Atomic uint64_t generation;
+    _Atomic uint64_t polled;
+    int notify;
+    atomic_bool prepared;
+} missing_cache_t;
+
+/*!
+ * \var g_missing_cache
+ * \brief The cache shared by all threads serving requests.
+ * \since 3.0
+ */
+static missing_cache_t g_missing_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .notify = -1 };
+
+/*!
+ * \fn uint64_t missing_hash(const char*, uint64_t)
+ * \brief Hashes a path, with the FNV-1a function or a variant of it with another multiplier.
+ * \param path The path to be hashed.
+ * \param multiplier The number the hash is multiplied by for every byte.
+ * \return The path's hash.
+ */
+uint64_t missing_hash(const char *path, uint64_t multiplier)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *c = (const unsigned char*) path; *c != '\0'; ++c)
+        hash = (hash ^ *c) * multiplier;
+
+    return hash;
+}
+
+/*!
+ * \fn void missing_cache_prepare(missing_cache_t*)
+ * \brief Allocates the cache when it is first used, and starts watching the default folder.
+ * \param cache The cache to be prepared.
+ */
+void missing_cache_prepare(missing_cache_t *cache)
+{
+    if (atomic_load_explicit(&cache->prepared, memory_order_acquire))
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (!atomic_load_explicit(&cache->prepared, memory_order_relaxed)) {
+        uint32_t capacity = settings_current()->missing_cache;
+
+        if (capacity > 0) {
+            for (cache->sets = 1; cache->sets * MISSING_WAYS < capacity; cache->sets *= 2)
+                ;
+
+            cache->entry = calloc(cache->sets * MISSING_WAYS, sizeof(missing_entry_t));
+        }
+
+        if ((cache->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1)
+            inotify_add_watch(cache->notify, "default", MISSING_EVENTS);
+
+        atomic_store_explicit(&cache->prepared, true, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*!
+ * \fn void missing_cache_poll(missing_cache_t*, uint64_t)
+ * \brief Moves the cache on to a new generation if any watched directory has changed.
+ * Changes are checked at most once per timer tick, by whichever thread first notices
+ * the tick. When directories cannot be watched, they are assumed to change on every tick.
+ * \param cache The cache to be checked.
+ * \param now The current time, in timer ticks.
+ */
+void missing_cache_poll(missing_cache_t *cache, uint64_t now)
+{
+    _Alignas(struct inotify_event) char events[4096];
+    uint64_t polled = atomic_load_explicit(&cache->polled, memory_order_relaxed);
+    bool changed = cache->notify == -1;
+
+    if (polled == now || !atomic_compare_exchange_strong(&cache->polled, &polled, now))
+        return;
+
+    while (cache->notify != -1 && read(cache->notify, events, sizeof(events)) > 0)
+        changed = true;
+
+    if (changed)
+        atomic_fetch_add(&cache->generation, 1);
+}
+
+/*!
+ * \fn bool missing_cache_watch(const missing_cache_t*, const char*)
+ * \brief Watches the deepest existing directory on a missing path for changes.
+ * Creating anything which leads to the missing path must change that directory. Must be
+ * called with the cache's lock held.
+ * \param cache The cache which will be invalidated by the changes.
+ * \param path The missing path.
+ * \return Will the changes leading to the path be noticed?
+ */
+bool missing_cache_watch(const missing_cache_t *cache, const char *path)
+{
+    char *slash;
+    char directory[BUFFER_SIZE];
+
+    if (cache->notify == -1)
+        return true;
+
+    if (snprintf(directory, sizeof(directory), "%s", path) >= (int) sizeof(directory))
+        return false;
+
+    while ((slash = strrchr(directory, '/')) != NULL) {
+        *slash = '\0';
+
+        if (inotify_add_watch(cache->notify, slash == directory ? "/" : directory, MISSING_EVENTS) != -1)
+            return true;
+
+        if (errno != ENOENT && errno != ENOTDIR)
+            return false;
+    }
+
+    return inotify_add_watch(cache->notify, ".", MISSING_EVENTS) != -1;
+}
+
+/*!
+ * \fn bool missing_entry_matches(const missing_entry_t*, uint64_t, uint64_t, uint64_t, uint64_t)
+ * \brief Checks whether an entry remembers a path as missing, without taking any lock.
+ * An entry being written, or written while it is checked, is taken not to match.
+ * \param entry The entry to be checked.
+ * \param hash The path's hash.
+ * \param check The path's second hash.
+ * \param generation The cache's current generation.
+ * \param now The current time, in timer ticks.
+ * \return Does the entry remember the path as missing?
+ */
+bool missing_entry_matches(const missing_entry_t *entry, uint64_t hash, uint64_t check, uint64_t generation, uint64_t now)
+{
+    uint64_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+
+    if (sequence & 1)
+        return false;
+
+    bool matches = atomic_load_explicit(&entry->hash, memory_order_relaxed) == hash
+        && atomic_load_explicit(&entry->check, memory_order_relaxed) == check
+        && atomic_load_explicit(&entry->generation, memory_order_relaxed) == generation
+        && atomic_load_explicit(&entry->expires, memory_order_relaxed) > now;
+
+    atomic_thread_fence(memory_order_acquire);
+    return matches && atomic_load_explicit(&entry->sequence, memory_order_relaxed) == sequence;
+}
+
+/*!
+ * \fn void missing_entry_write(missing_entry_t*, uint64_t, uint64_t, uint64_t, uint64_t)
+ * \brief Remembers a path in an entry. Must be called with the cache's lock held.
+ * \param entry The entry to be written.
+ * \param hash The path's hash.
+ * \param check The path's second hash.
+ * \param generation The generation the path has been found missing in.
+ * \param expires Until when the path can be trusted to still be missing, in timer ticks.
+ */
+void missing_entry_write(missing_entry_t *entry, uint64_t hash, uint64_t check, uint64_t generation, uint64_t expires)
+{
+    uint64_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&entry->hash, hash, memory_order_relaxed);
+    atomic_store_explicit(&entry->check, check, memory_order_relaxed);
+    atomic_store_explicit(&entry->generation, generation, memory_order_relaxed);
+    atomic_store_explicit(&entry->expires, expires, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->sequence, sequence + 2, memory_order_release);
+}
+
+/*!
+ * \fn bool missing_check(const char*, uint64_t*)
+ * \brief Checks whether a path has recently been found not to exist.
+ * The cache's current generation is returned, so that a path found missing afterwards
+ * is only remembered if nothing has changed in the meantime.
+ * \param path The path to be checked.
+ * \param generation The cache's current generation.
+ * \return Is the path known to be missing?
+ */
+extern bool missing_check(const char *path, uint64_t *generation)
+{
+    bool missing = false;
+    missing_cache_t *cache = &g_missing_cache;
+    uint64_t now = timer_clock();
+
+    missing_cache_prepare(cache);
+    missing_cache_poll(cache, now);
+
+    *generation = atomic_load(&cache->generation);
+
+    if (cache->entry != NULL) {
+        uint64_t hash = missing_hash(path, MISSING_HASH_MULTIPLIER);
+        uint64_t check = missing_hash(path, MISSING_CHECK_MULTIPLIER);
+        const missing_entry_t *set = &cache->entry[(hash & (cache->sets - 1)) * MISSING_WAYS];
+
+        for (size_t i = 0; i < MISSING_WAYS && !missing; ++i)
+            missing = missing_entry_matches(&set[i], hash, check, *generation, now);
+    }
+
+    return missing;
+}
+
+/*!
+ * \fn uint64_t missing_generation()
+ * \brief Informs the cache's current generation, which changes whenever any of the watched
+ * directories, the default folder included, changes.
+ * \return The cache's current generation.
+ */
+extern uint64_t missing_generation()
+{
+    missing_cache_t *cache = &g_missing_cache;
+
+    missing_cache_prepare(cache);
+    missing_cache_poll(cache, timer_clock());
+
+    return atomic_load(&cache->generation);
+}
+
+/*!
+ * \fn void missing_watch(const char*)
+ * \brief Watches the directory of a file whose changes must be noticed by the cache's users.
+ * \param path The file to be watched.
+ */
+extern void missing_watch(const char *path)
+{
+    missing_cache_t *cache = &g_missing_cache;
+
+    missing_cache_prepare(cache);
+    pthread_mutex_lock(&cache->lock);
+    missing_cache_watch(cache, path);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*!
+ * \fn void missing_insert(const char*, uint64_t)
+ * \brief Remembers a path which has been found not to exist.
+ * A path whose directory cannot be watched, such as when the watches are exhausted, is
+ * not remembered, as nothing could make the cache forget it before it expires.
+ * \param path The missing path.
+ * \param generation The cache's generation from before the path has been looked up.
+ */
+extern void missing_insert(const char *path, uint64_t generation)
+{
+    missing_cache_t *cache = &g_missing_cache;
+    uint64_t hash = missing_hash(path, MISSING_HASH_MULTIPLIER);
+    uint64_t now = timer_clock();
+
+    missing_cache_prepare(cache);
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->entry != NULL && missing_cache_watch(cache, path) && generation == atomic_load(&cache->generation)) {
+        missing_entry_t *set = &cache->entry[(hash & (cache->sets - 1)) * MISSING_WAYS];
+        missing_entry_t *victim = &set[0];
+
+        for (size_t i = 0; i < MISSING_WAYS; ++i) {
+            uint64_t expires = atomic_load_explicit(&set[i].expires, memory_order_relaxed);
+
+            if (expires <= now || atomic_load_explicit(&set[i].generation, memory_order_relaxed) != generation) {
+                victim = &set[i];
+                break;
+            }
+
+            if (expires < atomic_load_explicit(&victim->expires, memory_order_relaxed))
+                victim = &set[i];
+        }
+
+        uint64_t expires = now + settings_current()->missing_ttl / TIMER_TICK;
+        missing_entry_write(victim, hash, missing_hash(path, MISSING_CHECK_MULTIPLIER), generation, expires);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*!
+ * \fn void missing_finalize()
+ * \brief Forgets every missing path and stops watching directories.
+ */
+extern void missing_finalize()
+{
+    missing_cache_t *cache = &g_missing_cache;
+
+    if (cache->notify != -1)
+        close(cache->notify);
+
+    free(cache->entry);
+    cache->entry = NULL;
+    cache->notify = -1;
+    atomic_store(&cache->prepared, false);
+}
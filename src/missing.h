@@ -0,0 +1,24 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the missing paths cache.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_MISSING_H
+#define MU_HTTPD_MISSING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Forward declaration of missing paths functions.
+ * These functions are needed for answering requests for missing paths without looking
+ * them up again.
+ */
+extern bool missing_check(const char*, uint64_t*);
+extern void missing_insert(const char*, uint64_t);
+extern uint64_t missing_generation();
+extern void missing_watch(const char*);
+extern void missing_finalize();
+
+#endif
@@ -0,0 +1,193 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the blocking work offload pool.
+ * Event loops must never block, or else every connection they own is stalled. Thus,
+ * requests which cannot be answered from the caches alone, as they need files to be
+ * opened, read or listed, are handed over to a small pool of threads which may block
+ * instead, and whose results are then posted back to the loops owning the requests.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#include <pthread.h>
+#include <signal.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "file.h"
+#include "listing.h"
+#include "logger.h"
+#include "settings.h"
+
+#include "offload.h"
+
+/*!
+ * \struct offload_pool_t
+ * \brief The pool of threads running blocking work, and the queue of jobs waiting for them.
+ * \since 3.0
+ */
+typedef struct offload_pool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    offload_job_t *head;
+    offload_job_t *tail;
+    pthread_t *thread;
+    size_t count;
+    bool stopping;
+    logger_t *logger;
+} offload_pool_t;
+
+/*!
+ * \var g_offload_pool
+ * \brief The offload pool shared by all event loops.
+ * \since 3.0
+ */
+static offload_pool_t g_offload_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+  , .wake = PTHREAD_COND_INITIALIZER
+};
+
+/*!
+ * \fn void *offload_run(void*)
+ * \brief The routine of each of the pool's threads, which runs jobs as they are submitted.
+ * Each thread has its own log writer, memory arena, and file and listing shards, just
+ * like an event loop, and the arena is reset after every job.
+ * \param pool The pool the thread belongs to.
+ */
+void *offload_run(void *pool)
+{
+    offload_pool_t *offload = (offload_pool_t*) pool;
+    logger_writer_t *logger = logger_ring_writer_initialize(offload->logger, settings_current()->log_ring_size);
+    arena_t *arena = arena_create(settings_current()->arena_size);
+    file_shard_t *files = file_shard_create();
+    listing_shard_t *listings = listing_shard_create();
+
+    arena_bind(arena);
+    file_shard_bind(files);
+    listing_shard_bind(listings);
+    pthread_mutex_lock(&offload->lock);
+
+    // Jobs still queued when the pool is stopped are run nonetheless, as their loops are
+    // waiting for them to complete before their connections can be released.
+    while (offload->head != NULL || !offload->stopping) {
+        if (offload->head == NULL) {
+            pthread_cond_wait(&offload->wake, &offload->lock);
+            continue;
+        }
+
+        offload_job_t *job = offload->head;
+
+        if ((offload->head = job->next) == NULL)
+            offload->tail = NULL;
+
+        pthread_mutex_unlock(&offload->lock);
+
+        job->run(job, logger);
+        arena_reset(arena);
+
+        pthread_mutex_lock(&offload->lock);
+    }
+
+    pthread_mutex_unlock(&offload->lock);
+    arena_bind(NULL);
+    file_shard_bind(NULL);
+    listing_shard_bind(NULL);
+
+    logger_writer_finalize(logger);
+    arena_destroy(arena);
+    file_shard_destroy(files);
+    listing_shard_destroy(listings);
+
+    return NULL;
+}
+
+/*!
+ * \fn void offload_start(logger_t*, size_t)
+ * \brief Starts the offload pool's threads.
+ * The pool's threads never handle signals, so that signals are still handled by the
+ * main thread, as the server expects.
+ * \param logger The logger instance to which the pool's threads must log to.
+ * \param threads The number of threads to run blocking work on.
+ */
+extern void offload_start(logger_t *logger, size_t threads)
+{
+    sigset_t all, previous;
+    offload_pool_t *offload = &g_offload_pool;
+
+    if (threads == 0)
+        return;
+
+    offload->logger = logger;
+    offload->stopping = false;
+    offload->thread = calloc(threads, sizeof(pthread_t));
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    for (size_t i = 0; i < threads; ++i)
+        if (pthread_create(&offload->thread[offload->count], NULL, &offload_run, (void*) offload) == 0)
+            ++offload->count;
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/*!
+ * \fn bool offload_available()
+ * \brief Checks whether there are threads to run blocking work on.
+ * \return Is the offload pool running?
+ */
+extern bool offload_available()
+{
+    return g_offload_pool.count > 0;
+}
+
+/*!
+ * \fn void offload_submit(offload_job_t*)
+ * \brief Queues a job to be run by the offload pool.
+ * \param job The job to be run.
+ */
+extern void offload_submit(offload_job_t *job)
+{
+    offload_pool_t *offload = &g_offload_pool;
+
+    job->next = NULL;
+
+    pthread_mutex_lock(&offload->lock);
+
+    if (offload->tail != NULL)
+        offload->tail->next = job;
+    else
+        offload->head = job;
+
+    offload->tail = job;
+
+    pthread_cond_signal(&offload->wake);
+    pthread_mutex_unlock(&offload->lock);
+}
+
+/*!
+ * \fn void offload_stop()
+ * \brief Stops the offload pool, once every job already submitted has been run.
+ */
+extern void offload_stop()
+{
+    offload_pool_t *offload = &g_offload_pool;
+
+    if (offload->count == 0)
+        return;
+
+    pthread_mutex_lock(&offload->lock);
+    offload->stopping = true;
+    pthread_cond_broadcast(&offload->wake);
+    pthread_mutex_unlock(&offload->lock);
+
+    for (size_t i = 0; i < offload->count; ++i)
+        pthread_join(offload->thread[i], NULL);
+
+    free(offload->thread);
+
+    offload->thread = NULL;
+    offload->count = 0;
+}
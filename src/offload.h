@@ -0,0 +1,37 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the blocking work offload pool.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_OFFLOAD_H
+#define MU_HTTPD_OFFLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "logger.h"
+
+/*!
+ * \struct offload_job_t
+ * \brief A piece of blocking work handed over to the offload pool.
+ * Jobs are embedded into whatever they work on, and are run by one of the pool's
+ * threads, which log to their own writer. A job must itself let its submitter know
+ * that it is done, as the pool forgets about a job as soon as it has been run.
+ * \since 3.0
+ */
+typedef struct offload_job_t {
+    void (*run)(struct offload_job_t*, logger_writer_t*);
+    struct offload_job_t *next;
+} offload_job_t;
+
+/*
+ * Forward declaration of offload pool functions.
+ * These functions are needed for running blocking work away from the event loops.
+ */
+extern void offload_start(logger_t*, size_t);
+extern bool offload_available();
+extern void offload_submit(offload_job_t*);
+extern void offload_stop();
+
+#endif
@@ -0,0 +1,199 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of static site bundles.
+ * A bundle is mapped into memory once, when the server starts, and is shared by all of
+ * its threads, while the operating system shares its pages with any other process which
+ * maps it. Requests are then resolved by looking their paths up in the bundle's index,
+ * without any filesystem access, and files are sent straight from the mapped bundle.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "http.h"
+#include "file.h"
+
+#include "pack.h"
+
+/*!
+ * \var g_pack
+ * \brief The bundle being served, if any.
+ * \since 3.0
+ */
+static pack_t g_pack;
+
+/*!
+ * \fn bool pack_validate(const pack_t*, size_t)
+ * \brief Checks whether a mapped bundle is well-formed, so that it can be trusted.
+ * \param pack The bundle to be checked.
+ * \param size The bundle's size, as mapped.
+ * \return Is the bundle well-formed?
+ */
+bool pack_validate(const pack_t *pack, size_t size)
+{
+    const pack_header_t *header = pack->header;
+
+    if (size < sizeof(pack_header_t) || memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0)
+        return false;
+
+    if (header->version != PACK_VERSION || header->size != size)
+        return false;
+
+    if (header->index > size || (size - header->index) / sizeof(pack_entry_t) < header->count)
+        return false;
+
+    if (header->strings > size || size - header->strings < header->strings_length)
+        return false;
+
+    if (header->strings_length == 0 || pack->strings[header->strings_length - 1] != '\0')
+        return false;
+
+    for (size_t i = 0; i < header->count; ++i) {
+        const pack_entry_t *entry = &pack->entry[i];
+
+        if (entry->path >= header->strings_length || entry->mime >= header->strings_length)
+            return false;
+
+        for (size_t j = 0; j < PACK_VARIANT_COUNT; ++j) {
+            const pack_variant_t *variant = &entry->variant[j];
+
+            if (variant->offset > size || size - variant->offset < variant->length)
+                return false;
+
+            if (variant->etag >= header->strings_length)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \fn bool pack_open(const char*, char*, size_t)
+ * \brief Maps a bundle into memory, so that requests are served from it.
+ * The bundle is held open until the server stops, so it may be safely replaced by a
+ * newer one while the server runs, which is then served once the server is upgraded.
+ * \param path The bundle's path.
+ * \param error The buffer to describe why the bundle could not be opened into.
+ * \param size The error buffer's size.
+ * \return Has the bundle been opened?
+ */
+extern bool pack_open(const char *path, char *error, size_t size)
+{
+    pack_t *pack = &g_pack;
+    file_t *file = file_acquire(path, 0);
+
+    if (file == NULL || !S_ISREG(file->status.st_mode) || file->status.st_size == 0) {
+        snprintf(error, size, "the bundle '%s' could not be opened", path);
+        goto failure;
+    }
+
+    size_t length = (size_t) file->status.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, file->fd, 0);
+
+    if (data == MAP_FAILED) {
+        snprintf(error, size, "the bundle '%s' could not be mapped into memory", path);
+        goto failure;
+    }
+
+    pack->data = data;
+    pack->header = data;
+    pack->entry = (const pack_entry_t*) (pack->data + pack->header->index);
+    pack->strings = (const char*) (pack->data + pack->header->strings);
+
+    if (!pack_validate(pack, length)) {
+        snprintf(error, size, "the bundle '%s' is not a valid bundle", path);
+        munmap(data, length);
+        pack->data = NULL;
+        goto failure;
+    }
+
+    pack->file = file;
+    pack->prepared = calloc(pack->header->count * PACK_VARIANT_COUNT + 1, sizeof(*pack->prepared));
+
+    return true;
+
+failure:
+    if (file != NULL)
+        file_release(file);
+
+    return false;
+}
+
+/*!
+ * \fn const pack_t *pack_current()
+ * \brief Informs the bundle being served.
+ * \return The bundle being served, or NULL if requests are served from the public folder.
+ */
+extern const pack_t *pack_current()
+{
+    return g_pack.data != NULL ? &g_pack : NULL;
+}
+
+/*!
+ * \fn const char *pack_string(const pack_t*, uint32_t)
+ * \brief Retrieves a string from a bundle.
+ * \param pack The bundle to retrieve the string from.
+ * \param offset The string's offset within the bundle's strings.
+ * \return The string.
+ */
+extern const char *pack_string(const pack_t *pack, uint32_t offset)
+{
+    return pack->strings + offset;
+}
+
+/*!
+ * \fn const pack_entry_t *pack_find(const pack_t*, const char*)
+ * \brief Finds a file in a bundle by its path, with a binary search on its index.
+ * \param pack The bundle to look the file up in.
+ * \param path The file's path.
+ * \return The bundled file, or NULL if there is no such file in the bundle.
+ */
+extern const pack_entry_t *pack_find(const pack_t *pack, const char *path)
+{
+    size_t low = 0;
+    size_t high = pack->header->count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int comparison = strcmp(pack_string(pack, pack->entry[middle].path), path);
+
+        if (comparison == 0)
+            return &pack->entry[middle];
+
+        if (comparison < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return NULL;
+}
+
+/*!
+ * \fn void pack_close()
+ * \brief Releases the bundle being served, and every response prepared from it.
+ */
+extern void pack_close()
+{
+    pack_t *pack = &g_pack;
+
+    if (pack->data == NULL)
+        return;
+
+    for (size_t i = 0; i < pack->header->count * PACK_VARIANT_COUNT; ++i)
+        if (pack->prepared[i] != NULL)
+            http_prepared_release(pack->prepared[i]);
+
+    munmap((void*) pack->data, pack->header->size);
+    file_release(pack->file);
+    free(pack->prepared);
+
+    *pack = (pack_t) { 0 };
+}
@@ -0,0 +1,110 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for static site bundles.
+ * A bundle is a single file holding a whole public folder, as compiled by `mu-pack`. It
+ * starts with a header, followed by the contents of its files, each aligned to a page,
+ * by the index of its files, sorted by path, and by the strings the index refers to.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_PACK_H
+#define MU_HTTPD_PACK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "file.h"
+
+/*
+ * The bundle format's identification, and its version, which must be changed whenever
+ * the format changes, so that a server never reads a bundle it does not understand.
+ */
+#define PACK_MAGIC          "muHTTPpk"
+#define PACK_VERSION        1
+
+/*
+ * The alignment of the files' contents within a bundle, so that each file starts on a
+ * page of its own and can be sent straight from the page cache.
+ */
+#define PACK_ALIGNMENT      4096
+
+/*!
+ * \enum pack_variant_kind_t
+ * \brief The variants a bundled file may be stored as.
+ * \since 3.0
+ */
+typedef enum pack_variant_kind_t {
+    PACK_VARIANT_IDENTITY = 0
+  , PACK_VARIANT_GZIP
+  , PACK_VARIANT_COUNT
+} pack_variant_kind_t;
+
+/*!
+ * \struct pack_header_t
+ * \brief The header a bundle starts with, locating its index and strings.
+ * \since 3.0
+ */
+typedef struct pack_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index;
+    uint64_t strings;
+    uint64_t strings_length;
+    uint64_t size;
+} pack_header_t;
+
+/*!
+ * \struct pack_variant_t
+ * \brief A variant of a bundled file, with its contents' location and its entity tag.
+ * A variant which has not been stored has no length.
+ * \since 3.0
+ */
+typedef struct pack_variant_t {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t etag;
+    uint32_t reserved;
+} pack_variant_t;
+
+/*!
+ * \struct pack_entry_t
+ * \brief A bundled file, with its metadata computed when the bundle has been compiled.
+ * Paths and types are offsets into the bundle's strings. Paths start with a slash.
+ * \since 3.0
+ */
+typedef struct pack_entry_t {
+    uint32_t path;
+    uint32_t mime;
+    int64_t modified;
+    pack_variant_t variant[PACK_VARIANT_COUNT];
+} pack_entry_t;
+
+/*!
+ * \struct pack_t
+ * \brief A bundle mapped into memory, and shared by all threads serving requests.
+ * The responses to bundled files are prepared as they are first requested.
+ * \since 3.0
+ */
+typedef struct pack_t {
+    file_t *file;
+    const unsigned char *data;
+    const pack_header_t *header;
+    const pack_entry_t *entry;
+    const char *strings;
+    _Atomic(struct http_prepared_t *) *prepared;
+} pack_t;
+
+/*
+ * Forward declaration of bundle functions.
+ * These functions are needed for serving requests from a bundle instead of a folder.
+ */
+extern bool pack_open(const char*, char*, size_t);
+extern const pack_t *pack_current();
+extern const pack_entry_t *pack_find(const pack_t*, const char*);
+extern const char *pack_string(const pack_t*, uint32_t);
+extern void pack_close();
+
+#endif
@@ -0,0 +1,1399 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the reverse proxy.
+ * Requests for a proxy route are forwarded to one of its upstream servers, balanced
+ * either round-robin or to the server with the fewest requests in flight. An exchange
+ * with an upstream server never blocks, as it is the relay of its request's reply, and
+ * is moved along by whoever sends the reply whenever what it waits on is ready. Request
+ * bodies are forwarded as they are received, and bodies and upstream responses' contents
+ * delimited by their length are spliced from one connection into the other, through a
+ * pipe, so that they never have to be copied into the server. Connections to upstream
+ * servers are kept alive in pools, each owned by an event loop or a worker, so that a
+ * connection is only ever used by a single thread at a time, and is taken from its pool
+ * without any locking.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "body.h"
+#include "http.h"
+#include "logger.h"
+#include "settings.h"
+
+#include "proxy.h"
+
+/*
+ * The most idle connections a pool may keep to each upstream server, and spare pipes in
+ * all, the most headers an upstream server's response may have, and how much of a body
+ * or of an upstream response's content is spliced at once.
+ */
+#define PROXY_MAX_IDLE          32
+#define PROXY_MAX_HEADERS       64
+#define PROXY_CHUNK_SIZE        65536
+
+/*!
+ * \enum proxy_balance_t
+ * \brief The ways requests are balanced between the upstream servers of a proxy route.
+ * \since 3.0
+ */
+typedef enum proxy_balance_t {
+    PROXY_BALANCE_ROUND_ROBIN = 0
+  , PROXY_BALANCE_LEAST_CONNECTIONS
+} proxy_balance_t;
+
+/*!
+ * \enum proxy_phase_t
+ * \brief The phases of a request's exchange with an upstream server.
+ * \since 3.0
+ */
+typedef enum proxy_phase_t {
+    PROXY_PHASE_CONNECT = 0
+  , PROXY_PHASE_REQUEST
+  , PROXY_PHASE_HEAD
+  , PROXY_PHASE_RESPONDED
+  , PROXY_PHASE_CONTENT
+} proxy_phase_t;
+
+/*!
+ * \enum proxy_framing_t
+ * \brief The ways an upstream response may delimit its content.
+ * \since 3.0
+ */
+typedef enum proxy_framing_t {
+    PROXY_FRAMING_LENGTH = 0
+  , PROXY_FRAMING_CHUNKED
+  , PROXY_FRAMING_CLOSE
+} proxy_framing_t;
+
+/*!
+ * \struct proxy_upstream_t
+ * \brief An upstream server, and how many requests are in flight to it.
+ * An upstream server is found unhealthy when it cannot be connected to, and is skipped
+ * by the balancing until it is connected to again, by a request or a health check.
+ * \since 3.0
+ */
+typedef struct proxy_upstream_t {
+    char *name;
+    struct sockaddr_storage address;
+    socklen_t length;
+    atomic_bool healthy;
+    atomic_uint active;
+} proxy_upstream_t;
+
+/*!
+ * \struct proxy_t
+ * \brief The upstream servers of a proxy route, and how requests are balanced between them.
+ * \since 3.0
+ */
+struct proxy_t {
+    size_t first;
+    size_t count;
+    proxy_balance_t balance;
+    atomic_size_t cursor;
+};
+
+/*!
+ * \struct proxy_idle_t
+ * \brief A pool's idle connections to an upstream server, the most recently used last.
+ * \since 3.0
+ */
+typedef struct proxy_idle_t {
+    int fd[PROXY_MAX_IDLE];
+    size_t count;
+} proxy_idle_t;
+
+/*!
+ * \struct proxy_pool_t
+ * \brief The idle connections to every upstream server, and the spare pipes to splice through.
+ * \since 3.0
+ */
+struct proxy_pool_t {
+    proxy_idle_t idle[PROXY_MAX_UPSTREAMS];
+    int pipe[PROXY_MAX_IDLE][2];
+    size_t pipe_count;
+};
+
+/*!
+ * \struct proxy_exchange_t
+ * \brief A request's exchange with an upstream server, which relays the request's reply.
+ * The request's head, and its body as it is decoded, are queued up in the exchange's
+ * output until they are sent. What has been sent is kept until any of the body is read
+ * from the client, so that the request can be sent again through another connection. The
+ * response's head is received into the exchange's buffer, along with the start of its
+ * content, and the rest of the content is then relayed.
+ * \since 3.0
+ */
+typedef struct proxy_exchange_t {
+    struct http_relay_t relay;
+    proxy_t *proxy;
+    proxy_pool_t *pool;
+    proxy_phase_t phase;
+    size_t attempt;
+    size_t upstream;
+    int fd;
+    bool reused;
+    bool replayable;
+    bool head_only;
+    body_t *body;
+    bool chunked;
+    bool terminated;
+    char *output;
+    size_t output_length;
+    size_t output_sent;
+    size_t output_capacity;
+    char *buffer;
+    size_t capacity;
+    size_t received;
+    size_t size;
+    enum http_code_t status;
+    struct http_header_t header[PROXY_MAX_HEADERS];
+    size_t count_headers;
+    size_t length;
+    proxy_framing_t framing;
+    body_t content;
+    uint64_t remaining;
+    bool complete;
+    bool reusable;
+    int pipe[2];
+    size_t piped;
+    char *chunk;
+    size_t chunk_length;
+    size_t chunk_sent;
+    enum http_code_t failure;
+} proxy_exchange_t;
+
+/*!
+ * \struct proxy_registry_t
+ * \brief The upstream servers of all proxy routes, and the thread checking their health.
+ * \since 3.0
+ */
+typedef struct proxy_registry_t {
+    proxy_upstream_t upstream[PROXY_MAX_UPSTREAMS];
+    size_t upstream_count;
+    proxy_t **proxy;
+    size_t proxy_count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t checker;
+    uint32_t interval;
+    bool running;
+    atomic_bool stopping;
+} proxy_registry_t;
+
+/*!
+ * \var g_proxy
+ * \brief The upstream servers requests may be forwarded to.
+ * \since 3.0
+ */
+static proxy_registry_t g_proxy = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+  , .wake = PTHREAD_COND_INITIALIZER
+};
+
+/*!
+ * \var g_proxy_pool
+ * \brief The pool bound to the current thread, if any.
+ * Pools are owned by event loops and workers, which bind their own pools to the threads
+ * running them. Proxied requests are never offloaded, so no other thread needs a pool.
+ * \since 3.0
+ */
+static _Thread_local proxy_pool_t *g_proxy_pool = NULL;
+
+/*!
+ * \var g_proxy_request_hop
+ * \brief The headers of a request which are only meant for its own connection.
+ * Clients awaiting approval to send their bodies have already been given it.
+ * \since 3.0
+ */
+static const char *const g_proxy_request_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade", "Expect"
+};
+
+/*!
+ * \var g_proxy_response_hop
+ * \brief The headers of an upstream response which are not relayed to the client.
+ * The server adds its own connection, identification and date headers to every response.
+ * \since 3.0
+ */
+static const char *const g_proxy_response_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade"
+  , "Server", "Date"
+};
+
+/*!
+ * \fn bool proxy_parse_upstream(proxy_upstream_t*, const char*, char*, size_t)
+ * \brief Parses and resolves an upstream server, written as its host and port.
+ * \param upstream The upstream server to be parsed.
+ * \param spec The upstream server's host and port, with an IPv6 host within brackets.
+ * \param reason The buffer to describe why the upstream server is invalid into.
+ * \param size The reason buffer's size.
+ * \return Has the upstream server been parsed and resolved?
+ */
+bool proxy_parse_upstream(proxy_upstream_t *upstream, const char *spec, char *reason, size_t size)
+{
+    int code;
+    char host[256];
+    const char *port;
+    struct addrinfo *result;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    const char *end = spec[0] == '[' ? strchr(spec, ']') : strrchr(spec, ':');
+
+    if (end == NULL || (spec[0] == '[' && *++end != ':')) {
+        snprintf(reason, size, "expected 'host:port' for the upstream '%s'", spec);
+        return false;
+    }
+
+    size_t length = spec[0] == '[' ? (size_t) (end - spec - 2) : (size_t) (end - spec);
+    port = end + 1;
+
+    if (length == 0 || length >= sizeof(host) || port[0] == '\0') {
+        snprintf(reason, size, "expected 'host:port' for the upstream '%s'", spec);
+        return false;
+    }
+
+    memcpy(host, spec[0] == '[' ? spec + 1 : spec, length);
+    host[length] = '\0';
+
+    if ((code = getaddrinfo(host, port, &hints, &result)) != 0) {
+        snprintf(reason, size, "could not resolve the upstream '%s': %s", spec, gai_strerror(code));
+        return false;
+    }
+
+    memcpy(&upstream->address, result->ai_addr, result->ai_addrlen);
+    upstream->length = result->ai_addrlen;
+    upstream->name = strdup(spec);
+    atomic_init(&upstream->healthy, true);
+    atomic_init(&upstream->active, 0);
+
+    freeaddrinfo(result);
+    return true;
+}
+
+/*!
+ * \fn proxy_t *proxy_create(const char*, char*, size_t)
+ * \brief Creates the upstream servers of a proxy route.
+ * Requests are balanced between the servers as set by the `proxy_balance` setting.
+ * \param upstreams The upstream servers' hosts and ports, separated by commas.
+ * \param reason The buffer to describe why the upstream servers are invalid into.
+ * \param size The reason buffer's size.
+ * \return The proxy route's upstream servers, or NULL if they are invalid.
+ */
+extern proxy_t *proxy_create(const char *upstreams, char *reason, size_t size)
+{
+    char *cursor;
+    bool success = true;
+    proxy_registry_t *registry = &g_proxy;
+    const char *balance = settings_current()->proxy_balance;
+    proxy_t *proxy = calloc(1, sizeof(proxy_t));
+    char *list = strdup(upstreams);
+
+    if (strcmp(balance, "least-connections") == 0) {
+        proxy->balance = PROXY_BALANCE_LEAST_CONNECTIONS;
+    } else if (strcmp(balance, "round-robin") != 0) {
+        snprintf(reason, size, "unknown proxy balancing '%s'", balance);
+        success = false;
+    }
+
+    proxy->first = registry->upstream_count;
+    atomic_init(&proxy->cursor, 0);
+
+    for (char *spec = strtok_r(list, ",", &cursor); success && spec != NULL; spec = strtok_r(NULL, ",", &cursor)) {
+        if (registry->upstream_count >= PROXY_MAX_UPSTREAMS) {
+            snprintf(reason, size, "more than %d upstream servers", PROXY_MAX_UPSTREAMS);
+            success = false;
+        } else if ((success = proxy_parse_upstream(&registry->upstream[registry->upstream_count], spec, reason, size))) {
+            ++registry->upstream_count;
+            ++proxy->count;
+        }
+    }
+
+    free(list);
+
+    if (success && proxy->count == 0) {
+        snprintf(reason, size, "no upstream servers");
+        success = false;
+    }
+
+    if (!success) {
+        for (; proxy->count > 0; --proxy->count)
+            free(registry->upstream[--registry->upstream_count].name);
+
+        free(proxy);
+        return NULL;
+    }
+
+    registry->proxy = realloc(registry->proxy, sizeof(proxy_t*) * (registry->proxy_count + 1));
+    registry->proxy[registry->proxy_count++] = proxy;
+
+    return proxy;
+}
+
+/*!
+ * \fn int proxy_connect(const proxy_upstream_t*, bool*)
+ * \brief Starts opening a new connection to an upstream server, without blocking.
+ * A connection which could not be opened right away is being opened, until it becomes
+ * writable, whether it has then been opened or not.
+ * \param upstream The upstream server to connect to.
+ * \param connected Has the connection been opened right away?
+ * \return The new connection, or -1 if the server could not be connected to.
+ */
+int proxy_connect(const proxy_upstream_t *upstream, bool *connected)
+{
+    int nodelay = 1;
+    int fd = socket(upstream->address.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if (fd == -1)
+        return -1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+    *connected = connect(fd, (const struct sockaddr*) &upstream->address, upstream->length) == 0;
+
+    if (!*connected && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*!
+ * \fn bool proxy_connected(int)
+ * \brief Checks whether a connection being opened has been opened, once it is writable.
+ * \param fd The connection being opened.
+ * \return Has the connection been opened?
+ */
+bool proxy_connected(int fd)
+{
+    int error = 0;
+    socklen_t length = sizeof(int);
+
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+}
+
+/*!
+ * \fn size_t proxy_choose(proxy_t*)
+ * \brief Chooses the upstream server a request is forwarded to.
+ * Healthy servers are tried in turn, starting from the next one in the rotation, so that
+ * least-connections balancing breaks its ties round-robin. When no server is healthy, the
+ * next one in the rotation is tried anyway, as it may have come back since last checked.
+ * \param proxy The upstream servers of the request's route.
+ * \return The index of the chosen upstream server.
+ */
+size_t proxy_choose(proxy_t *proxy)
+{
+    unsigned fewest = UINT_MAX;
+    size_t start = atomic_fetch_add_explicit(&proxy->cursor, 1, memory_order_relaxed) % proxy->count;
+    size_t chosen = proxy->first + start;
+
+    for (size_t i = 0; i < proxy->count; ++i) {
+        size_t index = proxy->first + (start + i) % proxy->count;
+        proxy_upstream_t *upstream = &g_proxy.upstream[index];
+
+        if (!atomic_load_explicit(&upstream->healthy, memory_order_relaxed))
+            continue;
+
+        if (proxy->balance == PROXY_BALANCE_ROUND_ROBIN)
+            return index;
+
+        unsigned active = atomic_load_explicit(&upstream->active, memory_order_relaxed);
+
+        if (active < fewest) {
+            fewest = active;
+            chosen = index;
+        }
+    }
+
+    return chosen;
+}
+
+/*!
+ * \fn proxy_pool_t *proxy_pool_create()
+ * \brief Creates a new pool, with no idle connections yet.
+ * \return The new pool instance.
+ */
+extern proxy_pool_t *proxy_pool_create()
+{
+    return calloc(1, sizeof(proxy_pool_t));
+}
+
+/*!
+ * \fn void proxy_pool_bind(proxy_pool_t*)
+ * \brief Binds a pool to the current thread, so that it serves the thread's exchanges.
+ * \param pool The pool to be bound, or NULL to unbind the current one.
+ */
+extern void proxy_pool_bind(proxy_pool_t *pool)
+{
+    g_proxy_pool = pool;
+}
+
+/*!
+ * \fn void proxy_pool_destroy(proxy_pool_t*)
+ * \brief Closes a pool's idle connections and spare pipes, and frees the pool.
+ * \param pool The pool to be destroyed.
+ */
+extern void proxy_pool_destroy(proxy_pool_t *pool)
+{
+    for (size_t i = 0; i < PROXY_MAX_UPSTREAMS; ++i)
+        while (pool->idle[i].count > 0)
+            close(pool->idle[i].fd[--pool->idle[i].count]);
+
+    while (pool->pipe_count > 0) {
+        --pool->pipe_count;
+        close(pool->pipe[pool->pipe_count][0]);
+        close(pool->pipe[pool->pipe_count][1]);
+    }
+
+    free(pool);
+}
+
+/*!
+ * \fn int proxy_connection_acquire(proxy_pool_t*, size_t)
+ * \brief Takes an idle connection to an upstream server from a pool.
+ * Idle connections which the server has closed, or has sent anything through, are of no
+ * use anymore, and are closed instead.
+ * \param pool The pool to take the connection from, if any.
+ * \param index The index of the upstream server.
+ * \return The idle connection, or -1 if there is none.
+ */
+int proxy_connection_acquire(proxy_pool_t *pool, size_t index)
+{
+    char peek;
+    proxy_idle_t *idle = pool != NULL ? &pool->idle[index] : NULL;
+
+    while (idle != NULL && idle->count > 0) {
+        int fd = idle->fd[--idle->count];
+
+        if (recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+/*!
+ * \fn void proxy_connection_release(proxy_pool_t*, size_t, int, bool)
+ * \brief Gives a connection back to a pool, or closes it.
+ * \param pool The pool to give the connection back to, if any.
+ * \param index The index of the upstream server the connection is to.
+ * \param fd The connection to be released.
+ * \param reusable May the connection be used for another request?
+ */
+void proxy_connection_release(proxy_pool_t *pool, size_t index, int fd, bool reusable)
+{
+    proxy_idle_t *idle = pool != NULL ? &pool->idle[index] : NULL;
+
+    atomic_fetch_sub_explicit(&g_proxy.upstream[index].active, 1, memory_order_relaxed);
+
+    if (reusable && idle != NULL && idle->count < settings_current()->proxy_pool)
+        idle->fd[idle->count++] = fd;
+    else
+        close(fd);
+}
+
+/*!
+ * \fn bool proxy_pipe_acquire(proxy_pool_t*, int*)
+ * \brief Takes a spare pipe from a pool, or creates a new one.
+ * \param pool The pool to take the pipe from, if any.
+ * \param fds The pipe's descriptors.
+ * \return Has a pipe been taken?
+ */
+bool proxy_pipe_acquire(proxy_pool_t *pool, int *fds)
+{
+    if (pool != NULL && pool->pipe_count > 0) {
+        --pool->pipe_count;
+        fds[0] = pool->pipe[pool->pipe_count][0];
+        fds[1] = pool->pipe[pool->pipe_count][1];
+        return true;
+    }
+
+    return pipe2(fds, O_CLOEXEC) == 0;
+}
+
+/*!
+ * \fn void proxy_pipe_release(proxy_pool_t*, int*, bool)
+ * \brief Gives a pipe back to a pool, or closes it when content has been left stuck in it.
+ * \param pool The pool to give the pipe back to, if any.
+ * \param fds The pipe's descriptors.
+ * \param empty Has everything spliced into the pipe been spliced out of it?
+ */
+void proxy_pipe_release(proxy_pool_t *pool, int *fds, bool empty)
+{
+    if (empty && pool != NULL && pool->pipe_count < PROXY_MAX_IDLE) {
+        pool->pipe[pool->pipe_count][0] = fds[0];
+        pool->pipe[pool->pipe_count][1] = fds[1];
+        ++pool->pipe_count;
+    } else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    fds[0] = fds[1] = -1;
+}
+
+/*!
+ * \fn bool proxy_header_listed(const char*, const char *const*, size_t)
+ * \brief Checks whether a header is one of a list of headers, regardless of case.
+ * \param key The header's name.
+ * \param list The list of headers' names.
+ * \param count The number of headers in the list.
+ * \return Is the header in the list?
+ */
+bool proxy_header_listed(const char *key, const char *const *list, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        if (strcasecmp(key, list[i]) == 0)
+            return true;
+
+    return false;
+}
+
+/*!
+ * \fn char *proxy_request_build(const struct http_request_t*, size_t*)
+ * \brief Serializes a request to be forwarded to an upstream server.
+ * The request keeps its method, its target exactly as received and its end-to-end headers,
+ * and asks for its upstream connection to be kept alive, whatever the client has asked for.
+ * \param http_request The request to be forwarded.
+ * \param length The serialized request's length.
+ * \return The serialized request.
+ */
+char *proxy_request_build(const struct http_request_t *http_request, size_t *length)
+{
+    const char *method = logger_describe_http_method(http_request->method);
+    size_t count = sizeof(g_proxy_request_hop) / sizeof(g_proxy_request_hop[0]);
+    size_t required = strlen(method) + strlen(http_request->target) + 64;
+
+    for (size_t i = 0; i < http_request->count_headers; ++i)
+        required += strlen(http_request->header[i].key) + strlen(http_request->header[i].value) + 4;
+
+    char *request = malloc(sizeof(char) * required);
+    char *cursor = request;
+
+    cursor += sprintf(cursor, "%s %s HTTP/1.1\r\n", method, http_request->target);
+
+    for (size_t i = 0; i < http_request->count_headers; ++i)
+        if (!proxy_header_listed(http_request->header[i].key, g_proxy_request_hop, count))
+            cursor += sprintf(cursor, "%s: %s\r\n", http_request->header[i].key, http_request->header[i].value);
+
+    cursor += sprintf(cursor, "Connection: keep-alive\r\n\r\n");
+    *length = (size_t) (cursor - request);
+
+    return request;
+}
+
+/*!
+ * \fn int proxy_exchange_wait(proxy_exchange_t*, int, short)
+ * \brief Has an exchange wait for a descriptor to be ready, before it can move along.
+ * \param exchange The exchange which must wait.
+ * \param fd The descriptor to wait for.
+ * \param events The events to wait for.
+ * \return Always -1, with errno set to EAGAIN.
+ */
+int proxy_exchange_wait(proxy_exchange_t *exchange, int fd, short events)
+{
+    exchange->relay.fd = fd;
+    exchange->relay.events = events;
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*!
+ * \fn int proxy_exchange_fail(int)
+ * \brief Fails an exchange for a reason of its own, rather than that of a failed call.
+ * \param error The reason why the exchange has failed.
+ * \return Always -1, with errno set to the given reason.
+ */
+int proxy_exchange_fail(int error)
+{
+    errno = error;
+    return -1;
+}
+
+/*!
+ * \fn void proxy_exchange_detach(proxy_exchange_t*, bool)
+ * \brief Releases an exchange's upstream connection, once it is of no more use to it.
+ * \param exchange The exchange to detach from its upstream connection.
+ * \param reusable May the connection be used for another request?
+ */
+void proxy_exchange_detach(proxy_exchange_t *exchange, bool reusable)
+{
+    if (exchange->fd != -1)
+        proxy_connection_release(exchange->pool, exchange->upstream, exchange->fd, reusable);
+
+    exchange->fd = -1;
+}
+
+/*!
+ * \fn void proxy_exchange_append(proxy_exchange_t*, const char*, size_t)
+ * \brief Queues data up to be sent to the upstream server.
+ * \param exchange The exchange to queue the data up in.
+ * \param data The data to be sent.
+ * \param length The data's length.
+ */
+void proxy_exchange_append(proxy_exchange_t *exchange, const char *data, size_t length)
+{
+    if (exchange->output_length + length > exchange->output_capacity) {
+        size_t capacity = exchange->output_capacity > 0 ? exchange->output_capacity : BODY_CHUNK_SIZE;
+
+        while (exchange->output_length + length > capacity)
+            capacity *= 2;
+
+        exchange->output = realloc(exchange->output, sizeof(char) * capacity);
+        exchange->output_capacity = capacity;
+    }
+
+    memcpy(exchange->output + exchange->output_length, data, length);
+    exchange->output_length += length;
+}
+
+/*!
+ * \fn bool proxy_exchange_consume(void*, const char*, size_t)
+ * \brief Queues a piece of a request's decoded body up to be forwarded.
+ * A chunked body is chunked again, as it is forwarded without its chunk extensions.
+ * \param context The exchange forwarding the body.
+ * \param data The decoded piece of body.
+ * \param length The piece's length.
+ * \return Always true, as bodies are forwarded whatever they hold.
+ */
+bool proxy_exchange_consume(void *context, const char *data, size_t length)
+{
+    char prefix[24];
+    proxy_exchange_t *exchange = (proxy_exchange_t*) context;
+
+    if (!exchange->chunked) {
+        proxy_exchange_append(exchange, data, length);
+        return true;
+    }
+
+    if (length > 0) {
+        proxy_exchange_append(exchange, prefix, (size_t) sprintf(prefix, "%zx\r\n", length));
+        proxy_exchange_append(exchange, data, length);
+        proxy_exchange_append(exchange, "\r\n", 2);
+    }
+
+    return true;
+}
+
+/*!
+ * \fn int proxy_exchange_connect(proxy_exchange_t*)
+ * \brief Takes a connection to one of the upstream servers, from the pool if possible.
+ * Upstream servers which cannot be connected to are found unhealthy, and skipped.
+ * \param exchange The exchange to be connected.
+ * \return Zero once connected, or -1 on error or if the connection is still being opened.
+ */
+int proxy_exchange_connect(proxy_exchange_t *exchange)
+{
+    bool connected = false;
+    proxy_upstream_t *upstream;
+
+    if (exchange->fd != -1) {
+        connected = proxy_connected(exchange->fd);
+        atomic_store_explicit(&g_proxy.upstream[exchange->upstream].healthy, connected, memory_order_relaxed);
+
+        if (!connected)
+            proxy_exchange_detach(exchange, false);
+    }
+
+    while (!connected && exchange->attempt++ <= exchange->proxy->count) {
+        exchange->upstream = proxy_choose(exchange->proxy);
+        exchange->fd = proxy_connection_acquire(exchange->pool, exchange->upstream);
+        exchange->reused = connected = exchange->fd != -1;
+        upstream = &g_proxy.upstream[exchange->upstream];
+
+        if (!exchange->reused && (exchange->fd = proxy_connect(upstream, &connected)) == -1) {
+            atomic_store_explicit(&upstream->healthy, false, memory_order_relaxed);
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&upstream->active, 1, memory_order_relaxed);
+
+        if (!connected)
+            return proxy_exchange_wait(exchange, exchange->fd, POLLOUT);
+    }
+
+    if (!connected)
+        return proxy_exchange_fail(ECONNREFUSED);
+
+    exchange->phase = PROXY_PHASE_REQUEST;
+    return 0;
+}
+
+/*!
+ * \fn int proxy_exchange_send(proxy_exchange_t*)
+ * \brief Sends what has been queued up to the upstream server.
+ * What has been sent is dropped, unless the request may still have to be sent again.
+ * \param exchange The exchange to send the queued data of.
+ * \return Zero once everything has been sent, or -1 on error or if it must wait.
+ */
+int proxy_exchange_send(proxy_exchange_t *exchange)
+{
+    while (exchange->output_sent < exchange->output_length) {
+        size_t left = exchange->output_length - exchange->output_sent;
+        ssize_t sent = send(exchange->fd, exchange->output + exchange->output_sent, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (sent > 0)
+            exchange->output_sent += (size_t) sent;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return proxy_exchange_wait(exchange, exchange->fd, POLLOUT);
+        else if (errno != EINTR)
+            return -1;
+    }
+
+    if (!exchange->replayable)
+        exchange->output_length = exchange->output_sent = 0;
+
+    return 0;
+}
+
+/*!
+ * \fn int proxy_exchange_upload(proxy_exchange_t*, int)
+ * \brief Sends the request to the upstream server, along with its body as it is received.
+ * A body delimited by its length is spliced from the client's socket into the upstream
+ * connection, through the exchange's pipe. A chunked body is decoded as it is received,
+ * so that its end is found, and so that nothing after it is taken from the client.
+ * \param exchange The exchange to send the request of.
+ * \param client The client's socket.
+ * \return Zero once the whole request has been sent, or -1 on error or if it must wait.
+ */
+int proxy_exchange_upload(proxy_exchange_t *exchange, int client)
+{
+    ssize_t moved;
+    size_t consumed;
+    body_t *body = exchange->body;
+
+    while (proxy_exchange_send(exchange) == 0) {
+        if (exchange->piped > 0) {
+            moved = splice(exchange->pipe[0], NULL, exchange->fd, NULL, exchange->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+
+            if (moved > 0)
+                exchange->piped -= (size_t) moved;
+            else if (moved == -1 && errno == EAGAIN)
+                return proxy_exchange_wait(exchange, exchange->fd, POLLOUT);
+            else if (moved == 0 || errno != EINTR)
+                return proxy_exchange_fail(moved == 0 ? EPIPE : errno);
+
+            continue;
+        }
+
+        if (body == NULL || body->status == BODY_COMPLETE) {
+            if (!exchange->chunked || exchange->terminated) {
+                exchange->phase = PROXY_PHASE_HEAD;
+                return 0;
+            }
+
+            proxy_exchange_append(exchange, "0\r\n\r\n", 5);
+            exchange->terminated = true;
+            continue;
+        }
+
+        if (body->status != BODY_INCOMPLETE) {
+            exchange->failure = body->status == BODY_TOO_LONG
+                ? HTTP_RESPONSE_PAYLOAD_TOO_LARGE
+                : HTTP_RESPONSE_BAD_REQUEST;
+
+            return proxy_exchange_fail(EPROTO);
+        }
+
+        // Once any of the body is taken from the client, the request cannot be sent again.
+        exchange->replayable = false;
+        exchange->output_length = exchange->output_sent = 0;
+
+        if (body->encoding == BODY_ENCODING_LENGTH) {
+            size_t size = body->remaining < PROXY_CHUNK_SIZE ? (size_t) body->remaining : PROXY_CHUNK_SIZE;
+
+            if (exchange->pipe[0] == -1 && !proxy_pipe_acquire(exchange->pool, exchange->pipe))
+                return -1;
+
+            if ((moved = splice(client, NULL, exchange->pipe[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0) {
+                exchange->piped += (size_t) moved;
+                body_bypass(body, (size_t) moved);
+                continue;
+            }
+        } else {
+            if (exchange->chunk == NULL)
+                exchange->chunk = malloc(sizeof(char) * BODY_CHUNK_SIZE);
+
+            if ((moved = recv(client, exchange->chunk, BODY_CHUNK_SIZE, MSG_PEEK | MSG_DONTWAIT)) > 0) {
+                body_feed(body, exchange->chunk, (size_t) moved, &consumed);
+                moved = recv(client, exchange->chunk, consumed, MSG_DONTWAIT);
+                continue;
+            }
+        }
+
+        if (moved == 0)
+            return proxy_exchange_fail(ECONNRESET);
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return proxy_exchange_wait(exchange, client, POLLIN);
+        else if (errno != EINTR)
+            return -1;
+    }
+
+    return -1;
+}
+
+/*!
+ * \fn bool proxy_parse_head(proxy_exchange_t*, char*, size_t, bool*)
+ * \brief Parses an upstream response's status line and headers, in place.
+ * \param exchange The exchange to parse the response into.
+ * \param buffer The response's status line and headers.
+ * \param size The size of the response's status line and headers.
+ * \param delimited Has the response announced how its content is delimited?
+ * \return Is the response valid?
+ */
+bool proxy_parse_head(proxy_exchange_t *exchange, char *buffer, size_t size, bool *delimited)
+{
+    char *end = buffer + size - 2;
+    char *line = buffer;
+    char *next = memmem(line, (size_t) (end - line), "\r\n", 2);
+    size_t count = sizeof(g_proxy_response_hop) / sizeof(g_proxy_response_hop[0]);
+
+    if (next - line < 12 || strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ' || (next - line > 12 && line[12] != ' '))
+        return false;
+
+    if (!isdigit((unsigned char) line[9]) || !isdigit((unsigned char) line[10]) || !isdigit((unsigned char) line[11]))
+        return false;
+
+    exchange->status = (enum http_code_t) ((line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0'));
+    exchange->count_headers = 0;
+    exchange->reusable = line[7] == '1';
+    *delimited = false;
+
+    for (line = next + 2; line < end; line = next + 2) {
+        next = memmem(line, (size_t) (end + 2 - line), "\r\n", 2);
+        char *colon = memchr(line, ':', (size_t) (next - line));
+
+        if (colon == NULL || colon == line || isspace((unsigned char) line[0]))
+            return false;
+
+        char *value = colon + 1;
+        char *last = next;
+
+        while (value < last && isspace((unsigned char) *value))
+            ++value;
+
+        while (last > value && isspace((unsigned char) last[-1]))
+            --last;
+
+        *colon = *last = '\0';
+
+        if (strcasecmp(line, "Connection") == 0 && strcasestr(value, "close") != NULL)
+            exchange->reusable = false;
+
+        if (strcasecmp(line, "Content-Length") == 0 || strcasecmp(line, "Transfer-Encoding") == 0)
+            *delimited = true;
+
+        if (proxy_header_listed(line, g_proxy_response_hop, count))
+            continue;
+
+        if (exchange->count_headers >= PROXY_MAX_HEADERS)
+            return false;
+
+        exchange->header[exchange->count_headers++] = (struct http_header_t) { .key = line, .value = value };
+    }
+
+    return true;
+}
+
+/*!
+ * \fn bool proxy_head_interim(const char*, size_t)
+ * \brief Checks whether an upstream response is only an interim response.
+ * \param buffer The response's status line and headers.
+ * \param size The size of the response's status line and headers.
+ * \return Is the response an interim one, to be followed by the final response?
+ */
+bool proxy_head_interim(const char *buffer, size_t size)
+{
+    return size > 9 && strncmp(buffer, "HTTP/1.", 7) == 0 && buffer[9] == '1';
+}
+
+/*!
+ * \fn int proxy_exchange_parse(proxy_exchange_t*, size_t)
+ * \brief Parses the upstream response's head, and finds out how its content is delimited.
+ * The content received along with the head is kept, to be taken along with the head. The
+ * upstream connection is released as soon as the response has been completely received.
+ * \param exchange The exchange which has received the response's head.
+ * \param size The size of the response's status line and headers.
+ * \return Zero if the response is valid, or -1 otherwise.
+ */
+int proxy_exchange_parse(proxy_exchange_t *exchange, size_t size)
+{
+    bool delimited;
+    bool complete = false;
+    const char *rest = exchange->buffer + size;
+    size_t left = exchange->received - size;
+    size_t consumed = left;
+
+    if (body_initialize(&exchange->content, exchange->buffer, size, UINT64_MAX, body_discard, NULL) == BODY_INVALID)
+        return proxy_exchange_fail(EPROTO);
+
+    if (!proxy_parse_head(exchange, exchange->buffer, size, &delimited))
+        return proxy_exchange_fail(EPROTO);
+
+    if (exchange->head_only || exchange->status == HTTP_RESPONSE_NO_CONTENT || exchange->status == HTTP_RESPONSE_NOT_MODIFIED) {
+        consumed = 0;
+        complete = true;
+    } else if (!delimited) {
+        exchange->framing = PROXY_FRAMING_CLOSE;
+        exchange->relay.delimited = false;
+        exchange->reusable = false;
+    } else if (exchange->content.encoding == BODY_ENCODING_CHUNKED) {
+        body_status_t status = left > 0 ? body_feed(&exchange->content, rest, left, &consumed) : BODY_INCOMPLETE;
+
+        if (status == BODY_INVALID)
+            return proxy_exchange_fail(EPROTO);
+
+        exchange->framing = PROXY_FRAMING_CHUNKED;
+        complete = status == BODY_COMPLETE;
+    } else {
+        consumed = exchange->content.remaining < left ? (size_t) exchange->content.remaining : left;
+        exchange->remaining = exchange->content.remaining - consumed;
+        complete = exchange->remaining == 0;
+    }
+
+    exchange->size = size;
+    exchange->length = consumed;
+    exchange->complete = complete;
+    exchange->phase = PROXY_PHASE_RESPONDED;
+
+    // Anything the server has sent past the response's end makes its connection unusable.
+    if (complete)
+        proxy_exchange_detach(exchange, exchange->reusable && consumed == left);
+
+    return 0;
+}
+
+/*!
+ * \fn int proxy_exchange_receive(proxy_exchange_t*)
+ * \brief Receives the upstream response's status line and headers.
+ * Interim responses are skipped, as they have been asked for by no one.
+ * \param exchange The exchange to receive the response of.
+ * \return Zero once the response's head is received, or -1 on error or if it must wait.
+ */
+int proxy_exchange_receive(proxy_exchange_t *exchange)
+{
+    for (;;) {
+        char *end = memmem(exchange->buffer, exchange->received, "\r\n\r\n", 4);
+
+        if (end != NULL) {
+            size_t size = (size_t) (end - exchange->buffer) + 4;
+
+            if (!proxy_head_interim(exchange->buffer, size))
+                return proxy_exchange_parse(exchange, size);
+
+            exchange->received -= size;
+            memmove(exchange->buffer, exchange->buffer + size, exchange->received);
+            continue;
+        }
+
+        if (exchange->received >= exchange->capacity)
+            return proxy_exchange_fail(EPROTO);
+
+        size_t left = exchange->capacity - exchange->received;
+        ssize_t received = recv(exchange->fd, exchange->buffer + exchange->received, left, MSG_DONTWAIT);
+
+        if (received > 0) {
+            exchange->received += (size_t) received;
+            exchange->replayable = false;
+        } else if (received == 0) {
+            return proxy_exchange_fail(ECONNRESET);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return proxy_exchange_wait(exchange, exchange->fd, POLLIN);
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*!
+ * \fn int proxy_exchange_splice(proxy_exchange_t*, int)
+ * \brief Splices an upstream response's content into the client's socket, piece by piece.
+ * \param exchange The exchange relaying the response.
+ * \param client The client's socket.
+ * \return Zero once the content has been relayed, or -1 on error or if it must wait.
+ */
+int proxy_exchange_splice(proxy_exchange_t *exchange, int client)
+{
+    ssize_t moved;
+
+    for (;;) {
+        while (exchange->piped > 0) {
+            unsigned int more = exchange->complete ? 0 : SPLICE_F_MORE;
+            moved = splice(exchange->pipe[0], NULL, client, NULL, exchange->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+
+            if (moved > 0)
+                exchange->piped -= (size_t) moved;
+            else if (moved == -1 && errno == EAGAIN)
+                return proxy_exchange_wait(exchange, client, POLLOUT);
+            else if (moved == 0 || errno != EINTR)
+                return proxy_exchange_fail(moved == 0 ? EPIPE : errno);
+        }
+
+        if (exchange->complete)
+            return 0;
+
+        size_t size = exchange->remaining < PROXY_CHUNK_SIZE ? (size_t) exchange->remaining : PROXY_CHUNK_SIZE;
+
+        if (exchange->pipe[0] == -1 && !proxy_pipe_acquire(exchange->pool, exchange->pipe))
+            return -1;
+
+        moved = splice(exchange->fd, NULL, exchange->pipe[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (moved > 0) {
+            exchange->piped += (size_t) moved;
+            exchange->remaining -= (uint64_t) moved;
+
+            if ((exchange->complete = exchange->remaining == 0))
+                proxy_exchange_detach(exchange, exchange->reusable);
+        } else if (moved == 0) {
+            return proxy_exchange_fail(ECONNRESET);
+        } else if (errno == EAGAIN) {
+            return proxy_exchange_wait(exchange, exchange->fd, POLLIN);
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*!
+ * \fn int proxy_exchange_copy(proxy_exchange_t*, int)
+ * \brief Copies an upstream response's content into the client's socket, piece by piece.
+ * Chunked content is relayed as it is, but decoded along the way, so that its end is
+ * found. Content which is not delimited ends when the upstream server closes.
+ * \param exchange The exchange relaying the response.
+ * \param client The client's socket.
+ * \return Zero once the content has been relayed, or -1 on error or if it must wait.
+ */
+int proxy_exchange_copy(proxy_exchange_t *exchange, int client)
+{
+    for (;;) {
+        while (exchange->chunk_sent < exchange->chunk_length) {
+            size_t left = exchange->chunk_length - exchange->chunk_sent;
+            ssize_t sent = send(client, exchange->chunk + exchange->chunk_sent, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (sent > 0)
+                exchange->chunk_sent += (size_t) sent;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return proxy_exchange_wait(exchange, client, POLLOUT);
+            else if (errno != EINTR)
+                return -1;
+        }
+
+        if (exchange->complete)
+            return 0;
+
+        if (exchange->chunk == NULL)
+            exchange->chunk = malloc(sizeof(char) * BODY_CHUNK_SIZE);
+
+        exchange->chunk_length = exchange->chunk_sent = 0;
+        ssize_t received = recv(exchange->fd, exchange->chunk, BODY_CHUNK_SIZE, MSG_DONTWAIT);
+        size_t consumed = received > 0 ? (size_t) received : 0;
+
+        if (received == 0 && exchange->framing == PROXY_FRAMING_CLOSE) {
+            exchange->complete = true;
+            proxy_exchange_detach(exchange, false);
+            return 0;
+        }
+
+        if (received == 0)
+            return proxy_exchange_fail(ECONNRESET);
+
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return proxy_exchange_wait(exchange, exchange->fd, POLLIN);
+
+        if (received == -1 && errno != EINTR)
+            return -1;
+
+        if (exchange->framing == PROXY_FRAMING_CHUNKED && received > 0) {
+            body_status_t status = body_feed(&exchange->content, exchange->chunk, (size_t) received, &consumed);
+
+            if (status == BODY_INVALID || consumed == 0)
+                return proxy_exchange_fail(EPROTO);
+
+            if ((exchange->complete = status == BODY_COMPLETE))
+                proxy_exchange_detach(exchange, exchange->reusable && consumed == (size_t) received);
+        }
+
+        exchange->chunk_length = consumed;
+    }
+}
+
+/*!
+ * \fn int proxy_exchange_forward(struct http_relay_t*, int)
+ * \brief Moves an exchange along as far as it can go without blocking.
+ * A reused connection may have been closed by its server before the request could reach
+ * it, in which case the request is sent again through another connection, as long as
+ * nothing of its body has been taken from the client and nothing has been received.
+ * \param relay The exchange to be moved along.
+ * \param client The client's socket.
+ * \return Zero once the response's head or its content has been relayed, or -1 on error
+ * or if the exchange must wait.
+ */
+int proxy_exchange_forward(struct http_relay_t *relay, int client)
+{
+    int result = 0;
+    proxy_exchange_t *exchange = (proxy_exchange_t*) relay;
+
+    while (result == 0) {
+        switch (exchange->phase) {
+            case PROXY_PHASE_CONNECT: result = proxy_exchange_connect(exchange); break;
+            case PROXY_PHASE_REQUEST: result = proxy_exchange_upload(exchange, client); break;
+            case PROXY_PHASE_HEAD:    result = proxy_exchange_receive(exchange); break;
+            case PROXY_PHASE_RESPONDED:
+                return 0;
+
+            default:
+                return exchange->framing == PROXY_FRAMING_LENGTH
+                    ? proxy_exchange_splice(exchange, client)
+                    : proxy_exchange_copy(exchange, client);
+        }
+
+        bool retry = result == -1 && errno != EAGAIN && exchange->phase != PROXY_PHASE_CONNECT
+            && exchange->reused && exchange->replayable && exchange->failure == 0;
+
+        if (retry) {
+            proxy_exchange_detach(exchange, false);
+            exchange->phase = PROXY_PHASE_CONNECT;
+            exchange->output_sent = 0;
+            exchange->received = 0;
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
+/*!
+ * \fn bool proxy_exchange_respond(struct http_relay_t*, struct http_response_t*)
+ * \brief Takes the upstream response's head, and the content received along with it.
+ * The response's headers are only valid for as long as the exchange is, and its content
+ * is owned by the response. A failed exchange may tell which status to answer with.
+ * \param relay The exchange which has received the response's head.
+ * \param response The response to take the head into.
+ * \return Has the upstream server responded?
+ */
+bool proxy_exchange_respond(struct http_relay_t *relay, struct http_response_t *response)
+{
+    proxy_exchange_t *exchange = (proxy_exchange_t*) relay;
+
+    if (exchange->phase != PROXY_PHASE_RESPONDED) {
+        if (exchange->failure != 0)
+            response->status_code = exchange->failure;
+
+        return false;
+    }
+
+    response->status_code = exchange->status;
+    response->header = exchange->header;
+    response->count_headers = exchange->count_headers;
+    response->content = NULL;
+    response->length = exchange->length;
+
+    if (exchange->length > 0) {
+        response->content = malloc(sizeof(unsigned char) * exchange->length);
+        memcpy(response->content, exchange->buffer + exchange->size, exchange->length);
+    }
+
+    exchange->phase = PROXY_PHASE_CONTENT;
+    return true;
+}
+
+/*!
+ * \fn void proxy_exchange_release(struct http_relay_t*)
+ * \brief Releases an exchange, and its upstream connection back to the pool if it is reusable.
+ * A connection is only reusable once the whole response has been received from it, and a
+ * pipe only once everything spliced into it has been spliced out of it. The request's
+ * body, if it has not ended, is discarded from then on.
+ * \param relay The exchange to be released.
+ */
+void proxy_exchange_release(struct http_relay_t *relay)
+{
+    proxy_exchange_t *exchange = (proxy_exchange_t*) relay;
+
+    proxy_exchange_detach(exchange, false);
+
+    if (exchange->pipe[0] != -1)
+        proxy_pipe_release(exchange->pool, exchange->pipe, exchange->piped == 0);
+
+    if (exchange->body != NULL && exchange->body->context == exchange) {
+        exchange->body->consumer = body_discard;
+        exchange->body->context = NULL;
+    }
+
+    free(exchange->output);
+    free(exchange->buffer);
+    free(exchange->chunk);
+    free(exchange);
+}
+
+/*!
+ * \fn struct http_relay_t *proxy_open(proxy_t*, const struct http_request_t*)
+ * \brief Opens an exchange with one of a proxy route's upstream servers, for a request.
+ * Nothing is done until the exchange is first moved along, by whoever sends its reply.
+ * A request whose body is still to be received has its body taken over by the exchange,
+ * so that the body is forwarded as it is received.
+ * \param proxy The upstream servers of the request's route.
+ * \param http_request The request to be forwarded.
+ * \return The exchange's relay.
+ */
+extern struct http_relay_t *proxy_open(proxy_t *proxy, const struct http_request_t *http_request)
+{
+    proxy_exchange_t *exchange = calloc(1, sizeof(proxy_exchange_t));
+
+    exchange->relay = (struct http_relay_t) {
+        .forward = proxy_exchange_forward
+      , .respond = proxy_exchange_respond
+      , .release = proxy_exchange_release
+      , .delimited = true
+      , .fd = -1
+    };
+
+    exchange->proxy = proxy;
+    exchange->pool = g_proxy_pool;
+    exchange->fd = -1;
+    exchange->pipe[0] = exchange->pipe[1] = -1;
+    exchange->head_only = http_request->method == HTTP_HEAD;
+    exchange->replayable = true;
+    exchange->capacity = settings_current()->max_header_size;
+    exchange->buffer = malloc(sizeof(char) * exchange->capacity);
+    exchange->output = proxy_request_build(http_request, &exchange->output_length);
+    exchange->output_capacity = exchange->output_length;
+
+    if (http_request->body != NULL) {
+        exchange->body = http_request->body;
+        exchange->chunked = exchange->body->encoding == BODY_ENCODING_CHUNKED;
+        exchange->body->consumer = proxy_exchange_consume;
+        exchange->body->context = exchange;
+    }
+
+    return &exchange->relay;
+}
+
+/*!
+ * \fn void *proxy_check_run(void*)
+ * \brief Checks the health of every upstream server, periodically.
+ * A server is healthy if it can be connected to within the proxy timeout.
+ * \param argument The registry of upstream servers.
+ * \return Nothing.
+ */
+void *proxy_check_run(void *argument)
+{
+    struct timespec deadline;
+    proxy_registry_t *registry = (proxy_registry_t*) argument;
+
+    pthread_mutex_lock(&registry->lock);
+
+    while (!atomic_load(&registry->stopping)) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += registry->interval / 1000;
+        deadline.tv_nsec += (long) (registry->interval % 1000) * 1000000;
+
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+
+        if (pthread_cond_timedwait(&registry->wake, &registry->lock, &deadline) != ETIMEDOUT)
+            continue;
+
+        pthread_mutex_unlock(&registry->lock);
+
+        for (size_t i = 0; i < registry->upstream_count && !atomic_load(&registry->stopping); ++i) {
+            bool connected;
+            int fd = proxy_connect(&registry->upstream[i], &connected);
+            struct pollfd writable = { .fd = fd, .events = POLLOUT };
+
+            if (fd != -1 && !connected)
+                connected = poll(&writable, 1, (int) settings_current()->proxy_timeout) == 1 && proxy_connected(fd);
+
+            atomic_store_explicit(&registry->upstream[i].healthy, connected, memory_order_relaxed);
+
+            if (fd != -1)
+                close(fd);
+        }
+
+        pthread_mutex_lock(&registry->lock);
+    }
+
+    pthread_mutex_unlock(&registry->lock);
+    return NULL;
+}
+
+/*!
+ * \fn void proxy_start(uint32_t)
+ * \brief Starts checking the health of the upstream servers in the background.
+ * The checking thread never handles signals, so that signals are still handled by the
+ * main thread, as the server expects.
+ * \param interval The time between two checks, in milliseconds, or zero for no checks.
+ */
+extern void proxy_start(uint32_t interval)
+{
+    sigset_t all, previous;
+    proxy_registry_t *registry = &g_proxy;
+
+    if (registry->upstream_count == 0 || interval == 0)
+        return;
+
+    registry->interval = interval;
+    atomic_init(&registry->stopping, false);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    registry->running = pthread_create(&registry->checker, NULL, &proxy_check_run, (void*) registry) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/*!
+ * \fn void proxy_finalize()
+ * \brief Stops checking the upstream servers' health, and releases them.
+ */
+extern void proxy_finalize()
+{
+    proxy_registry_t *registry = &g_proxy;
+
+    if (registry->running) {
+        pthread_mutex_lock(&registry->lock);
+        atomic_store(&registry->stopping, true);
+        pthread_cond_broadcast(&registry->wake);
+        pthread_mutex_unlock(&registry->lock);
+
+        pthread_join(registry->checker, NULL);
+        registry->running = false;
+    }
+
+    for (size_t i = 0; i < registry->upstream_count; ++i)
+        free(registry->upstream[i].name);
+
+    for (size_t i = 0; i < registry->proxy_count; ++i)
+        free(registry->proxy[i]);
+
+    free(registry->proxy);
+
+    registry->proxy = NULL;
+    registry->proxy_count = 0;
+    registry->upstream_count = 0;
+}
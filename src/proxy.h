@@ -0,0 +1,54 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the reverse proxy.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_PROXY_H
+#define MU_HTTPD_PROXY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+
+/*
+ * The most upstream servers all proxy routes may forward requests to.
+ */
+#define PROXY_MAX_UPSTREAMS 32
+
+/*!
+ * \typedef proxy_t
+ * \brief The upstream servers a proxy route forwards its requests to.
+ * \since 3.0
+ */
+typedef struct proxy_t proxy_t;
+
+/*!
+ * \typedef proxy_pool_t
+ * \brief The idle connections to the upstream servers kept by an event loop or a worker.
+ * A pool is only ever used by the thread it is bound to, so that its connections are
+ * taken and given back without any locking.
+ * \since 3.0
+ */
+typedef struct proxy_pool_t proxy_pool_t;
+
+/*
+ * Forward declaration of proxy functions.
+ * These functions are needed for forwarding requests to the upstream servers.
+ */
+extern proxy_t *proxy_create(const char*, char*, size_t);
+extern struct http_relay_t *proxy_open(proxy_t*, const struct http_request_t*);
+extern void proxy_start(uint32_t);
+extern void proxy_finalize();
+
+/*
+ * Forward declaration of proxy pool functions.
+ * These functions are needed for keeping upstream connections alive between requests.
+ */
+extern proxy_pool_t *proxy_pool_create();
+extern void proxy_pool_bind(proxy_pool_t*);
+extern void proxy_pool_destroy(proxy_pool_t*);
+
+#endif
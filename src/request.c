@@ -4,108 +4,953 @@
  * \author Rodrigo Siqueira <rodriados@gmail.com>
  * \copyright 2014-present Rodrigo Siqueira
  */
+#define _GNU_SOURCE
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <time.h>
 
+#include "arena.h"
+#include "body.h"
 #include "config.h"
+#include "file.h"
 #include "response.h"
 #include "http.h"
 #include "logger.h"
+#include "settings.h"
 
 #include "request.h"
 
+#define REQUEST_CHUNK_SIZE   16384
+#define REQUEST_CHUNK_PREFIX 10
+#define REQUEST_CHUNK_BUFFER (REQUEST_CHUNK_PREFIX + REQUEST_CHUNK_SIZE + 2)
+
+/*!
+ * \fn request_frame_t request_frame(const char *, size_t, size_t *)
+ * \brief Checks whether a buffer already holds a request's whole header section.
+ * Any bytes beyond the header section belong to the request's body, or to the client's
+ * next request if the request has no body.
+ * \param buffer The buffer with the bytes received so far.
+ * \param length The number of bytes received so far.
+ * \param size The header section's size, if it has been completely received.
+ * \return The header section's receiving state.
+ */
+extern request_frame_t request_frame(const char *buffer, size_t length, size_t *size)
+{
+    const char *end = memmem(buffer, length, "\r\n\r\n", 4);
+    size_t max_header_size = settings_current()->max_header_size;
+
+    if (end == NULL)
+        return length > max_header_size
+            ? REQUEST_FRAME_TOO_LONG
+            : REQUEST_FRAME_INCOMPLETE;
+
+    *size = end - buffer + 4;
+
+    return *size > max_header_size
+        ? REQUEST_FRAME_TOO_LONG
+        : REQUEST_FRAME_COMPLETE;
+}
+
+/*
+ * The interim reply sent to clients which wait for the server's approval before sending
+ * their request's body, as asked by the `Expect: 100-continue` header.
+ */
+static const char g_request_continue_reply[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
 /*!
- * \fn enum http_error_t request_read(struct request_t *, char **, size_t *)
- * \brief Reads the request into memory.
+ * \fn body_status_t request_body_start(const request_t*, body_t*, const char*, size_t)
+ * \brief Prepares for receiving a request's body, once its header section is received.
+ * Clients which await approval before sending their bodies are only given it if their
+ * bodies have not already been refused. The approval is small enough to never block.
+ * \param request The request whose body is to be received.
+ * \param body The request's body decoder.
+ * \param header The request's raw header section.
+ * \param size The header section's size.
+ * \return The body's decoding state.
+ */
+extern body_status_t request_body_start(const request_t *request, body_t *body, const char *header, size_t size)
+{
+    uint64_t limit = settings_current()->max_request_size;
+    body_status_t status = body_initialize(body, header, size, limit, body_discard, NULL);
+
+    if (status == BODY_INCOMPLETE && body->expects_continue) {
+        ssize_t ignored = send(request->client, g_request_continue_reply, sizeof(g_request_continue_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        (void) ignored;
+    }
+
+    return status;
+}
+
+/*!
+ * \fn enum http_error_t request_body_error(body_status_t)
+ * \brief Maps the final state of a request's body to the request's error status.
+ * \param status The body's decoding state.
+ * \return The request's error status.
+ */
+extern enum http_error_t request_body_error(body_status_t status)
+{
+    switch (status) {
+        case BODY_INVALID:  return HTTP_ERROR_BODY_INVALID;
+        case BODY_TOO_LONG: return HTTP_ERROR_BODY_TOO_LONG;
+        default:            return HTTP_ERROR_OK;
+    }
+}
+
+/*!
+ * \fn enum http_error_t request_read(struct request_t *, char **, size_t *, size_t *)
+ * \brief Reads the request's header section into memory.
+ * The bytes received along with the header section might already be part of the body.
  * \param request The request to be read into memory.
  * \param buffer The request's raw buffer.
- * \param length The total request length.
+ * \param length The number of bytes received.
+ * \param size The header section's size, or zero if it has not been completely received.
  * \return The error status for reading the request.
  */
-enum http_error_t request_read(struct request_t *request, char **buffer, size_t *length)
+enum http_error_t request_read(struct request_t *request, char **buffer, size_t *length, size_t *size)
 {
-    size_t offset = 0;
+    size_t capacity = PAGE_SIZE;
+    request_frame_t frame = REQUEST_FRAME_INCOMPLETE;
+
+    *size = 0;
+    *length = 0;
+    *buffer = malloc(sizeof(char) * capacity);
 
-    *buffer = malloc(sizeof(char) * PAGE_SIZE);
-    size_t bytes_read = recv(request->client, *buffer, PAGE_SIZE, 0);
+    while (frame == REQUEST_FRAME_INCOMPLETE) {
+        if (*length + 1 >= capacity)
+            *buffer = realloc(*buffer, sizeof(char) * (capacity *= 2));
 
-    while (bytes_read >= PAGE_SIZE) {
-        offset += bytes_read;
+        ssize_t bytes_read = recv(request->client, *buffer + *length, capacity - *length - 1, 0);
 
-        if (offset + PAGE_SIZE > MAX_REQUEST_SIZE)
-            return HTTP_ERROR_REQUEST_TOO_LONG;
+        if (bytes_read <= 0)
+            break;
 
-        *buffer = realloc(*buffer, sizeof(char) * (offset + PAGE_SIZE));
-        bytes_read = recv(request->client, *buffer + offset, PAGE_SIZE, MSG_DONTWAIT);
+        *length += bytes_read;
+        frame = request_frame(*buffer, *length, size);
     }
 
-    *length = offset + bytes_read;
-    *(*buffer + *length) = (char) 0;
+    if (frame == REQUEST_FRAME_TOO_LONG) {
+        *size = *length;
+        return HTTP_ERROR_REQUEST_TOO_LONG;
+    }
 
     return HTTP_ERROR_OK;
 }
 
 /*!
- * \fn void request_write_response(struct request_t *, struct http_response_t *)
- * \brief Sends a response back to the request client.
- * \param request The request to be responded.
- * \param response The request's response.
+ * \fn body_status_t request_read_body(struct request_t *, body_t *, const char *, size_t)
+ * \brief Receives a request's body, decoding it in fixed-size chunks.
+ * \param request The request whose body is to be received.
+ * \param body The request's body decoder.
+ * \param received The bytes of the body received along with the header section.
+ * \param length The number of bytes received along with the header section.
+ * \return The body's decoding state.
  */
-void request_write_response(struct request_t *request, struct http_response_t *response)
+body_status_t request_read_body(struct request_t *request, body_t *body, const char *received, size_t length)
+{
+    size_t consumed;
+    char chunk[BODY_CHUNK_SIZE];
+    body_status_t status = body_feed(body, received, length, &consumed);
+
+    while (status == BODY_INCOMPLETE) {
+        ssize_t bytes_read = recv(request->client, chunk, sizeof(chunk), 0);
+
+        if (bytes_read <= 0)
+            break;
+
+        status = body_feed(body, chunk, bytes_read, &consumed);
+    }
+
+    return status;
+}
+
+/*!
+ * \fn bool request_wants_close(const struct http_request_t *)
+ * \brief Checks whether the client has asked for its connection to be closed.
+ * \param http_request The client's HTTP request.
+ * \return Must the connection be closed after the response?
+ */
+bool request_wants_close(const struct http_request_t *http_request)
+{
+    for (size_t i = 0; i < http_request->count_headers; ++i)
+        if (strcasecmp(http_request->header[i].key, "Connection") == 0)
+            return strncasecmp(http_request->header[i].value, "close", 5) == 0;
+
+    return false;
+}
+
+/*!
+ * \fn bool request_response_framed(const struct http_response_t *)
+ * \brief Checks whether a response already tells how its content is delimited.
+ * Responses with no content and responses to be revalidated have no content by definition.
+ * \param response The response to be checked.
+ * \return Must the response be sent without announcing a length of its own?
+ */
+bool request_response_framed(const struct http_response_t *response)
+{
+    if (response->status_code == HTTP_RESPONSE_NO_CONTENT || response->status_code == HTTP_RESPONSE_NOT_MODIFIED)
+        return true;
+
+    for (size_t i = 0; i < response->count_headers; ++i)
+        if (strcasecmp(response->header[i].key, "Content-Length") == 0 || strcasecmp(response->header[i].key, "Transfer-Encoding") == 0)
+            return true;
+
+    return false;
+}
+
+/*!
+ * \fn void request_serialize_response(const struct http_response_t *, request_reply_t *)
+ * \brief Serializes the response's status line and headers into the reply's buffer.
+ * \param response The response to be serialized.
+ * \param reply The reply to serialize the response into.
+ */
+void request_serialize_response(const struct http_response_t *response, request_reply_t *reply)
 {
-    char buffer[2048];
     const char *status_str = response_status_string(response->status_code);
+    size_t required = strlen(response->protocol) + strlen(status_str) + 16;
+
+    for (size_t i = 0; i < response->count_headers; ++i)
+        required += strlen(response->header[i].key) + strlen(response->header[i].value) + 4;
+
+    if (required > reply->header_capacity) {
+        reply->header = realloc(reply->header, sizeof(char) * required);
+        reply->header_capacity = required;
+    }
+
+    char *cursor = reply->header;
+    cursor += sprintf(cursor, "%s %d %s\r\n", response->protocol, response->status_code, status_str);
+
+    for (size_t i = 0; i < response->count_headers; ++i)
+        cursor += sprintf(cursor, "%s: %s\r\n", response->header[i].key, response->header[i].value);
+
+    memcpy(cursor, "\r\n", 2);
+    reply->header_length = cursor + 2 - reply->header;
+}
+
+/*!
+ * \fn void request_serialize_prepared(struct http_prepared_t *, request_reply_t *)
+ * \brief Serializes the headers of a prepared response which change from one reply to the next.
+ * Only the `Date` and `Connection` headers are written into the reply's buffer, while the
+ * rest is sent straight from the prepared response, which the reply takes a reference
+ * to, so that the reply can still be sent with a single call.
+ * \param prepared The prepared response to be serialized.
+ * \param reply The reply to serialize the response into.
+ */
+void request_serialize_prepared(struct http_prepared_t *prepared, request_reply_t *reply)
+{
+    const char *date = response_current_date();
+    const char *connection = reply->keepalive ? "keep-alive" : "close";
+    size_t required = strlen(date) + strlen(connection) + 32;
+
+    if (required > reply->header_capacity) {
+        reply->header = realloc(reply->header, sizeof(char) * required);
+        reply->header_capacity = required;
+    }
+
+    atomic_fetch_add(&prepared->references, 1);
+
+    reply->prepared = prepared;
+    reply->header_length = (size_t) sprintf(reply->header, "Date: %s\r\nConnection: %s\r\n\r\n", date, connection);
+}
+
+/*!
+ * \fn void request_reply_serialize(request_reply_t*, struct http_response_t*, logger_entry_t*, logger_writer_t*)
+ * \brief Serializes a response's status line and headers into its reply, and logs it.
+ * The response's content is moved into the reply's body.
+ * \param reply The reply to serialize the response into.
+ * \param http_response The response to be serialized.
+ * \param log_entry The request's log entry, to be completed with the response's status.
+ * \param logger_writer The logger writer instance to log to.
+ */
+void request_reply_serialize(
+    request_reply_t *reply
+  , struct http_response_t *http_response
+  , logger_entry_t *log_entry
+  , logger_writer_t *logger_writer
+) {
+    if (reply->keepalive && http_response->prepared == NULL) {
+        response_update_header(http_response, "Connection", "keep-alive");
+
+        if (http_response->content == NULL && http_response->stream == NULL && http_response->file == NULL && !request_response_framed(http_response))
+            response_update_header(http_response, "Content-Length", "0");
+    }
+
+    if (http_response->prepared != NULL)
+        request_serialize_prepared(http_response->prepared, reply);
+    else
+        request_serialize_response(http_response, reply);
+
+    log_entry->http_code = http_response->status_code;
+    logger_write(logger_writer, log_entry);
+
+    reply->body = http_response->content;
+    reply->body_length = http_response->length;
+    http_response->content = NULL;
+}
+
+/*!
+ * \fn void request_reply_fill(request_reply_t*, enum http_error_t, struct http_request_t*, struct http_response_t*, logger_writer_t*, time_t)
+ * \brief Serializes a request's response into its reply, logs it, and releases them both.
+ * A relayed response is only serialized and logged once its relay has received its head,
+ * so the reply keeps the request's log entry, along with a copy of the request's URI.
+ * \param reply The reply to be produced for the request.
+ * \param error The error status for receiving and parsing the request.
+ * \param http_request The parsed request.
+ * \param http_response The request's response.
+ * \param logger_writer The logger writer instance to log to.
+ * \param t The time the request has been processed at.
+ */
+void request_reply_fill(
+    request_reply_t *reply
+  , enum http_error_t error
+  , struct http_request_t *http_request
+  , struct http_response_t *http_response
+  , logger_writer_t *logger_writer
+  , time_t t
+) {
+    reply->keepalive = reply->keepalive
+        && error == HTTP_ERROR_OK
+        && !request_wants_close(http_request);
+
+    logger_entry_t log_entry = {
+        .level = LOGGER_LEVEL_INFO
+      , .datetime = *localtime(&t)
+      , .http_method = http_request->method
+      , .http_code = http_response->status_code
+      , .http_uri = http_request->uri
+    };
 
-    sprintf(buffer, "%s %d %s\r\n", response->protocol, response->status_code, status_str);
-    send(request->client, buffer, strlen(buffer), MSG_MORE);
+    if (http_response->relay != NULL) {
+        size_t path = strlen(http_request->uri.path) + 1;
+        size_t query = strlen(http_request->uri.query) + 1;
+        char *uri = malloc(sizeof(char) * (path + query));
 
-    for (size_t i = 0; i < response->count_headers; ++i) {
-        sprintf(buffer, "%s: %s\r\n", response->header[i].key, response->header[i].value);
-        send(request->client, buffer, strlen(buffer), MSG_MORE);
+        memcpy(uri, http_request->uri.path, path);
+        memcpy(uri + path, http_request->uri.query, query);
+
+        reply->relayed = log_entry;
+        reply->relayed.http_uri = (struct http_uri_t) { .path = uri, .query = uri + path };
+        reply->relay = http_response->relay;
+        reply->footprint = settings_current()->max_header_size + BODY_CHUNK_SIZE;
+        http_response->relay = NULL;
+    } else {
+        request_reply_serialize(reply, http_response, &log_entry, logger_writer);
+        reply->footprint = reply->body_length;
+    }
+
+    // A file reply only ever holds a single chunk of its file in memory, and only when
+    // its file cannot be sent straight from its descriptor.
+    if (http_response->file != NULL) {
+        reply->file = http_response->file;
+        reply->file_offset = (off_t) http_response->offset;
+        reply->file_length = (off_t) (http_response->offset + http_response->length);
+        reply->body_length = 0;
+        reply->footprint = REQUEST_CHUNK_SIZE;
+        http_response->file = NULL;
+    }
+
+    // A streamed reply's first chunk is produced right away, so that it can be sent
+    // along with the reply's header.
+    if (http_response->stream != NULL) {
+        reply->stream = http_response->stream;
+        reply->body = malloc(sizeof(unsigned char) * REQUEST_CHUNK_BUFFER);
+        reply->footprint = REQUEST_CHUNK_BUFFER;
+        http_response->stream = NULL;
+        request_reply_next(reply);
     }
 
-    send(request->client, "\r\n", 2, MSG_MORE);
-    send(request->client, response->content, response->length, 0);
+    http_request_free(http_request);
+
+    // A prepared response holds nothing but a reference to what has been prepared.
+    if (http_response->prepared != NULL)
+        http_prepared_release(http_response->prepared);
+    else
+        response_free(http_response);
+}
+
+/*!
+ * \fn int request_reply_relay(request_reply_t*, int, bool, logger_writer_t*)
+ * \brief Moves a relayed reply along, as far as it can go without blocking.
+ * Once the relay has received the response's head, the reply is serialized and logged,
+ * and its header and the content received so far are to be sent before the relay is
+ * moved along again. A relay which has failed, or whose deadline has expired, has its
+ * reply replaced by an error reply, and its connection is not kept alive. Neither is a
+ * connection whose relayed content is not delimited. The relay is released as soon as
+ * its content has been relayed.
+ * \param reply The relayed reply to be moved along.
+ * \param client The client's socket.
+ * \param expired Has the relay's deadline expired, while waiting for its upstream server?
+ * \param logger_writer The logger writer instance to log to.
+ * \return Zero once the reply has something to be sent or has been relayed, or -1 on
+ * error or if the relay must wait for its descriptor.
+ */
+extern int request_reply_relay(request_reply_t *reply, int client, bool expired, logger_writer_t *logger_writer)
+{
+    int result = -1;
+    struct http_response_t http_response;
+
+    if (expired)
+        errno = ETIMEDOUT;
+    else
+        result = reply->relay->forward(reply->relay, client);
+
+    if (result == -1 && errno == EAGAIN)
+        return result;
+
+    // Once the head has been sent, the relay is done with as soon as its content is.
+    if (reply->relayed.http_uri.path == NULL) {
+        if (result == 0) {
+            reply->relay->release(reply->relay);
+            reply->relay = NULL;
+        }
+
+        return result;
+    }
+
+    http_response = response_make_relayed(reply->relay, expired ? HTTP_RESPONSE_GATEWAY_TIMEOUT : HTTP_RESPONSE_BAD_GATEWAY);
+
+    if (result == -1) {
+        reply->relay->release(reply->relay);
+        reply->relay = NULL;
+        reply->keepalive = false;
+    } else {
+        reply->keepalive = reply->keepalive && reply->relay->delimited;
+    }
+
+    request_reply_serialize(reply, &http_response, &reply->relayed, logger_writer);
+    free(reply->relayed.http_uri.path);
+    reply->relayed.http_uri.path = NULL;
+
+    if (http_response.prepared != NULL)
+        http_prepared_release(http_response.prepared);
+    else
+        response_free(&http_response);
+
+    return 0;
+}
+
+/*!
+ * \fn void request_respond(request_t*, enum http_error_t, char*, size_t, logger_writer_t*, request_reply_t*)
+ * \brief Processes a received request and produces its serialized reply.
+ * The reply must indicate whether its connection may be kept alive, and that is
+ * updated according to the request. The reply's body is owned by the reply.
+ * \param request The request being processed.
+ * \param error The error status for receiving the request.
+ * \param raw The request's raw contents, which are modified while processing.
+ * \param length The request's raw contents length.
+ * \param logger_writer The logger writer instance to log to.
+ * \param reply The reply to be produced for the request.
+ */
+extern void request_respond(
+    request_t *request
+  , enum http_error_t error
+  , char *raw
+  , size_t length
+  , logger_writer_t *logger_writer
+  , request_reply_t *reply
+) {
+    time_t t = time(NULL);
+    struct http_request_t http_request = http_request_parse(&error, raw, length);
+
+    struct http_response_t http_response = error == HTTP_ERROR_OK
+        ? response_process(&http_request)
+        : response_make_error(error);
+
+    request_reply_fill(reply, error, &http_request, &http_response, logger_writer, t);
+}
+
+/*!
+ * \fn void request_respond_parsed(request_t*, struct http_request_t*, logger_writer_t*, request_reply_t*)
+ * \brief Processes a request which has already been parsed, and produces its serialized reply.
+ * The request must have been detached by `request_respond_cached`, and its raw contents
+ * are freed along with it.
+ * \param request The request being processed.
+ * \param http_request The parsed request.
+ * \param logger_writer The logger writer instance to log to.
+ * \param reply The reply to be produced for the request.
+ */
+extern void request_respond_parsed(
+    request_t *request
+  , struct http_request_t *http_request
+  , logger_writer_t *logger_writer
+  , request_reply_t *reply
+) {
+    time_t t = time(NULL);
+    char *raw = http_request->raw;
+    struct http_response_t http_response = response_process(http_request);
+
+    request_reply_fill(reply, HTTP_ERROR_OK, http_request, &http_response, logger_writer, t);
+    free(raw);
+}
+
+/*!
+ * \fn bool request_respond_cached(request_t*, enum http_error_t, const char*, size_t, body_t*, logger_writer_t*, request_reply_t*, struct http_request_t*)
+ * \brief Produces a received request's serialized reply, only if it can be done without blocking.
+ * The request is parsed from a copy of its raw contents, which are left untouched, so
+ * that it can still be processed with `request_respond` when it cannot be answered. A
+ * request whose body is still to be received is only answered if its body is taken over
+ * by its response, which then receives the body by itself. A request which cannot be
+ * answered may instead be detached, so that it can be processed by another thread with
+ * `request_respond_parsed`, without being parsed again.
+ * \param request The request being processed.
+ * \param error The error status for receiving the request.
+ * \param raw The request's raw contents.
+ * \param length The request's raw contents length.
+ * \param body The request's body decoder, if its body is still to be received.
+ * \param logger_writer The logger writer instance to log to.
+ * \param reply The reply to be produced for the request.
+ * \param detached The request, detached when it cannot be answered, or NULL to leave it.
+ * \return Has the reply been produced?
+ */
+extern bool request_respond_cached(
+    request_t *request
+  , enum http_error_t error
+  , const char *raw
+  , size_t length
+  , body_t *body
+  , logger_writer_t *logger_writer
+  , request_reply_t *reply
+  , struct http_request_t *detached
+) {
+    time_t t = time(NULL);
+    struct http_response_t http_response;
+    char *copy = arena_malloc(sizeof(char) * (length + 1));
+
+    memcpy(copy, raw, length);
+    copy[length] = '\0';
+
+    struct http_request_t http_request = http_request_parse(&error, copy, length);
+    http_request.body = body;
+
+    if (error == HTTP_ERROR_OK && !response_process_cached(&http_request, &http_response)) {
+        if (detached != NULL)
+            *detached = http_request_detach(&http_request, length);
+
+        http_request_free(&http_request);
+        arena_free(copy);
+        return false;
+    }
+
+    if (error != HTTP_ERROR_OK)
+        http_response = response_make_error(error);
+
+    request_reply_fill(reply, error, &http_request, &http_response, logger_writer, t);
+    arena_free(copy);
+
+    return true;
+}
+
+/*!
+ * \fn bool request_reply_read(request_reply_t *)
+ * \brief Reads the next chunk of a file reply, replacing the chunk already sent.
+ * A file which can no longer be read, or which has shrunk, cannot complete its reply,
+ * whose length has already been announced, so its connection must not be kept alive.
+ * \param reply The reply whose next chunk must be read.
+ * \return Has a chunk been read?
+ */
+bool request_reply_read(request_reply_t *reply)
+{
+    if (reply->file_offset >= reply->file_length)
+        return false;
+
+    if (reply->body == NULL)
+        reply->body = malloc(sizeof(unsigned char) * REQUEST_CHUNK_SIZE);
+
+    size_t size = reply->file_length - reply->file_offset < REQUEST_CHUNK_SIZE
+        ? (size_t) (reply->file_length - reply->file_offset)
+        : REQUEST_CHUNK_SIZE;
+
+    ssize_t length = pread(reply->file->fd, reply->body, size, reply->file_offset);
+
+    if (length <= 0) {
+        reply->file_offset = reply->file_length;
+        reply->keepalive = false;
+        return false;
+    }
+
+    reply->file_offset += length;
+    reply->body_length = (size_t) length;
+    return true;
+}
+
+/*!
+ * \fn ssize_t request_reply_sendfile(request_reply_t *, int)
+ * \brief Sends what is left of a file reply's file, straight from its descriptor.
+ * The file's contents are never copied into the server, and are sent from the page cache.
+ * \param reply The file reply being sent.
+ * \param client The socket to send the file through.
+ * \return The number of bytes sent, or -1 on error.
+ */
+extern ssize_t request_reply_sendfile(request_reply_t *reply, int client)
+{
+    ssize_t sent = sendfile(client, reply->file->fd, &reply->file_offset, (size_t) (reply->file_length - reply->file_offset));
+
+    if (sent == 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return sent;
+}
+
+/*!
+ * \fn size_t request_reply_size(const request_reply_t *)
+ * \brief Informs how many bytes of a reply are held in memory, in all of its parts.
+ * \param reply The reply being sent.
+ * \return The number of bytes of the reply held in memory.
+ */
+extern size_t request_reply_size(const request_reply_t *reply)
+{
+    size_t prepared = reply->prepared != NULL ? reply->prepared->length : 0;
+    return prepared + reply->header_length + reply->body_length;
+}
+
+/*!
+ * \fn size_t request_reply_gather(const request_reply_t *, size_t, struct iovec *)
+ * \brief Points to the parts of a reply held in memory which are still to be sent.
+ * \param reply The reply being sent.
+ * \param sent The number of bytes of the reply already sent.
+ * \param iov The parts left to be sent, of which there are up to REQUEST_REPLY_PARTS.
+ * \return The number of parts left to be sent.
+ */
+extern size_t request_reply_gather(const request_reply_t *reply, size_t sent, struct iovec *iov)
+{
+    size_t count = 0;
+    const struct http_prepared_t *prepared = reply->prepared;
+    size_t head = prepared != NULL ? prepared->header_length : 0;
+
+    struct iovec part[REQUEST_REPLY_PARTS] = {
+        { prepared != NULL ? prepared->data : NULL, head }
+      , { reply->header, reply->header_length }
+      , { prepared != NULL ? prepared->data + head : NULL, prepared != NULL ? prepared->length - head : 0 }
+      , { reply->body, reply->body_length }
+    };
+
+    for (size_t i = 0; i < REQUEST_REPLY_PARTS; ++i) {
+        if (sent >= part[i].iov_len) {
+            sent -= part[i].iov_len;
+            continue;
+        }
+
+        iov[count++] = (struct iovec) { (char*) part[i].iov_base + sent, part[i].iov_len - sent };
+        sent = 0;
+    }
+
+    return count;
+}
+
+/*!
+ * \fn bool request_reply_next(request_reply_t *)
+ * \brief Produces the next chunk of a streamed reply, replacing the chunk already sent.
+ * Chunk sizes are written with a fixed number of digits, so that the content can be
+ * produced directly into place. The stream is released as soon as it has ended. A file
+ * reply's chunks are read from its file, when the file is not sent from its descriptor.
+ * \param reply The reply whose next chunk must be produced.
+ * \return Has a chunk been produced, or has the reply been completely sent?
+ */
+extern bool request_reply_next(request_reply_t *reply)
+{
+    static const char terminator[] = "0\r\n\r\n";
+    char prefix[REQUEST_CHUNK_PREFIX + 1];
+
+    if (reply->file != NULL)
+        return request_reply_read(reply);
+
+    if (reply->stream == NULL)
+        return false;
+
+    size_t length = reply->stream->produce(reply->stream, reply->body + REQUEST_CHUNK_PREFIX, REQUEST_CHUNK_SIZE);
+
+    if (length == 0) {
+        reply->stream->release(reply->stream);
+        reply->stream = NULL;
+
+        memcpy(reply->body, terminator, sizeof(terminator) - 1);
+        reply->body_length = sizeof(terminator) - 1;
+        return true;
+    }
+
+    snprintf(prefix, sizeof(prefix), "%08x\r\n", (unsigned) length);
+    memcpy(reply->body, prefix, REQUEST_CHUNK_PREFIX);
+    memcpy(reply->body + REQUEST_CHUNK_PREFIX + length, "\r\n", 2);
+
+    reply->body_length = REQUEST_CHUNK_PREFIX + length + 2;
+    return true;
+}
+
+/*!
+ * \fn void request_reply_release(request_reply_t *)
+ * \brief Releases the reply's body once it has been sent.
+ * The reply's header buffer is kept, so that it can be reused by the next reply.
+ * \param reply The reply to be released.
+ */
+extern void request_reply_release(request_reply_t *reply)
+{
+    if (reply->stream != NULL)
+        reply->stream->release(reply->stream);
+
+    if (reply->file != NULL)
+        file_release(reply->file);
+
+    if (reply->relay != NULL)
+        reply->relay->release(reply->relay);
+
+    if (reply->prepared != NULL)
+        http_prepared_release(reply->prepared);
+
+    free(reply->body);
+    free(reply->relayed.http_uri.path);
+
+    reply->body = NULL;
+    reply->stream = NULL;
+    reply->file = NULL;
+    reply->relay = NULL;
+    reply->prepared = NULL;
+    reply->relayed.http_uri.path = NULL;
+    reply->body_length = 0;
+    reply->footprint = 0;
+    reply->header_length = 0;
+}
+
+/*!
+ * \fn int request_relay_block(struct request_t *, request_reply_t *, logger_writer_t *)
+ * \brief Moves a relayed reply along, blocking until it has something to be sent or has been relayed.
+ * The client's socket is made non-blocking while the relay is moved along, so that it is
+ * only ever waited for when the relay asks for it. The relay never waits longer than the
+ * proxy timeout for its upstream server, nor than the body or write deadline for its client.
+ * \param request The request being responded.
+ * \param reply The request's relayed reply.
+ * \param logger_writer The logger writer instance to log to.
+ * \return Zero once the reply has something to be sent or has been relayed, or -1 on error.
+ */
+int request_relay_block(struct request_t *request, request_reply_t *reply, logger_writer_t *logger_writer)
+{
+    int result;
+    bool expired = false;
+    const settings_t *settings = settings_current();
+    int flags = fcntl(request->client, F_GETFL);
+
+    fcntl(request->client, F_SETFL, flags | O_NONBLOCK);
+
+    while ((result = request_reply_relay(reply, request->client, expired, logger_writer)) == -1 && errno == EAGAIN) {
+        struct pollfd ready = { .fd = reply->relay->fd, .events = reply->relay->events };
+        bool upstream = ready.fd != request->client;
+
+        int timeout = (int) (upstream ? settings->proxy_timeout
+            : ready.events == POLLIN ? settings->timeout_body : settings->timeout_write);
+
+        int polled = poll(&ready, 1, timeout);
+
+        if (polled == 0 && !upstream)
+            break;
+
+        expired = polled == 0;
+    }
+
+    fcntl(request->client, F_SETFL, flags);
+    return result;
+}
+
+/*!
+ * \fn void request_write_reply(struct request_t *, request_reply_t *, logger_writer_t *)
+ * \brief Sends a reply back to the request client.
+ * The parts of the reply held in memory are sent together with a single call, and with
+ * MSG_MORE when more follows them, so that they leave in the same segment as the start of
+ * what follows. When corking is enabled, the whole reply is corked instead, so that no
+ * partial segment is sent until the reply is complete, even when the body is sent by
+ * many calls. A streamed reply's chunks are produced one at a time, as the previous
+ * one has been sent, while a file reply's file is sent straight from its descriptor. A
+ * relayed reply is only serialized once its relay has received its head, and its
+ * connection is not kept alive unless its content has been completely relayed.
+ * \param request The request to be responded.
+ * \param reply The request's serialized reply.
+ * \param logger_writer The logger writer instance to log to.
+ */
+void request_write_reply(struct request_t *request, request_reply_t *reply, logger_writer_t *logger_writer)
+{
+    size_t count;
+    ssize_t sent = 0;
+    size_t offset = 0;
+    struct iovec iov[REQUEST_REPLY_PARTS];
+    int cork = (int) settings_current()->cork;
+
+    if (reply->relay != NULL && request_relay_block(request, reply, logger_writer) != 0) {
+        reply->keepalive = false;
+        return;
+    }
+
+    int more = reply->file != NULL || reply->stream != NULL || reply->relay != NULL ? MSG_MORE : 0;
+
+    if (cork)
+        setsockopt(request->client, IPPROTO_TCP, TCP_CORK, &cork, sizeof(int));
+
+    while (sent >= 0 && (count = request_reply_gather(reply, offset, iov)) > 0) {
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+        offset += (sent = sendmsg(request->client, &message, more | MSG_NOSIGNAL)) > 0 ? (size_t) sent : 0;
+    }
+
+    while (sent >= 0 && reply->file != NULL && reply->file_offset < reply->file_length)
+        sent = request_reply_sendfile(reply, request->client);
+
+    while (sent >= 0 && request_reply_next(reply))
+        for (offset = 0; offset < reply->body_length && sent >= 0; offset += sent)
+            sent = send(request->client, reply->body + offset, reply->body_length - offset, MSG_NOSIGNAL);
+
+    if (sent >= 0 && reply->relay != NULL)
+        sent = request_relay_block(request, reply, logger_writer);
+
+    if (sent < 0)
+        reply->keepalive = false;
+
+    if (cork) {
+        cork = 0;
+        setsockopt(request->client, IPPROTO_TCP, TCP_CORK, &cork, sizeof(int));
+    }
+}
+
+/*
+ * The replies sent to rejected clients. The replies are serialized at compile time,
+ * so that rejecting a client costs as little as possible when the server can least
+ * afford it.
+ */
+#define REQUEST_REJECTION_REPLY(status)             \
+    "HTTP/1.1 " status "\r\n"                       \
+    "Connection: close\r\n"                         \
+    "Server: μHTTPd Webserver\r\n"                  \
+    "Retry-After: " RETRY_AFTER "\r\n"              \
+    "Content-Length: 0\r\n"                         \
+    "\r\n"
+
+static const char g_request_overloaded_reply[] = REQUEST_REJECTION_REPLY("503 Service Unavailable");
+static const char g_request_limited_reply[] = REQUEST_REJECTION_REPLY("429 Too Many Requests");
+
+/*!
+ * \fn void request_reject(const request_t*, enum http_code_t)
+ * \brief Rejects a request, either as the server is overloaded or the client is limited.
+ * The request is not read, and the reply is sent without ever blocking on the client.
+ * \param request The request to be rejected.
+ * \param code The rejection's status code.
+ */
+extern void request_reject(const request_t *request, enum http_code_t code)
+{
+    ssize_t ignored = code == HTTP_RESPONSE_TOO_MANY_REQUESTS
+        ? send(request->client, g_request_limited_reply, sizeof(g_request_limited_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL)
+        : send(request->client, g_request_overloaded_reply, sizeof(g_request_overloaded_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    (void) ignored;
+}
+
+/*!
+ * \var g_request_memory
+ * \brief The memory held by the requests being processed by blocking workers.
+ * Event loops account for their connections' memory by themselves.
+ * \since 3.0
+ */
+static atomic_size_t g_request_memory = 0;
+
+/*!
+ * \fn size_t request_memory()
+ * \brief Informs how much memory is held by the requests being processed by blocking workers.
+ * \return The memory held by the requests, in bytes.
+ */
+extern size_t request_memory()
+{
+    return atomic_load_explicit(&g_request_memory, memory_order_relaxed);
+}
+
+/*!
+ * \fn void request_memory_hold(size_t*, size_t)
+ * \brief Accounts for memory held by a request being processed by a blocking worker.
+ * \param held The memory already held by the request, which is updated.
+ * \param amount The memory the request holds on top of it.
+ */
+void request_memory_hold(size_t *held, size_t amount)
+{
+    atomic_fetch_add_explicit(&g_request_memory, amount, memory_order_relaxed);
+    *held += amount;
+}
+
+/*!
+ * \fn void request_memory_release(size_t)
+ * \brief Releases the memory held by a request processed by a blocking worker.
+ * \param held The memory held by the request.
+ */
+void request_memory_release(size_t held)
+{
+    atomic_fetch_sub_explicit(&g_request_memory, held, memory_order_relaxed);
 }
 
 /*!
  * \fn void request_process(request_t*, logger_writer_t*)
  * \brief Processes a request and sends a response to user.
+ * The memory held by the request and its reply is accounted for while the request is
+ * processed, so that the server can stop accepting clients while over its budget.
  * \param request The request to be processed.
  * \param logger_writer The logger writer instance to log to.
  */
 extern void request_process(request_t *request, logger_writer_t *logger_writer)
 {
-    size_t length;
+    body_t body;
+    size_t held = 0;
+    size_t length, size;
     char *request_buffer;
-    time_t t = time(NULL);
+    request_reply_t reply = { .keepalive = false };
 
-    enum http_error_t error = request_read(request, &request_buffer, &length);
-    struct http_request_t http_request = http_request_parse(&error, request_buffer, length);
+    enum http_error_t error = request_read(request, &request_buffer, &length, &size);
+    request_memory_hold(&held, length);
 
-    struct http_response_t http_response = error == HTTP_ERROR_OK
-        ? response_process(&http_request)
-        : response_make_error(error);
+    if (error == HTTP_ERROR_OK && size > 0) {
+        body_status_t status = request_body_start(request, &body, request_buffer, size);
 
-    logger_entry_t log_entry = {
-        .level = LOGGER_LEVEL_INFO
-      , .datetime = *localtime(&t)
-      , .http_method = http_request.method
-      , .http_code = http_response.status_code
-      , .http_uri = http_request.uri
-    };
+        // A request whose body is taken over by its reply receives the body while sent.
+        if (status == BODY_INCOMPLETE && request_respond_cached(request, error, request_buffer, size, &body, logger_writer, &reply, NULL)) {
+            size_t consumed;
+            body_feed(&body, request_buffer + size, length - size, &consumed);
+            request_memory_hold(&held, reply.footprint + reply.header_capacity);
+            request_write_reply(request, &reply, logger_writer);
+
+            request_reply_release(&reply);
+            request_memory_release(held);
+            free(reply.header);
+            free(request_buffer);
+            return;
+        }
+
+        if (status == BODY_INCOMPLETE)
+            status = request_read_body(request, &body, request_buffer + size, length - size);
+
+        size = status != BODY_INCOMPLETE ? size : 0;
+        error = request_body_error(status);
+    }
+
+    // A client which has not sent its whole request before its deadline, or which has
+    // closed its connection before doing so, is not worth a reply.
+    if (error == HTTP_ERROR_OK && size == 0) {
+        request_memory_release(held);
+        free(request_buffer);
+        return;
+    }
 
-    request_write_response(request, &http_response);
-    logger_write(logger_writer, &log_entry);
+    request_buffer[size] = (char) 0;
+    request_respond(request, error, request_buffer, size, logger_writer, &reply);
+    request_memory_hold(&held, reply.footprint + reply.header_capacity);
+    request_write_reply(request, &reply, logger_writer);
 
-    http_request_free(&http_request);
-    response_free(&http_response);
+    request_reply_release(&reply);
+    request_memory_release(held);
+    free(reply.header);
+    free(request_buffer);
 }
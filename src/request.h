@@ -7,8 +7,14 @@
 #ifndef MU_HTTPD_REQUEST_H
 #define MU_HTTPD_REQUEST_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
+#include "body.h"
+#include "file.h"
+#include "http.h"
 #include "server.h"
 #include "logger.h"
 
@@ -19,13 +25,78 @@
  */
 typedef struct request_t {
     socket_id_t client;
-    struct sockaddr_in origin;
+    struct sockaddr_storage origin;
 } request_t;
 
+/*!
+ * \enum request_frame_t
+ * \brief The states of a request's header section being received from a client.
+ * \since 3.0
+ */
+typedef enum request_frame_t {
+    REQUEST_FRAME_INCOMPLETE = 0
+  , REQUEST_FRAME_COMPLETE
+  , REQUEST_FRAME_TOO_LONG
+} request_frame_t;
+
+/*!
+ * \struct request_reply_t
+ * \brief A serialized response, ready to be sent back to a client.
+ * The body of a streamed reply only holds its current chunk, already framed. Once it
+ * has been sent, the reply's next chunk replaces it, until the stream has ended. A file
+ * reply is sent from its open file, from its offset up to its length, after its header.
+ * A relayed reply keeps its request's log entry until its relay has received its head,
+ * when the reply is serialized and logged. A prepared reply is sent straight from the
+ * prepared response it holds a reference to, and its own header only holds its `Date`
+ * and `Connection` headers, which are sent in between the prepared headers and content.
+ * \since 3.0
+ */
+typedef struct request_reply_t {
+    char *header;
+    size_t header_length;
+    size_t header_capacity;
+    unsigned char *body;
+    size_t body_length;
+    size_t footprint;
+    struct http_stream_t *stream;
+    file_t *file;
+    off_t file_offset;
+    off_t file_length;
+    struct http_relay_t *relay;
+    struct http_prepared_t *prepared;
+    logger_entry_t relayed;
+    bool keepalive;
+} request_reply_t;
+
+/*
+ * The most parts a reply held in memory is sent in: the prepared headers, the reply's own
+ * header, the prepared content and the reply's own body.
+ */
+#define REQUEST_REPLY_PARTS 4
+
 /*
  * Forward declaration of request processing function.
  * This function is responsible for truly processing a request.
  */
 extern void request_process(request_t *, logger_writer_t*);
+extern void request_reject(const request_t*, enum http_code_t);
+extern size_t request_memory();
+
+/*
+ * Forward declaration of request processing steps.
+ * These functions allow requests to be processed without blocking on their clients.
+ */
+extern request_frame_t request_frame(const char*, size_t, size_t*);
+extern body_status_t request_body_start(const request_t*, body_t*, const char*, size_t);
+extern enum http_error_t request_body_error(body_status_t);
+extern void request_respond(request_t*, enum http_error_t, char*, size_t, logger_writer_t*, request_reply_t*);
+extern void request_respond_parsed(request_t*, struct http_request_t*, logger_writer_t*, request_reply_t*);
+extern bool request_respond_cached(request_t*, enum http_error_t, const char*, size_t, body_t*, logger_writer_t*, request_reply_t*, struct http_request_t*);
+extern size_t request_reply_size(const request_reply_t*);
+extern size_t request_reply_gather(const request_reply_t*, size_t, struct iovec*);
+extern bool request_reply_next(request_reply_t*);
+extern ssize_t request_reply_sendfile(request_reply_t*, int);
+extern int request_reply_relay(request_reply_t*, int, bool, logger_writer_t*);
+extern void request_reply_release(request_reply_t*);
 
 #endif
@@ -4,25 +4,88 @@
  * must produce a request for the client.
  * \author Rodrigo Siqueira <rodriados@gmail.com>
  */
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 
 #include "http.h"
+#include "arena.h"
+#include "asset.h"
 #include "config.h"
+#include "file.h"
+#include "listing.h"
+#include "missing.h"
+#include "pack.h"
+#include "proxy.h"
+#include "router.h"
+#include "settings.h"
+#include "vhost.h"
 #include "response.h"
 
-bool response_check_moved_object(char *, const char *);
-bool response_check_public_object(char *, const char *);
+/*!
+ * \struct response_redirect_t
+ * \brief A permanent redirection, from the path it was moved from to its new location.
+ * \since 3.0
+ */
+typedef struct response_redirect_t {
+    char *origin;
+    char *target;
+    size_t position;
+} response_redirect_t;
+
+/*!
+ * \struct response_moved_t
+ * \brief The permanent redirections of a host, as read from its file, sorted by origin.
+ * The redirections are only read again when any watched directory has changed, and the
+ * redirections file itself is found to have changed. The tables replaced are kept until
+ * the server stops, as other threads may still be looking paths up in them.
+ * \since 3.0
+ */
+typedef struct response_moved_t {
+    _Atomic uint64_t generation;
+    struct stat status;
+    response_redirect_t *redirect;
+    size_t count;
+    struct response_moved_t *retired;
+} response_moved_t;
+
+/*!
+ * \var g_response_moved
+ * \brief The permanent redirections currently in effect, for each host's partition.
+ * \since 3.0
+ */
+static _Atomic(response_moved_t *) g_response_moved[MAX_VIRTUAL_HOSTS + 1];
+
+/*!
+ * \var g_response_moved_lock
+ * \brief The lock for reading the permanent redirections again.
+ * \since 3.0
+ */
+static pthread_mutex_t g_response_moved_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool response_resolve(struct http_request_t *, bool, struct http_response_t *);
+const response_moved_t *response_moved_current(const vhost_t *, uint64_t, bool);
+bool response_check_moved_object(const response_moved_t *, char *, const char *);
+file_t *response_check_public_object(const char *, size_t);
 struct http_response_t response_make_error_view(enum http_code_t);
+struct http_response_t response_make_file_view(enum http_code_t, file_t *, const char *);
 struct http_response_t response_make_moved_view(const char *);
-struct http_response_t response_make_object_view(const char *);
+struct http_response_t response_make_object_view(file_t *, const char *, const char *, size_t);
+bool response_resolve_pack(const pack_t *, const struct http_request_t *, bool, struct http_response_t *);
+bool response_path_escapes(const char *);
+bool response_resolve_static(const router_route_t *, struct http_request_t *, bool, struct http_response_t *);
+bool response_resolve_proxy(const router_route_t *, const struct http_request_t *, struct http_response_t *);
 
 /*!
  * \fn struct http_response_t response_process(struct http_request_t *)
@@ -32,18 +95,207 @@ struct http_response_t response_make_object_view(const char *);
  */
 struct http_response_t response_process(struct http_request_t *http_request)
 {
+    struct http_response_t response;
+
+    response_resolve(http_request, true, &response);
+    return response;
+}
+
+/*!
+ * \fn bool response_process_cached(struct http_request_t *, struct http_response_t *)
+ * \brief Processes a HTTP request only if it can be answered without blocking.
+ * Requests are answered right away from the caches and the bundle, and from files whose
+ * responses have been prepared or which are sent straight from their descriptors. Any
+ * other request must be processed with `response_process` instead.
+ * \param http_request The HTTP request to be processed.
+ * \param response The produced HTTP response, if any.
+ * \return Has the request been answered?
+ */
+extern bool response_process_cached(struct http_request_t *http_request, struct http_response_t *response)
+{
+    return response_resolve(http_request, false, response);
+}
+
+/*!
+ * \fn bool response_check_cached_object(const char *, size_t, struct http_response_t *)
+ * \brief Creates a HTTP response of a public file, if it can be made from the cache alone.
+ * \param target The final target name.
+ * \param partition The file cache's partition of the requested host.
+ * \param response The created HTTP response, if any.
+ * \return Has the response been created?
+ */
+bool response_check_cached_object(const char *target, size_t partition, struct http_response_t *response)
+{
+    file_t *object = file_lookup(target, partition);
+
+    if (object == NULL)
+        return false;
+
+    if (S_ISREG(object->status.st_mode) && (atomic_load(&object->prepared) != NULL || object->status.st_size > FILE_INLINE_SIZE)) {
+        *response = response_make_file_view(HTTP_RESPONSE_OK, object, target);
+        return true;
+    }
+
+    file_release(object);
+    return false;
+}
+
+/*!
+ * \fn bool response_resolve(struct http_request_t *, bool, struct http_response_t *)
+ * \brief Processes a HTTP request, unless it must block when it is not allowed to.
+ * Requests are dispatched by the route they match. Paths which are routed, but not for
+ * the request's method, are answered as if the method were not implemented. Requests
+ * whose body is still to be received are only answered if they are to be forwarded.
+ * \param http_request The HTTP request to be processed.
+ * \param blocking May the request be processed with blocking filesystem accesses?
+ * \param response The produced HTTP response, if any.
+ * \return Has the request been answered?
+ */
+bool response_resolve(struct http_request_t *http_request, bool blocking, struct http_response_t *response)
+{
+    bool routed;
+    char location[BUFFER_SIZE];
+    const router_route_t *route = router_match(http_request->uri.path, http_request->method, &routed);
+
+    // A body still to be received is only taken over by proxy routes, which forward it.
+    if (http_request->body != NULL && (route == NULL || route->kind != ROUTER_PROXY))
+        return false;
+
+    if (route == NULL) {
+        *response = response_make_error_view(routed ? HTTP_RESPONSE_NOT_IMPLEMENTED : HTTP_RESPONSE_NOT_FOUND);
+        return true;
+    }
+
+    switch (route->kind) {
+        case ROUTER_REDIRECT: {
+            const char *remainder = router_remainder(route, http_request->uri.path);
+            size_t length = strlen(route->argument);
+
+            if (length > 0 && route->argument[length - 1] == '/' && remainder[0] == '/')
+                ++remainder;
+
+            snprintf(location, sizeof(location), "%s%s", route->argument, remainder);
+            *response = response_make_moved_view(location);
+            return true;
+        }
+
+        case ROUTER_ERROR:
+            *response = response_make_error_view(route->status);
+            return true;
+
+        case ROUTER_HANDLER:
+            *response = route->handler(http_request);
+            return true;
+
+        case ROUTER_PROXY:
+            return response_resolve_proxy(route, http_request, response);
+
+        default:
+            return response_resolve_static(route, http_request, blocking, response);
+    }
+}
+
+/*!
+ * \fn const vhost_t *response_find_host(const struct http_request_t *)
+ * \brief Finds the virtual host a HTTP request has been sent to.
+ * \param http_request The HTTP request to find the host of.
+ * \return The request's virtual host, or NULL if it is for the default host.
+ */
+const vhost_t *response_find_host(const struct http_request_t *http_request)
+{
+    if (vhost_count() == 0)
+        return NULL;
+
+    for (size_t i = 0; i < http_request->count_headers; ++i)
+        if (strcasecmp(http_request->header[i].key, "Host") == 0)
+            return vhost_find(http_request->header[i].value);
+
+    return NULL;
+}
+
+/*!
+ * \fn bool response_path_escapes(const char *)
+ * \brief Checks whether a decoded path has a `..` segment, which would climb out of the
+ * folder the path is looked up in.
+ * \param path The decoded path to be checked.
+ * \return Does the path have a parent directory segment?
+ */
+bool response_path_escapes(const char *path)
+{
+    for (const char *segment = path; segment != NULL; segment = strchr(segment, '/')) {
+        segment += segment[0] == '/';
+
+        if (segment[0] == '.' && segment[1] == '.' && (segment[2] == '/' || segment[2] == '\0'))
+            return true;
+    }
+
+    return false;
+}
+
+/*!
+ * \fn bool response_resolve_static(const router_route_t *, struct http_request_t *, bool, struct http_response_t *)
+ * \brief Processes a HTTP request for a static route, unless it must block when it is not allowed to.
+ * The requested path, past the route's prefix, is looked up in the route's folder, or
+ * in the folder of the host the request has been sent to, with the host's redirections
+ * and through its partition of the file cache.
+ * \param route The static route the request has matched.
+ * \param http_request The HTTP request to be processed.
+ * \param blocking May the request be processed with blocking filesystem accesses?
+ * \param response The produced HTTP response, if any.
+ * \return Has the request been answered?
+ */
+bool response_resolve_static(const router_route_t *route, struct http_request_t *http_request, bool blocking, struct http_response_t *response)
+{
+    file_t *object;
+    uint64_t generation;
+    const response_moved_t *moved;
     char target[BUFFER_SIZE];
+    char location[BUFFER_SIZE];
+
+    // Paths are joined with the folder of their host or route as they are, so a parent
+    // directory segment would reach into another host's folder, or out of them all.
+    if (response_path_escapes(http_request->uri.path)) {
+        *response = response_make_error_view(HTTP_RESPONSE_BAD_REQUEST);
+        return true;
+    }
 
-    if (http_request->method & ~(HTTP_GET | HTTP_POST))
-        return response_make_error_view(HTTP_RESPONSE_NOT_IMPLEMENTED);
+    if (pack_current() != NULL)
+        return response_resolve_pack(pack_current(), http_request, blocking, response);
 
-    if (response_check_moved_object(target, http_request->uri.path))
-        return response_make_moved_view(target);
+    const vhost_t *host = response_find_host(http_request);
+    const char *folder = route->argument != NULL ? route->argument : host != NULL ? host->folder : settings_current()->public_folder;
+    size_t partition = host != NULL ? host->partition : 0;
 
-    if (response_check_public_object(target, http_request->uri.path))
-        return response_make_object_view(target);
+    snprintf(target, BUFFER_SIZE, "%s%s", folder, router_remainder(route, http_request->uri.path));
+
+    if (missing_check(target, &generation)) {
+        *response = response_make_error_view(HTTP_RESPONSE_NOT_FOUND);
+        return true;
+    }
+
+    if ((moved = response_moved_current(host, generation, blocking)) == NULL)
+        return false;
+
+    if (response_check_moved_object(moved, location, http_request->uri.path)) {
+        *response = response_make_moved_view(location);
+        return true;
+    }
 
-    return response_make_error_view(HTTP_RESPONSE_NOT_FOUND);
+    if (!blocking)
+        return response_check_cached_object(target, partition, response);
+
+    if ((object = response_check_public_object(target, partition)) != NULL) {
+        *response = response_make_object_view(object, target, http_request->uri.query, partition);
+        return true;
+    }
+
+    // Only paths which really do not exist are remembered as missing, so that a failure
+    // to open an existing file, such as from running out of descriptors, is not kept.
+    if (errno == ENOENT || errno == ENOTDIR)
+        missing_insert(target, generation);
+
+    *response = response_make_error_view(HTTP_RESPONSE_NOT_FOUND);
+    return true;
 }
 
 /*!
@@ -62,8 +314,12 @@ struct http_response_t response_make_error(enum http_error_t error)
         case HTTP_ERROR_URI_TOO_LONG:
         case HTTP_ERROR_REQUEST_TOO_LONG:
         case HTTP_ERROR_HEADERS_EMPTY:
+        case HTTP_ERROR_BODY_INVALID:
             return response_make_error_view(HTTP_RESPONSE_BAD_REQUEST);
 
+        case HTTP_ERROR_BODY_TOO_LONG:
+            return response_make_error_view(HTTP_RESPONSE_PAYLOAD_TOO_LARGE);
+
         case HTTP_ERROR_PROTOCOL_INVALID:
             return response_make_error_view(HTTP_RESPONSE_VERSION_NOT_SUPPORTED);
 
@@ -82,11 +338,32 @@ const char *response_status_string(enum http_code_t code)
 {
     switch (code) {
         case HTTP_RESPONSE_OK:                    return "Ok";
+        case HTTP_RESPONSE_CREATED:               return "Created";
+        case HTTP_RESPONSE_ACCEPTED:              return "Accepted";
+        case HTTP_RESPONSE_NO_CONTENT:            return "No Content";
+        case HTTP_RESPONSE_PARTIAL_CONTENT:       return "Partial Content";
         case HTTP_RESPONSE_MOVED_PERMANENTLY:     return "Moved Permanently";
+        case HTTP_RESPONSE_FOUND:                 return "Found";
+        case HTTP_RESPONSE_SEE_OTHER:             return "See Other";
+        case HTTP_RESPONSE_NOT_MODIFIED:          return "Not Modified";
+        case HTTP_RESPONSE_TEMPORARY_REDIRECT:    return "Temporary Redirect";
+        case HTTP_RESPONSE_PERMANENT_REDIRECT:    return "Permanent Redirect";
         case HTTP_RESPONSE_BAD_REQUEST:           return "Bad Request";
+        case HTTP_RESPONSE_UNAUTHORIZED:          return "Unauthorized";
+        case HTTP_RESPONSE_FORBIDDEN:             return "Forbidden";
         case HTTP_RESPONSE_NOT_FOUND:             return "Not Found";
+        case HTTP_RESPONSE_METHOD_NOT_ALLOWED:    return "Method Not Allowed";
+        case HTTP_RESPONSE_CONFLICT:              return "Conflict";
+        case HTTP_RESPONSE_GONE:                  return "Gone";
+        case HTTP_RESPONSE_PAYLOAD_TOO_LARGE:     return "Payload Too Large";
+        case HTTP_RESPONSE_UNSUPPORTED_MEDIA:     return "Unsupported Media Type";
+        case HTTP_RESPONSE_UNPROCESSABLE_CONTENT: return "Unprocessable Content";
+        case HTTP_RESPONSE_TOO_MANY_REQUESTS:     return "Too Many Requests";
         case HTTP_RESPONSE_INTERNAL_SERVER_ERROR: return "Internal Server Error";
         case HTTP_RESPONSE_NOT_IMPLEMENTED:       return "Not Implemented";
+        case HTTP_RESPONSE_BAD_GATEWAY:           return "Bad Gateway";
+        case HTTP_RESPONSE_SERVICE_UNAVAILABLE:   return "Service Unavailable";
+        case HTTP_RESPONSE_GATEWAY_TIMEOUT:       return "Gateway Timeout";
         case HTTP_RESPONSE_VERSION_NOT_SUPPORTED: return "HTTP Version Not Supported";
         default:                                  return "Unknown";
     }
@@ -96,26 +373,26 @@ void response_add_header(struct http_response_t *, const char *, const char *);
 void response_update_header(struct http_response_t *, const char *, const char *);
 void response_add_common_headers(struct http_response_t *);
 void response_add_file_header(struct http_response_t *, const char *, size_t);
+void response_add_etag_header(struct http_response_t *, const file_t *);
+struct http_prepared_t *response_prepare(const struct http_response_t *);
 
 /*!
- * \fn char *response_read_file(const char *, size_t *)
- * \brief Reads a whole file into memory for sending it as content.
- * \param filename The name of file to be loaded and sent as content.
+ * \fn unsigned char *response_read_object(const file_t *, size_t *)
+ * \brief Reads a whole open file into memory for sending it as content.
+ * The file is read from its start, whatever other requests are doing with it.
+ * \param file The open file to be loaded and sent as content.
  * \param length The file's total content length.
  * \return The file contents.
  */
-unsigned char *response_read_file(const char *filename, size_t *length)
+unsigned char *response_read_object(const file_t *file, size_t *length)
 {
-    FILE *file = fopen(filename, "rb");
-
-    fseek(file, 0L, SEEK_END);
-    *length = ftell(file);
+    ssize_t bytes = 0;
+    size_t size = (size_t) file->status.st_size;
+    unsigned char *content = malloc(sizeof(unsigned char) * (size + 1));
 
-    unsigned char *content = malloc(sizeof(unsigned char) * (*length + 1));
-
-    rewind(file);
-    fread(content, sizeof(unsigned char), *length, file);
-    fclose(file);
+    for (*length = 0; *length < size; *length += (size_t) bytes)
+        if ((bytes = pread(file->fd, content + *length, size - *length, (off_t) *length)) <= 0)
+            break;
 
     return content;
 }
@@ -131,166 +408,687 @@ struct http_response_t response_make_basic(enum http_code_t status)
     return (struct http_response_t) {
         .protocol       = "HTTP/1.1"
       , .status_code    = status
-      , .header         = malloc(sizeof(struct http_header_t) * 100)
+      , .header         = arena_malloc(sizeof(struct http_header_t) * 100)
       , .count_headers  = 0
     };
 }
 
 /*!
- * \fn struct http_response_t response_make_file_view(enum http_code_t, const char *)
+ * \fn struct http_response_t response_make_file_view(enum http_code_t, file_t *, const char *)
  * \brief Creates a HTTP response of a file.
+ * Small files are read into the response right away, while larger ones are sent from
+ * their open descriptor, which the response then holds on to until it has been sent. A
+ * small file's response is prepared the first time it is made, and kept along with the
+ * file, so that it is never made again for as long as the file is unchanged.
  * \param status The response's HTTP status code.
+ * \param file The open file to be returned, or NULL if it could not be opened.
  * \param filename The name of file to be returned.
  * \return The HTTP response for the requested file.
  */
-struct http_response_t response_make_file_view(enum http_code_t status, const char *filename)
+struct http_response_t response_make_file_view(enum http_code_t status, file_t *file, const char *filename)
 {
+    struct http_prepared_t *prepared = file != NULL && status == HTTP_RESPONSE_OK
+        ? atomic_load(&file->prepared)
+        : NULL;
+
+    if (prepared != NULL) {
+        atomic_fetch_add(&prepared->references, 1);
+        file_release(file);
+
+        return (struct http_response_t) {
+            .protocol     = "HTTP/1.1"
+          , .status_code  = status
+          , .prepared     = prepared
+        };
+    }
+
     struct http_response_t response = response_make_basic(status);
 
-    response.content = response_read_file(filename, &response.length);
+    if (file != NULL && file->status.st_size > FILE_INLINE_SIZE) {
+        response.file = file;
+        response.length = (size_t) file->status.st_size;
+    } else if (file != NULL) {
+        response.content = response_read_object(file, &response.length);
+    }
 
     response_add_common_headers(&response);
     response_add_file_header(&response, filename, response.length);
 
+    if (file != NULL)
+        response_add_etag_header(&response, file);
+
+    if (file != NULL && response.file == NULL) {
+        if (status == HTTP_RESPONSE_OK && response.length == (size_t) file->status.st_size) {
+            struct http_prepared_t *expected = NULL;
+            prepared = response_prepare(&response);
+
+            // Another request may have prepared the same file's response meanwhile.
+            if (!atomic_compare_exchange_strong(&file->prepared, &expected, prepared))
+                http_prepared_release(prepared);
+        }
+
+        file_release(file);
+    }
+
     return response;
 }
 
 /*!
- * \fn void response_append_contents(struct http_response_t *, const unsigned char *, size_t)
- * \brief Appends content to the end of a HTTP response.
- * \param response The response to have data appended to.
- * \param buffer The buffer to be appended to the end of the request.
- * \param length The length of buffer to be appended to response.
+ * \struct response_listing_t
+ * \brief The state of a directory index listing, produced while it is sent.
+ * The listing is made of the directory page template, followed by one script call for
+ * each of the directory's entries in the page being listed, and by the page's index.
+ * \since 3.0
  */
-void response_append_contents(struct http_response_t *response, const unsigned char *buffer, size_t length)
+typedef struct response_listing_t {
+    struct http_stream_t stream;
+    const unsigned char *template;
+    size_t template_length;
+    size_t offset;
+    listing_t *listing;
+    const uint32_t *order;
+    bool descending;
+    size_t cursor;
+    size_t end;
+    size_t page;
+    size_t pages;
+    char entry[BUFFER_SIZE * 2];
+    size_t entry_length;
+} response_listing_t;
+
+/*!
+ * \fn void response_listing_query(response_listing_t *, const char *)
+ * \brief Reads the order and the page of a listing from its request's query string.
+ * Listings may be sorted by `name`, `modified` or `size`, in `asc` or `desc` order.
+ * \param listing The listing being requested.
+ * \param query The request's query string.
+ */
+void response_listing_query(response_listing_t *listing, const char *query)
 {
-    size_t prev_size = response->length;
-    size_t final_size = prev_size + length;
+    static const char *const sort_name[LISTING_SORT_COUNT] = {
+        [LISTING_SORT_NAME]     = "name"
+      , [LISTING_SORT_MODIFIED] = "modified"
+      , [LISTING_SORT_SIZE]     = "size"
+    };
+
+    listing_sort_t sort = LISTING_SORT_NAME;
 
-    response->content = realloc(response->content, sizeof(unsigned char) * (final_size + 1));
-    response->length = final_size;
+    while (query != NULL && *query != '\0') {
+        size_t length = strcspn(query, "&");
 
-    char length_str[15];
-    sprintf(length_str, "%zu", final_size);
+        for (int i = 0; i < LISTING_SORT_COUNT; ++i)
+            if (length == strlen(sort_name[i]) + 5 && strncmp(query, "sort=", 5) == 0 && strncmp(query + 5, sort_name[i], length - 5) == 0)
+                sort = (listing_sort_t) i;
 
-    memcpy(response->content + prev_size, buffer, length);
-    response_update_header(response, "Content-Length", length_str);
+        if (length == 10 && strncmp(query, "order=desc", 10) == 0)
+            listing->descending = true;
+
+        if (length > 5 && strncmp(query, "page=", 5) == 0)
+            listing->page = strtoul(query + 5, NULL, 10);
+
+        query += length + (query[length] == '&');
+    }
+
+    listing->order = listing->listing->order[sort];
 }
 
 /*!
- * void response_make_directory_listing(struct http_response_t *, const char *)
- * \brief Creates a HTTP response of a directory index listing.
- * \param response The response to which the listing must be appended.
- * \param dirname The directory to be listed.
+ * \fn size_t response_listing_escape(char *, size_t, const char *)
+ * \brief Escapes a name so that it can be written within a script string.
+ * \param buffer The buffer to write the escaped name to.
+ * \param size The buffer's size.
+ * \param name The name to be escaped.
+ * \return The escaped name's length, or zero if it does not fit the buffer.
  */
-void response_make_directory_listing(struct http_response_t *response, const char *dirname)
+size_t response_listing_escape(char *buffer, size_t size, const char *name)
 {
-    struct dirent *obj;
-    char tmp[BUFFER_SIZE];
+    size_t length = 0;
 
-    size_t length = 0, capacity = BUFFER_SIZE;
-    unsigned char *buffer = malloc(sizeof(unsigned char) * capacity);
+    for (const unsigned char *c = (const unsigned char*) name; *c != '\0'; ++c) {
+        if (length + 5 >= size)
+            return 0;
+
+        if (*c == '"' || *c == '\\' || *c == '<' || *c < 0x20)
+            length += sprintf(buffer + length, "\\x%02x", *c);
+        else
+            buffer[length++] = (char) *c;
+    }
+
+    buffer[length] = '\0';
+    return length;
+}
 
-    DIR *dir = opendir(dirname);
+/*!
+ * \fn bool response_listing_next(response_listing_t *)
+ * \brief Describes the next entry in the listing, or the index of the listing's pages.
+ * \param listing The listing being produced.
+ * \return Is there anything left to be listed?
+ */
+bool response_listing_next(response_listing_t *listing)
+{
+    char name[BUFFER_SIZE];
+    const listing_t *directory = listing->listing;
 
-    while ((obj = readdir(dir)) != NULL) {
-        size_t size;
-        struct stat st;
-        sprintf(tmp, "%s/%s", dirname, obj->d_name);
+    while (listing->cursor < listing->end) {
+        size_t position = listing->cursor++;
+        const listing_entry_t *entry = &directory->entry[listing->order[listing_position(directory, position, listing->descending)]];
+        int size;
 
-        stat(tmp, &st);
+        if (response_listing_escape(name, sizeof(name), entry->name) == 0)
+            continue;
 
-        if (S_ISDIR(st.st_mode))
-            sprintf(tmp, "<script>d(\"%s\", %lu);</script>%zn", obj->d_name, st.st_mtime, &size);
+        if (entry->directory)
+            size = snprintf(listing->entry, sizeof(listing->entry), "<script>d(\"%s\", %lu);</script>", name, entry->modified);
         else
-            sprintf(tmp, "<script>f(\"%s\", %lu, %ld);</script>%zn", obj->d_name, st.st_mtime, st.st_size, &size);
+            size = snprintf(listing->entry, sizeof(listing->entry), "<script>f(\"%s\", %lu, %ld);</script>", name, entry->modified, entry->size);
+
+        if (size > 0 && (size_t) size < sizeof(listing->entry)) {
+            listing->entry_length = (size_t) size;
+            return true;
+        }
+    }
+
+    if (listing->pages > 1) {
+        listing->entry_length = sprintf(listing->entry, "<script>p(%zu, %zu);</script>", listing->page, listing->pages);
+        listing->pages = 0;
+        return true;
+    }
+
+    return false;
+}
+
+/*!
+ * \fn size_t response_listing_produce(struct http_stream_t *, unsigned char *, size_t)
+ * \brief Produces the next piece of a directory index listing.
+ * Entries are never split between pieces.
+ * \param stream The listing being produced.
+ * \param buffer The buffer to produce the listing into.
+ * \param capacity The buffer's capacity.
+ * \return The number of bytes produced.
+ */
+size_t response_listing_produce(struct http_stream_t *stream, unsigned char *buffer, size_t capacity)
+{
+    size_t length = 0;
+    response_listing_t *listing = (response_listing_t*) stream;
 
-        while (length + size + 1 > capacity)
-            buffer = realloc(buffer, sizeof(unsigned char) * (capacity *= 2));
+    if (listing->offset < listing->template_length) {
+        length = listing->template_length - listing->offset < capacity
+            ? listing->template_length - listing->offset
+            : capacity;
 
-        memcpy(buffer + length, tmp, size + 1);
-        length += size;
+        memcpy(buffer, listing->template + listing->offset, length);
+        listing->offset += length;
     }
 
-    closedir(dir);
-    response_append_contents(response, buffer, length);
-    free(buffer);
+    while (length < capacity) {
+        if (listing->entry_length == 0 && !response_listing_next(listing))
+            break;
+
+        if (listing->entry_length > capacity - length)
+            break;
+
+        memcpy(buffer + length, listing->entry, listing->entry_length);
+        length += listing->entry_length;
+        listing->entry_length = 0;
+    }
+
+    return length;
 }
 
 /*!
- * \fn struct http_response_t response_make_directory_view(enum http_code_t, const char *)
+ * \fn void response_listing_release(struct http_stream_t *)
+ * \brief Releases a directory index listing, whether or not it has been completely sent.
+ * \param stream The listing to be released.
+ */
+void response_listing_release(struct http_stream_t *stream)
+{
+    response_listing_t *listing = (response_listing_t*) stream;
+
+    listing_release(listing->listing);
+    free(listing);
+}
+
+/*!
+ * \fn struct http_response_t response_make_directory_view(enum http_code_t, const char *, const char *, size_t)
  * \brief Creates a directory index as a response to client.
+ * A generated listing is taken from the listing cache, and streamed, so that its size
+ * does not have to be known beforehand. Listings are paginated when a page size is set.
  * \param status The HTTP status code to be returned.
  * \param dirname The directory to be listed.
+ * \param query The request's query string, with the listing's order and page.
+ * \param partition The file cache's partition to open the directory's index through.
  * \return The HTTP response created.
  */
-struct http_response_t response_make_directory_view(enum http_code_t status, const char *dirname)
+struct http_response_t response_make_directory_view(enum http_code_t status, const char *dirname, const char *query, size_t partition)
 {
+    file_t *index;
     char indexfile[BUFFER_SIZE];
-    struct stat objstat;
 
-    sprintf(indexfile, "%s/index.html", dirname);
+    snprintf(indexfile, sizeof(indexfile), "%s/index.html", dirname);
 
-    if (stat(indexfile, &objstat) == 0)
-        return response_make_file_view(status, indexfile);
+    if ((index = file_acquire(indexfile, partition)) != NULL && S_ISREG(index->status.st_mode))
+        return response_make_file_view(status, index, indexfile);
 
-    struct http_response_t response = response_make_file_view(status, "default/directory.html");
-    response_make_directory_listing(&response, dirname);
+    if (index != NULL)
+        file_release(index);
+
+    listing_t *directory = listing_acquire(dirname);
+
+    if (directory == NULL)
+        return response_make_error_view(HTTP_RESPONSE_INTERNAL_SERVER_ERROR);
+
+    struct http_response_t response = response_make_basic(status);
+    response_listing_t *listing = calloc(1, sizeof(response_listing_t));
+    size_t page_size = settings_current()->listing_page_size;
+
+    listing->stream.produce = response_listing_produce;
+    listing->stream.release = response_listing_release;
+    listing->template = asset_find("directory.html", &listing->template_length);
+    listing->listing = directory;
+
+    response_listing_query(listing, query);
+
+    if (page_size > 0) {
+        listing->pages = directory->count > 0 ? (directory->count + page_size - 1) / page_size : 1;
+        listing->page = listing->page < 1 ? 1 : listing->page > listing->pages ? listing->pages : listing->page;
+        listing->cursor = (listing->page - 1) * page_size;
+        listing->end = listing->cursor + page_size < directory->count ? listing->cursor + page_size : directory->count;
+    } else {
+        listing->end = directory->count;
+    }
+
+    response.stream = &listing->stream;
+
+    response_add_common_headers(&response);
+    response_add_header(&response, "Content-Type", "text/html");
+    response_add_header(&response, "Transfer-Encoding", "chunked");
 
     return response;
 }
 
+/*!
+ * \var g_response_error
+ * \brief The prepared responses for each HTTP error status, as they are first needed.
+ * \since 3.0
+ */
+static _Atomic(struct http_prepared_t *) g_response_error[600 - 400];
+
 /*!
  * \fn struct http_response_t response_make_error_view(enum http_code_t)
  * \brief Creates a response for a HTTP error status.
+ * Error pages are embedded into the server, so an error's response never changes, and
+ * is prepared only once, the first time the error happens.
  * \param status The HTTP status to generate error page for.
  * \return The HTTP response for the given status.
  */
 struct http_response_t response_make_error_view(enum http_code_t status)
 {
-    char filename[150];
-    sprintf(filename, "default/%d.html", status);
+    char name[16];
+    char length_str[25];
+    struct http_prepared_t *expected = NULL;
+    struct http_prepared_t *prepared = atomic_load(&g_response_error[status - 400]);
+
+    if (prepared == NULL) {
+        struct http_response_t response = response_make_basic(status);
+
+        snprintf(name, sizeof(name), "%d.html", status);
+        const unsigned char *page = asset_find(name, &response.length);
+        sprintf(length_str, "%zu", response.length);
+
+        response_add_common_headers(&response);
+        response_add_header(&response, "Content-Type", "text/html");
+        response_add_header(&response, "Content-Length", length_str);
+
+        response.content = (unsigned char*) page;
+        prepared = response_prepare(&response);
+        response.content = NULL;
+        response_free(&response);
+
+        // Another request may have prepared the same error's response meanwhile.
+        if (!atomic_compare_exchange_strong(&g_response_error[status - 400], &expected, prepared)) {
+            http_prepared_release(prepared);
+            prepared = expected;
+        }
+    }
+
+    atomic_fetch_add(&prepared->references, 1);
+
+    return (struct http_response_t) {
+        .protocol     = "HTTP/1.1"
+      , .status_code  = status
+      , .prepared     = prepared
+    };
+}
+
+/*!
+ * \fn struct http_prepared_t *response_prepare(const struct http_response_t *)
+ * \brief Serializes a response beforehand, so that it can answer many requests.
+ * The `Date` and `Connection` headers are left out, as they are added to each request.
+ * \param response The response to be prepared, which must have its content in memory.
+ * \return The prepared response.
+ */
+struct http_prepared_t *response_prepare(const struct http_response_t *response)
+{
+    const char *status_str = response_status_string(response->status_code);
+    size_t required = strlen(response->protocol) + strlen(status_str) + 16 + response->length;
+
+    for (size_t i = 0; i < response->count_headers; ++i)
+        required += strlen(response->header[i].key) + strlen(response->header[i].value) + 4;
+
+    struct http_prepared_t *prepared = malloc(sizeof(struct http_prepared_t));
+    char *cursor = prepared->data = malloc(sizeof(char) * required);
+
+    cursor += sprintf(cursor, "%s %d %s\r\n", response->protocol, response->status_code, status_str);
+
+    for (size_t i = 0; i < response->count_headers; ++i)
+        if (strcmp(response->header[i].key, "Date") != 0 && strcmp(response->header[i].key, "Connection") != 0)
+            cursor += sprintf(cursor, "%s: %s\r\n", response->header[i].key, response->header[i].value);
+
+    prepared->header_length = cursor - prepared->data;
+    prepared->length = prepared->header_length + response->length;
+    prepared->status_code = response->status_code;
+    atomic_init(&prepared->references, 1);
+
+    if (response->length > 0)
+        memcpy(cursor, response->content, response->length);
+
+    return prepared;
+}
+
+/*!
+ * \fn void response_finalize()
+ * \brief Releases the responses prepared beforehand, and the permanent redirections.
+ */
+extern void response_finalize()
+{
+    for (size_t i = 0; i < sizeof(g_response_error) / sizeof(g_response_error[0]); ++i)
+        if (g_response_error[i] != NULL)
+            http_prepared_release(atomic_exchange(&g_response_error[i], NULL));
+
+    for (size_t k = 0; k < sizeof(g_response_moved) / sizeof(g_response_moved[0]); ++k) {
+        for (response_moved_t *moved = atomic_exchange(&g_response_moved[k], NULL), *next; moved != NULL; moved = next) {
+            next = moved->retired;
+
+            for (size_t i = 0; i < moved->count; ++i) {
+                free(moved->redirect[i].origin);
+                free(moved->redirect[i].target);
+            }
+
+            free(moved->redirect);
+            free(moved);
+        }
+    }
+}
+
+/*!
+ * \fn struct http_response_t response_handle_health(const struct http_request_t *)
+ * \brief Answers health checks, telling that the server is up and serving requests.
+ * \param http_request The health check's HTTP request.
+ * \return The HTTP response to the health check.
+ */
+extern struct http_response_t response_handle_health(const struct http_request_t *http_request)
+{
+    struct http_response_t response = response_make_basic(HTTP_RESPONSE_OK);
+
+    (void) http_request;
+
+    response.length = 3;
+    response.content = malloc(sizeof(unsigned char) * response.length);
+    memcpy(response.content, "OK\n", response.length);
 
-    return response_make_file_view(status, filename);
+    response_add_common_headers(&response);
+    response_add_header(&response, "Content-Type", "text/plain");
+    response_add_header(&response, "Content-Length", "3");
+
+    return response;
 }
 
 /*!
- * \fn bool response_check_moved_object(char *, const char *)
+ * \fn bool response_resolve_proxy(const router_route_t *, const struct http_request_t *, struct http_response_t *)
+ * \brief Forwards a HTTP request for a proxy route.
+ * Forwarding never blocks, as the response is only relayed once it is sent, by whoever
+ * sends it, and whenever the upstream server is ready for it.
+ * \param route The proxy route the request has matched.
+ * \param http_request The HTTP request to be forwarded.
+ * \param response The produced HTTP response.
+ * \return Has the request been answered?
+ */
+bool response_resolve_proxy(const router_route_t *route, const struct http_request_t *http_request, struct http_response_t *response)
+{
+    *response = (struct http_response_t) {
+        .protocol   = "HTTP/1.1"
+      , .relay      = proxy_open(route->proxy, http_request)
+    };
+
+    return true;
+}
+
+/*!
+ * \fn struct http_response_t response_make_relayed(struct http_relay_t *, enum http_code_t)
+ * \brief Creates the response relayed from elsewhere, once its relay has received its head.
+ * The relayed response keeps its status, and its headers but for those only meant for
+ * its own connection, which are replaced by the server's own. The relay itself is kept
+ * by its caller, to relay the rest of the response's content.
+ * \param relay The relay which has received the response's head.
+ * \param failure The status to answer with, if the relay has failed.
+ * \return The produced response.
+ */
+extern struct http_response_t response_make_relayed(struct http_relay_t *relay, enum http_code_t failure)
+{
+    struct http_response_t relayed = { .status_code = failure };
+
+    if (!relay->respond(relay, &relayed))
+        return response_make_error_view(relayed.status_code);
+
+    struct http_response_t response = response_make_basic(relayed.status_code);
+    response_add_common_headers(&response);
+
+    for (size_t i = 0; i < relayed.count_headers; ++i)
+        response_add_header(&response, relayed.header[i].key, relayed.header[i].value);
+
+    response.content = relayed.content;
+    response.length = relayed.length;
+
+    return response;
+}
+
+/*!
+ * \fn void response_preload(const char *)
+ * \brief Loads a public file into the file cache before it is first requested.
+ * The file's contents are read ahead into the page cache, and a small file's response
+ * is prepared right away, as the first request for it would have.
+ * \param target The path of the file to be loaded.
+ */
+extern void response_preload(const char *target)
+{
+    file_t *object = response_check_public_object(target, 0);
+
+    if (object == NULL)
+        return;
+
+    if (!S_ISREG(object->status.st_mode)) {
+        file_release(object);
+        return;
+    }
+
+    posix_fadvise(object->fd, 0, 0, POSIX_FADV_WILLNEED);
+    struct http_response_t response = response_make_file_view(HTTP_RESPONSE_OK, object, target);
+
+    if (response.prepared != NULL)
+        http_prepared_release(response.prepared);
+    else
+        response_free(&response);
+}
+
+/*!
+ * \fn int response_moved_compare(const void *, const void *)
+ * \brief Orders redirections by their origins, and then by their positions in the file.
+ * \param a The first redirection to be compared.
+ * \param b The second redirection to be compared.
+ * \return The redirections' relative order.
+ */
+int response_moved_compare(const void *a, const void *b)
+{
+    const response_redirect_t *x = a;
+    const response_redirect_t *y = b;
+    int comparison = strcmp(x->origin, y->origin);
+
+    return comparison != 0 ? comparison : (x->position > y->position) - (x->position < y->position);
+}
+
+/*!
+ * \fn response_moved_t *response_moved_read(const char *, const struct stat *)
+ * \brief Reads the permanent redirections from a redirections file.
+ * Only the first redirection from each origin is kept, as it is the one which applies.
+ * \param path The redirections file's path.
+ * \param status The redirections file's status, or zeroes if there is no such file.
+ * \return The redirections read.
+ */
+response_moved_t *response_moved_read(const char *path, const struct stat *status)
+{
+    size_t capacity = 0;
+    char origin[BUFFER_SIZE];
+    char target[BUFFER_SIZE];
+    response_moved_t *moved = calloc(1, sizeof(response_moved_t));
+    FILE *db_moved = status->st_ino != 0 ? fopen(path, "r") : NULL;
+
+    moved->status = *status;
+
+    while (db_moved != NULL && fscanf(db_moved, "%2047s %2047s ", origin, target) == 2) {
+        if (moved->count == capacity)
+            moved->redirect = realloc(moved->redirect, sizeof(response_redirect_t) * (capacity = capacity ? capacity * 2 : 16));
+
+        moved->redirect[moved->count] = (response_redirect_t) {
+            .origin   = strdup(origin)
+          , .target   = strdup(target)
+          , .position = moved->count
+        };
+
+        ++moved->count;
+    }
+
+    if (db_moved != NULL)
+        fclose(db_moved);
+
+    if (moved->count > 0)
+        qsort(moved->redirect, moved->count, sizeof(response_redirect_t), response_moved_compare);
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < moved->count; ++i) {
+        if (kept > 0 && strcmp(moved->redirect[kept - 1].origin, moved->redirect[i].origin) == 0) {
+            free(moved->redirect[i].origin);
+            free(moved->redirect[i].target);
+        } else {
+            moved->redirect[kept++] = moved->redirect[i];
+        }
+    }
+
+    moved->count = kept;
+    return moved;
+}
+
+/*!
+ * \fn const response_moved_t *response_moved_current(const vhost_t *, uint64_t, bool)
+ * \brief Retrieves a host's permanent redirections in effect for a generation of the watched folders.
+ * The redirections file is only checked again once any watched folder has changed. The
+ * default host's redirections are read from the default folder, and a virtual host only
+ * has redirections if it has its own redirections file.
+ * \param host The virtual host, or NULL for the default host.
+ * \param generation The missing paths cache's current generation.
+ * \param blocking May the redirections file be checked, and read again, if needed?
+ * \return The redirections, or NULL if they must be checked but that is not allowed.
+ */
+const response_moved_t *response_moved_current(const vhost_t *host, uint64_t generation, bool blocking)
+{
+    struct stat status;
+    const char *path = host != NULL ? host->moved : "default/.moved";
+    _Atomic(response_moved_t *) *current = &g_response_moved[host != NULL ? host->partition : 0];
+    response_moved_t *moved = atomic_load(current);
+
+    if (moved != NULL && atomic_load(&moved->generation) == generation)
+        return moved;
+
+    if (!blocking)
+        return NULL;
+
+    pthread_mutex_lock(&g_response_moved_lock);
+    moved = atomic_load(current);
+
+    if (path == NULL || stat(path, &status) != 0)
+        memset(&status, 0, sizeof(status));
+
+    if (moved == NULL
+        || moved->status.st_ino != status.st_ino
+        || moved->status.st_size != status.st_size
+        || moved->status.st_mtim.tv_sec != status.st_mtim.tv_sec
+        || moved->status.st_mtim.tv_nsec != status.st_mtim.tv_nsec
+    ) {
+        response_moved_t *fresh = response_moved_read(path, &status);
+        fresh->retired = moved;
+        atomic_store(current, fresh);
+        moved = fresh;
+    }
+
+    if (atomic_load(&moved->generation) < generation)
+        atomic_store(&moved->generation, generation);
+
+    pthread_mutex_unlock(&g_response_moved_lock);
+    return moved;
+}
+
+/*!
+ * \fn bool response_check_moved_object(const response_moved_t *, char *, const char *)
  * \brief Checks whethe the given object has suffered a permanent move.
+ * \param moved The permanent redirections in effect.
  * \param target The object's redirection target.
  * \param objname The name of object being currenly requested.
  * \return Has the object been moved?
  */
-bool response_check_moved_object(char *target, const char *objname)
+bool response_check_moved_object(const response_moved_t *moved, char *target, const char *objname)
 {
-    char origin[BUFFER_SIZE];
-    FILE *db_moved = fopen("default/.moved", "r");
+    size_t low = 0;
+    size_t high = moved->count;
 
-    while (!feof(db_moved)) {
-        fscanf(db_moved, "%s %s ", origin, target);
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int comparison = strcmp(moved->redirect[middle].origin, objname);
 
-        if (strcmp(origin, objname) == 0)
+        if (comparison == 0) {
+            snprintf(target, BUFFER_SIZE, "%s", moved->redirect[middle].target);
             return true;
+        }
+
+        if (comparison < 0)
+            low = middle + 1;
+        else
+            high = middle;
     }
 
     return false;
 }
 
 /**
- * \fn bool response_check_public_object(char *, const char *)
- * \brief Checks whether the given name is a public object.
+ * \fn file_t *response_check_public_object(const char *, size_t)
+ * \brief Checks whether the given name is a public object, and opens it if so.
+ * Objects are opened through the file cache, so that a cached object is served without
+ * resolving its path again. Objects which are neither files nor directories are as good
+ * as missing.
  * \param target The final target name.
- * \param objname The object name to be checked.
- * \return Is the requested object public?
+ * \param partition The file cache's partition to open the object through.
+ * \return The requested object, or NULL if it is not public.
  */
-bool response_check_public_object(char *target, const char *objname)
+file_t *response_check_public_object(const char *target, size_t partition)
 {
-    struct stat st;
+    file_t *object = file_acquire(target, partition);
 
-    sprintf(target, PUBLIC_FOLDER "%s", objname);
-    stat(target, &st);
+    if (object != NULL && !S_ISDIR(object->status.st_mode) && !S_ISREG(object->status.st_mode)) {
+        file_release(object);
+        errno = ENOENT;
+        return NULL;
+    }
 
-    return S_ISDIR(st.st_mode) || S_ISREG(st.st_mode);
+    return object;
 }
 
 /*!
@@ -303,8 +1101,8 @@ bool response_check_public_object(char *target, const char *objname)
 void response_add_header(struct http_response_t *response, const char *key, const char *value)
 {
     size_t count = response->count_headers;
-    response->header[count].key   = malloc(sizeof(char) * (strlen(key) + 1));
-    response->header[count].value = malloc(sizeof(char) * (strlen(value) + 1));
+    response->header[count].key   = arena_malloc(sizeof(char) * (strlen(key) + 1));
+    response->header[count].value = arena_malloc(sizeof(char) * (strlen(value) + 1));
 
     strcpy(response->header[count].key, key);
     strcpy(response->header[count].value, value);
@@ -323,7 +1121,7 @@ void response_update_header(struct http_response_t *response, const char *key, c
 {
     for (size_t i = 0; i < response->count_headers; ++i) {
         if (strcmp(response->header[i].key, key) == 0) {
-            response->header[i].value = realloc(response->header[i].value, sizeof(char) * (strlen(value) + 1));
+            response->header[i].value = arena_realloc(response->header[i].value, sizeof(char) * (strlen(value) + 1));
             strcpy(response->header[i].value, value);
             return;
         }
@@ -349,23 +1147,179 @@ struct http_response_t response_make_moved_view(const char *target)
 }
 
 /*!
- * \fn struct http_response_t response_make_object_view(const char *)
+ * \fn struct http_response_t response_make_object_view(file_t *, const char *, const char *, size_t)
  * \brief Creates a HTTP response of a public object.
+ * \param object The open object to be returned to client.
  * \param objname The name of the object to be returned to client.
+ * \param query The request's query string.
+ * \param partition The file cache's partition the object has been opened through.
  * \return The created HTTP response with corresponding object.
  */
-struct http_response_t response_make_object_view(const char *objname)
+struct http_response_t response_make_object_view(file_t *object, const char *objname, const char *query, size_t partition)
+{
+    if (S_ISREG(object->status.st_mode))
+        return response_make_file_view(HTTP_RESPONSE_OK, object, objname);
+
+    file_release(object);
+    return response_make_directory_view(HTTP_RESPONSE_OK, objname, query, partition);
+}
+
+/*!
+ * \fn bool response_accepts_gzip(const struct http_request_t *)
+ * \brief Checks whether the client accepts contents compressed with gzip.
+ * \param http_request The client's HTTP request.
+ * \return Does the client accept gzip, with a non-zero quality?
+ */
+bool response_accepts_gzip(const struct http_request_t *http_request)
+{
+    for (size_t i = 0; i < http_request->count_headers; ++i) {
+        if (strcasecmp(http_request->header[i].key, "Accept-Encoding") != 0)
+            continue;
+
+        for (const char *coding = http_request->header[i].value; *coding != '\0'; ) {
+            coding += strspn(coding, " \t,");
+            size_t extent = strcspn(coding, ",");
+
+            if (strcspn(coding, " \t;,") == 4 && strncasecmp(coding, "gzip", 4) == 0) {
+                const char *parameter = memchr(coding, ';', extent);
+
+                if (parameter != NULL)
+                    parameter += 1 + strspn(parameter + 1, " \t");
+
+                return parameter == NULL || strncasecmp(parameter, "q=", 2) != 0 || strtod(parameter + 2, NULL) > 0;
+            }
+
+            coding += extent;
+        }
+    }
+
+    return false;
+}
+
+/*!
+ * \fn const pack_entry_t *response_check_pack_object(const pack_t *, const char *)
+ * \brief Finds the bundled file a path refers to.
+ * A path naming a directory refers to the directory's index file, as listings are not
+ * bundled, and a path ending with a slash can only name a directory.
+ * \param pack The bundle to look the path up in.
+ * \param path The requested path.
+ * \return The bundled file, or NULL if the path is not in the bundle.
+ */
+const pack_entry_t *response_check_pack_object(const pack_t *pack, const char *path)
+{
+    const pack_entry_t *entry;
+    char target[BUFFER_SIZE];
+    size_t length = strlen(path);
+
+    while (length > 0 && path[length - 1] == '/')
+        --length;
+
+    if (length == strlen(path) && (entry = pack_find(pack, path)) != NULL)
+        return entry;
+
+    if (snprintf(target, sizeof(target), "%.*s/index.html", (int) length, path) >= (int) sizeof(target))
+        return NULL;
+
+    return pack_find(pack, target);
+}
+
+/*!
+ * \fn struct http_response_t response_make_pack_view(const pack_t *, const pack_entry_t *, bool)
+ * \brief Creates a HTTP response of a bundled file.
+ * The file's variant compressed with gzip is chosen when the client accepts it. Small
+ * variants have their responses prepared the first time they are made, right from the
+ * mapped bundle, while larger ones are sent straight from the bundle's descriptor.
+ * \param pack The bundle the file is in.
+ * \param entry The bundled file to be returned.
+ * \param gzip Does the client accept contents compressed with gzip?
+ * \return The HTTP response for the bundled file.
+ */
+struct http_response_t response_make_pack_view(const pack_t *pack, const pack_entry_t *entry, bool gzip)
 {
-    struct stat objstat;
-    stat(objname, &objstat);
+    char length_str[25];
+    bool compressed = entry->variant[PACK_VARIANT_GZIP].length > 0;
+    pack_variant_kind_t kind = gzip && compressed ? PACK_VARIANT_GZIP : PACK_VARIANT_IDENTITY;
+    const pack_variant_t *variant = &entry->variant[kind];
+    _Atomic(struct http_prepared_t *) *slot = &pack->prepared[(size_t) (entry - pack->entry) * PACK_VARIANT_COUNT + kind];
+    struct http_prepared_t *expected = NULL;
+    struct http_prepared_t *prepared = atomic_load(slot);
+
+    if (prepared == NULL) {
+        struct http_response_t response = response_make_basic(HTTP_RESPONSE_OK);
+        sprintf(length_str, "%zu", (size_t) variant->length);
+
+        response_add_common_headers(&response);
+        response_add_header(&response, "Content-Type", pack_string(pack, entry->mime));
+        response_add_header(&response, "Content-Length", length_str);
+        response_add_header(&response, "ETag", pack_string(pack, variant->etag));
+
+        if (kind == PACK_VARIANT_GZIP)
+            response_add_header(&response, "Content-Encoding", "gzip");
+
+        if (compressed)
+            response_add_header(&response, "Vary", "Accept-Encoding");
+
+        response.length = (size_t) variant->length;
+
+        if (response.length > FILE_INLINE_SIZE) {
+            atomic_fetch_add(&pack->file->references, 1);
+            response.file = pack->file;
+            response.offset = (size_t) variant->offset;
+            return response;
+        }
+
+        response.content = (unsigned char*) pack->data + variant->offset;
+        prepared = response_prepare(&response);
+        response.content = NULL;
+        response_free(&response);
+
+        // Another request may have prepared the same variant's response meanwhile.
+        if (!atomic_compare_exchange_strong(slot, &expected, prepared)) {
+            http_prepared_release(prepared);
+            prepared = expected;
+        }
+    }
+
+    atomic_fetch_add(&prepared->references, 1);
+
+    return (struct http_response_t) {
+        .protocol     = "HTTP/1.1"
+      , .status_code  = HTTP_RESPONSE_OK
+      , .prepared     = prepared
+    };
+}
+
+/*!
+ * \fn bool response_resolve_pack(const pack_t *, const struct http_request_t *, bool, struct http_response_t *)
+ * \brief Processes a HTTP request for a file in the bundle being served.
+ * Bundled files are found without any filesystem access. Only paths missing from the
+ * bundle are looked up in the permanent redirections.
+ * \param pack The bundle being served.
+ * \param http_request The HTTP request to be processed.
+ * \param blocking May the permanent redirections be read again, if needed?
+ * \param response The produced HTTP response, if any.
+ * \return Has the request been answered?
+ */
+bool response_resolve_pack(const pack_t *pack, const struct http_request_t *http_request, bool blocking, struct http_response_t *response)
+{
+    const pack_entry_t *entry;
+    const response_moved_t *moved;
+    char location[BUFFER_SIZE];
+
+    if ((entry = response_check_pack_object(pack, http_request->uri.path)) != NULL) {
+        *response = response_make_pack_view(pack, entry, response_accepts_gzip(http_request));
+        return true;
+    }
 
-    if (S_ISREG(objstat.st_mode))
-        return response_make_file_view(HTTP_RESPONSE_OK, objname);
+    if ((moved = response_moved_current(NULL, missing_generation(), blocking)) == NULL)
+        return false;
 
-    if (S_ISDIR(objstat.st_mode))
-        return response_make_directory_view(HTTP_RESPONSE_OK, objname);
+    if (response_check_moved_object(moved, location, http_request->uri.path))
+        *response = response_make_moved_view(location);
+    else
+        *response = response_make_error_view(HTTP_RESPONSE_NOT_FOUND);
 
-    return response_make_error_view(HTTP_RESPONSE_INTERNAL_SERVER_ERROR);
+    return true;
 }
 
 /*!
@@ -399,14 +1353,33 @@ const char *response_get_mime(const char *extension)
  */
 void response_add_common_headers(struct http_response_t *response)
 {
-    char tbuffer[80];
+    response_add_header(response, "Connection", "close");
+    response_add_header(response, "Server", "μHTTPd Webserver");
+    response_add_header(response, "Date", response_current_date());
+}
+
+/*!
+ * \fn const char *response_current_date()
+ * \brief Formats the current date for the `Date` header.
+ * The date only changes once a second, so it is only formatted again by each thread
+ * when the second has changed.
+ * \return The current date, formatted as a HTTP date.
+ */
+extern const char *response_current_date()
+{
+    static _Thread_local time_t formatted = 0;
+    static _Thread_local char date[80];
+
     time_t now = time(NULL);
-    struct tm gmt = *gmtime(&now);
-    strftime(tbuffer, sizeof(tbuffer), "%a, %d %b %Y %H:%M:%S %Z", &gmt);
 
-    response_add_header(response, "Connection", "closed");
-    response_add_header(response, "Server", "μHTTPd Webserver");
-    response_add_header(response, "Date", tbuffer);
+    if (now != formatted) {
+        struct tm gmt;
+        gmtime_r(&now, &gmt);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %Z", &gmt);
+        formatted = now;
+    }
+
+    return date;
 }
 
 /*!
@@ -427,6 +1400,21 @@ void response_add_file_header(struct http_response_t *response, const char *file
     response_add_header(response, "Content-Length", length_str);
 }
 
+/*!
+ * \fn void response_add_etag_header(struct http_response_t *, const file_t *)
+ * \brief Adds the entity tag of the file being returned to the response.
+ * Files are tagged by their modification time and size, as they are cheap to compare.
+ * \param response The target response to which the header must be added to.
+ * \param file The file being returned by the response.
+ */
+void response_add_etag_header(struct http_response_t *response, const file_t *file)
+{
+    char etag[40];
+
+    snprintf(etag, sizeof(etag), "\"%lx-%lx\"", (unsigned long) file->status.st_mtim.tv_sec, (unsigned long) file->status.st_size);
+    response_add_header(response, "ETag", etag);
+}
+
 /*!
  * \fn void response_free(struct http_response_t *)
  * \brief Frees up resources used by the response structure.
@@ -436,11 +1424,23 @@ void response_free(struct http_response_t *response)
 {
     if (response != NULL) {
         for (size_t i = 0; i < response->count_headers; ++i) {
-            free(response->header[i].key);
-            free(response->header[i].value);
+            arena_free(response->header[i].key);
+            arena_free(response->header[i].value);
         }
 
-        free(response->header);
+        arena_free(response->header);
         free(response->content);
+
+        if (response->stream != NULL)
+            response->stream->release(response->stream);
+
+        if (response->file != NULL)
+            file_release(response->file);
+
+        if (response->prepared != NULL)
+            http_prepared_release(response->prepared);
+
+        if (response->relay != NULL)
+            response->relay->release(response->relay);
     }
 }
@@ -6,13 +6,22 @@
 #ifndef MU_HTTPD_RESPONSE_H
 #define MU_HTTPD_RESPONSE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "http.h"
 
 extern struct http_response_t response_process(struct http_request_t *);
+extern bool response_process_cached(struct http_request_t *, struct http_response_t *);
 extern struct http_response_t response_make_error(enum http_error_t);
+extern struct http_response_t response_make_relayed(struct http_relay_t *, enum http_code_t);
+extern void response_update_header(struct http_response_t *, const char *, const char *);
 extern void response_free(struct http_response_t *);
 extern const char *response_status_string(enum http_code_t);
+extern const char *response_current_date();
+extern const char *response_get_mime(const char *);
+extern struct http_response_t response_handle_health(const struct http_request_t *);
+extern void response_preload(const char *);
+extern void response_finalize();
 
 #endif
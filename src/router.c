@@ -0,0 +1,462 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the request router.
+ * Routes are mounted on path prefixes, and are read from the routes file once, when
+ * the server starts, into a radix tree. A request is then matched to the route with
+ * the longest prefix of its path, by walking the tree down along its path, so that
+ * matching costs no more than the path's length, and never allocates.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "http.h"
+#include "proxy.h"
+#include "response.h"
+
+#include "router.h"
+
+/*
+ * The maximum number of custom handlers which can be registered, and the separators
+ * between the fields of a line in the routes file.
+ */
+#define ROUTER_MAX_HANDLERS 16
+#define ROUTER_SEPARATORS   " \t\r\n"
+
+/*!
+ * \struct router_node_t
+ * \brief A node of the router's radix tree.
+ * A node's label points into the prefix of the route which has created it. Children
+ * are linked to their siblings, and no two of them start with the same character.
+ * \since 3.0
+ */
+typedef struct router_node_t {
+    const char *label;
+    size_t length;
+    int32_t child;
+    int32_t sibling;
+    int32_t route;
+} router_node_t;
+
+/*!
+ * \struct router_t
+ * \brief The router, with its routes and the radix tree their prefixes are organized in.
+ * \since 3.0
+ */
+typedef struct router_t {
+    router_node_t *node;
+    size_t node_count;
+    router_route_t *route;
+    size_t route_count;
+} router_t;
+
+/*!
+ * \struct router_handler_entry_t
+ * \brief A custom handler, registered by its name.
+ * \since 3.0
+ */
+typedef struct router_handler_entry_t {
+    const char *name;
+    router_handler_t handler;
+} router_handler_entry_t;
+
+/*!
+ * \var g_router
+ * \brief The router requests are dispatched by.
+ * \since 3.0
+ */
+static router_t g_router;
+
+/*!
+ * \var g_router_default
+ * \brief The route serving the public folder, when no route has been mounted on the root.
+ * \since 3.0
+ */
+static const router_route_t g_router_default = {
+    .prefix   = "/"
+  , .length   = 1
+  , .methods  = HTTP_GET | HTTP_POST
+  , .kind     = ROUTER_STATIC
+};
+
+/*!
+ * \var g_router_handler
+ * \brief The custom handlers routes may be dispatched to.
+ * \since 3.0
+ */
+static router_handler_entry_t g_router_handler[ROUTER_MAX_HANDLERS];
+
+/*!
+ * \fn void router_register(const char*, router_handler_t)
+ * \brief Registers a custom handler, so that routes can be dispatched to it by its name.
+ * Handlers must be registered before the routes are loaded.
+ * \param name The handler's name, as written in the routes file.
+ * \param handler The handler to be registered.
+ */
+extern void router_register(const char *name, router_handler_t handler)
+{
+    for (size_t i = 0; i < ROUTER_MAX_HANDLERS; ++i) {
+        if (g_router_handler[i].name == NULL || strcmp(g_router_handler[i].name, name) == 0) {
+            g_router_handler[i] = (router_handler_entry_t) { .name = name, .handler = handler };
+            return;
+        }
+    }
+}
+
+/*!
+ * \fn int32_t router_node_create(router_t*, const char*, size_t, int32_t)
+ * \brief Creates a new node in the router's tree.
+ * \param router The router to create the node in.
+ * \param label The node's label.
+ * \param length The label's length.
+ * \param route The route ending at the node, or -1 if none.
+ * \return The new node's index.
+ */
+int32_t router_node_create(router_t *router, const char *label, size_t length, int32_t route)
+{
+    router->node = realloc(router->node, sizeof(router_node_t) * (router->node_count + 1));
+    router->node[router->node_count] = (router_node_t) {
+        .label    = label
+      , .length   = length
+      , .child    = -1
+      , .sibling  = -1
+      , .route    = route
+    };
+
+    return (int32_t) router->node_count++;
+}
+
+/*!
+ * \fn bool router_insert(router_t*, int32_t)
+ * \brief Inserts a route's prefix into the router's tree.
+ * The edge sharing the prefix's next characters is split where they diverge, so that
+ * every node has at most one child for each character.
+ * \param router The router to insert the route into.
+ * \param route The index of the route to be inserted.
+ * \return Has the route been inserted, or is its prefix already taken?
+ */
+bool router_insert(router_t *router, int32_t route)
+{
+    const char *prefix = router->route[route].prefix;
+    size_t length = router->route[route].length;
+    int32_t node = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        int32_t *link = &router->node[node].child;
+
+        while (*link != -1 && router->node[*link].label[0] != prefix[i])
+            link = &router->node[*link].sibling;
+
+        if (*link == -1) {
+            int32_t leaf = router_node_create(router, prefix + i, length - i, route);
+            // The links must be found again, as creating a node may have moved them.
+            for (link = &router->node[node].child; *link != -1; link = &router->node[*link].sibling);
+            *link = leaf;
+            return true;
+        }
+
+        int32_t child = *link;
+        size_t common = 0;
+
+        while (common < router->node[child].length && i + common < length && router->node[child].label[common] == prefix[i + common])
+            ++common;
+
+        if (common < router->node[child].length) {
+            int32_t split = router_node_create(router, router->node[child].label, common, -1);
+
+            for (link = &router->node[node].child; *link != child; link = &router->node[*link].sibling);
+
+            router->node[split].sibling = router->node[child].sibling;
+            router->node[split].child = child;
+            router->node[child].sibling = -1;
+            router->node[child].label += common;
+            router->node[child].length -= common;
+            *link = split;
+            child = split;
+        }
+
+        node = child;
+        i += common;
+    }
+
+    if (router->node[node].route != -1)
+        return false;
+
+    router->node[node].route = route;
+    return true;
+}
+
+/*!
+ * \fn bool router_parse_methods(char*, uint32_t*)
+ * \brief Parses the methods a route accepts, separated by commas, or `*` for all of them.
+ * \param methods The methods, as written in the routes file.
+ * \param mask The methods, as a mask of HTTP methods.
+ * \return Have the methods been parsed?
+ */
+bool router_parse_methods(char *methods, uint32_t *mask)
+{
+    char *cursor;
+
+    *mask = 0;
+
+    if (strcmp(methods, "*") == 0) {
+        *mask = UINT32_MAX;
+        return true;
+    }
+
+    for (char *method = strtok_r(methods, ",", &cursor); method != NULL; method = strtok_r(NULL, ",", &cursor)) {
+        enum http_method_t parsed = http_request_parse_map_method(method);
+
+        if (parsed == HTTP_METHOD_UNKNOWN)
+            return false;
+
+        *mask |= parsed;
+    }
+
+    return *mask != 0;
+}
+
+/*!
+ * \fn bool router_parse_route(router_route_t*, char*, char*, size_t)
+ * \brief Parses a route from a line of the routes file.
+ * Each line holds a route's prefix, its methods, its kind and the kind's argument: the
+ * folder of a static route, which is optional, the target of a redirect route, the
+ * status of an error route, the name of a handler route's handler, or the upstream
+ * servers of a proxy route, as their hosts and ports separated by commas.
+ * \param route The route to be parsed.
+ * \param line The line to parse the route from.
+ * \param reason The buffer to describe why the route is invalid into.
+ * \param size The reason buffer's size.
+ * \return Has the route been parsed?
+ */
+bool router_parse_route(router_route_t *route, char *line, char *reason, size_t size)
+{
+    char *cursor;
+    char *prefix = strtok_r(line, ROUTER_SEPARATORS, &cursor);
+    char *methods = strtok_r(NULL, ROUTER_SEPARATORS, &cursor);
+    char *kind = strtok_r(NULL, ROUTER_SEPARATORS, &cursor);
+    char *argument = strtok_r(NULL, ROUTER_SEPARATORS, &cursor);
+
+    if (kind == NULL || strtok_r(NULL, ROUTER_SEPARATORS, &cursor) != NULL) {
+        snprintf(reason, size, "expected 'prefix methods kind [argument]'");
+        return false;
+    }
+
+    if (prefix[0] != '/') {
+        snprintf(reason, size, "the prefix '%s' does not start with '/'", prefix);
+        return false;
+    }
+
+    if (!router_parse_methods(methods, &route->methods)) {
+        snprintf(reason, size, "invalid methods '%s'", methods);
+        return false;
+    }
+
+    if (strcmp(kind, "static") == 0) {
+        route->kind = ROUTER_STATIC;
+    } else if (strcmp(kind, "redirect") == 0 && argument != NULL) {
+        route->kind = ROUTER_REDIRECT;
+    } else if (strcmp(kind, "error") == 0 && argument != NULL) {
+        char *end;
+        long status = strtol(argument, &end, 10);
+
+        if (*end != '\0' || status < 400 || status > 599 || strcmp(response_status_string((enum http_code_t) status), "Unknown") == 0) {
+            snprintf(reason, size, "unknown error status '%s'", argument);
+            return false;
+        }
+
+        route->kind = ROUTER_ERROR;
+        route->status = (enum http_code_t) status;
+    } else if (strcmp(kind, "handler") == 0 && argument != NULL) {
+        for (size_t i = 0; i < ROUTER_MAX_HANDLERS && g_router_handler[i].name != NULL; ++i)
+            if (strcmp(g_router_handler[i].name, argument) == 0)
+                route->handler = g_router_handler[i].handler;
+
+        if (route->handler == NULL) {
+            snprintf(reason, size, "unknown handler '%s'", argument);
+            return false;
+        }
+
+        route->kind = ROUTER_HANDLER;
+    } else if (strcmp(kind, "proxy") == 0 && argument != NULL) {
+        if ((route->proxy = proxy_create(argument, reason, size)) == NULL)
+            return false;
+
+        route->kind = ROUTER_PROXY;
+    } else {
+        snprintf(reason, size, "invalid route kind '%s'%s", kind, argument == NULL ? " without an argument" : "");
+        return false;
+    }
+
+    route->prefix = strdup(prefix);
+    route->length = strlen(prefix);
+    route->argument = argument != NULL ? strdup(argument) : NULL;
+
+    return true;
+}
+
+/*!
+ * \fn bool router_load(const char*, char*, size_t)
+ * \brief Builds the router from the routes file.
+ * The public folder is served from the root unless another route is mounted on it.
+ * \param path The routes file's path, or an empty string if there are no routes.
+ * \param error The buffer to describe why the routes could not be loaded into.
+ * \param size The error buffer's size.
+ * \return Has the router been built?
+ */
+extern bool router_load(const char *path, char *error, size_t size)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t number = 0;
+    bool success = true;
+    bool rooted = false;
+    char reason[256];
+    router_t *router = &g_router;
+    FILE *file = NULL;
+
+    if (path[0] != '\0' && (file = fopen(path, "r")) == NULL) {
+        snprintf(error, size, "could not open '%s': %s", path, strerror(errno));
+        return false;
+    }
+
+    router_node_create(router, "", 0, -1);
+
+    while (success && file != NULL && getline(&line, &capacity, file) != -1) {
+        char *comment = strchr(line, '#');
+        router_route_t route = { 0 };
+
+        ++number;
+
+        if (comment != NULL)
+            *comment = '\0';
+
+        if (line[strspn(line, ROUTER_SEPARATORS)] == '\0')
+            continue;
+
+        if (!router_parse_route(&route, line, reason, sizeof(reason))) {
+            snprintf(error, size, "%s:%zu: %s", path, number, reason);
+            success = false;
+            continue;
+        }
+
+        router->route = realloc(router->route, sizeof(router_route_t) * (router->route_count + 1));
+        router->route[router->route_count] = route;
+        rooted = rooted || strcmp(route.prefix, "/") == 0;
+
+        if (!router_insert(router, (int32_t) router->route_count++)) {
+            snprintf(error, size, "%s:%zu: the prefix '%s' is already routed", path, number, route.prefix);
+            success = false;
+        }
+    }
+
+    if (success && !rooted) {
+        router->route = realloc(router->route, sizeof(router_route_t) * (router->route_count + 1));
+        router->route[router->route_count] = g_router_default;
+        router->route[router->route_count].prefix = strdup(g_router_default.prefix);
+        router_insert(router, (int32_t) router->route_count++);
+    }
+
+    if (file != NULL)
+        fclose(file);
+
+    free(line);
+
+    if (!success)
+        router_finalize();
+
+    return success;
+}
+
+/*!
+ * \fn const router_route_t *router_match(const char*, enum http_method_t, bool*)
+ * \brief Finds the route with the longest prefix of a path, if it accepts a method.
+ * A prefix not ending with a slash only matches whole path segments, so that a route
+ * mounted on `/api` matches `/api` and `/api/users`, but not `/apis`. A route shadows
+ * every shorter prefix, even for the methods it does not accept itself.
+ * \param path The requested path.
+ * \param method The requested method.
+ * \param routed Is the path routed at all, whatever the method?
+ * \return The matching route, or NULL if the path is not routed or the method not accepted.
+ */
+extern const router_route_t *router_match(const char *path, enum http_method_t method, bool *routed)
+{
+    const router_t *router = &g_router;
+    const router_route_t *match = NULL;
+    int32_t node = 0;
+    size_t i = 0;
+
+    *routed = false;
+
+    if (router->node_count == 0) {
+        *routed = path[0] == '/';
+        return *routed && (g_router_default.methods & method) ? &g_router_default : NULL;
+    }
+
+    while (node != -1) {
+        const router_node_t *current = &router->node[node];
+
+        if (current->route != -1) {
+            const router_route_t *route = &router->route[current->route];
+
+            if (route->prefix[route->length - 1] == '/' || path[i] == '\0' || path[i] == '/')
+                match = route;
+        }
+
+        if (path[i] == '\0')
+            break;
+
+        for (node = current->child; node != -1 && router->node[node].label[0] != path[i]; node = router->node[node].sibling);
+
+        if (node != -1 && strncmp(router->node[node].label, path + i, router->node[node].length) != 0)
+            break;
+
+        if (node != -1)
+            i += router->node[node].length;
+    }
+
+    *routed = match != NULL;
+    return match != NULL && (match->methods & method) ? match : NULL;
+}
+
+/*!
+ * \fn const char *router_remainder(const router_route_t*, const char*)
+ * \brief Finds what is left of a path after the prefix of the route it has matched.
+ * The remainder always keeps its leading slash, if any, so that it can be appended
+ * to the route's folder or target.
+ * \param route The route matched by the path.
+ * \param path The requested path.
+ * \return The path's remainder.
+ */
+extern const char *router_remainder(const router_route_t *route, const char *path)
+{
+    return route->prefix[route->length - 1] == '/'
+        ? path + route->length - 1
+        : path + route->length;
+}
+
+/*!
+ * \fn void router_finalize()
+ * \brief Releases the router and all of its routes.
+ */
+extern void router_finalize()
+{
+    router_t *router = &g_router;
+
+    for (size_t i = 0; i < router->route_count; ++i) {
+        free(router->route[i].prefix);
+        free(router->route[i].argument);
+    }
+
+    free(router->route);
+    free(router->node);
+
+    *router = (router_t) { 0 };
+}
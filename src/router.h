@@ -0,0 +1,68 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the request router.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_ROUTER_H
+#define MU_HTTPD_ROUTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "proxy.h"
+
+/*!
+ * \enum router_kind_t
+ * \brief The ways a request can be dispatched by the route it matches.
+ * \since 3.0
+ */
+typedef enum router_kind_t {
+    ROUTER_STATIC = 0
+  , ROUTER_REDIRECT
+  , ROUTER_ERROR
+  , ROUTER_HANDLER
+  , ROUTER_PROXY
+} router_kind_t;
+
+/*!
+ * \typedef router_handler_t
+ * \brief A custom handler, which produces the response to the requests of its routes.
+ * Handlers are run by the event loops themselves, so they must never block.
+ * \since 3.0
+ */
+typedef struct http_response_t (*router_handler_t)(const struct http_request_t *);
+
+/*!
+ * \struct router_route_t
+ * \brief A route, mounted on a path prefix, and the requests it accepts.
+ * A static route serves files from its folder, or from the public folder if it has
+ * none, a redirect route redirects to its target, an error route answers with its
+ * status, a handler route is answered by its handler and a proxy route forwards its
+ * requests to its upstream servers.
+ * \since 3.0
+ */
+typedef struct router_route_t {
+    char *prefix;
+    size_t length;
+    uint32_t methods;
+    router_kind_t kind;
+    char *argument;
+    enum http_code_t status;
+    router_handler_t handler;
+    proxy_t *proxy;
+} router_route_t;
+
+/*
+ * Forward declaration of router functions.
+ * These functions are needed for building the router and matching requests to routes.
+ */
+extern void router_register(const char*, router_handler_t);
+extern bool router_load(const char*, char*, size_t);
+extern const router_route_t *router_match(const char*, enum http_method_t, bool*);
+extern const char *router_remainder(const router_route_t*, const char*);
+extern void router_finalize();
+
+#endif
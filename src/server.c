@@ -4,50 +4,107 @@
  * \author Rodrigo Siqueira <rodriados@gmail.com>
  * \copyright 2014-present Rodrigo Siqueira
  */
+#define _GNU_SOURCE
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
-#include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sched.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 
+#include "config.h"
+#include "colors.h"
+#include "file.h"
+#include "listing.h"
 #include "logger.h"
 #include "request.h"
+#include "limiter.h"
+#include "settings.h"
+#include "endpoint.h"
+#include "loop.h"
+#include "offload.h"
+#include "proxy.h"
 
 #include "server.h"
 
+#define SERVER_LISTENERS_ENV "MU_HTTPD_LISTENERS"
+#define SERVER_READY_ENV     "MU_HTTPD_READY"
+#define SERVER_WARNING_MSG   BG_WARNING(" WARNING ") " %s\n"
+#define SERVER_SOCKET_MSG    BG_SUCCESS(" SOCKET ") FG_INFO(" %s\n")
+#define SERVER_FASTOPEN_PATH "/proc/sys/net/ipv4/tcp_fastopen"
+#define SERVER_ERROR_SIZE    256
+
 /*!
- * \typedef server_request_channel_t
- * \brief The channel type by which requests are passed to server workers.
+ * \struct server_request_channel_t
+ * \brief The channel by which requests are passed to server workers.
+ * The channel is a bounded queue, so that requests are rejected rather than left
+ * waiting for a long time when workers cannot keep up with them.
  * \since 3.0
  */
-typedef request_t *server_request_channel_t;
+typedef struct server_request_channel_t {
+    request_t **queue;
+    size_t capacity;
+    size_t head;
+    size_t count;
+} server_request_channel_t;
 
 /*!
  * \struct server_worker_t
  * \brief The payload sent by the server to initialize a worker.
+ * Each worker keeps its own shards of the file and listing caches and its own pool of
+ * upstream connections, for the requests it serves.
  * \since 3.0
  */
 typedef struct server_worker_t {
     const server_t *server;
     logger_writer_t *logger;
+    file_shard_t *files;
+    listing_shard_t *listings;
+    proxy_pool_t *proxy;
+    limiter_t *limiter;
     server_request_channel_t *request_channel;
+    const socket_id_t *listener;
     uint32_t id;
 } server_worker_t;
 
 /*!
  * \struct server_internal_t
  * \brief The internal server struct for private server functions.
+ * Outside of per-core mode, the requests taken in and not yet answered are counted
+ * by the server itself, as event loops count their own connections.
  * \since 3.0
  */
 typedef struct server_internal_t {
     server_request_channel_t request_channel;
+    atomic_uint inflight;
+    limiter_t *limiter;
+    endpoint_t endpoint[MAX_ENDPOINTS];
+    int endpoint_count;
+    int connections;
+    socket_id_t *listener;
+    int listener_count;
+    socket_id_t *inherited;
+    int inherited_count;
+    int ready;
+    int stop;
+    bool configured;
+    bool handed;
+    char error[SERVER_ERROR_SIZE];
 } server_internal_t;
 
 /*!
@@ -65,11 +122,32 @@ static pthread_mutex_t g_server_mutex;
 static pthread_cond_t g_server_consumer_fence;
 
 /*!
- * \var g_server_producer_fence
- * \brief The condition for signaling that a request may be produced on a channel.
+ * \var g_server_wakeup
+ * \brief The descriptor through which signal handlers wake the server's main thread up.
+ * \since 3.0
+ */
+static int g_server_wakeup = -1;
+
+/*!
+ * \var g_server_upgrade
+ * \brief Signals the server to hand its sockets over to a new server process.
+ * \since 3.0
+ */
+static volatile sig_atomic_t g_server_upgrade = false;
+
+/*!
+ * \var g_server_reload
+ * \brief Signals the server to reload its settings.
+ * \since 3.0
+ */
+static volatile sig_atomic_t g_server_reload = false;
+
+/*!
+ * \var g_server_forced
+ * \brief Signals the server to stop without waiting for its requests to be answered.
  * \since 3.0
  */
-static pthread_cond_t g_server_producer_fence;
+static volatile sig_atomic_t g_server_forced = false;
 
 /*!
  * \var g_server_status
@@ -78,76 +156,497 @@ static pthread_cond_t g_server_producer_fence;
  */
 server_status_t g_server_status = SERVER_UNINITIALIZED;
 
+/*!
+ * \fn void server_handoff_receive(server_internal_t*)
+ * \brief Takes over the sockets handed over by the server process being replaced.
+ * A server started by another server's upgrade inherits its listening sockets, and
+ * the descriptor through which it must report when it is ready to serve clients.
+ * \param internal The internal state of the server taking the sockets over.
+ */
+void server_handoff_receive(server_internal_t *internal)
+{
+    char *end;
+    const char *ready = getenv(SERVER_READY_ENV);
+    const char *listeners = getenv(SERVER_LISTENERS_ENV);
+
+    internal->ready = ready != NULL ? atoi(ready) : -1;
+
+    if (internal->ready != -1)
+        fcntl(internal->ready, F_SETFD, FD_CLOEXEC);
+
+    for (const char *cursor = listeners; cursor != NULL && *cursor != '\0'; cursor = end) {
+        socket_id_t socket_id = (socket_id_t) strtol(cursor, &end, 10);
+
+        if (end == cursor)
+            break;
+
+        internal->inherited = realloc(internal->inherited, (internal->inherited_count + 1) * sizeof(socket_id_t));
+        internal->inherited[internal->inherited_count++] = socket_id;
+
+        if (*end == ',')
+            ++end;
+    }
+
+    // The variables are removed, so that they are not passed on to any other program
+    // the server might execute later on.
+    unsetenv(SERVER_READY_ENV);
+    unsetenv(SERVER_LISTENERS_ENV);
+}
+
+/*!
+ * \fn socket_id_t server_socket_inherit(server_internal_t*, const endpoint_t*)
+ * \brief Takes over a listening socket inherited from a previous server process.
+ * \param internal The internal state of the server taking the socket over.
+ * \param endpoint The endpoint the socket must be bound to.
+ * \return The inherited socket, or -1 if none is bound to the endpoint.
+ */
+socket_id_t server_socket_inherit(server_internal_t *internal, const endpoint_t *endpoint)
+{
+    for (int i = 0; i < internal->inherited_count; ++i) {
+        socket_id_t socket_id = internal->inherited[i];
+
+        if (endpoint_match(endpoint, socket_id)) {
+            internal->inherited[i] = internal->inherited[--internal->inherited_count];
+            fcntl(socket_id, F_SETFL, fcntl(socket_id, F_GETFL) | O_NONBLOCK);
+            fcntl(socket_id, F_SETFD, FD_CLOEXEC);
+            return socket_id;
+        }
+    }
+
+    return -1;
+}
+
+/*!
+ * \fn void server_socket_warn(const char*, const char*)
+ * \brief Warns that a socket option configured for the server could not be used as is.
+ * \param name The name of the socket option's setting.
+ * \param reason The reason the option could not be used.
+ */
+void server_socket_warn(const char *name, const char *reason)
+{
+    char message[SERVER_ERROR_SIZE];
+
+    snprintf(message, sizeof(message), "Socket option %s: %s", name, reason);
+    fprintf(stderr, SERVER_WARNING_MSG, message);
+}
+
+/*!
+ * \fn bool server_socket_option(socket_id_t, int, int, int, const char*, bool)
+ * \brief Sets an option on a listening socket.
+ * \param socket_id The socket to set the option on.
+ * \param level The protocol level the option belongs to.
+ * \param option The option to be set.
+ * \param value The option's new value.
+ * \param name The name of the option's setting, to be reported on failure.
+ * \param report Must a failure be reported?
+ * \return Has the option been set?
+ */
+bool server_socket_option(socket_id_t socket_id, int level, int option, int value, const char *name, bool report)
+{
+    if (setsockopt(socket_id, level, option, &value, sizeof(int)) == 0)
+        return true;
+
+    if (report)
+        server_socket_warn(name, strerror(errno));
+
+    return false;
+}
+
+/*!
+ * \fn void server_socket_buffer(socket_id_t, int, size_t, const char*, bool)
+ * \brief Sets the size of a listening socket's buffer, inherited by its connections.
+ * The kernel doubles the requested size for its own bookkeeping, but also caps it to
+ * a system-wide maximum, in which case the server warns about the smaller buffer.
+ * \param socket_id The socket to set the buffer size of.
+ * \param option The buffer to be sized.
+ * \param size The requested buffer size, or zero for the system default.
+ * \param name The name of the buffer size's setting, to be reported on failure.
+ * \param report Must a failure be reported?
+ */
+void server_socket_buffer(socket_id_t socket_id, int option, size_t size, const char *name, bool report)
+{
+    int actual = 0;
+    socklen_t l = sizeof(int);
+    char reason[SERVER_ERROR_SIZE];
+
+    if (size == 0 || !server_socket_option(socket_id, SOL_SOCKET, option, (int) size, name, report))
+        return;
+
+    if (report && getsockopt(socket_id, SOL_SOCKET, option, &actual, &l) == 0 && (size_t) actual < 2 * size) {
+        snprintf(reason, sizeof(reason), "limited to %d bytes by net.core.%s", actual / 2
+          , option == SO_SNDBUF ? "wmem_max" : "rmem_max");
+        server_socket_warn(name, reason);
+    }
+}
+
+/*!
+ * \fn bool server_fastopen_enabled()
+ * \brief Checks whether the system allows TCP Fast Open on listening sockets.
+ * \return Is TCP Fast Open enabled for servers?
+ */
+bool server_fastopen_enabled()
+{
+    int flags = 0;
+    FILE *sysctl = fopen(SERVER_FASTOPEN_PATH, "r");
+
+    if (sysctl == NULL)
+        return true;
+
+    if (fscanf(sysctl, "%d", &flags) != 1)
+        flags = 0x2;
+
+    fclose(sysctl);
+    return (flags & 0x2) != 0;
+}
+
+/*!
+ * \fn void server_socket_configure(server_internal_t*, socket_id_t, int)
+ * \brief Sets the configured options on a listening socket.
+ * Connections accepted from a listening socket inherit its options, so that they do
+ * not need to be set again for every connection. Options are also set on inherited
+ * sockets, as settings may have changed since the previous server process set them.
+ * Failures are only reported for the first TCP socket, as all sockets share the same
+ * options. No failure prevents the server from starting.
+ * \param internal The internal state of the server the socket belongs to.
+ * \param socket_id The listening socket to be configured.
+ * \param family The address family of the socket.
+ */
+void server_socket_configure(server_internal_t *internal, socket_id_t socket_id, int family)
+{
+    const settings_t *settings = settings_current();
+    bool report = !internal->configured;
+
+    // Unix domain sockets have no TCP options, and cannot reuse the address of a socket
+    // left behind on the filesystem, so only their buffers are sized.
+    if (family == AF_UNIX) {
+        server_socket_buffer(socket_id, SO_SNDBUF, settings->send_buffer, "send_buffer", false);
+        server_socket_buffer(socket_id, SO_RCVBUF, settings->receive_buffer, "receive_buffer", false);
+        return;
+    }
+
+    // Connections are only accepted once their first data arrives, so that workers and
+    // event loops are not woken up for clients that have not yet sent their requests.
+    // The kernel counts the deferral in seconds, so it is rounded up.
+    int defer = (int) ((settings->defer_accept + 999) / 1000);
+
+    if (settings->reuseaddr)
+        server_socket_option(socket_id, SOL_SOCKET, SO_REUSEADDR, 1, "reuseaddr", report);
+
+    server_socket_option(socket_id, IPPROTO_TCP, TCP_NODELAY, (int) settings->nodelay, "nodelay", report && settings->nodelay);
+    server_socket_option(socket_id, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer, "defer_accept", report && defer);
+    server_socket_option(socket_id, IPPROTO_TCP, TCP_FASTOPEN, (int) settings->fastopen, "fastopen", report && settings->fastopen);
+    server_socket_buffer(socket_id, SO_SNDBUF, settings->send_buffer, "send_buffer", report);
+    server_socket_buffer(socket_id, SO_RCVBUF, settings->receive_buffer, "receive_buffer", report);
+
+    if (report && settings->fastopen && !server_fastopen_enabled())
+        server_socket_warn("fastopen", "disabled for servers by net.ipv4.tcp_fastopen");
+
+    internal->configured = true;
+}
+
+/*!
+ * \fn void server_socket_report(socket_id_t)
+ * \brief Reports the options in effect on a listening socket to the terminal.
+ * The options are read back from the socket, so that the values reported are the
+ * ones actually used by the kernel.
+ * \param socket_id The listening socket to be reported.
+ */
+void server_socket_report(socket_id_t socket_id)
+{
+    socklen_t l = sizeof(int);
+    char message[SERVER_ERROR_SIZE];
+    int reuseaddr = 0, nodelay = 0, defer = 0, fastopen = 0, sndbuf = 0, rcvbuf = 0;
+
+    getsockopt(socket_id, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, &l);
+    getsockopt(socket_id, IPPROTO_TCP, TCP_NODELAY, &nodelay, &l);
+    getsockopt(socket_id, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, &l);
+    getsockopt(socket_id, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, &l);
+    getsockopt(socket_id, SOL_SOCKET, SO_SNDBUF, &sndbuf, &l);
+    getsockopt(socket_id, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &l);
+
+    snprintf(message, sizeof(message)
+      , "reuseaddr=%d nodelay=%d cork=%u defer_accept=%ds fastopen=%d send_buffer=%d receive_buffer=%d"
+      , reuseaddr != 0, nodelay != 0, settings_current()->cork, defer, fastopen, sndbuf, rcvbuf);
+
+    fprintf(stderr, SERVER_SOCKET_MSG, message);
+}
+
+/*!
+ * \fn socket_id_t server_socket_fail(server_internal_t*, socket_id_t, const char*)
+ * \brief Records why a listening socket could not be opened, and closes it.
+ * \param internal The internal state of the server the socket was being opened for.
+ * \param socket_id The socket which could not be opened, or -1 if none was created.
+ * \param call The name of the call which has failed.
+ * \return Always -1, as no socket has been opened.
+ */
+socket_id_t server_socket_fail(server_internal_t *internal, socket_id_t socket_id, const char *call)
+{
+    snprintf(internal->error, sizeof(internal->error), "%s: %s", call, strerror(errno));
+
+    if (socket_id != -1)
+        close(socket_id);
+
+    return -1;
+}
+
+/*!
+ * \fn socket_id_t server_socket_open(server_internal_t*, endpoint_t*, server_mode_t)
+ * \brief Opens a new socket listening on one of the server's endpoints.
+ * \param internal The internal state of the server the socket is being opened for.
+ * \param endpoint The endpoint the socket must listen on.
+ * \param mode The server mode the socket is being opened for.
+ * \return The new listening socket, or -1 if it could not be opened.
+ */
+socket_id_t server_socket_open(server_internal_t *internal, endpoint_t *endpoint, server_mode_t mode)
+{
+    int enable = 1, disable = 0;
+    int family = endpoint->address.ss_family;
+    socket_id_t socket_id = server_socket_inherit(internal, endpoint);
+
+    if (socket_id != -1) {
+        server_socket_configure(internal, socket_id, family);
+        return socket_id;
+    }
+
+    // Listening sockets are always polled before a connection is accepted from them.
+    // In shared mode, the listening sockets are polled by the server's main thread,
+    // while in reuseport mode, each worker polls its own sockets. In per-core mode, each
+    // event loop polls its own sockets alongside its connections. Thus, in all modes,
+    // a stop request can be noticed while waiting for connections. Unix domain sockets
+    // cannot be bound more than once, so a single socket is polled by all workers.
+    bool reuseport = family != AF_UNIX && (mode == SERVER_MODE_REUSEPORT || mode == SERVER_MODE_PERCORE);
+    socket_id = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (socket_id == -1)
+        return server_socket_fail(internal, socket_id, "socket");
+
+    server_socket_configure(internal, socket_id, family);
+
+    if (reuseport && setsockopt(socket_id, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) == -1)
+        return server_socket_fail(internal, socket_id, "setsockopt");
+
+    // IPv6 sockets accept IPv4 clients as well, so that a single endpoint is enough to
+    // serve both protocols, regardless of the system's default.
+    if (family == AF_INET6 && setsockopt(socket_id, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(int)) == -1)
+        return server_socket_fail(internal, socket_id, "setsockopt");
+
+    if (family == AF_UNIX)
+        endpoint_unlink_stale(endpoint);
+
+    if (bind(socket_id, (struct sockaddr*) &endpoint->address, endpoint->length) == -1)
+        return server_socket_fail(internal, socket_id, "bind");
+
+    if (listen(socket_id, internal->connections) == -1)
+        return server_socket_fail(internal, socket_id, "listen");
+
+    endpoint_update(endpoint, socket_id);
+
+    return socket_id;
+}
+
+/*!
+ * \fn bool server_listener_owned(const server_internal_t*, int)
+ * \brief Checks whether a listener is the only one holding its socket.
+ * Unix domain sockets are shared by all workers, so that their socket is held only by
+ * the first worker's listener.
+ * \param internal The internal state of the server the listener belongs to.
+ * \param index The listener's index.
+ * \return Is the listener's socket its own?
+ */
+bool server_listener_owned(const server_internal_t *internal, int index)
+{
+    return index < internal->endpoint_count
+        || internal->endpoint[index % internal->endpoint_count].address.ss_family != AF_UNIX;
+}
+
 /*!
  * \fn server_status_t server_create(server_t*, int)
- * \brief Creates a server and opens a new TCP socket.
+ * \brief Creates a server and opens a socket listening on each of its endpoints.
  * \param server The server instance to be created.
  * \param connections The server's maximum number of simultaneous connections.
  * \return The server status after its creation.
  */
 extern server_status_t server_create(server_t *server, int connections)
 {
-    struct sockaddr_in localaddr;
+    server_internal_t *internal = calloc(1, sizeof(server_internal_t));
 
-    memset(&localaddr, 0, sizeof(struct sockaddr_in));
+    internal->connections = connections;
+    internal->endpoint_count = endpoint_parse(server->address, server->port, internal->endpoint, MAX_ENDPOINTS);
 
-    localaddr.sin_family = AF_INET;
-    localaddr.sin_addr.s_addr = inet_addr(server->address);
-    localaddr.sin_port = htons(server->port);
+    if (internal->endpoint_count < 0)
+        snprintf(internal->error, sizeof(internal->error), "Invalid address list: %s", server->address);
 
-    server->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    server_handoff_receive(internal);
 
-    bind(server->socket, (struct sockaddr*) &localaddr, sizeof(struct sockaddr_in));
-    listen(server->socket, connections);
+    internal->listener = malloc(MAX_ENDPOINTS * sizeof(socket_id_t));
 
-    g_server_status = errno || server->socket == -1
+    g_server_status = server->mode == SERVER_MODE_UNKNOWN || internal->endpoint_count <= 0
         ? SERVER_FAIL_CREATE_SOCKET
         : SERVER_SUCCESS;
 
-    server->address = inet_ntoa(localaddr.sin_addr);
-    server->port = ntohs(localaddr.sin_port);
+    while (internal->listener_count < internal->endpoint_count && g_server_status == SERVER_SUCCESS) {
+        endpoint_t *endpoint = &internal->endpoint[internal->listener_count];
+        socket_id_t socket_id = server_socket_open(internal, endpoint, server->mode);
 
-    if (g_server_status == SERVER_SUCCESS)
-        server->_internal = calloc(1, sizeof(server_internal_t));
+        if (socket_id != -1)
+            internal->listener[internal->listener_count++] = socket_id;
+        else
+            g_server_status = SERVER_FAIL_CREATE_SOCKET;
+    }
+
+    if (g_server_status == SERVER_SUCCESS) {
+        int reported = 0;
+
+        // The options of a TCP socket are reported, as Unix domain sockets have none.
+        while (reported + 1 < internal->endpoint_count && internal->endpoint[reported].address.ss_family == AF_UNIX)
+            ++reported;
+
+        server->_internal = internal;
+        server_socket_report(internal->listener[reported]);
+    } else {
+        if (internal->error[0] != '\0')
+            fprintf(stderr, SERVER_WARNING_MSG, internal->error);
+
+        for (int i = 0; i < internal->listener_count; ++i)
+            close(internal->listener[i]);
+
+        while (internal->inherited_count > 0)
+            close(internal->inherited[--internal->inherited_count]);
+
+        free(internal->listener);
+        free(internal->inherited);
+        free(internal);
+    }
 
     return g_server_status;
 }
 
+/*!
+ * \fn bool server_endpoint_describe(const server_t*, int, char*, size_t)
+ * \brief Describes one of the endpoints the server is listening on.
+ * \param server The server to describe the endpoint of.
+ * \param index The index of the endpoint to be described.
+ * \param buffer The buffer to write the description to.
+ * \param size The buffer's size.
+ * \return Is there an endpoint with the given index?
+ */
+extern bool server_endpoint_describe(const server_t *server, int index, char *buffer, size_t size)
+{
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    if (index >= internal->endpoint_count)
+        return false;
+
+    endpoint_describe(&internal->endpoint[index], buffer, size);
+    return true;
+}
+
+/*!
+ * \fn bool server_listeners_open(const server_t*, int)
+ * \brief Opens all listening sockets needed by the server's workers or event loops.
+ * Every worker gets a listener for each of the server's endpoints. The first worker's
+ * listeners are the sockets which have been opened when the server was created, while
+ * the others are bound to the same endpoints with SO_REUSEPORT. No more sockets are
+ * opened once one of them fails, and the listeners left without a socket are set to -1.
+ * \param server The server to open the listening sockets for.
+ * \param count The number of workers needing listening sockets.
+ * \return Has every worker got a socket listening on each of the server's endpoints?
+ */
+bool server_listeners_open(const server_t *server, int count)
+{
+    bool success = true;
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+    int endpoints = internal->endpoint_count;
+
+    internal->listener = realloc(internal->listener, count * endpoints * sizeof(socket_id_t));
+    internal->listener_count = count * endpoints;
+
+    for (int i = endpoints; i < internal->listener_count; ++i) {
+        if (!success)
+            internal->listener[i] = -1;
+        else if (server_listener_owned(internal, i))
+            internal->listener[i] = server_socket_open(internal, &internal->endpoint[i % endpoints], server->mode);
+        else
+            internal->listener[i] = internal->listener[i % endpoints];
+
+        success = internal->listener[i] != -1;
+    }
+
+    // Inherited sockets left over are only found when the server is started with fewer
+    // workers or endpoints than the process it has replaced. Clients still waiting on
+    // them are lost.
+    while (internal->inherited_count > 0)
+        close(internal->inherited[--internal->inherited_count]);
+
+    return success;
+}
+
+/*!
+ * \fn void server_listeners_close(const server_t*)
+ * \brief Closes all listening sockets opened for the server's workers or event loops.
+ * The sockets opened when the server was created are only closed when the server is
+ * destroyed.
+ * \param server The server to close the listening sockets of.
+ */
+void server_listeners_close(const server_t *server)
+{
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    for (int i = internal->endpoint_count; i < internal->listener_count; ++i)
+        if (internal->listener[i] != -1 && server_listener_owned(internal, i))
+            close(internal->listener[i]);
+
+    internal->listener_count = internal->endpoint_count;
+}
+
 /*!
  * \fn request_t *server_request_channel_receive(server_request_channel_t*)
  * \brief Waits for a new request from the channel within a worker.
+ * Requests still in the channel are handed out even after the server has stopped.
  * \param channel The channel to wait a new request from.
- * \return The received request connection.
+ * \return The received request connection, or NULL if the server has stopped.
  */
 request_t *server_request_channel_receive(server_request_channel_t *channel)
 {
     pthread_mutex_lock(&g_server_mutex);
-    pthread_cond_wait(&g_server_consumer_fence, &g_server_mutex);
 
-    request_t *request = *channel;
-    *channel = (request_t*) NULL;
+    while (channel->count == 0 && g_server_status == SERVER_SUCCESS)
+        pthread_cond_wait(&g_server_consumer_fence, &g_server_mutex);
+
+    request_t *request = NULL;
+
+    if (channel->count > 0) {
+        request = channel->queue[channel->head];
+        channel->head = (channel->head + 1) % channel->capacity;
+        --channel->count;
+    }
 
-    pthread_cond_signal(&g_server_producer_fence);
     pthread_mutex_unlock(&g_server_mutex);
 
     return request;
 }
 
 /*!
- * \fn void server_request_channel_post(server_request_channel_t*, request_t*)
- * \brief Posts a new request to the channel and waits for worker to consume it.
+ * \fn bool server_request_channel_post(server_request_channel_t*, request_t*)
+ * \brief Posts a new request to the channel, unless the channel is full.
  * \param channel The channel to send the request to.
  * \param request The request to be sent to a worker.
+ * \return Has the request been posted to the channel?
  */
-void server_request_channel_post(server_request_channel_t *channel, request_t *request)
+bool server_request_channel_post(server_request_channel_t *channel, request_t *request)
 {
     pthread_mutex_lock(&g_server_mutex);
 
-    *channel = request;
+    bool posted = channel->count < channel->capacity;
+
+    if (posted) {
+        channel->queue[(channel->head + channel->count++) % channel->capacity] = request;
+        pthread_cond_signal(&g_server_consumer_fence);
+    }
 
-    pthread_cond_signal(&g_server_consumer_fence);
-    pthread_cond_wait(&g_server_producer_fence, &g_server_mutex);
     pthread_mutex_unlock(&g_server_mutex);
+
+    return posted;
 }
 
 /*!
@@ -175,24 +674,130 @@ void server_cleanup_request(request_t *request)
  */
 void server_cleanup_worker(server_worker_t *worker)
 {
+    file_shard_bind(NULL);
+    file_shard_destroy(worker->files);
+    listing_shard_bind(NULL);
+    listing_shard_destroy(worker->listings);
+    proxy_pool_bind(NULL);
+    proxy_pool_destroy(worker->proxy);
     logger_writer_finalize(worker->logger);
     free(worker);
 }
 
 /*!
- * \fn void server_worker_request_wait(server_worker_t*)
+ * \fn bool server_request_admit(server_internal_t*)
+ * \brief Takes a request in, unless the server is already serving as many as it may.
+ * \param internal The server's internal state.
+ * \return Has the request been taken in?
+ */
+bool server_request_admit(server_internal_t *internal)
+{
+    if (atomic_fetch_add(&internal->inflight, 1) < settings_current()->max_inflight)
+        return true;
+
+    atomic_fetch_sub(&internal->inflight, 1);
+    return false;
+}
+
+/*!
+ * \fn bool server_memory_exceeded()
+ * \brief Checks whether the requests being processed by workers hold more memory than
+ * the server's budget, in which case no new client is accepted until some is released.
+ * \return Is the server over its memory budget?
+ */
+bool server_memory_exceeded()
+{
+    return request_memory() > settings_current()->memory_budget;
+}
+
+/*!
+ * \fn void server_worker_request_process(server_worker_t*, request_t*)
+ * \brief Processes a request taken in, unless its client has gone over its rate limit.
+ * \param worker The worker processing the request.
+ * \param request The request to be processed.
+ */
+void server_worker_request_process(server_worker_t *worker, request_t *request)
+{
+    server_internal_t *internal = (server_internal_t*) worker->server->_internal;
+
+    if (worker->limiter != NULL && !limiter_allow(worker->limiter, (struct sockaddr*) &request->origin))
+        request_reject(request, HTTP_RESPONSE_TOO_MANY_REQUESTS);
+    else
+        request_process(request, worker->logger);
+
+    atomic_fetch_sub(&internal->inflight, 1);
+}
+
+/*!
+ * \fn bool server_worker_request_wait(server_worker_t*)
  * \brief Waits for a new request from channel and processes it.
  * \param worker The worker to wait for a request.
+ * \return Has a request been processed?
  */
-void server_worker_request_wait(server_worker_t *worker)
+bool server_worker_request_wait(server_worker_t *worker)
 {
     request_t *request = server_request_channel_receive(worker->request_channel);
 
     if (request != NULL) {
         pthread_cleanup_push((server_cleanup_func) &server_cleanup_request, request);
-        request_process(request, worker->logger);
+        server_worker_request_process(worker, request);
         pthread_cleanup_pop(true);
     }
+
+    return request != NULL;
+}
+
+request_t *server_connection_accept(socket_id_t, server_status_t*);
+
+/*!
+ * \fn server_status_t server_worker_connection_wait(server_worker_t*)
+ * \brief Waits for new connections on the worker's own sockets and processes them.
+ * While the server is over its memory budget, the worker stops accepting clients, and
+ * only checks back on the budget every tick. Clients taken in while the server already
+ * serves as many requests as it may are rejected.
+ * \param worker The worker to wait for a connection.
+ * \return The worker's status after waiting for a connection.
+ */
+server_status_t server_worker_connection_wait(server_worker_t *worker)
+{
+    struct pollfd fds[MAX_ENDPOINTS + 1];
+    server_status_t status = SERVER_SUCCESS;
+    server_internal_t *internal = (server_internal_t*) worker->server->_internal;
+
+    bool paused = server_memory_exceeded();
+    int count = paused ? 0 : internal->endpoint_count;
+
+    // The server's stop descriptor is never read from, so once the server has stopped,
+    // it wakes up every worker still waiting for a connection.
+    fds[0] = (struct pollfd) { .fd = internal->stop, .events = POLLIN };
+
+    for (int i = 0; i < count; ++i)
+        fds[i + 1] = (struct pollfd) { .fd = worker->listener[i], .events = POLLIN };
+
+    if (poll(fds, count + 1, paused ? TIMER_TICK : -1) == -1 || (fds[0].revents & POLLIN))
+        return SERVER_SUCCESS;
+
+    // Sockets shared with other workers may have had their clients taken by the time
+    // this worker accepts from them, in which case nothing is accepted. Other workers
+    // may also have gone over the memory budget meanwhile, in which case clients are
+    // left waiting in the backlog.
+    for (int i = 0; i < count && status == SERVER_SUCCESS && !server_memory_exceeded(); ++i) {
+        if (!(fds[i + 1].revents & POLLIN))
+            continue;
+
+        request_t *request = server_connection_accept(worker->listener[i], &status);
+
+        if (request != NULL && !server_request_admit(internal)) {
+            request_reject(request, HTTP_RESPONSE_SERVICE_UNAVAILABLE);
+            server_cleanup_request(request);
+        } else if (request != NULL) {
+            pthread_cleanup_push((server_cleanup_func) &server_cleanup_request, request);
+            server_worker_request_process(worker, request);
+            pthread_cleanup_pop(true);
+        }
+    }
+
+    return status;
 }
 
 /*!
@@ -204,8 +809,21 @@ void *server_worker_thread_run(void *worker)
 {
     pthread_cleanup_push((server_cleanup_func) &server_cleanup_worker, worker);
 
-    while (g_server_status == SERVER_SUCCESS)
-        server_worker_request_wait((server_worker_t*) worker);
+    const server_t *server = ((server_worker_t*) worker)->server;
+    server_status_t worker_status = SERVER_SUCCESS;
+
+    file_shard_bind(((server_worker_t*) worker)->files);
+    listing_shard_bind(((server_worker_t*) worker)->listings);
+    proxy_pool_bind(((server_worker_t*) worker)->proxy);
+
+    // In shared mode, workers keep on processing the requests already taken in by the
+    // server after it has stopped, and only leave once the request channel is empty.
+    if (server->mode == SERVER_MODE_REUSEPORT) {
+        while ((g_server_status | worker_status) == SERVER_SUCCESS)
+            worker_status = server_worker_connection_wait((server_worker_t*) worker);
+    } else {
+        while (server_worker_request_wait((server_worker_t*) worker));
+    }
 
     pthread_cleanup_pop(1);
     return NULL;
@@ -228,68 +846,473 @@ pthread_t server_worker_initialize(const server_t *server, logger_t *logger, int
 
     worker->server = server;
     worker->logger = logger_writer_initialize(logger);
+    worker->files = file_shard_create();
+    worker->listings = listing_shard_create();
+    worker->proxy = proxy_pool_create();
+    worker->limiter = internal->limiter;
     worker->request_channel = &internal->request_channel;
+    worker->listener = NULL;
     worker->id = id;
 
+    // In reuseport mode, every worker listens on its own sockets bound to the server's
+    // endpoints, and never shares a request channel.
+    if (server->mode == SERVER_MODE_REUSEPORT)
+        worker->listener = &internal->listener[id * internal->endpoint_count];
+
     pthread_create(&worker_thread, NULL, &server_worker_thread_run, (void*) worker);
 
     return worker_thread;
 }
 
 /*!
- * \fn server_status_t server_connection_wait(const server_t*)
- * \brief Sets the server to wait for a new client request.
- * \param server The server instance to wait for a new request.
- * \return The current server status.
+ * \fn request_t *server_connection_accept(socket_id_t, server_status_t*)
+ * \brief Accepts a new client connection from a listening socket.
+ * \param socket_id The listening socket to accept a connection from.
+ * \param status The server status after waiting for a connection.
+ * \return The new client request, or NULL if no connection was accepted.
  */
-server_status_t server_connection_wait(const server_t *server)
+request_t *server_connection_accept(socket_id_t socket_id, server_status_t *status)
 {
-    struct sockaddr_in client_address;
+    struct sockaddr_storage client_address;
 
-    socklen_t l = sizeof(struct sockaddr_in);
-    socket_id_t client_socket = accept(server->socket, (struct sockaddr*) &client_address, &l);
+    socklen_t l = sizeof(struct sockaddr_storage);
+    socket_id_t client_socket = accept4(socket_id, (struct sockaddr*) &client_address, &l, SOCK_CLOEXEC);
 
-    if (client_socket == -1)
-        return (errno != EAGAIN && errno != EWOULDBLOCK)
+    if (client_socket == -1) {
+        *status = (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
             ? SERVER_FAIL_ACCEPT_CLIENT
             : SERVER_SUCCESS;
+        return NULL;
+    }
+
+    // Workers block while receiving requests and sending replies, so a client must not
+    // be able to hold on to a worker for longer than the header and write deadlines.
+    const settings_t *settings = settings_current();
+    struct timeval recv_timeout = { .tv_sec = settings->timeout_header / 1000, .tv_usec = (settings->timeout_header % 1000) * 1000 };
+    struct timeval send_timeout = { .tv_sec = settings->timeout_write / 1000, .tv_usec = (settings->timeout_write % 1000) * 1000 };
+
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(struct timeval));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(struct timeval));
 
     request_t *request = malloc(sizeof(request_t));
-    server_internal_t *internal = (server_internal_t*) server->_internal;
 
     request->client = client_socket;
     request->origin = client_address;
 
-    // Posting the request to the channel, so a worker can consume it.
-    // Control is only returned when it is confirmed that a worker has consumed from
-    // the channel and consequently will process the request.
-    server_request_channel_post(&internal->request_channel, request);
+    *status = SERVER_SUCCESS;
+    return request;
+}
+
+/*!
+ * \fn server_status_t server_connection_wait(const server_t*, socket_id_t)
+ * \brief Accepts a new client from one of the server's listening sockets.
+ * \param server The server instance to accept a new client for.
+ * \param socket_id The listening socket to accept the client from.
+ * \return The current server status.
+ */
+server_status_t server_connection_wait(const server_t *server, socket_id_t socket_id)
+{
+    server_status_t status;
+    request_t *request = server_connection_accept(socket_id, &status);
+
+    if (request == NULL)
+        return status;
+
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    // Posting the request to the channel, so a worker can consume it. When too many
+    // requests are already being served or waiting for a worker, the request is promptly
+    // rejected, so that the server degrades gracefully instead of letting every request
+    // time out.
+    if (!server_request_admit(internal)) {
+        request_reject(request, HTTP_RESPONSE_SERVICE_UNAVAILABLE);
+        server_cleanup_request(request);
+    } else if (!server_request_channel_post(&internal->request_channel, request)) {
+        atomic_fetch_sub(&internal->inflight, 1);
+        request_reject(request, HTTP_RESPONSE_SERVICE_UNAVAILABLE);
+        server_cleanup_request(request);
+    }
 
     return SERVER_SUCCESS;
 }
 
+/*!
+ * \fn server_status_t server_wait(const server_t*)
+ * \brief Waits on the server's main thread for a signal or, in shared mode, clients.
+ * In shared mode, no client is accepted while the server is over its memory budget,
+ * which is only checked back on every tick.
+ * \param server The server instance to wait on.
+ * \return The current server status.
+ */
+server_status_t server_wait(const server_t *server)
+{
+    uint64_t value;
+    struct pollfd fds[MAX_ENDPOINTS + 1];
+    server_status_t status = SERVER_SUCCESS;
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    bool paused = server->mode == SERVER_MODE_SHARED && server_memory_exceeded();
+    int count = server->mode == SERVER_MODE_SHARED && !paused ? internal->endpoint_count : 0;
+    fds[0] = (struct pollfd) { .fd = g_server_wakeup, .events = POLLIN };
+
+    for (int i = 0; i < count; ++i)
+        fds[i + 1] = (struct pollfd) { .fd = internal->listener[i], .events = POLLIN };
+
+    if (poll(fds, count + 1, paused ? TIMER_TICK : -1) == -1)
+        return SERVER_SUCCESS;
+
+    if (fds[0].revents & POLLIN) {
+        ssize_t ignored = read(g_server_wakeup, &value, sizeof(uint64_t));
+        (void) ignored;
+    }
+
+    for (int i = 0; i < count && status == SERVER_SUCCESS && !server_memory_exceeded(); ++i)
+        if (fds[i + 1].revents & POLLIN)
+            status = server_connection_wait(server, internal->listener[i]);
+
+    return status;
+}
+
+/*!
+ * \fn void server_wakeup()
+ * \brief Wakes the server's main thread up, so that it handles a signal.
+ */
+void server_wakeup()
+{
+    uint64_t value = 1;
+
+    ssize_t ignored = write(g_server_wakeup, &value, sizeof(uint64_t));
+    (void) ignored;
+}
+
 /*!
  * \fn void server_force_stop(int)
- * \brief Forces the server to stop and wakes up all waiting threads.
+ * \brief Requests the server to stop, and wakes its main thread up.
+ * The server stops once all requests already taken in have been answered, unless
+ * it is requested to stop for a second time while doing so.
  * \param signal (ignored)
  */
 void server_force_stop(int signal)
 {
+    if (g_server_status == SERVER_STOP_REQUESTED)
+        g_server_forced = true;
+
     g_server_status = SERVER_STOP_REQUESTED;
+    server_wakeup();
+}
+
+/*!
+ * \fn void server_force_upgrade(int)
+ * \brief Requests the server to be replaced by a new server process.
+ * \param signal (ignored)
+ */
+void server_force_upgrade(int signal)
+{
+    g_server_upgrade = true;
+    server_wakeup();
+}
+
+/*!
+ * \fn void server_force_reload(int)
+ * \brief Requests the server to reload its settings.
+ * \param signal (ignored)
+ */
+void server_force_reload(int signal)
+{
+    g_server_reload = true;
+    server_wakeup();
+}
+
+/*!
+ * \fn void server_reload()
+ * \brief Reloads the server's settings, which are used by every request from then on.
+ * The server keeps its current settings if the new ones cannot be loaded.
+ */
+void server_reload()
+{
+    char error[SETTINGS_ERROR_SIZE];
+
+    if (!settings_reload(error, sizeof(error)) || *error != '\0')
+        fprintf(stderr, SERVER_WARNING_MSG, error);
+}
+
+/*!
+ * \fn bool server_handoff(const server_t*)
+ * \brief Hands the server's listening sockets over to a new server process.
+ * The server's binary is executed anew with the same arguments, and the new process
+ * inherits the listening sockets rather than opening its own. Clients keep on being
+ * queued on the sockets while the new process starts up, so none is turned away.
+ * \param server The server instance whose sockets must be handed over.
+ * \return Has the new server process taken over the sockets?
+ */
+bool server_handoff(const server_t *server)
+{
+    extern char **environ;
+
+    int ready[2];
+    char byte = 0;
+    size_t count = 0;
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    if (server->argv == NULL || pipe2(ready, O_CLOEXEC) == -1)
+        return false;
+
+    while (environ[count] != NULL)
+        ++count;
+
+    char ready_variable[sizeof(SERVER_READY_ENV) + 12];
+    char *listeners_variable = malloc(sizeof(SERVER_LISTENERS_ENV) + 12 * internal->listener_count);
+    char **envp = malloc((count + 3) * sizeof(char*));
+
+    int length = sprintf(listeners_variable, "%s=", SERVER_LISTENERS_ENV);
+    sprintf(ready_variable, "%s=%d", SERVER_READY_ENV, ready[1]);
+
+    for (int i = 0; i < internal->listener_count; ++i)
+        if (internal->listener[i] != -1 && server_listener_owned(internal, i))
+            length += sprintf(
+                listeners_variable + length, "%s%d"
+              , length > (int) sizeof(SERVER_LISTENERS_ENV) ? "," : ""
+              , internal->listener[i]
+            );
+
+    memcpy(envp, environ, count * sizeof(char*));
+    envp[count + 0] = listeners_variable;
+    envp[count + 1] = ready_variable;
+    envp[count + 2] = NULL;
+
+    pid_t pid = fork();
+
+    // Every descriptor but the ones being handed over is closed when the new binary is
+    // executed, so that no client served by this process is kept open by the new one.
+    if (pid == 0) {
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+
+        for (int i = 0; i < internal->listener_count; ++i)
+            if (internal->listener[i] != -1 && server_listener_owned(internal, i))
+                fcntl(internal->listener[i], F_SETFD, 0);
+
+        fcntl(ready[1], F_SETFD, 0);
+        execvpe(server->argv[0], server->argv, envp);
+        _exit(EXIT_FAILURE);
+    }
+
+    free(listeners_variable);
+    free(envp);
+    close(ready[1]);
+
+    int result = -1;
+    int timeout = (int) settings_current()->handoff_timeout;
+    struct pollfd fd = { .fd = ready[0], .events = POLLIN };
+
+    // The new process reports it is ready by writing to the pipe. If it exits or takes
+    // too long to do so, it is killed and this process keeps on serving clients.
+    while (pid != -1 && (result = poll(&fd, 1, timeout)) == -1 && errno == EINTR);
+
+    bool handed = result > 0 && read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+
+    if (pid != -1 && !handed) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+
+    return handed;
+}
+
+/*!
+ * \fn void server_handoff_complete(server_internal_t*)
+ * \brief Reports to the replaced server process that the server is ready.
+ * \param internal The internal state of the server which has taken the sockets over.
+ */
+void server_handoff_complete(server_internal_t *internal)
+{
+    char byte = 1;
+
+    if (internal->ready != -1) {
+        ssize_t ignored = write(internal->ready, &byte, 1);
+        (void) ignored;
+
+        close(internal->ready);
+        internal->ready = -1;
+    }
+}
+
+/*!
+ * \fn uint64_t server_drain_deadline()
+ * \brief Computes the time by which the server must have finished draining.
+ * \return The deadline, in nanoseconds of the realtime clock.
+ */
+uint64_t server_drain_deadline()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec
+        + (uint64_t) settings_current()->drain_timeout * 1000000ull;
+}
+
+/*!
+ * \fn bool server_drain_slice(uint64_t, struct timespec*)
+ * \brief Computes the time until which to wait for a thread, while the server drains.
+ * Threads are waited for in short slices, so that a second stop request is noticed.
+ * \param deadline The time by which the server must have finished draining.
+ * \param slice The time until which the thread may be waited for.
+ * \return Can the thread still be waited for?
+ */
+bool server_drain_slice(uint64_t deadline, struct timespec *slice)
+{
+    clock_gettime(CLOCK_REALTIME, slice);
+    uint64_t now = (uint64_t) slice->tv_sec * 1000000000ull + (uint64_t) slice->tv_nsec;
+
+    if (g_server_forced || now >= deadline)
+        return false;
+
+    uint64_t until = now + (uint64_t) TIMER_TICK * 1000000ull;
+    until = until < deadline ? until : deadline;
+
+    slice->tv_sec = (time_t) (until / 1000000000ull);
+    slice->tv_nsec = (long) (until % 1000000000ull);
+
+    return true;
+}
+
+/*!
+ * \fn void server_drain_begin(const server_t*)
+ * \brief Stops accepting new clients, and wakes up all workers waiting for them.
+ * \param server The server instance to be drained.
+ */
+void server_drain_begin(const server_t *server)
+{
+    uint64_t value = 1;
+    server_internal_t *internal = (server_internal_t*) server->_internal;
 
+    pthread_mutex_lock(&g_server_mutex);
+    g_server_status = SERVER_STOP_REQUESTED;
     pthread_cond_broadcast(&g_server_consumer_fence);
-    pthread_cond_broadcast(&g_server_producer_fence);
+    pthread_mutex_unlock(&g_server_mutex);
+
+    ssize_t ignored = write(internal->stop, &value, sizeof(uint64_t));
+    (void) ignored;
+}
+
+/*!
+ * \fn void server_worker_finalize(pthread_t*, uint64_t)
+ * \brief Waits for a worker thread to finalize, or cancels it when out of time.
+ * \param worker_thread The worker thread to be finalized.
+ * \param deadline The time by which the worker must have finalized.
+ */
+void server_worker_finalize(pthread_t *worker_thread, uint64_t deadline)
+{
+    bool joined = false;
+    struct timespec slice;
+
+    while (!joined && server_drain_slice(deadline, &slice))
+        joined = pthread_timedjoin_np(*worker_thread, NULL, &slice) == 0;
+
+    if (!joined) {
+        pthread_cancel(*worker_thread);
+        pthread_join(*worker_thread, NULL);
+    }
+}
+
+/*!
+ * \fn int server_loop_cpu_list(int*, int)
+ * \brief Lists the processors the server is allowed to run on.
+ * \param cpu_list The list to be filled with the available processors.
+ * \param capacity The list's capacity.
+ * \return The number of available processors.
+ */
+int server_loop_cpu_list(int *cpu_list, int capacity)
+{
+    int count = 0;
+    cpu_set_t cpuset;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) == -1)
+        return 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < capacity; ++cpu)
+        if (CPU_ISSET(cpu, &cpuset))
+            cpu_list[count++] = cpu;
+
+    return count;
+}
+
+/*!
+ * \fn loop_t **server_loops_initialize(const server_t*, logger_t*, int)
+ * \brief Initializes an event loop per processor, and sets them ready to serve requests.
+ * Each event loop has its own listening sockets, bound to the server's endpoints, and
+ * its thread is pinned to one of the processors the server is allowed to run on. The
+ * offload pool shared by the loops is started before them.
+ * \param server The server instance to start the event loops off.
+ * \param logger The logger instance to which the loops must log to.
+ * \param workers The number of event loops to spawn.
+ * \return The list of event loops started.
+ */
+loop_t **server_loops_initialize(const server_t *server, logger_t *logger, int workers)
+{
+    int cpu_list[CPU_SETSIZE];
+    int cpu_count = server_loop_cpu_list(cpu_list, CPU_SETSIZE);
+
+    loop_t **loop = calloc(workers, sizeof(loop_t*));
+    const settings_t *settings = settings_current();
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    // The server's limits are evenly split among the event loops, so that each loop
+    // can enforce its share without ever looking at the others.
+    loop_limits_t limits = {
+        .connections = (settings->max_inflight + workers - 1) / workers
+      , .memory = settings->memory_budget / workers
+      , .limiter = internal->limiter
+    };
+
+    offload_start(logger, settings->offload_threads);
+
+    for (int i = 0; i < workers; ++i) {
+        const socket_id_t *listener = &internal->listener[i * internal->endpoint_count];
+        loop[i] = loop_create(i, listener, internal->endpoint_count, logger, server->engine, limits);
+        loop_start(loop[i], cpu_count > 0 ? cpu_list[i % cpu_count] : -1);
+    }
+
+    return loop;
 }
 
 /*!
- * \fn void server_worker_finalize(pthread_t*)
- * \brief Cancels the execution of a worker thread and waits for it to finalize.
- * \param worker_thread The worker thread to be cancelled.
+ * \fn void server_loops_finalize(loop_t**, int, uint64_t)
+ * \brief Drains all event loops, and stops those which are still running when out of time.
+ * The offload pool is only stopped once every loop has stopped, so that no more work can
+ * be submitted to it, and the loops are only destroyed once the pool has posted back
+ * everything it was still working on.
+ * \param loop The list of event loops to be finalized.
+ * \param workers The number of event loops spawned.
+ * \param deadline The time by which the event loops must have finalized.
  */
-void server_worker_finalize(pthread_t *worker_thread)
+void server_loops_finalize(loop_t **loop, int workers, uint64_t deadline)
 {
-    pthread_cancel(*worker_thread);
-    pthread_join(*worker_thread, NULL);
+    struct timespec slice;
+
+    for (int i = 0; i < workers; ++i)
+        if (loop[i] != NULL)
+            loop_drain(loop[i]);
+
+    for (int i = 0; i < workers; ++i) {
+        if (loop[i] != NULL) {
+            while (server_drain_slice(deadline, &slice) && !loop_join(loop[i], &slice));
+
+            loop_stop(loop[i]);
+        }
+    }
+
+    for (int i = 0; i < workers; ++i)
+        if (loop[i] != NULL)
+            loop_join(loop[i], NULL);
+
+    offload_stop();
+
+    for (int i = 0; i < workers; ++i)
+        if (loop[i] != NULL)
+            loop_destroy(loop[i]);
+
+    free(loop);
 }
 
 /*!
@@ -305,31 +1328,123 @@ extern server_status_t server_listen(const server_t *server, logger_t *logger, i
     if (g_server_status != SERVER_SUCCESS)
         return g_server_status;
 
+    loop_t **loop = NULL;
+    pthread_t *worker_thread = NULL;
     server_status_t server_status = SERVER_SUCCESS;
-    pthread_t *worker_thread = calloc(workers, sizeof(pthread_t));
+
+    const settings_t *settings = settings_current();
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    // A worker or event loop without its own listening sockets would never accept any
+    // client, so the server does not start at all rather than start without them.
+    if (!server_listeners_open(server, server->mode == SERVER_MODE_SHARED ? 1 : workers)) {
+        fprintf(stderr, SERVER_WARNING_MSG, internal->error);
+        server_listeners_close(server);
+        return SERVER_FAIL_CREATE_SOCKET;
+    }
+
+    // The rate limiter is shared by all workers or event loops, as a client's requests
+    // may be served by any of them. Clients may always burst up to a second's worth.
+    if (server->rate_limit > 0) {
+        uint32_t burst = server->rate_limit > settings->rate_limit_burst ? server->rate_limit : settings->rate_limit_burst;
+        internal->limiter = limiter_create(LIMITER_SIZE, server->rate_limit, burst);
+    }
+
+    internal->request_channel.capacity = settings->queue_size;
+    internal->request_channel.queue = malloc(settings->queue_size * sizeof(request_t*));
 
     pthread_mutex_init(&g_server_mutex, NULL);
-    pthread_cond_init(&g_server_producer_fence, NULL);
     pthread_cond_init(&g_server_consumer_fence, NULL);
 
+    g_server_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    internal->stop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    sigaddset(&signal_mask, SIGUSR2);
+    sigaddset(&signal_mask, SIGHUP);
+
     signal(SIGINT, &server_force_stop);
+    signal(SIGTERM, &server_force_stop);
+    signal(SIGUSR2, &server_force_upgrade);
+    signal(SIGHUP, &server_force_reload);
 
-    for (int i = 0; i < workers; ++i)
-        worker_thread[i] = server_worker_initialize(server, logger, i);
+    // Files are sent with `sendfile`, which unlike `send` cannot be told not to raise
+    // SIGPIPE when a client has gone away.
+    signal(SIGPIPE, SIG_IGN);
 
-    while ((g_server_status | server_status) == SERVER_SUCCESS)
-        server_status = server_connection_wait(server);
+    // The workers are spawned with the handled signals blocked, so that signals are
+    // always handled by the main thread, and wake it up when it is left waiting.
+    pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
 
-    server_force_stop(0);
+    if (server->mode == SERVER_MODE_PERCORE) {
+        loop = server_loops_initialize(server, logger, workers);
+    } else {
+        worker_thread = calloc(workers, sizeof(pthread_t));
 
-    for (int i = 0; i < workers; ++i)
-        server_worker_finalize(&worker_thread[i]);
+        for (int i = 0; i < workers; ++i)
+            worker_thread[i] = server_worker_initialize(server, logger, i);
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &signal_mask, NULL);
+    server_handoff_complete(internal);
+
+    while ((g_server_status | server_status) == SERVER_SUCCESS) {
+        server_status = server_wait(server);
+
+        if (g_server_reload) {
+            g_server_reload = false;
+            server_reload();
+        }
+
+        if (g_server_upgrade) {
+            g_server_upgrade = false;
+
+            internal->handed = server_handoff(server);
+
+            if (internal->handed)
+                g_server_status = SERVER_STOP_REQUESTED;
+            else
+                fprintf(stderr, SERVER_WARNING_MSG, "Server could not hand its sockets over to a new process.");
+        }
+    }
+
+    // The server stops accepting new clients, and lets its workers answer the requests
+    // they have already taken in. Workers which take too long to do so are cancelled.
+    server_drain_begin(server);
+    uint64_t deadline = server_drain_deadline();
+
+    if (server->mode == SERVER_MODE_PERCORE) {
+        server_loops_finalize(loop, workers, deadline);
+    } else {
+        request_t *request;
+
+        for (int i = 0; i < workers; ++i)
+            server_worker_finalize(&worker_thread[i], deadline);
+
+        // Requests still waiting for a worker are dropped.
+        while ((request = server_request_channel_receive(&internal->request_channel)) != NULL)
+            server_cleanup_request(request);
+
+        free(worker_thread);
+    }
+
+    free(internal->request_channel.queue);
+    server_listeners_close(server);
+
+    int wakeup = g_server_wakeup;
+    g_server_wakeup = -1;
+
+    close(wakeup);
+    close(internal->stop);
 
-    pthread_cond_destroy(&g_server_producer_fence);
     pthread_cond_destroy(&g_server_consumer_fence);
     pthread_mutex_destroy(&g_server_mutex);
 
-    free(worker_thread);
+    if (internal->limiter != NULL)
+        limiter_destroy(internal->limiter);
 
     return server_status == SERVER_SUCCESS
         ? g_server_status
@@ -360,6 +1475,54 @@ extern const char *server_status_describe(server_status_t status)
     }
 }
 
+/*!
+ * \fn server_mode_t server_mode_parse(const char*)
+ * \brief Finds the server mode corresponding to the given name.
+ * \param name The name of the server mode.
+ * \return The corresponding server mode.
+ */
+extern server_mode_t server_mode_parse(const char *name)
+{
+    if (strcmp(name, "shared")    == 0) return SERVER_MODE_SHARED;
+    if (strcmp(name, "reuseport") == 0) return SERVER_MODE_REUSEPORT;
+    if (strcmp(name, "percore")   == 0) return SERVER_MODE_PERCORE;
+
+    return SERVER_MODE_UNKNOWN;
+}
+
+/*!
+ * \fn int server_mode_default_workers(server_mode_t)
+ * \brief Finds the default number of workers to be spawned in a server mode.
+ * In per-core mode, an event loop is spawned for every processor available.
+ * \param mode The server mode to get the default number of workers for.
+ * \return The default number of workers.
+ */
+extern int server_mode_default_workers(server_mode_t mode)
+{
+    int cpu_list[CPU_SETSIZE];
+
+    if (mode == SERVER_MODE_PERCORE) {
+        int cpu_count = server_loop_cpu_list(cpu_list, CPU_SETSIZE);
+        return cpu_count > 0 ? cpu_count : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    return MAX_THREADS;
+}
+
+/*!
+ * \fn server_engine_t server_engine_parse(const char*)
+ * \brief Finds the I/O engine corresponding to the given name.
+ * \param name The name of the I/O engine.
+ * \return The corresponding I/O engine.
+ */
+extern server_engine_t server_engine_parse(const char *name)
+{
+    if (strcmp(name, "epoll") == 0) return SERVER_ENGINE_EPOLL;
+    if (strcmp(name, "uring") == 0) return SERVER_ENGINE_URING;
+
+    return SERVER_ENGINE_UNKNOWN;
+}
+
 /*!
  * \fn void server_destroy(server_t*)
  * \brief Destroys a server instance and closes its connection.
@@ -367,6 +1530,18 @@ extern const char *server_status_describe(server_status_t status)
  */
 extern void server_destroy(server_t *server)
 {
-    free(server->_internal);
-    close(server->socket);
+    server_internal_t *internal = (server_internal_t*) server->_internal;
+
+    // Unix domain sockets are removed from the filesystem, unless they have been handed
+    // over to a new server process, which is still listening on them.
+    for (int i = 0; i < internal->endpoint_count; ++i) {
+        close(internal->listener[i]);
+
+        if (!internal->handed)
+            endpoint_unlink(&internal->endpoint[i]);
+    }
+
+    free(internal->listener);
+    free(internal->inherited);
+    free(internal);
 }
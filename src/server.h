@@ -7,6 +7,8 @@
 #ifndef MU_HTTPD_SERVER_H
 #define MU_HTTPD_SERVER_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "logger.h"
@@ -24,6 +26,29 @@ typedef enum server_status_t {
   , SERVER_STOP_REQUESTED = -1
 } server_status_t;
 
+/*!
+ * \enum server_mode_t
+ * \brief The ways the server can distribute connections among its workers.
+ * \since 3.0
+ */
+typedef enum server_mode_t {
+    SERVER_MODE_SHARED = 0
+  , SERVER_MODE_REUSEPORT
+  , SERVER_MODE_PERCORE
+  , SERVER_MODE_UNKNOWN = -1
+} server_mode_t;
+
+/*!
+ * \enum server_engine_t
+ * \brief The I/O engines by which the server's event loops can be driven.
+ * \since 3.0
+ */
+typedef enum server_engine_t {
+    SERVER_ENGINE_EPOLL = 0
+  , SERVER_ENGINE_URING
+  , SERVER_ENGINE_UNKNOWN = -1
+} server_engine_t;
+
 /*!
  * \typedef socket_id_t
  * \brief The identifier for a server socket.
@@ -37,9 +62,12 @@ typedef int socket_id_t;
  * \since 3.0
  */
 typedef struct server_t {
-    socket_id_t socket;
-    char *address;
+    const char *address;
     uint16_t port;
+    server_mode_t mode;
+    server_engine_t engine;
+    uint32_t rate_limit;
+    char **argv;
     void *_internal;
 } server_t;
 
@@ -49,7 +77,11 @@ typedef struct server_t {
  */
 extern server_status_t server_create(server_t*, int);
 extern server_status_t server_listen(const server_t*, logger_t*, int);
+extern bool server_endpoint_describe(const server_t*, int, char*, size_t);
 extern const char *server_status_describe(server_status_t);
+extern server_mode_t server_mode_parse(const char*);
+extern int server_mode_default_workers(server_mode_t);
+extern server_engine_t server_engine_parse(const char*);
 extern void server_destroy(server_t*);
 
 #endif
@@ -0,0 +1,561 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the server's runtime settings.
+ * Settings are read from a configuration file of `name = value` lines, and then from
+ * the overrides given on the command line. The settings in use are published as an
+ * immutable copy, which is atomically replaced when settings are reloaded, so that
+ * threads can read them without any locks. Replaced copies are only freed when the
+ * server exits, as threads might still be reading them.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "config.h"
+
+#include "settings.h"
+
+/*!
+ * \enum settings_type_t
+ * \brief The types of values a setting can hold.
+ * \since 3.0
+ */
+typedef enum settings_type_t {
+    SETTINGS_NUMBER = 0
+  , SETTINGS_SIZE
+  , SETTINGS_DURATION
+  , SETTINGS_STRING
+} settings_type_t;
+
+/*!
+ * \struct settings_field_t
+ * \brief Describes a setting, and where its value is kept.
+ * \since 3.0
+ */
+typedef struct settings_field_t {
+    const char *name;
+    settings_type_t type;
+    size_t offset;
+    size_t size;
+    uint64_t min;
+    uint64_t max;
+    bool reloadable;
+} settings_field_t;
+
+/*!
+ * \struct settings_override_t
+ * \brief A setting given on the command line, which overrides the configuration file.
+ * \since 3.0
+ */
+typedef struct settings_override_t {
+    char *name;
+    char *value;
+} settings_override_t;
+
+#define SETTINGS_FIELD(name, type, min, max, reloadable)    \
+    { #name, type, offsetof(settings_t, name), sizeof(((settings_t*) 0)->name), min, max, reloadable }
+
+/*!
+ * \var g_settings_field
+ * \brief The list of all settings which can be configured.
+ * \since 3.0
+ */
+static const settings_field_t g_settings_field[] = {
+    SETTINGS_FIELD(address,           SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(port,              SETTINGS_NUMBER,   0, UINT16_MAX, false)
+  , SETTINGS_FIELD(mode,              SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(engine,            SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(workers,           SETTINGS_NUMBER,   0, 4096,       false)
+  , SETTINGS_FIELD(backlog,           SETTINGS_NUMBER,   1, INT32_MAX,  false)
+  , SETTINGS_FIELD(reuseaddr,         SETTINGS_NUMBER,   0, 1,          false)
+  , SETTINGS_FIELD(defer_accept,      SETTINGS_DURATION, 0, INT32_MAX,  false)
+  , SETTINGS_FIELD(fastopen,          SETTINGS_NUMBER,   0, UINT16_MAX, false)
+  , SETTINGS_FIELD(nodelay,           SETTINGS_NUMBER,   0, 1,          false)
+  , SETTINGS_FIELD(cork,              SETTINGS_NUMBER,   0, 1,          false)
+  , SETTINGS_FIELD(send_buffer,       SETTINGS_SIZE,     0, INT32_MAX / 2, false)
+  , SETTINGS_FIELD(receive_buffer,    SETTINGS_SIZE,     0, INT32_MAX / 2, false)
+  , SETTINGS_FIELD(queue_size,        SETTINGS_NUMBER,   1, 1 << 20,    false)
+  , SETTINGS_FIELD(max_inflight,      SETTINGS_NUMBER,   1, INT32_MAX,  false)
+  , SETTINGS_FIELD(memory_budget,     SETTINGS_SIZE,     1, SIZE_MAX,   false)
+  , SETTINGS_FIELD(rate_limit,        SETTINGS_NUMBER,   0, 1000000,    false)
+  , SETTINGS_FIELD(rate_limit_burst,  SETTINGS_NUMBER,   1, 1000000,    false)
+  , SETTINGS_FIELD(log_file,          SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(log_ring_size,     SETTINGS_SIZE,     1024, SIZE_MAX, false)
+  , SETTINGS_FIELD(arena_size,        SETTINGS_SIZE,     1024, SIZE_MAX, false)
+  , SETTINGS_FIELD(uring_entries,     SETTINGS_NUMBER,   8, 32768,      false)
+  , SETTINGS_FIELD(uring_buffers,     SETTINGS_NUMBER,   1, 32768,      false)
+  , SETTINGS_FIELD(offload_threads,   SETTINGS_NUMBER,   0, 256,        false)
+  , SETTINGS_FIELD(public_folder,     SETTINGS_STRING,   0, 0,          true)
+  , SETTINGS_FIELD(bundle,            SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(routes,            SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(vhosts,            SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(proxy_balance,     SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(proxy_pool,        SETTINGS_NUMBER,   0, 32,         true)
+  , SETTINGS_FIELD(proxy_timeout,     SETTINGS_DURATION, 1, INT32_MAX,  true)
+  , SETTINGS_FIELD(proxy_health,      SETTINGS_DURATION, 0, INT32_MAX,  false)
+  , SETTINGS_FIELD(listing_cache,     SETTINGS_NUMBER,   0, 65536,      false)
+  , SETTINGS_FIELD(listing_ttl,       SETTINGS_DURATION, 0, UINT32_MAX, true)
+  , SETTINGS_FIELD(listing_page_size, SETTINGS_NUMBER,   0, UINT32_MAX, true)
+  , SETTINGS_FIELD(file_cache,        SETTINGS_NUMBER,   0, 65536,      false)
+  , SETTINGS_FIELD(file_ttl,          SETTINGS_DURATION, 0, UINT32_MAX, true)
+  , SETTINGS_FIELD(missing_cache,     SETTINGS_NUMBER,   0, 1 << 20,    false)
+  , SETTINGS_FIELD(missing_ttl,       SETTINGS_DURATION, 0, UINT32_MAX, true)
+  , SETTINGS_FIELD(warmup_threads,    SETTINGS_NUMBER,   0, 256,        false)
+  , SETTINGS_FIELD(warmup_manifest,   SETTINGS_STRING,   0, 0,          false)
+  , SETTINGS_FIELD(max_header_size,   SETTINGS_SIZE,     1024, INT32_MAX, true)
+  , SETTINGS_FIELD(max_request_size,  SETTINGS_SIZE,     0, SIZE_MAX,   true)
+  , SETTINGS_FIELD(timeout_header,    SETTINGS_DURATION, 1, UINT32_MAX, true)
+  , SETTINGS_FIELD(timeout_body,      SETTINGS_DURATION, 1, UINT32_MAX, true)
+  , SETTINGS_FIELD(timeout_keepalive, SETTINGS_DURATION, 1, UINT32_MAX, true)
+  , SETTINGS_FIELD(timeout_write,     SETTINGS_DURATION, 1, UINT32_MAX, true)
+  , SETTINGS_FIELD(drain_timeout,     SETTINGS_DURATION, 0, UINT32_MAX, true)
+  , SETTINGS_FIELD(handoff_timeout,   SETTINGS_DURATION, 1, UINT32_MAX, true)
+};
+
+#define SETTINGS_FIELD_COUNT (sizeof(g_settings_field) / sizeof(settings_field_t))
+
+/*!
+ * \var g_settings_default
+ * \brief The default settings, with which the server has been compiled.
+ * \since 3.0
+ */
+static const settings_t g_settings_default = {
+    .address = DEFAULT_ADDR
+  , .port = DEFAULT_PORT
+  , .mode = DEFAULT_MODE
+  , .engine = DEFAULT_ENGINE
+  , .workers = 0
+  , .backlog = MAX_CONNECTIONS
+  , .reuseaddr = REUSEADDR
+  , .defer_accept = DEFER_ACCEPT
+  , .fastopen = FASTOPEN_QUEUE
+  , .nodelay = NODELAY
+  , .cork = CORK
+  , .send_buffer = SEND_BUFFER
+  , .receive_buffer = RECEIVE_BUFFER
+  , .queue_size = MAX_QUEUED_REQUESTS
+  , .max_inflight = MAX_INFLIGHT
+  , .memory_budget = MEMORY_BUDGET
+  , .rate_limit = RATE_LIMIT
+  , .rate_limit_burst = RATE_LIMIT_BURST
+  , .log_file = LOG_FILE
+  , .log_ring_size = LOG_RING_SIZE
+  , .arena_size = ARENA_SIZE
+  , .uring_entries = LOOP_URING_ENTRIES
+  , .uring_buffers = LOOP_URING_BUFFERS
+  , .offload_threads = OFFLOAD_THREADS
+  , .public_folder = PUBLIC_FOLDER
+  , .bundle = BUNDLE_FILE
+  , .routes = ROUTES_FILE
+  , .vhosts = VHOSTS_FILE
+  , .proxy_balance = PROXY_BALANCE
+  , .proxy_pool = PROXY_POOL
+  , .proxy_timeout = PROXY_TIMEOUT
+  , .proxy_health = PROXY_HEALTH
+  , .listing_cache = LISTING_CACHE_SIZE
+  , .listing_ttl = LISTING_TTL
+  , .listing_page_size = LISTING_PAGE_SIZE
+  , .file_cache = FILE_CACHE_SIZE
+  , .file_ttl = FILE_TTL
+  , .missing_cache = MISSING_CACHE_SIZE
+  , .missing_ttl = MISSING_TTL
+  , .warmup_threads = WARMUP_THREADS
+  , .warmup_manifest = WARMUP_MANIFEST
+  , .max_header_size = MAX_HEADER_SIZE
+  , .max_request_size = MAX_REQUEST_SIZE
+  , .timeout_header = TIMEOUT_HEADER
+  , .timeout_body = TIMEOUT_BODY
+  , .timeout_keepalive = TIMEOUT_KEEPALIVE
+  , .timeout_write = TIMEOUT_WRITE
+  , .drain_timeout = DRAIN_TIMEOUT
+  , .handoff_timeout = HANDOFF_TIMEOUT
+};
+
+/*!
+ * \var g_settings
+ * \brief The settings currently in use.
+ * \since 3.0
+ */
+static const settings_t *_Atomic g_settings = &g_settings_default;
+
+/*!
+ * \var g_settings_path
+ * \brief The configuration file the settings are read from.
+ * \since 3.0
+ */
+static char *g_settings_path = NULL;
+
+/*!
+ * \var g_settings_required
+ * \brief Must the configuration file exist? Only the default file may be missing.
+ * \since 3.0
+ */
+static bool g_settings_required = false;
+
+/*!
+ * \var g_settings_override
+ * \brief The list of settings given on the command line.
+ * \since 3.0
+ */
+static settings_override_t *g_settings_override = NULL;
+static size_t g_settings_override_count = 0;
+
+/*!
+ * \var g_settings_retired
+ * \brief The list of settings which have been replaced, and are yet to be freed.
+ * \since 3.0
+ */
+static settings_t **g_settings_retired = NULL;
+static size_t g_settings_retired_count = 0;
+
+/*!
+ * \fn const settings_field_t *settings_field_find(const char*)
+ * \brief Finds the description of a setting by its name.
+ * \param name The setting's name.
+ * \return The setting's description, or NULL if there is no such setting.
+ */
+const settings_field_t *settings_field_find(const char *name)
+{
+    for (size_t i = 0; i < SETTINGS_FIELD_COUNT; ++i)
+        if (strcmp(g_settings_field[i].name, name) == 0)
+            return &g_settings_field[i];
+
+    return NULL;
+}
+
+/*!
+ * \fn bool settings_number_parse(const char*, settings_type_t, uint64_t*)
+ * \brief Parses a numeric setting value, with the suffixes allowed by its type.
+ * Sizes may be given in kibibytes, mebibytes or gibibytes, with the `k`, `m` or `g`
+ * suffixes, and durations may be given in seconds or milliseconds, with the `s` or
+ * `ms` suffixes. Durations are given in milliseconds by default.
+ * \param value The value to be parsed.
+ * \param type The setting's type.
+ * \param result The parsed value.
+ * \return Is the value valid?
+ */
+bool settings_number_parse(const char *value, settings_type_t type, uint64_t *result)
+{
+    char *suffix;
+    uint64_t scale = 1;
+
+    errno = 0;
+    *result = strtoull(value, &suffix, 10);
+
+    if (suffix == value || errno != 0 || *value == '-')
+        return false;
+
+    if (type == SETTINGS_SIZE && *suffix != '\0' && suffix[1] == '\0') {
+        switch (tolower(*suffix++)) {
+            case 'k': scale = 1ull << 10; break;
+            case 'm': scale = 1ull << 20; break;
+            case 'g': scale = 1ull << 30; break;
+            default:  return false;
+        }
+    }
+
+    if (type == SETTINGS_DURATION && strcmp(suffix, "s") == 0) {
+        scale = 1000;
+        ++suffix;
+    } else if (type == SETTINGS_DURATION && strcmp(suffix, "ms") == 0) {
+        suffix += 2;
+    }
+
+    if (*suffix != '\0' || *result > UINT64_MAX / scale)
+        return false;
+
+    *result *= scale;
+    return true;
+}
+
+/*!
+ * \fn bool settings_assign(settings_t*, const char*, const char*, char*, size_t)
+ * \brief Assigns a value to a setting, if the value is valid for it.
+ * \param settings The settings to be changed.
+ * \param name The setting's name.
+ * \param value The setting's new value.
+ * \param error The buffer to describe why the setting could not be assigned.
+ * \param size The error buffer's size.
+ * \return Has the value been assigned?
+ */
+bool settings_assign(settings_t *settings, const char *name, const char *value, char *error, size_t size)
+{
+    uint64_t number;
+    const settings_field_t *field = settings_field_find(name);
+
+    if (field == NULL) {
+        snprintf(error, size, "unknown setting '%s'", name);
+        return false;
+    }
+
+    char *target = (char*) settings + field->offset;
+
+    if (field->type == SETTINGS_STRING) {
+        if (strlen(value) >= field->size) {
+            snprintf(error, size, "the value of '%s' is too long", name);
+            return false;
+        }
+
+        strcpy(target, value);
+        return true;
+    }
+
+    if (!settings_number_parse(value, field->type, &number) || number < field->min || number > field->max) {
+        snprintf(error, size, "invalid value '%s' for '%s'", value, name);
+        return false;
+    }
+
+    if (field->size == sizeof(uint32_t))
+        *(uint32_t*) target = (uint32_t) number;
+    else
+        *(size_t*) target = (size_t) number;
+
+    return true;
+}
+
+/*!
+ * \fn char *settings_trim(char*)
+ * \brief Trims the whitespace around a string.
+ * \param string The string to be trimmed.
+ * \return The trimmed string.
+ */
+char *settings_trim(char *string)
+{
+    char *end = string + strlen(string);
+
+    while (isspace((unsigned char) *string))
+        ++string;
+
+    while (end > string && isspace((unsigned char) end[-1]))
+        --end;
+
+    *end = '\0';
+    return string;
+}
+
+/*!
+ * \fn bool settings_file_read(settings_t*, char*, size_t)
+ * \brief Reads settings from the configuration file.
+ * Every line of the file assigns a value to a setting, as in `name = value`. Empty
+ * lines, and anything after a `#` character, are ignored.
+ * \param settings The settings to be read into.
+ * \param error The buffer to describe why the file could not be read.
+ * \param size The error buffer's size.
+ * \return Has the file been successfully read?
+ */
+bool settings_file_read(settings_t *settings, char *error, size_t size)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t number = 0;
+    bool success = true;
+    char reason[SETTINGS_ERROR_SIZE];
+
+    FILE *file = fopen(g_settings_path, "r");
+
+    if (file == NULL) {
+        bool missing = errno == ENOENT;
+
+        if (g_settings_required || !missing)
+            snprintf(error, size, "could not open '%s': %s", g_settings_path, strerror(errno));
+
+        return !g_settings_required && missing;
+    }
+
+    while (success && getline(&line, &capacity, file) != -1) {
+        char *comment = strchr(line, '#');
+        char *separator = strchr(line, '=');
+
+        ++number;
+
+        if (comment != NULL)
+            *comment = '\0';
+
+        if (*settings_trim(line) == '\0')
+            continue;
+
+        if (separator == NULL || (comment != NULL && separator > comment)) {
+            snprintf(error, size, "%s:%zu: expected 'name = value'", g_settings_path, number);
+            success = false;
+            continue;
+        }
+
+        *separator = '\0';
+
+        if (!settings_assign(settings, settings_trim(line), settings_trim(separator + 1), reason, sizeof(reason))) {
+            snprintf(error, size, "%s:%zu: %s", g_settings_path, number, reason);
+            success = false;
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    return success;
+}
+
+/*!
+ * \fn bool settings_load(settings_t*, char*, size_t)
+ * \brief Loads the settings from their defaults, configuration file and command line.
+ * \param settings The settings to be loaded.
+ * \param error The buffer to describe why the settings could not be loaded.
+ * \param size The error buffer's size.
+ * \return Have the settings been successfully loaded?
+ */
+bool settings_load(settings_t *settings, char *error, size_t size)
+{
+    char reason[SETTINGS_ERROR_SIZE];
+
+    *settings = g_settings_default;
+
+    if (!settings_file_read(settings, error, size))
+        return false;
+
+    for (size_t i = 0; i < g_settings_override_count; ++i) {
+        settings_override_t *override = &g_settings_override[i];
+
+        if (!settings_assign(settings, override->name, override->value, reason, sizeof(reason))) {
+            snprintf(error, size, "command line: %s", reason);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \fn void settings_override(const char*, const char*)
+ * \brief Overrides a setting, whatever its value on the configuration file.
+ * Overrides must be given before the settings are initialized, and are checked then.
+ * \param name The setting's name.
+ * \param value The setting's value.
+ */
+extern void settings_override(const char *name, const char *value)
+{
+    size_t count = g_settings_override_count++;
+
+    g_settings_override = realloc(g_settings_override, g_settings_override_count * sizeof(settings_override_t));
+    g_settings_override[count].name = strdup(name);
+    g_settings_override[count].value = strdup(value);
+}
+
+/*!
+ * \fn bool settings_initialize(const char*, char*, size_t)
+ * \brief Loads and publishes the settings the server starts with.
+ * \param path The configuration file, or NULL for the default one, which may be missing.
+ * \param error The buffer to describe why the settings could not be loaded.
+ * \param size The error buffer's size.
+ * \return Have the settings been successfully loaded?
+ */
+extern bool settings_initialize(const char *path, char *error, size_t size)
+{
+    settings_t *settings = malloc(sizeof(settings_t));
+
+    g_settings_path = strdup(path != NULL ? path : DEFAULT_CONFIG);
+    g_settings_required = path != NULL;
+
+    if (!settings_load(settings, error, size)) {
+        free(settings);
+        return false;
+    }
+
+    atomic_store_explicit(&g_settings, settings, memory_order_release);
+    return true;
+}
+
+/*!
+ * \fn bool settings_reload(char*, size_t)
+ * \brief Reloads the settings, and publishes them for new requests to use.
+ * Settings which cannot be changed while the server runs keep their current values.
+ * \param error The buffer to describe why settings could not be reloaded, or which
+ * settings have been kept. Left empty if all settings have been reloaded.
+ * \param size The error buffer's size.
+ * \return Have the settings been successfully reloaded?
+ */
+extern bool settings_reload(char *error, size_t size)
+{
+    size_t length = 0;
+    const settings_t *current = settings_current();
+    settings_t *settings = malloc(sizeof(settings_t));
+
+    *error = '\0';
+
+    if (!settings_load(settings, error, size)) {
+        free(settings);
+        return false;
+    }
+
+    for (size_t i = 0; i < SETTINGS_FIELD_COUNT; ++i) {
+        const settings_field_t *field = &g_settings_field[i];
+        char *target = (char*) settings + field->offset;
+        const char *source = (const char*) current + field->offset;
+
+        if (field->reloadable || memcmp(target, source, field->size) == 0)
+            continue;
+
+        memcpy(target, source, field->size);
+
+        if (length < size)
+            length += snprintf(
+                error + length, size - length, "%s%s"
+              , length > 0 ? ", " : "Settings kept until the server restarts: "
+              , field->name
+            );
+    }
+
+    g_settings_retired = realloc(g_settings_retired, (g_settings_retired_count + 1) * sizeof(settings_t*));
+    g_settings_retired[g_settings_retired_count++] = (settings_t*) current;
+
+    atomic_store_explicit(&g_settings, settings, memory_order_release);
+    return true;
+}
+
+/*!
+ * \fn const settings_t *settings_current()
+ * \brief Gets the settings currently in use.
+ * The settings must not be held on to for longer than a request takes to be served.
+ * \return The current settings.
+ */
+extern const settings_t *settings_current()
+{
+    return atomic_load_explicit(&g_settings, memory_order_acquire);
+}
+
+/*!
+ * \fn void settings_finalize()
+ * \brief Frees all settings, and goes back to the default ones.
+ */
+extern void settings_finalize()
+{
+    const settings_t *current = atomic_exchange(&g_settings, &g_settings_default);
+
+    if (current != &g_settings_default)
+        free((settings_t*) current);
+
+    for (size_t i = 0; i < g_settings_retired_count; ++i)
+        if (g_settings_retired[i] != &g_settings_default)
+            free(g_settings_retired[i]);
+
+    for (size_t i = 0; i < g_settings_override_count; ++i) {
+        free(g_settings_override[i].name);
+        free(g_settings_override[i].value);
+    }
+
+    free(g_settings_retired);
+    free(g_settings_override);
+    free(g_settings_path);
+
+    g_settings_retired = NULL;
+    g_settings_override = NULL;
+    g_settings_path = NULL;
+    g_settings_retired_count = 0;
+    g_settings_override_count = 0;
+}
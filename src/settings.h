@@ -0,0 +1,87 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the server's runtime settings.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_SETTINGS_H
+#define MU_HTTPD_SETTINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define SETTINGS_STRING_SIZE 256
+#define SETTINGS_ERROR_SIZE  512
+
+/*!
+ * \struct settings_t
+ * \brief The server's settings, as read from its configuration file and command line.
+ * Settings are never changed once published, but replaced by a new copy when they are
+ * reloaded. Settings which cannot be changed while the server runs are kept as they
+ * were when the server started.
+ * \since 3.0
+ */
+typedef struct settings_t {
+    char address[SETTINGS_STRING_SIZE];
+    uint32_t port;
+    char mode[SETTINGS_STRING_SIZE];
+    char engine[SETTINGS_STRING_SIZE];
+    uint32_t workers;
+    uint32_t backlog;
+    uint32_t reuseaddr;
+    uint32_t defer_accept;
+    uint32_t fastopen;
+    uint32_t nodelay;
+    uint32_t cork;
+    size_t send_buffer;
+    size_t receive_buffer;
+    uint32_t queue_size;
+    uint32_t max_inflight;
+    size_t memory_budget;
+    uint32_t rate_limit;
+    uint32_t rate_limit_burst;
+    char log_file[SETTINGS_STRING_SIZE];
+    size_t log_ring_size;
+    size_t arena_size;
+    uint32_t uring_entries;
+    uint32_t uring_buffers;
+    uint32_t offload_threads;
+    char public_folder[SETTINGS_STRING_SIZE];
+    char bundle[SETTINGS_STRING_SIZE];
+    char routes[SETTINGS_STRING_SIZE];
+    char vhosts[SETTINGS_STRING_SIZE];
+    char proxy_balance[SETTINGS_STRING_SIZE];
+    uint32_t proxy_pool;
+    uint32_t proxy_timeout;
+    uint32_t proxy_health;
+    uint32_t listing_cache;
+    uint32_t listing_ttl;
+    uint32_t listing_page_size;
+    uint32_t file_cache;
+    uint32_t file_ttl;
+    uint32_t missing_cache;
+    uint32_t missing_ttl;
+    uint32_t warmup_threads;
+    char warmup_manifest[SETTINGS_STRING_SIZE];
+    size_t max_header_size;
+    size_t max_request_size;
+    uint32_t timeout_header;
+    uint32_t timeout_body;
+    uint32_t timeout_keepalive;
+    uint32_t timeout_write;
+    uint32_t drain_timeout;
+    uint32_t handoff_timeout;
+} settings_t;
+
+/*
+ * Forward declaration of settings functions.
+ * These functions are needed for loading, reloading and reading the server's settings.
+ */
+extern void settings_override(const char*, const char*);
+extern bool settings_initialize(const char*, char*, size_t);
+extern bool settings_reload(char*, size_t);
+extern const settings_t *settings_current();
+extern void settings_finalize();
+
+#endif
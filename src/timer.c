@@ -0,0 +1,182 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the timer wheels.
+ * Timers are kept in a hierarchy of wheels of slots, each slot holding a list of the
+ * timers expiring within its range of ticks. Arming or cancelling a timer only needs
+ * to link it into or out of a slot, no matter how many timers there are. As the wheel
+ * turns, timers on the upper levels are cascaded down, until they expire.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "config.h"
+
+#include "timer.h"
+
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE   (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+/*!
+ * \fn uint64_t timer_clock()
+ * \brief Reads the current time, in timer ticks.
+ * \return The number of ticks elapsed since an arbitrary point in the past.
+ */
+extern uint64_t timer_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000) / TIMER_TICK;
+}
+
+/*!
+ * \fn void timer_wheel_initialize(timer_wheel_t*, uint64_t)
+ * \brief Initializes an empty timer wheel.
+ * \param wheel The timer wheel to be initialized.
+ * \param now The current time, in timer ticks.
+ */
+extern void timer_wheel_initialize(timer_wheel_t *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+        for (size_t i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+            wheel->slot[level][i].next = wheel->slot[level][i].prev = &wheel->slot[level][i];
+}
+
+/*!
+ * \fn void timer_wheel_insert(timer_wheel_t*, timer_entry_t*)
+ * \brief Links a timer into the slot covering its deadline.
+ * The timer is put into the lowest level whose range reaches its deadline.
+ * \param wheel The timer wheel to insert the timer into.
+ * \param entry The timer to be inserted.
+ */
+void timer_wheel_insert(timer_wheel_t *wheel, timer_entry_t *entry)
+{
+    size_t level = 0;
+    uint64_t delta = entry->expires - wheel->now;
+
+    if (delta >= TIMER_WHEEL_RANGE)
+        entry->expires = wheel->now + (delta = TIMER_WHEEL_RANGE - 1);
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+        ++level;
+
+    timer_entry_t *head = &wheel->slot[level][(entry->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+    entry->next = head->next;
+    entry->prev = head;
+    head->next->prev = entry;
+    head->next = entry;
+}
+
+/*!
+ * \fn void timer_unlink(timer_entry_t*)
+ * \brief Unlinks a timer from the slot it is in.
+ * \param entry The timer to be unlinked.
+ */
+void timer_unlink(timer_entry_t *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = entry->prev = NULL;
+}
+
+/*!
+ * \fn void timer_arm(timer_wheel_t*, timer_entry_t*, uint64_t)
+ * \brief Arms a timer to expire after a timeout. An armed timer is re-armed.
+ * \param wheel The timer wheel to arm the timer on.
+ * \param entry The timer to be armed.
+ * \param timeout The timeout, in milliseconds.
+ */
+extern void timer_arm(timer_wheel_t *wheel, timer_entry_t *entry, uint64_t timeout)
+{
+    uint64_t ticks = (timeout + TIMER_TICK - 1) / TIMER_TICK;
+
+    if (timer_armed(entry))
+        timer_unlink(entry);
+    else
+        ++wheel->count;
+
+    entry->expires = wheel->now + (ticks > 0 ? ticks : 1);
+    timer_wheel_insert(wheel, entry);
+}
+
+/*!
+ * \fn void timer_cancel(timer_wheel_t*, timer_entry_t*)
+ * \brief Cancels a timer, if it is armed.
+ * \param wheel The timer wheel the timer has been armed on.
+ * \param entry The timer to be cancelled.
+ */
+extern void timer_cancel(timer_wheel_t *wheel, timer_entry_t *entry)
+{
+    if (timer_armed(entry)) {
+        timer_unlink(entry);
+        --wheel->count;
+    }
+}
+
+/*!
+ * \fn bool timer_armed(const timer_entry_t*)
+ * \brief Checks whether a timer is armed.
+ * \param entry The timer to be checked.
+ * \return Is the timer armed?
+ */
+extern bool timer_armed(const timer_entry_t *entry)
+{
+    return entry->prev != NULL;
+}
+
+/*!
+ * \fn timer_entry_t *timer_advance(timer_wheel_t*, uint64_t)
+ * \brief Turns the wheel up to the current time, and collects the expired timers.
+ * The expired timers are disarmed, and chained through their next pointers, which
+ * must be read before each timer is handled, as handling it might re-arm it.
+ * \param wheel The timer wheel to be turned.
+ * \param now The current time, in timer ticks.
+ * \return The chain of expired timers, or NULL if none has expired.
+ */
+extern timer_entry_t *timer_advance(timer_wheel_t *wheel, uint64_t now)
+{
+    timer_entry_t *expired = NULL;
+
+    while (wheel->now < now && wheel->count > 0) {
+        uint64_t tick = ++wheel->now;
+
+        // Whenever a level completes a turn, the next slot of the level above covers
+        // the coming ticks. Its timers are then spread into the lower levels.
+        for (size_t level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if ((tick & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+                break;
+
+            timer_entry_t *head = &wheel->slot[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+            while (head->next != head) {
+                timer_entry_t *entry = head->next;
+                timer_unlink(entry);
+                timer_wheel_insert(wheel, entry);
+            }
+        }
+
+        timer_entry_t *head = &wheel->slot[0][tick & TIMER_WHEEL_MASK];
+
+        while (head->next != head) {
+            timer_entry_t *entry = head->next;
+            timer_unlink(entry);
+
+            entry->next = expired;
+            expired = entry;
+            --wheel->count;
+        }
+    }
+
+    if (wheel->now < now)
+        wheel->now = now;
+
+    return expired;
+}
@@ -0,0 +1,53 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the timer wheels.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_TIMER_H
+#define MU_HTTPD_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+
+/*!
+ * \struct timer_entry_t
+ * \brief A timer, embedded into the object whose deadline it keeps track of.
+ * \since 3.0
+ */
+typedef struct timer_entry_t {
+    struct timer_entry_t *next;
+    struct timer_entry_t *prev;
+    uint64_t expires;
+} timer_entry_t;
+
+/*!
+ * \struct timer_wheel_t
+ * \brief A hierarchical timer wheel, in which timers are armed and cancelled in O(1).
+ * Each level of the wheel covers a range of ticks as many times larger as the level
+ * below has slots. Timers are moved to lower levels as their deadlines come near.
+ * \since 3.0
+ */
+typedef struct timer_wheel_t {
+    uint64_t now;
+    size_t count;
+    timer_entry_t slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+/*
+ * Forward declaration of timer wheel functions.
+ * These functions are needed for arming timers and collecting the expired ones.
+ */
+extern uint64_t timer_clock();
+extern void timer_wheel_initialize(timer_wheel_t*, uint64_t);
+extern void timer_arm(timer_wheel_t*, timer_entry_t*, uint64_t);
+extern void timer_cancel(timer_wheel_t*, timer_entry_t*);
+extern bool timer_armed(const timer_entry_t*);
+extern timer_entry_t *timer_advance(timer_wheel_t*, uint64_t);
+
+#endif
@@ -0,0 +1,320 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the io_uring submission rings.
+ * The rings are set up and driven directly through the kernel's system calls, so
+ * that no external library is needed. Each ring is meant to be owned and driven by
+ * a single thread, and also owns a ring of buffers from which the kernel picks the
+ * buffers data is received into.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "uring.h"
+
+/*!
+ * \struct uring_internal_t
+ * \brief The internal io_uring struct for private ring functions.
+ * \since 3.0
+ */
+typedef struct uring_internal_t {
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    unsigned char *buffers;
+    size_t buffer_size;
+    uint16_t buffer_mask;
+    uint16_t buffer_tail;
+} uring_internal_t;
+
+/*!
+ * \fn bool uring_supported()
+ * \brief Checks whether the running kernel allows io_uring to be used by the server.
+ * Rings must be owned by a single thread, and must be able to select buffers from
+ * a registered ring of buffers, which is only possible on Linux 6.1 or newer.
+ * \return Can io_uring be used?
+ */
+extern bool uring_supported()
+{
+    uring_t uring;
+
+    if (!uring_create(&uring, 8))
+        return false;
+
+    bool supported = uring_buffers_register(&uring, 0, 1, PAGE_SIZE);
+    uring_destroy(&uring);
+
+    return supported;
+}
+
+/*!
+ * \fn bool uring_create(uring_t*, unsigned)
+ * \brief Sets up a new ring and maps its queues into memory.
+ * The ring can only be driven by the thread that has created it.
+ * \param uring The ring to be set up.
+ * \param entries The number of entries on the ring's submission queue.
+ * \return Has the ring been successfully set up?
+ */
+extern bool uring_create(uring_t *uring, unsigned entries)
+{
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN
+      , .cq_entries = entries * 4
+    };
+
+    memset(uring, 0, sizeof(uring_t));
+    uring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+
+    if (uring->fd < 0)
+        return false;
+
+    uring_internal_t *internal = calloc(1, sizeof(uring_internal_t));
+    uring->_internal = internal;
+
+    internal->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    internal->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    internal->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both queues' rings at once, so the largest of both is mapped
+    // and shared between the two queues.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (internal->cq_ring_size > internal->sq_ring_size)
+            internal->sq_ring_size = internal->cq_ring_size;
+        internal->cq_ring_size = internal->sq_ring_size;
+    }
+
+    internal->sq_ring = mmap(
+        NULL, internal->sq_ring_size, PROT_READ | PROT_WRITE
+      , MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING
+    );
+
+    internal->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+        ? internal->sq_ring
+        : mmap(
+            NULL, internal->cq_ring_size, PROT_READ | PROT_WRITE
+          , MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING
+        );
+
+    uring->sqes = mmap(
+        NULL, internal->sqes_size, PROT_READ | PROT_WRITE
+      , MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES
+    );
+
+    if (internal->sq_ring == MAP_FAILED || internal->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        uring_destroy(uring);
+        return false;
+    }
+
+    unsigned char *sq_ring = internal->sq_ring;
+    unsigned char *cq_ring = internal->cq_ring;
+
+    uring->sq_entries = params.sq_entries;
+    uring->sq_head  = (unsigned*) (sq_ring + params.sq_off.head);
+    uring->sq_tail  = (unsigned*) (sq_ring + params.sq_off.tail);
+    uring->sq_mask  = *(unsigned*) (sq_ring + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned*) (sq_ring + params.sq_off.array);
+
+    uring->cq_head  = (unsigned*) (cq_ring + params.cq_off.head);
+    uring->cq_tail  = (unsigned*) (cq_ring + params.cq_off.tail);
+    uring->cq_mask  = *(unsigned*) (cq_ring + params.cq_off.ring_mask);
+    uring->cqes     = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+
+    // Submission entries are always consumed in order, so the indirection array can
+    // be filled once with an identity mapping and never touched again.
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+        uring->sq_array[i] = i;
+
+    return true;
+}
+
+/*!
+ * \fn struct io_uring_sqe *uring_get_sqe(uring_t*)
+ * \brief Takes a blank submission entry to be filled with a new operation.
+ * If the submission queue is full, the pending entries are submitted first.
+ * \param uring The ring to submit the operation to.
+ * \return The submission entry to be filled.
+ */
+extern struct io_uring_sqe *uring_get_sqe(uring_t *uring)
+{
+    unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *uring->sq_tail + uring->sq_pending;
+
+    if (tail - head >= uring->sq_entries) {
+        uring_submit_and_wait(uring, 0);
+        tail = *uring->sq_tail + uring->sq_pending;
+    }
+
+    struct io_uring_sqe *sqe = &uring->sqes[tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ++uring->sq_pending;
+
+    return sqe;
+}
+
+/*!
+ * \fn int uring_submit_and_wait(uring_t*, unsigned)
+ * \brief Submits all pending operations, and waits for some operations to complete.
+ * All operations submitted since the last call are submitted with a single call.
+ * \param uring The ring to submit operations to.
+ * \param wait The number of completions to wait for.
+ * \return The number of operations submitted, or a negative error code.
+ */
+extern int uring_submit_and_wait(uring_t *uring, unsigned wait)
+{
+    unsigned tail = *uring->sq_tail + uring->sq_pending;
+    __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+    uring->sq_pending = 0;
+
+    unsigned submit = tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    if (submit == 0 && wait == 0)
+        return 0;
+
+    int result = (int) syscall(__NR_io_uring_enter, uring->fd, submit, wait, flags, NULL, 0);
+    return result < 0 ? -errno : result;
+}
+
+/*!
+ * \fn struct io_uring_cqe *uring_peek_cqe(uring_t*)
+ * \brief Peeks at the oldest completion not yet seen, without waiting for it.
+ * \param uring The ring to reap completions from.
+ * \return The oldest completion, or NULL if there are none.
+ */
+extern struct io_uring_cqe *uring_peek_cqe(uring_t *uring)
+{
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    return head != tail
+        ? &uring->cqes[head & uring->cq_mask]
+        : NULL;
+}
+
+/*!
+ * \fn void uring_cqe_seen(uring_t*)
+ * \brief Marks the oldest completion as seen, so that its entry can be reused.
+ * \param uring The ring to reap completions from.
+ */
+extern void uring_cqe_seen(uring_t *uring)
+{
+    __atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*!
+ * \fn bool uring_buffers_register(uring_t*, uint16_t, uint16_t, size_t)
+ * \brief Registers a ring of buffers, from which data can be received into.
+ * \param uring The ring to register buffers to.
+ * \param group The buffer group id, which operations must select buffers from.
+ * \param count The number of buffers, which must be a power of two.
+ * \param size The size of each buffer.
+ * \return Have the buffers been successfully registered?
+ */
+extern bool uring_buffers_register(uring_t *uring, uint16_t group, uint16_t count, size_t size)
+{
+    void *buf_ring = NULL;
+    uring_internal_t *internal = (uring_internal_t*) uring->_internal;
+
+    if (posix_memalign(&buf_ring, PAGE_SIZE, count * sizeof(struct io_uring_buf)) != 0)
+        return false;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) buf_ring
+      , .ring_entries = count
+      , .bgid = group
+    };
+
+    memset(buf_ring, 0, count * sizeof(struct io_uring_buf));
+
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free(buf_ring);
+        return false;
+    }
+
+    internal->buf_ring = buf_ring;
+    internal->buffers = malloc(count * size);
+    internal->buffer_size = size;
+    internal->buffer_mask = count - 1;
+    internal->buffer_tail = 0;
+
+    for (uint16_t i = 0; i < count; ++i)
+        uring_buffer_recycle(uring, i);
+
+    return true;
+}
+
+/*!
+ * \fn unsigned char *uring_buffer_get(uring_t*, uint16_t)
+ * \brief Finds the memory of a buffer that has been selected by an operation.
+ * \param uring The ring the buffer has been registered to.
+ * \param id The id of the selected buffer.
+ * \return The buffer's memory.
+ */
+extern unsigned char *uring_buffer_get(uring_t *uring, uint16_t id)
+{
+    uring_internal_t *internal = (uring_internal_t*) uring->_internal;
+    return internal->buffers + (size_t) id * internal->buffer_size;
+}
+
+/*!
+ * \fn void uring_buffer_recycle(uring_t*, uint16_t)
+ * \brief Gives a buffer back to the kernel, once its contents have been consumed.
+ * \param uring The ring the buffer has been registered to.
+ * \param id The id of the buffer being given back.
+ */
+extern void uring_buffer_recycle(uring_t *uring, uint16_t id)
+{
+    uring_internal_t *internal = (uring_internal_t*) uring->_internal;
+    struct io_uring_buf *buf = &internal->buf_ring->bufs[internal->buffer_tail & internal->buffer_mask];
+
+    buf->addr = (uint64_t) (uintptr_t) uring_buffer_get(uring, id);
+    buf->len = (uint32_t) internal->buffer_size;
+    buf->bid = id;
+
+    __atomic_store_n(&internal->buf_ring->tail, ++internal->buffer_tail, __ATOMIC_RELEASE);
+}
+
+/*!
+ * \fn void uring_destroy(uring_t*)
+ * \brief Tears a ring down, and frees all of its resources.
+ * \param uring The ring to be destroyed.
+ */
+extern void uring_destroy(uring_t *uring)
+{
+    uring_internal_t *internal = (uring_internal_t*) uring->_internal;
+
+    // The ring is closed first, so that the kernel lets go of the buffers before their
+    // memory is given back to the system.
+    close(uring->fd);
+
+    if (internal != NULL) {
+        if (uring->sqes != NULL && uring->sqes != MAP_FAILED)
+            munmap(uring->sqes, internal->sqes_size);
+
+        if (internal->cq_ring != NULL && internal->cq_ring != MAP_FAILED && internal->cq_ring != internal->sq_ring)
+            munmap(internal->cq_ring, internal->cq_ring_size);
+
+        if (internal->sq_ring != NULL && internal->sq_ring != MAP_FAILED)
+            munmap(internal->sq_ring, internal->sq_ring_size);
+
+        free(internal->buf_ring);
+        free(internal->buffers);
+        free(internal);
+    }
+
+    uring->_internal = NULL;
+}
@@ -0,0 +1,51 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the io_uring submission rings.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_URING_H
+#define MU_HTTPD_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*!
+ * \struct uring_t
+ * \brief An io_uring instance, with its rings mapped into memory.
+ * \since 3.0
+ */
+typedef struct uring_t {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *_internal;
+} uring_t;
+
+/*
+ * Forward declaration of io_uring functions.
+ * These functions are needed for submitting operations and reaping their completions.
+ */
+extern bool uring_supported();
+extern bool uring_create(uring_t*, unsigned);
+extern struct io_uring_sqe *uring_get_sqe(uring_t*);
+extern int uring_submit_and_wait(uring_t*, unsigned);
+extern struct io_uring_cqe *uring_peek_cqe(uring_t*);
+extern void uring_cqe_seen(uring_t*);
+extern bool uring_buffers_register(uring_t*, uint16_t, uint16_t, size_t);
+extern unsigned char *uring_buffer_get(uring_t*, uint16_t);
+extern void uring_buffer_recycle(uring_t*, uint16_t);
+extern void uring_destroy(uring_t*);
+
+#endif
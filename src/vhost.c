@@ -0,0 +1,304 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the name-based virtual hosts.
+ * Hosts are read from the hosts file once, when the server starts, and a perfect hash
+ * function is searched for their names, so that the host a request is sent to is then
+ * found with a single probe, and a single comparison, whatever the number of hosts.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "missing.h"
+
+#include "vhost.h"
+
+/*
+ * The longest host name allowed, the number of seeds tried for each table size while
+ * searching for a perfect hash function, the largest table size tried, and the
+ * separators between the fields of a line in the hosts file.
+ */
+#define VHOST_NAME_SIZE     256
+#define VHOST_SEED_ATTEMPTS 4096
+#define VHOST_MAX_SLOTS     (1u << 20)
+#define VHOST_SEPARATORS    " \t\r\n"
+
+/*!
+ * \struct vhost_table_t
+ * \brief The virtual hosts, and the table their names are perfectly hashed into.
+ * \since 3.0
+ */
+typedef struct vhost_table_t {
+    vhost_t *host;
+    size_t count;
+    int32_t *slot;
+    size_t slots;
+    uint64_t seed;
+} vhost_table_t;
+
+/*!
+ * \var g_vhost
+ * \brief The virtual hosts requests may be sent to.
+ * \since 3.0
+ */
+static vhost_table_t g_vhost;
+
+/*!
+ * \fn uint64_t vhost_hash(const char*, size_t, uint64_t)
+ * \brief Hashes a host name with a seed, with the FNV-1a function and a final mix.
+ * \param name The host name to be hashed.
+ * \param length The host name's length.
+ * \param seed The seed telling apart the hash functions of the family.
+ * \return The host name's hash.
+ */
+uint64_t vhost_hash(const char *name, size_t length, uint64_t seed)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+
+    for (size_t i = 0; i < length; ++i)
+        hash = (hash ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/*!
+ * \fn bool vhost_table_build(vhost_table_t*)
+ * \brief Searches for a seed with which no two host names hash into the same slot.
+ * The table starts with twice as many slots as there are hosts, and is only grown if no
+ * perfect hash function is found for its size.
+ * \param table The hosts table to be built.
+ * \return Has a perfect hash function been found?
+ */
+bool vhost_table_build(vhost_table_t *table)
+{
+    for (table->slots = 2; table->slots < table->count * 2; table->slots *= 2)
+        ;
+
+    for (; table->slots <= VHOST_MAX_SLOTS; table->slots *= 2) {
+        table->slot = realloc(table->slot, sizeof(int32_t) * table->slots);
+
+        for (table->seed = 1; table->seed <= VHOST_SEED_ATTEMPTS; ++table->seed) {
+            size_t i = 0;
+
+            memset(table->slot, -1, sizeof(int32_t) * table->slots);
+
+            for (; i < table->count; ++i) {
+                const vhost_t *host = &table->host[i];
+                int32_t *slot = &table->slot[vhost_hash(host->name, host->length, table->seed) & (table->slots - 1)];
+
+                if (*slot != -1)
+                    break;
+
+                *slot = (int32_t) i;
+            }
+
+            if (i == table->count)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+/*!
+ * \fn bool vhost_parse_host(vhost_t*, char*, char*, size_t)
+ * \brief Parses a virtual host from a line of the hosts file.
+ * Each line holds a host's name, its folder and, optionally, its redirections file.
+ * \param host The virtual host to be parsed.
+ * \param line The line to parse the host from.
+ * \param reason The buffer to describe why the host is invalid into.
+ * \param size The reason buffer's size.
+ * \return Has the host been parsed?
+ */
+bool vhost_parse_host(vhost_t *host, char *line, char *reason, size_t size)
+{
+    char *cursor;
+    char *name = strtok_r(line, VHOST_SEPARATORS, &cursor);
+    char *folder = strtok_r(NULL, VHOST_SEPARATORS, &cursor);
+    char *moved = strtok_r(NULL, VHOST_SEPARATORS, &cursor);
+
+    if (folder == NULL || strtok_r(NULL, VHOST_SEPARATORS, &cursor) != NULL) {
+        snprintf(reason, size, "expected 'name folder [redirections]'");
+        return false;
+    }
+
+    if (strlen(name) >= VHOST_NAME_SIZE || strpbrk(name, ":/") != NULL) {
+        snprintf(reason, size, "invalid host name '%s'", name);
+        return false;
+    }
+
+    for (char *c = name; *c != '\0'; ++c)
+        *c = (char) tolower((unsigned char) *c);
+
+    host->name = strdup(name);
+    host->length = strlen(name);
+    host->folder = strdup(folder);
+    host->moved = moved != NULL ? strdup(moved) : NULL;
+
+    return true;
+}
+
+/*!
+ * \fn bool vhost_load(const char*, char*, size_t)
+ * \brief Reads the virtual hosts from the hosts file, and builds their table.
+ * Requests for any other host are served by the default host, from the public folder.
+ * \param path The hosts file's path, or an empty string if there are no virtual hosts.
+ * \param error The buffer to describe why the hosts could not be loaded into.
+ * \param size The error buffer's size.
+ * \return Have the hosts been loaded?
+ */
+extern bool vhost_load(const char *path, char *error, size_t size)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t number = 0;
+    bool success = true;
+    char reason[256];
+    vhost_table_t *table = &g_vhost;
+    FILE *file;
+
+    if (path[0] == '\0')
+        return true;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        snprintf(error, size, "could not open '%s': %s", path, strerror(errno));
+        return false;
+    }
+
+    while (success && getline(&line, &capacity, file) != -1) {
+        char *comment = strchr(line, '#');
+        vhost_t host = { 0 };
+
+        ++number;
+
+        if (comment != NULL)
+            *comment = '\0';
+
+        if (line[strspn(line, VHOST_SEPARATORS)] == '\0')
+            continue;
+
+        if (!vhost_parse_host(&host, line, reason, sizeof(reason))) {
+            snprintf(error, size, "%s:%zu: %s", path, number, reason);
+            success = false;
+            continue;
+        }
+
+        host.partition = table->count + 1;
+        table->host = realloc(table->host, sizeof(vhost_t) * (table->count + 1));
+        table->host[table->count++] = host;
+
+        for (size_t i = 0; i + 1 < table->count; ++i) {
+            if (strcmp(table->host[i].name, host.name) == 0) {
+                snprintf(error, size, "%s:%zu: the host '%s' is already defined", path, number, host.name);
+                success = false;
+            }
+        }
+
+        if (success && table->count > MAX_VIRTUAL_HOSTS) {
+            snprintf(error, size, "%s:%zu: more than %d virtual hosts", path, number, MAX_VIRTUAL_HOSTS);
+            success = false;
+        }
+    }
+
+    fclose(file);
+    free(line);
+
+    if (success && table->count > 0 && !vhost_table_build(table)) {
+        snprintf(error, size, "%s: no perfect hash function found for its host names", path);
+        success = false;
+    }
+
+    if (!success) {
+        vhost_finalize();
+        return false;
+    }
+
+    // Changes to the hosts' redirections are only noticed by watching their directories.
+    for (size_t i = 0; i < table->count; ++i)
+        if (table->host[i].moved != NULL)
+            missing_watch(table->host[i].moved);
+
+    return true;
+}
+
+/*!
+ * \fn const vhost_t *vhost_find(const char*)
+ * \brief Finds the virtual host a request has been sent to, by its `Host` header.
+ * The header's port, if any, is ignored, and names are compared regardless of case.
+ * \param header The request's `Host` header, or NULL if it has none.
+ * \return The virtual host, or NULL if the request is for the default host.
+ */
+extern const vhost_t *vhost_find(const char *header)
+{
+    size_t length;
+    char name[VHOST_NAME_SIZE];
+    const vhost_table_t *table = &g_vhost;
+
+    if (header == NULL || table->count == 0)
+        return NULL;
+
+    header += strspn(header, " \t");
+    length = header[0] == '[' ? strcspn(header, "]") : strcspn(header, ": \t");
+
+    if (header[0] == '[' && header[length++] != ']')
+        return NULL;
+
+    if (length > 0 && header[length - 1] == '.')
+        --length;
+
+    if (length == 0 || length >= VHOST_NAME_SIZE)
+        return NULL;
+
+    for (size_t i = 0; i < length; ++i)
+        name[i] = (char) tolower((unsigned char) header[i]);
+
+    int32_t slot = table->slot[vhost_hash(name, length, table->seed) & (table->slots - 1)];
+
+    if (slot == -1)
+        return NULL;
+
+    const vhost_t *host = &table->host[slot];
+    return host->length == length && memcmp(host->name, name, length) == 0 ? host : NULL;
+}
+
+/*!
+ * \fn size_t vhost_count()
+ * \brief Informs the number of virtual hosts, besides the default one.
+ * \return The number of virtual hosts.
+ */
+extern size_t vhost_count()
+{
+    return g_vhost.count;
+}
+
+/*!
+ * \fn void vhost_finalize()
+ * \brief Releases the virtual hosts and their table.
+ */
+extern void vhost_finalize()
+{
+    vhost_table_t *table = &g_vhost;
+
+    for (size_t i = 0; i < table->count; ++i) {
+        free(table->host[i].name);
+        free(table->host[i].folder);
+        free(table->host[i].moved);
+    }
+
+    free(table->host);
+    free(table->slot);
+
+    *table = (vhost_table_t) { 0 };
+}
@@ -0,0 +1,37 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The types and functions declarations for the name-based virtual hosts.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_VHOST_H
+#define MU_HTTPD_VHOST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ * \struct vhost_t
+ * \brief A virtual host, selected by the name requests are sent to.
+ * Each host serves its own folder, with its own redirections, if any, and has its own
+ * partition of the file cache. Partition zero is left to the default host.
+ * \since 3.0
+ */
+typedef struct vhost_t {
+    char *name;
+    size_t length;
+    char *folder;
+    char *moved;
+    size_t partition;
+} vhost_t;
+
+/*
+ * Forward declaration of virtual host functions.
+ * These functions are needed for selecting the host requests are sent to.
+ */
+extern bool vhost_load(const char*, char*, size_t);
+extern const vhost_t *vhost_find(const char*);
+extern size_t vhost_count();
+extern void vhost_finalize();
+
+#endif
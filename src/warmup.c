@@ -0,0 +1,445 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The implementation of the caches warm-up at startup.
+ * Right after the server starts listening, the public folder is walked in the background
+ * by a few threads at once, which fills the listing cache, and the files most likely to
+ * be requested are then loaded into the file cache, and their contents into the page
+ * cache, so that the first requests for them do not pay for a cold start. The files
+ * loaded are those listed in a warm-up manifest, most often listed first, followed by
+ * the folder's smallest files, up to the file cache's capacity.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "listing.h"
+#include "response.h"
+#include "settings.h"
+
+#include "warmup.h"
+
+/*
+ * The deepest a folder may be within the public folder to be walked, so that links
+ * looping back to a parent folder are not followed forever.
+ */
+#define WARMUP_MAX_DEPTH 32
+
+/*!
+ * \struct warmup_folder_t
+ * \brief A folder waiting to be walked.
+ * \since 3.0
+ */
+typedef struct warmup_folder_t {
+    char *path;
+    int depth;
+} warmup_folder_t;
+
+/*!
+ * \struct warmup_file_t
+ * \brief A file found while walking the public folder.
+ * \since 3.0
+ */
+typedef struct warmup_file_t {
+    char *path;
+    off_t size;
+} warmup_file_t;
+
+/*!
+ * \struct warmup_rank_t
+ * \brief A path listed in the warm-up manifest, and how many times it has been listed.
+ * \since 3.0
+ */
+typedef struct warmup_rank_t {
+    const char *path;
+    size_t hits;
+} warmup_rank_t;
+
+/*!
+ * \struct warmup_t
+ * \brief The state of the warm-up, shared by all of its threads.
+ * Folders are taken from the queue by the walking threads, which stop once the queue is
+ * empty and no thread is walking a folder, as nothing else can be queued anymore.
+ * \since 3.0
+ */
+typedef struct warmup_t {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t coordinator;
+    bool running;
+    atomic_bool stopping;
+    char *folder;
+    char *manifest;
+    size_t threads;
+    warmup_folder_t *queue;
+    size_t queued;
+    size_t queue_capacity;
+    size_t busy;
+    warmup_file_t *file;
+    size_t count;
+    size_t capacity;
+    char **preload;
+    size_t preloads;
+    atomic_size_t next;
+} warmup_t;
+
+/*!
+ * \var g_warmup
+ * \brief The warm-up running in the background, if any.
+ * \since 3.0
+ */
+static warmup_t g_warmup = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+  , .wake = PTHREAD_COND_INITIALIZER
+};
+
+/*!
+ * \fn void warmup_queue_folder(warmup_t*, const char*, int)
+ * \brief Queues a folder to be walked. The warm-up's lock must be held.
+ * \param warmup The warm-up walking the folder.
+ * \param path The folder's path.
+ * \param depth The folder's depth within the public folder.
+ */
+void warmup_queue_folder(warmup_t *warmup, const char *path, int depth)
+{
+    if (warmup->queued == warmup->queue_capacity) {
+        warmup->queue_capacity = warmup->queue_capacity > 0 ? warmup->queue_capacity * 2 : 64;
+        warmup->queue = realloc(warmup->queue, sizeof(warmup_folder_t) * warmup->queue_capacity);
+    }
+
+    warmup->queue[warmup->queued++] = (warmup_folder_t) { .path = strdup(path), .depth = depth };
+}
+
+/*!
+ * \fn void warmup_walk_folder(warmup_t*, const warmup_folder_t*)
+ * \brief Lists a folder through the listing cache, queueing its subfolders to be walked
+ * and keeping its files to be loaded.
+ * \param warmup The warm-up walking the folder.
+ * \param folder The folder to be walked.
+ */
+void warmup_walk_folder(warmup_t *warmup, const warmup_folder_t *folder)
+{
+    char path[BUFFER_SIZE];
+    listing_t *listing = listing_acquire(folder->path);
+
+    if (listing == NULL)
+        return;
+
+    pthread_mutex_lock(&warmup->lock);
+
+    for (size_t i = 0; i < listing->count; ++i) {
+        const listing_entry_t *entry = &listing->entry[i];
+
+        if (strcmp(entry->name, "..") == 0 || snprintf(path, sizeof(path), "%s/%s", folder->path, entry->name) >= (int) sizeof(path))
+            continue;
+
+        if (entry->directory) {
+            if (folder->depth < WARMUP_MAX_DEPTH)
+                warmup_queue_folder(warmup, path, folder->depth + 1);
+
+            continue;
+        }
+
+        if (warmup->count == warmup->capacity) {
+            warmup->capacity = warmup->capacity > 0 ? warmup->capacity * 2 : 256;
+            warmup->file = realloc(warmup->file, sizeof(warmup_file_t) * warmup->capacity);
+        }
+
+        warmup->file[warmup->count++] = (warmup_file_t) { .path = strdup(path), .size = entry->size };
+    }
+
+    pthread_cond_broadcast(&warmup->wake);
+    pthread_mutex_unlock(&warmup->lock);
+    listing_release(listing);
+}
+
+/*!
+ * \fn void *warmup_walk_run(void*)
+ * \brief Walks queued folders, until there are none left to be walked.
+ * \param arg The warm-up being run.
+ */
+void *warmup_walk_run(void *arg)
+{
+    warmup_t *warmup = (warmup_t*) arg;
+
+    pthread_mutex_lock(&warmup->lock);
+
+    for (;;) {
+        while (warmup->queued == 0 && warmup->busy > 0 && !atomic_load(&warmup->stopping))
+            pthread_cond_wait(&warmup->wake, &warmup->lock);
+
+        if (warmup->queued == 0 || atomic_load(&warmup->stopping))
+            break;
+
+        warmup_folder_t folder = warmup->queue[--warmup->queued];
+        ++warmup->busy;
+
+        pthread_mutex_unlock(&warmup->lock);
+        warmup_walk_folder(warmup, &folder);
+        free(folder.path);
+        pthread_mutex_lock(&warmup->lock);
+
+        --warmup->busy;
+    }
+
+    pthread_cond_broadcast(&warmup->wake);
+    pthread_mutex_unlock(&warmup->lock);
+
+    return NULL;
+}
+
+/*!
+ * \fn void *warmup_preload_run(void*)
+ * \brief Loads the files to be preloaded, taking them in order, until none is left.
+ * \param arg The warm-up being run.
+ */
+void *warmup_preload_run(void *arg)
+{
+    size_t next;
+    warmup_t *warmup = (warmup_t*) arg;
+
+    while (!atomic_load(&warmup->stopping) && (next = atomic_fetch_add(&warmup->next, 1)) < warmup->preloads)
+        response_preload(warmup->preload[next]);
+
+    return NULL;
+}
+
+/*!
+ * \fn int warmup_compare_string(const void*, const void*)
+ * \brief Orders strings alphabetically.
+ * \param a The first string to be compared.
+ * \param b The second string to be compared.
+ * \return The strings' order.
+ */
+int warmup_compare_string(const void *a, const void *b)
+{
+    return strcmp(*(char *const*) a, *(char *const*) b);
+}
+
+/*!
+ * \fn int warmup_compare_rank(const void*, const void*)
+ * \brief Orders paths listed in the manifest from the most to the least often listed.
+ * \param a The first path to be compared.
+ * \param b The second path to be compared.
+ * \return The paths' order.
+ */
+int warmup_compare_rank(const void *a, const void *b)
+{
+    const warmup_rank_t *x = (const warmup_rank_t*) a;
+    const warmup_rank_t *y = (const warmup_rank_t*) b;
+
+    return x->hits != y->hits ? (x->hits < y->hits) - (x->hits > y->hits) : strcmp(x->path, y->path);
+}
+
+/*!
+ * \fn int warmup_compare_size(const void*, const void*)
+ * \brief Orders files from the smallest to the largest.
+ * \param a The first file to be compared.
+ * \param b The second file to be compared.
+ * \return The files' order.
+ */
+int warmup_compare_size(const void *a, const void *b)
+{
+    const warmup_file_t *x = (const warmup_file_t*) a;
+    const warmup_file_t *y = (const warmup_file_t*) b;
+
+    return x->size != y->size ? (x->size > y->size) - (x->size < y->size) : strcmp(x->path, y->path);
+}
+
+/*!
+ * \fn void warmup_preload_manifest(warmup_t*, size_t)
+ * \brief Lists the paths in the manifest to be preloaded, most often listed first.
+ * Each line's last word is taken as a path, so that both a plain list of paths and the
+ * server's own access log can be used as a manifest.
+ * \param warmup The warm-up being run.
+ * \param limit The most files to be preloaded.
+ */
+void warmup_preload_manifest(warmup_t *warmup, size_t limit)
+{
+    char *line = NULL;
+    char **listed = NULL;
+    size_t size = 0, count = 0, capacity = 0, ranks = 0;
+    char target[BUFFER_SIZE];
+    FILE *manifest = fopen(warmup->manifest, "r");
+
+    if (manifest == NULL)
+        return;
+
+    while (getline(&line, &size, manifest) != -1) {
+        char *save, *path = NULL;
+
+        for (char *word = strtok_r(line, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save))
+            path = word;
+
+        if (path == NULL || path[0] != '/')
+            continue;
+
+        if (count == capacity)
+            listed = realloc(listed, sizeof(char*) * (capacity = capacity > 0 ? capacity * 2 : 256));
+
+        path[strcspn(path, "?")] = '\0';
+        listed[count++] = strdup(path);
+    }
+
+    qsort(listed, count, sizeof(char*), warmup_compare_string);
+    warmup_rank_t *rank = malloc(sizeof(warmup_rank_t) * (count + 1));
+
+    for (size_t i = 0; i < count; ++i) {
+        if (ranks > 0 && strcmp(rank[ranks - 1].path, listed[i]) == 0)
+            rank[ranks - 1].hits++;
+        else
+            rank[ranks++] = (warmup_rank_t) { .path = listed[i], .hits = 1 };
+    }
+
+    qsort(rank, ranks, sizeof(warmup_rank_t), warmup_compare_rank);
+
+    for (size_t i = 0; i < ranks && warmup->preloads < limit; ++i)
+        if (snprintf(target, sizeof(target), "%s%s", warmup->folder, rank[i].path) < (int) sizeof(target))
+            warmup->preload[warmup->preloads++] = strdup(target);
+
+    for (size_t i = 0; i < count; ++i)
+        free(listed[i]);
+
+    fclose(manifest);
+    free(listed);
+    free(rank);
+    free(line);
+}
+
+/*!
+ * \fn void warmup_preload_smallest(warmup_t*, size_t)
+ * \brief Lists the smallest files found to be preloaded, after those in the manifest.
+ * Smaller files are preferred, as their whole responses are kept in the file cache.
+ * \param warmup The warm-up being run.
+ * \param limit The most files to be preloaded.
+ */
+void warmup_preload_smallest(warmup_t *warmup, size_t limit)
+{
+    size_t listed = warmup->preloads;
+    char **manifest = malloc(sizeof(char*) * (listed + 1));
+
+    memcpy(manifest, warmup->preload, sizeof(char*) * listed);
+    qsort(manifest, listed, sizeof(char*), warmup_compare_string);
+    qsort(warmup->file, warmup->count, sizeof(warmup_file_t), warmup_compare_size);
+
+    for (size_t i = 0; i < warmup->count && warmup->preloads < limit; ++i)
+        if (bsearch(&warmup->file[i].path, manifest, listed, sizeof(char*), warmup_compare_string) == NULL)
+            warmup->preload[warmup->preloads++] = strdup(warmup->file[i].path);
+
+    free(manifest);
+}
+
+/*!
+ * \fn void warmup_spawn(warmup_t*, void *(*)(void*))
+ * \brief Runs a warm-up phase on all of the warm-up's threads, and waits for it to end.
+ * \param warmup The warm-up being run.
+ * \param phase The phase to be run.
+ */
+void warmup_spawn(warmup_t *warmup, void *(*phase)(void*))
+{
+    pthread_t *thread = calloc(warmup->threads, sizeof(pthread_t));
+
+    for (size_t i = 0; i < warmup->threads; ++i)
+        pthread_create(&thread[i], NULL, phase, (void*) warmup);
+
+    for (size_t i = 0; i < warmup->threads; ++i)
+        pthread_join(thread[i], NULL);
+
+    free(thread);
+}
+
+/*!
+ * \fn void *warmup_run(void*)
+ * \brief Walks the public folder, and then preloads the files chosen to be preloaded.
+ * \param arg The warm-up being run.
+ */
+void *warmup_run(void *arg)
+{
+    warmup_t *warmup = (warmup_t*) arg;
+    size_t limit = settings_current()->file_cache;
+
+    warmup_queue_folder(warmup, warmup->folder, 0);
+    warmup_spawn(warmup, &warmup_walk_run);
+
+    warmup->preload = malloc(sizeof(char*) * (limit + 1));
+
+    if (warmup->manifest != NULL)
+        warmup_preload_manifest(warmup, limit);
+
+    warmup_preload_smallest(warmup, limit);
+    warmup_spawn(warmup, &warmup_preload_run);
+
+    return NULL;
+}
+
+/*!
+ * \fn void warmup_start(const char*, const char*, size_t)
+ * \brief Starts warming the caches up in the background.
+ * The warm-up's threads never handle signals, so that signals are still handled by the
+ * main thread, as the server expects.
+ * \param folder The public folder to be walked.
+ * \param manifest The manifest listing the paths to be preloaded, or NULL if none.
+ * \param threads The number of threads to walk the folder and preload files with.
+ */
+extern void warmup_start(const char *folder, const char *manifest, size_t threads)
+{
+    sigset_t all, previous;
+    warmup_t *warmup = &g_warmup;
+
+    warmup->folder = strdup(folder);
+    warmup->manifest = manifest != NULL ? strdup(manifest) : NULL;
+    warmup->threads = threads;
+    atomic_init(&warmup->stopping, false);
+    atomic_init(&warmup->next, 0);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    warmup->running = pthread_create(&warmup->coordinator, NULL, &warmup_run, (void*) warmup) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/*!
+ * \fn void warmup_finalize()
+ * \brief Stops the warm-up, if it is still running, and releases its state.
+ */
+extern void warmup_finalize()
+{
+    warmup_t *warmup = &g_warmup;
+
+    if (!warmup->running)
+        return;
+
+    pthread_mutex_lock(&warmup->lock);
+    atomic_store(&warmup->stopping, true);
+    pthread_cond_broadcast(&warmup->wake);
+    pthread_mutex_unlock(&warmup->lock);
+
+    pthread_join(warmup->coordinator, NULL);
+
+    for (size_t i = 0; i < warmup->queued; ++i)
+        free(warmup->queue[i].path);
+
+    for (size_t i = 0; i < warmup->count; ++i)
+        free(warmup->file[i].path);
+
+    for (size_t i = 0; i < warmup->preloads; ++i)
+        free(warmup->preload[i]);
+
+    free(warmup->queue);
+    free(warmup->file);
+    free(warmup->preload);
+    free(warmup->folder);
+    free(warmup->manifest);
+
+    warmup->running = false;
+}
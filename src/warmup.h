@@ -0,0 +1,19 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file The functions declarations for warming the caches up at startup.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#ifndef MU_HTTPD_WARMUP_H
+#define MU_HTTPD_WARMUP_H
+
+#include <stddef.h>
+
+/*
+ * Forward declaration of warm-up functions.
+ * These functions are needed for warming the caches up while the server already serves.
+ */
+extern void warmup_start(const char*, const char*, size_t);
+extern void warmup_finalize();
+
+#endif
@@ -0,0 +1,366 @@
+/*!
+ * mu-HTTPd: A very very simple HTTP server.
+ * \file A tool compiling a public folder into a bundle the server can be run from.
+ * Every file in the folder is stored along with its type and its entity tag, as the
+ * server would have found them, and text files are also stored compressed with gzip
+ * when that makes them noticeably smaller. The bundle is written to a temporary file
+ * first, and renamed over its final path once complete, so that a bundle being served
+ * is never seen half-written.
+ * \author Rodrigo Siqueira <rodriados@gmail.com>
+ * \copyright 2014-present Rodrigo Siqueira
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pack.h"
+#include "response.h"
+
+#define PACK_MAX_DEPTH      64
+#define PACK_PATH_SIZE      4096
+
+/*!
+ * \struct pack_source_t
+ * \brief A file found in the folder being bundled.
+ * \since 3.0
+ */
+typedef struct pack_source_t {
+    char *path;
+    char *source;
+    struct stat status;
+} pack_source_t;
+
+/*!
+ * \struct pack_builder_t
+ * \brief The state of a bundle being compiled.
+ * \since 3.0
+ */
+typedef struct pack_builder_t {
+    pack_source_t *source;
+    size_t count;
+    size_t capacity;
+    char *strings;
+    size_t strings_length;
+    size_t strings_capacity;
+    int fd;
+    uint64_t offset;
+    size_t compressed;
+} pack_builder_t;
+
+/*!
+ * \fn void pack_fail(const char*, const char*)
+ * \brief Reports an error and stops the tool.
+ * \param message The error's description.
+ * \param subject The path the error is about.
+ */
+void pack_fail(const char *message, const char *subject)
+{
+    fprintf(stderr, "mu-pack: %s: %s\n", message, subject);
+    exit(EXIT_FAILURE);
+}
+
+/*!
+ * \fn void pack_collect(pack_builder_t*, const char*, const char*, int)
+ * \brief Collects every regular file in a folder, and in its subfolders.
+ * \param builder The bundle being compiled.
+ * \param folder The folder to collect files from.
+ * \param prefix The folder's path, as requested from the server.
+ * \param depth The folder's depth, so that links looping back are not followed forever.
+ */
+void pack_collect(pack_builder_t *builder, const char *folder, const char *prefix, int depth)
+{
+    struct dirent *item;
+    DIR *directory = opendir(folder);
+
+    if (directory == NULL)
+        pack_fail("cannot read folder", folder);
+
+    if (depth > PACK_MAX_DEPTH)
+        pack_fail("folder nested too deep", folder);
+
+    while ((item = readdir(directory)) != NULL) {
+        char source[PACK_PATH_SIZE];
+        char path[PACK_PATH_SIZE];
+        struct stat status;
+
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+            continue;
+
+        if (snprintf(source, sizeof(source), "%s/%s", folder, item->d_name) >= (int) sizeof(source)
+         || snprintf(path, sizeof(path), "%s/%s", prefix, item->d_name) >= (int) sizeof(path))
+            pack_fail("path too long", source);
+
+        if (stat(source, &status) == -1)
+            pack_fail("cannot read file", source);
+
+        if (S_ISDIR(status.st_mode)) {
+            pack_collect(builder, source, path, depth + 1);
+            continue;
+        }
+
+        if (!S_ISREG(status.st_mode))
+            continue;
+
+        if (builder->count == builder->capacity) {
+            builder->capacity = builder->capacity > 0 ? builder->capacity * 2 : 64;
+            builder->source = realloc(builder->source, sizeof(pack_source_t) * builder->capacity);
+        }
+
+        builder->source[builder->count++] = (pack_source_t) {
+            .path = strdup(path)
+          , .source = strdup(source)
+          , .status = status
+        };
+    }
+
+    closedir(directory);
+}
+
+/*!
+ * \fn int pack_compare(const void*, const void*)
+ * \brief Orders bundled files by their paths, as they are looked up by the server.
+ * \param a The first file to be compared.
+ * \param b The second file to be compared.
+ * \return The files' order.
+ */
+int pack_compare(const void *a, const void *b)
+{
+    return strcmp(((const pack_source_t*) a)->path, ((const pack_source_t*) b)->path);
+}
+
+/*!
+ * \fn uint32_t pack_intern(pack_builder_t*, const char*)
+ * \brief Stores a string into the bundle's strings.
+ * \param builder The bundle being compiled.
+ * \param string The string to be stored.
+ * \return The string's offset within the bundle's strings.
+ */
+uint32_t pack_intern(pack_builder_t *builder, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    size_t offset = builder->strings_length;
+
+    while (builder->strings_length + length > builder->strings_capacity) {
+        builder->strings_capacity = builder->strings_capacity > 0 ? builder->strings_capacity * 2 : 4096;
+        builder->strings = realloc(builder->strings, builder->strings_capacity);
+    }
+
+    memcpy(builder->strings + offset, string, length);
+    builder->strings_length += length;
+
+    return (uint32_t) offset;
+}
+
+/*!
+ * \fn uint64_t pack_write(pack_builder_t*, const void*, size_t)
+ * \brief Writes contents into the bundle, at its next aligned position.
+ * \param builder The bundle being compiled.
+ * \param data The contents to be written.
+ * \param length The contents' length.
+ * \return The position the contents have been written at.
+ */
+uint64_t pack_write(pack_builder_t *builder, const void *data, size_t length)
+{
+    uint64_t offset = (builder->offset + PACK_ALIGNMENT - 1) / PACK_ALIGNMENT * PACK_ALIGNMENT;
+
+    for (size_t written = 0; written < length; ) {
+        ssize_t bytes = pwrite(builder->fd, (const char*) data + written, length - written, (off_t) (offset + written));
+
+        if (bytes <= 0)
+            pack_fail("cannot write bundle", strerror(errno));
+
+        written += (size_t) bytes;
+    }
+
+    builder->offset = offset + length;
+    return offset;
+}
+
+/*!
+ * \fn unsigned char *pack_read(const pack_source_t*)
+ * \brief Reads a whole file to be bundled into memory.
+ * \param file The file to be read.
+ * \return The file's contents.
+ */
+unsigned char *pack_read(const pack_source_t *file)
+{
+    size_t length = (size_t) file->status.st_size;
+    unsigned char *data = malloc(length + 1);
+    FILE *source = fopen(file->source, "rb");
+
+    if (source == NULL || fread(data, 1, length, source) != length)
+        pack_fail("cannot read file", file->source);
+
+    fclose(source);
+    return data;
+}
+
+/*!
+ * \fn unsigned char *pack_compress(const unsigned char*, size_t, size_t*)
+ * \brief Compresses contents with gzip, at the highest compression level.
+ * \param data The contents to be compressed.
+ * \param length The contents' length.
+ * \param compressed The compressed contents' length.
+ * \return The compressed contents, or NULL if they could not be compressed.
+ */
+unsigned char *pack_compress(const unsigned char *data, size_t length, size_t *compressed)
+{
+    z_stream stream = { 0 };
+
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    size_t capacity = deflateBound(&stream, length);
+    unsigned char *output = malloc(capacity);
+
+    stream.next_in = (unsigned char*) data;
+    stream.avail_in = (uInt) length;
+    stream.next_out = output;
+    stream.avail_out = (uInt) capacity;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        free(output);
+        return NULL;
+    }
+
+    *compressed = stream.total_out;
+    deflateEnd(&stream);
+
+    return output;
+}
+
+/*!
+ * \fn void pack_store(pack_builder_t*, const pack_source_t*, pack_entry_t*)
+ * \brief Stores a file into the bundle, and describes it in the bundle's index.
+ * Only text files are compressed, and their compressed variant is only kept when it
+ * is at least a tenth smaller than the file itself.
+ * \param builder The bundle being compiled.
+ * \param file The file to be stored.
+ * \param entry The file's entry in the bundle's index.
+ */
+void pack_store(pack_builder_t *builder, const pack_source_t *file, pack_entry_t *entry)
+{
+    char etag[64];
+    size_t compressed = 0;
+    size_t length = (size_t) file->status.st_size;
+    const char *mime = response_get_mime(strrchr(file->path, '.'));
+    unsigned char *data = pack_read(file);
+    unsigned char *deflated = strncmp(mime, "text/", 5) == 0 && length > 0
+        ? pack_compress(data, length, &compressed)
+        : NULL;
+
+    *entry = (pack_entry_t) {
+        .path = pack_intern(builder, file->path)
+      , .mime = pack_intern(builder, mime)
+      , .modified = (int64_t) file->status.st_mtim.tv_sec
+    };
+
+    snprintf(etag, sizeof(etag), "\"%lx-%lx\"", (unsigned long) file->status.st_mtim.tv_sec, (unsigned long) length);
+    entry->variant[PACK_VARIANT_IDENTITY].offset = pack_write(builder, data, length);
+    entry->variant[PACK_VARIANT_IDENTITY].length = length;
+    entry->variant[PACK_VARIANT_IDENTITY].etag = pack_intern(builder, etag);
+
+    // The compressed variant is tagged apart, as it is not the same representation.
+    if (deflated != NULL && compressed < length - length / 10) {
+        snprintf(etag, sizeof(etag), "\"%lx-%lx-gzip\"", (unsigned long) file->status.st_mtim.tv_sec, (unsigned long) length);
+        entry->variant[PACK_VARIANT_GZIP].offset = pack_write(builder, deflated, compressed);
+        entry->variant[PACK_VARIANT_GZIP].length = compressed;
+        entry->variant[PACK_VARIANT_GZIP].etag = pack_intern(builder, etag);
+        builder->compressed++;
+    }
+
+    free(deflated);
+    free(data);
+}
+
+/*!
+ * \fn void pack_usage(const char*)
+ * \brief Prints the tool's usage message.
+ * \param program The program's name.
+ */
+void pack_usage(const char *program)
+{
+    fprintf(stderr,
+        "usage: %s folder bundle\n"
+        "  folder  the public folder to be bundled\n"
+        "  bundle  the bundle to be written, which the server is run from with -o bundle=path\n"
+      , program
+    );
+}
+
+/*!
+ * \fn int main(int, char **)
+ * \brief The bundling tool's entry point.
+ * \param argc The number of command line arguments.
+ * \param argv The list of command line arguments.
+ */
+int main(int argc, char **argv)
+{
+    char temporary[PACK_PATH_SIZE];
+    pack_builder_t builder = { .offset = sizeof(pack_header_t) };
+
+    if (argc != 3) {
+        pack_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    pack_collect(&builder, argv[1], "", 0);
+    qsort(builder.source, builder.count, sizeof(pack_source_t), pack_compare);
+
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", argv[2]) >= (int) sizeof(temporary))
+        pack_fail("path too long", argv[2]);
+
+    if ((builder.fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+        pack_fail("cannot create bundle", temporary);
+
+    pack_entry_t *entry = calloc(builder.count + 1, sizeof(pack_entry_t));
+    pack_intern(&builder, "");
+
+    for (size_t i = 0; i < builder.count; ++i)
+        pack_store(&builder, &builder.source[i], &entry[i]);
+
+    pack_header_t header = {
+        .magic = PACK_MAGIC
+      , .version = PACK_VERSION
+      , .count = (uint32_t) builder.count
+      , .index = pack_write(&builder, entry, sizeof(pack_entry_t) * builder.count)
+    };
+
+    header.strings = pack_write(&builder, builder.strings, builder.strings_length);
+    header.strings_length = builder.strings_length;
+    header.size = builder.offset;
+
+    if (pwrite(builder.fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || fsync(builder.fd) == -1)
+        pack_fail("cannot write bundle", temporary);
+
+    close(builder.fd);
+
+    if (rename(temporary, argv[2]) == -1)
+        pack_fail("cannot replace bundle", argv[2]);
+
+    fprintf(stderr, "mu-pack: %zu files, %zu compressed, %lu bytes written to %s\n",
+        builder.count, builder.compressed, (unsigned long) header.size, argv[2]);
+
+    for (size_t i = 0; i < builder.count; ++i) {
+        free(builder.source[i].path);
+        free(builder.source[i].source);
+    }
+
+    free(builder.source);
+    free(builder.strings);
+    free(entry);
+
+    return EXIT_SUCCESS;
+}